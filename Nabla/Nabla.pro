@@ -8,9 +8,39 @@ TARGET = Nabla
 TEMPLATE = app
 
 
+INCLUDEPATH += ../client ../libtapcfg
+
 SOURCES += main.cpp\
-        loginwindow.cpp
+        loginwindow.cpp\
+        statuswindow.cpp
+
+# The tunnel code shared with the command line client
+SOURCES += ../client/tunnel.c\
+        ../client/tunnel_ipv4.c\
+        ../client/tunnel_ipv6.c\
+        ../client/tunnel_ayiya.c\
+        ../client/compat.c\
+        ../client/logger.c\
+        ../client/hash_sha1.c\
+        ../client/hash_md5.c\
+        ../client/command.c\
+        ../client/ndisc.c\
+        ../client/checksum.c\
+        ../client/capture.c\
+        ../client/transport.c\
+        ../client/netmon.c\
+        ../client/keepalive.c\
+        ../client/compress.c\
+        ../client/tic/common.c\
+        ../client/tic/tic.c\
+        ../libtapcfg/tapcfg.c\
+        ../libtapcfg/taplog.c\
+        ../libtapcfg/dlpi.c
 
-HEADERS  += loginwindow.h
+HEADERS  += loginwindow.h\
+        statuswindow.h
 
 FORMS    += loginwindow.ui
+
+unix:LIBS += -lpthread
+win32:LIBS += -lws2_32
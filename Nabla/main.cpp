@@ -1,9 +1,93 @@
 #include <QtGui/QApplication>
+#include <QtCore/QStringList>
 #include "loginwindow.h"
+#include "statuswindow.h"
+
+#include <string.h>
+
+static int usage()
+{
+    qWarning("Usage: Nabla --status <local ipv6> <prefix> <remote ipv6> "
+             "<remote ipv4> <password> [beat interval]");
+    return 1;
+}
+
+// Starts an AYIYA tunnel with the same arguments as the command line
+// client and shows its status until the window is closed. The login
+// window doesn't create tunnels yet, so this is the way to open the
+// status view.
+static int runStatus(QApplication &app, const QStringList &args)
+{
+    endpoint_t endpoint;
+    tunnel_t *tunnel;
+    bool ok;
+    int sockets, ret;
+
+    if (args.size() < 7) {
+        return usage();
+    }
+
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.type = TUNNEL_TYPE_AYIYA;
+    if (inet_pton(AF_INET6, args[2].toLatin1().constData(), &endpoint.local_ipv6) <= 0 ||
+        inet_pton(AF_INET6, args[4].toLatin1().constData(), &endpoint.remote_ipv6) <= 0 ||
+        inet_pton(AF_INET, args[5].toLatin1().constData(), &endpoint.remote_ipv4) <= 0) {
+        return usage();
+    }
+    endpoint.local_prefix = args[3].toInt(&ok);
+    if (!ok) {
+        return usage();
+    }
+    strncpy(endpoint.password, args[6].toUtf8().constData(),
+            sizeof(endpoint.password)-1);
+    endpoint.beat_interval = (args.size() > 7) ? args[7].toInt(&ok) : 60;
+    if (!ok) {
+        return usage();
+    }
+
+    // Echo every second so that the round trip time graph has samples
+    endpoint.rtt_interval = 1;
+
+    INIT_SOCKETLIB(sockets);
+    if (!sockets) {
+        qWarning("Error initializing the socket library");
+        return 1;
+    }
+
+    tunnel = tunnel_init(&endpoint);
+    if (!tunnel) {
+        qWarning("Error initializing the tunnel, check permissions");
+        return 1;
+    }
+    if (tunnel_start(tunnel) == -1) {
+        qWarning("Error starting the tunnel");
+        tunnel_destroy(tunnel);
+        return 1;
+    }
+
+    StatusWindow *status = new StatusWindow(tunnel);
+    status->setAttribute(Qt::WA_QuitOnClose);
+    status->show();
+    ret = app.exec();
+
+    // The window samples the tunnel, so delete it first
+    delete status;
+    tunnel_destroy(tunnel);
+
+    CLOSE_SOCKETLIB(sockets);
+
+    return ret;
+}
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    if (args.size() > 1 && args[1] == "--status") {
+        return runStatus(a, args);
+    }
+
     LoginWindow w;
     w.show();
     return a.exec();
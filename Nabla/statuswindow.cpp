@@ -0,0 +1,152 @@
+#include "statuswindow.h"
+
+#include <QtCore/QTimer>
+#include <QtGui/QLabel>
+#include <QtGui/QPainter>
+#include <QtGui/QPolygonF>
+#include <QtGui/QVBoxLayout>
+
+// Four samples per second and a minute of history
+static const int SAMPLE_INTERVAL_MS = 250;
+static const int HISTORY_SAMPLES = 240;
+
+GraphWidget::GraphWidget(const QString &title, const QString &unit,
+                         bool dual, QWidget *parent)
+    : QWidget(parent), m_title(title), m_unit(unit), m_dual(dual)
+{
+    setMinimumSize(320, 90);
+}
+
+void GraphWidget::addSample(double received, double sent)
+{
+    m_received.append(received);
+    m_sent.append(sent);
+    if (m_received.size() > HISTORY_SAMPLES) {
+        m_received.remove(0);
+        m_sent.remove(0);
+    }
+    update();
+}
+
+static QPolygonF graphPolygon(const QVector<double> &values, const QRectF &area,
+                              double scale)
+{
+    QPolygonF polygon;
+    double step = area.width() / (HISTORY_SAMPLES - 1);
+    double x = area.right() - step * (values.size() - 1);
+
+    for (int i = 0; i < values.size(); i++, x += step) {
+        polygon << QPointF(x, area.bottom() - values[i] * scale);
+    }
+    return polygon;
+}
+
+void GraphWidget::paintEvent(QPaintEvent *)
+{
+    QPainter painter(this);
+    QRectF area = QRectF(rect()).adjusted(4, 18, -4, -4);
+
+    painter.fillRect(rect(), Qt::white);
+    painter.setPen(Qt::lightGray);
+    for (int i = 0; i <= 4; i++) {
+        double y = area.top() + area.height() * i / 4;
+        painter.drawLine(QPointF(area.left(), y), QPointF(area.right(), y));
+    }
+
+    double maximum = 0;
+    for (int i = 0; i < m_received.size(); i++) {
+        maximum = qMax(maximum, m_received[i]);
+        if (m_dual) {
+            maximum = qMax(maximum, m_sent[i]);
+        }
+    }
+    double scale = (maximum > 0) ? area.height() / (maximum * 1.1) : 0;
+
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setPen(QPen(Qt::darkGreen, 1.5));
+    painter.drawPolyline(graphPolygon(m_received, area, scale));
+    if (m_dual) {
+        painter.setPen(QPen(Qt::darkBlue, 1.5));
+        painter.drawPolyline(graphPolygon(m_sent, area, scale));
+    }
+
+    QString label = m_title;
+    if (!m_received.isEmpty()) {
+        if (m_dual) {
+            label += QString(": %1 / %2 %3 (received / sent)")
+                     .arg(m_received.last(), 0, 'f', 1)
+                     .arg(m_sent.last(), 0, 'f', 1)
+                     .arg(m_unit);
+        } else {
+            label += QString(": %1 %2").arg(m_received.last(), 0, 'f', 1).arg(m_unit);
+        }
+    }
+    painter.setPen(Qt::black);
+    painter.drawText(QRectF(rect()).adjusted(4, 2, -4, 0),
+                     Qt::AlignLeft | Qt::AlignTop, label);
+}
+
+StatusWindow::StatusWindow(tunnel_t *tunnel, QWidget *parent)
+    : QWidget(parent), m_tunnel(tunnel)
+{
+    setWindowTitle(tr("Tunnel status"));
+
+    m_throughput = new GraphWidget(tr("Throughput"), tr("kbit/s"), true, this);
+    m_packets = new GraphWidget(tr("Packet rate"), tr("packets/s"), true, this);
+    m_drops = new GraphWidget(tr("Drops"), tr("packets/s"), true, this);
+    m_rtt = new GraphWidget(tr("Round trip time"), tr("ms"), false, this);
+    m_summary = new QLabel(this);
+
+    QVBoxLayout *layout = new QVBoxLayout(this);
+    layout->addWidget(m_throughput);
+    layout->addWidget(m_packets);
+    layout->addWidget(m_drops);
+    layout->addWidget(m_rtt);
+    layout->addWidget(m_summary);
+
+    tunnel_get_stats(m_tunnel, &m_last);
+    m_time.start();
+
+    m_timer = new QTimer(this);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(sample()));
+    m_timer->start(SAMPLE_INTERVAL_MS);
+}
+
+StatusWindow::~StatusWindow()
+{
+    m_timer->stop();
+}
+
+void StatusWindow::sample()
+{
+    tunnel_stats_t stats;
+    double seconds;
+
+    tunnel_get_stats(m_tunnel, &stats);
+    seconds = m_time.restart() / 1000.0;
+    if (seconds <= 0) {
+        return;
+    }
+
+    m_throughput->addSample((stats.rx_bytes - m_last.rx_bytes) * 8 / seconds / 1000,
+                            (stats.tx_bytes - m_last.tx_bytes) * 8 / seconds / 1000);
+    m_packets->addSample((stats.rx_packets - m_last.rx_packets) / seconds,
+                         (stats.tx_packets - m_last.tx_packets) / seconds);
+    m_drops->addSample((stats.rx_dropped - m_last.rx_dropped) / seconds,
+                       (stats.tx_dropped - m_last.tx_dropped) / seconds);
+    m_rtt->addSample(stats.rtt_srtt / 1000.0);
+
+    QString summary = tr("Received %1 packets (%2 dropped), sent %3 packets (%4 dropped)")
+                      .arg(stats.rx_packets).arg(stats.rx_dropped)
+                      .arg(stats.tx_packets).arg(stats.tx_dropped);
+    if (stats.rtt_samples > 0) {
+        summary += tr("\nRound trip time %1 ms, minimum %2 ms")
+                   .arg(stats.rtt_srtt / 1000.0, 0, 'f', 1)
+                   .arg(stats.rtt_min / 1000.0, 0, 'f', 1);
+    } else {
+        summary += tr("\nNo round trip time measured yet");
+    }
+    m_summary->setText(summary);
+
+    m_last = stats;
+}
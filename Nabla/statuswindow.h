@@ -0,0 +1,64 @@
+#ifndef STATUSWINDOW_H
+#define STATUSWINDOW_H
+
+#include <QtCore/QTime>
+#include <QtCore/QVector>
+#include <QtGui/QWidget>
+
+extern "C" {
+#include "tunnel.h"
+}
+
+class QLabel;
+class QTimer;
+
+// Scrolling plot of the latest samples, either a single series or
+// received and sent series sharing the same scale
+class GraphWidget : public QWidget
+{
+public:
+    GraphWidget(const QString &title, const QString &unit, bool dual,
+                QWidget *parent = 0);
+
+    void addSample(double received, double sent = 0);
+
+protected:
+    void paintEvent(QPaintEvent *event);
+
+private:
+    QString m_title;
+    QString m_unit;
+    bool m_dual;
+
+    QVector<double> m_received;
+    QVector<double> m_sent;
+};
+
+// Live view of a running tunnel. The counters are sampled a few times
+// per second with tunnel_get_stats, which never takes the locks of
+// the tunnel, so the view can't slow down the forwarding.
+class StatusWindow : public QWidget
+{
+    Q_OBJECT
+
+public:
+    StatusWindow(tunnel_t *tunnel, QWidget *parent = 0);
+    ~StatusWindow();
+
+private slots:
+    void sample();
+
+private:
+    tunnel_t *m_tunnel;
+    tunnel_stats_t m_last;
+    QTime m_time;
+    QTimer *m_timer;
+
+    GraphWidget *m_throughput;
+    GraphWidget *m_packets;
+    GraphWidget *m_drops;
+    GraphWidget *m_rtt;
+    QLabel *m_summary;
+};
+
+#endif // STATUSWINDOW_H
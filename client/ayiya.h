@@ -60,6 +60,13 @@ enum ayiya_opcode
 	ayiya_op_query_response		= 0x7	/* Query Response */
 };
 
+/*
+ * Next header of a forwarded packet compressed with LZ4, taken from the
+ * range reserved for experimentation (RFC 3692). The payload is the
+ * original length (2 bytes, network order) followed by an LZ4 block.
+ */
+#define AYIYA_NEXTHDR_LZ4	253
+
 struct ayiyahdr
 {
 #if BYTE_ORDER == BIG_ENDIAN
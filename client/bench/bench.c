@@ -0,0 +1,146 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
+
+#include "bench.h"
+
+uint64_t
+bench_nanotime()
+{
+#if defined(_WIN32) || defined(_WIN64)
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t) ((double) count.QuadPart * 1000000000.0 / freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+uint64_t
+bench_cycles()
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double da = *((const double *) a);
+	double db = *((const double *) b);
+
+	return (da > db) - (da < db);
+}
+
+double
+bench_percentile(double *values, int count, double percentile)
+{
+	int idx;
+
+	if (count <= 0)
+		return 0.0;
+
+	qsort(values, count, sizeof(double), compare_double);
+	idx = (int) (percentile * (count - 1) / 100.0 + 0.5);
+	return values[idx];
+}
+
+void
+bench_run(bench_func_t func, void *arg, bench_result_t *result)
+{
+	double ns[BENCH_SAMPLES], cycles[BENCH_SAMPLES];
+	uint64_t iterations, start;
+	int i;
+
+	/* Warm up caches and find an iteration count long enough */
+	iterations = 1;
+	for (;;) {
+		start = bench_nanotime();
+		func(arg, iterations);
+		if (bench_nanotime() - start >= BENCH_SAMPLE_NS / 4)
+			break;
+		iterations *= 2;
+	}
+	iterations *= 4;
+
+	for (i=0; i<BENCH_SAMPLES; i++) {
+		uint64_t c, t;
+
+		t = bench_nanotime();
+		c = bench_cycles();
+		func(arg, iterations);
+		c = bench_cycles() - c;
+		t = bench_nanotime() - t;
+
+		ns[i] = (double) t / iterations;
+		cycles[i] = (double) c / iterations;
+	}
+
+	result->ns_per_op = bench_percentile(ns, BENCH_SAMPLES, 50);
+	result->cycles_per_op = bench_percentile(cycles, BENCH_SAMPLES, 50);
+}
+
+void
+bench_print_header()
+{
+	printf("%-28s %6s %12s %12s %11s\n",
+	       "case", "bytes", "ns/op", "cycles/op", "bytes/cycle");
+}
+
+void
+bench_print(const char *name, int bytes, const bench_result_t *result)
+{
+	printf("%-28s %6d %12.1f", name, bytes, result->ns_per_op);
+	if (result->cycles_per_op > 0) {
+		printf(" %12.1f", result->cycles_per_op);
+		if (bytes > 0) {
+			printf(" %11.3f", bytes / result->cycles_per_op);
+		} else {
+			printf(" %11s", "-");
+		}
+	} else {
+		printf(" %12s %11s", "-", "-");
+	}
+	printf("\n");
+	fflush(stdout);
+}
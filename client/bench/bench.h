@@ -0,0 +1,58 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/* Number of timed samples taken of each case, the median is reported */
+#define BENCH_SAMPLES 11
+
+/* Minimum wall clock time of a single sample in nanoseconds */
+#define BENCH_SAMPLE_NS 20000000ULL
+
+typedef void (*bench_func_t)(void *arg, uint64_t iterations);
+
+struct bench_result_s {
+	double ns_per_op;
+	double cycles_per_op;
+};
+typedef struct bench_result_s bench_result_t;
+
+/* Monotonic time in nanoseconds */
+uint64_t bench_nanotime();
+
+/* Cycle counter value, always zero if not available on the platform */
+uint64_t bench_cycles();
+
+/* Runs func with an automatically calibrated iteration count and
+ * stores the median time and cycle counts per iteration in result */
+void bench_run(bench_func_t func, void *arg, bench_result_t *result);
+
+/* Prints the column titles of bench_print lines */
+void bench_print_header();
+
+/* Prints a single result line, bytes is the amount of data processed
+ * by one iteration and can be zero if not meaningful */
+void bench_print(const char *name, int bytes, const bench_result_t *result);
+
+/* Sorts the values and returns the requested percentile (0-100) */
+double bench_percentile(double *values, int count, double percentile);
+
+#endif /* BENCH_H */
@@ -0,0 +1,444 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* End-to-end harness running a real AYIYA client tunnel between a
+ * frame socketpair (instead of a TAP device) and a loopback AYIYA peer.
+ * Needs no privileges. The 6in4 and 6in6 tunnels use raw sockets and
+ * can't be driven without root, so only AYIYA is measured.
+ *
+ * Traffic is sent with a fixed window of packets in flight, "tx" is
+ * from the TAP side to the server and "rx" from the server to the TAP
+ * side. CPU time is for the whole process, so it includes the harness
+ * generating and consuming the traffic. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../compat.h"
+#include "../tunnel.h"
+#include "bench.h"
+#include "peer.h"
+
+#define HARNESS_PASSWORD "harness"
+#define HARNESS_TIMEOUT_MS 200
+
+/* Consecutive send errors after which a run is aborted */
+#define HARNESS_MAX_ERRORS 10
+
+/* Offset of the sequence number and timestamp in the IPv6 packet */
+#define HARNESS_STAMP_OFFSET 40
+
+static const char routerhw[] = { 0x00, 0x01, 0x23, 0x45, 0x67, 0x89 };
+
+struct harness_s {
+	tunnel_t *tunnel;
+	ayiya_peer_t peer;
+	int tap_fd;
+
+	struct in6_addr local_ipv6;
+	struct in6_addr remote_ipv6;
+
+	double *latencies;
+	int window;
+
+	/* Sequence numbers are unique over all runs, so that packets
+	 * arriving late from a previous run are not counted. The packets
+	 * of the current run still waiting for an answer are flagged. */
+	uint32_t seqbase;
+	unsigned char *pending;
+};
+typedef struct harness_s harness_t;
+
+struct harness_result_s {
+	int received;
+	int lost;
+	uint64_t elapsed_ns;
+	uint64_t cpu_ns;
+};
+typedef struct harness_result_s harness_result_t;
+
+static uint64_t
+cputime()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return ((uint64_t) usage.ru_utime.tv_sec +
+	        (uint64_t) usage.ru_stime.tv_sec) * 1000000000ULL +
+	       ((uint64_t) usage.ru_utime.tv_usec +
+	        (uint64_t) usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int
+wait_readable(int fd, int msec)
+{
+	struct timeval tv;
+	fd_set rfds;
+
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	return select(fd+1, &rfds, NULL, NULL, &tv) > 0;
+}
+
+/* Fills an IPv6 packet of size bytes with the sequence and timestamp */
+static void
+build_packet(unsigned char *pkt, int size, const struct in6_addr *src,
+             const struct in6_addr *dst, uint32_t seq)
+{
+	uint64_t now;
+	int i;
+
+	memset(pkt, 0, 40);
+	pkt[0] = 0x60;
+	pkt[4] = (size-40) >> 8;
+	pkt[5] = (size-40);
+	pkt[6] = 59;
+	pkt[7] = 64;
+	memcpy(pkt+8, src, 16);
+	memcpy(pkt+24, dst, 16);
+
+	now = bench_nanotime();
+	for (i=0; i<4; i++)
+		pkt[HARNESS_STAMP_OFFSET+i] = seq >> (24-i*8);
+	for (i=0; i<8; i++)
+		pkt[HARNESS_STAMP_OFFSET+4+i] = now >> (56-i*8);
+}
+
+/* Returns true if pkt is a packet of size bytes built by the harness
+ * with the given addresses, other traffic of the tunnel like router
+ * solicitations is ignored */
+static int
+packet_match(const unsigned char *pkt, int len, int size,
+             const struct in6_addr *src, const struct in6_addr *dst)
+{
+	return len == size && (pkt[0] & 0xf0) == 0x60 && pkt[6] == 59 &&
+	       !memcmp(pkt+8, src, 16) && !memcmp(pkt+24, dst, 16);
+}
+
+static uint32_t
+packet_seq(const unsigned char *pkt)
+{
+	uint32_t seq = 0;
+	int i;
+
+	for (i=0; i<4; i++)
+		seq = (seq << 8) | pkt[HARNESS_STAMP_OFFSET+i];
+	return seq;
+}
+
+static uint64_t
+packet_stamp(const unsigned char *pkt)
+{
+	uint64_t stamp = 0;
+	int i;
+
+	for (i=0; i<8; i++)
+		stamp = (stamp << 8) | pkt[HARNESS_STAMP_OFFSET+4+i];
+	return stamp;
+}
+
+static int
+send_tx(harness_t *harness, int size, uint32_t seq)
+{
+	unsigned char frame[14+2048];
+
+	memcpy(frame, routerhw, 6);
+	memset(frame+6, 0, 6);
+	frame[12] = 0x86;
+	frame[13] = 0xdd;
+	build_packet(frame+14, size, &harness->local_ipv6,
+	             &harness->remote_ipv6, seq);
+
+	return write(harness->tap_fd, frame, 14+size) == 14+size ? 0 : -1;
+}
+
+/* Milliseconds left until deadline, rounded up */
+static int
+remaining_ms(uint64_t deadline)
+{
+	uint64_t now = bench_nanotime();
+
+	if (now >= deadline) {
+		return -1;
+	}
+	return (deadline - now + 999999) / 1000000;
+}
+
+/* Waits until deadline for a packet of the harness, other packets are
+ * skipped. Returns 0 and stores the sequence number and timestamp of
+ * the packet, or -1 if none arrived in time. */
+static int
+recv_tx(harness_t *harness, int size, uint64_t deadline,
+        uint32_t *seq, uint64_t *stamp)
+{
+	unsigned char buf[PEER_HDRLEN+2048];
+	int msec, ret;
+
+	while ((msec = remaining_ms(deadline)) >= 0) {
+		ret = ayiya_peer_recv(&harness->peer, buf, sizeof(buf), msec);
+		if (packet_match(buf+PEER_HDRLEN, ret, size,
+		                 &harness->local_ipv6, &harness->remote_ipv6)) {
+			*seq = packet_seq(buf+PEER_HDRLEN);
+			*stamp = packet_stamp(buf+PEER_HDRLEN);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int
+send_rx(harness_t *harness, int size, uint32_t seq)
+{
+	unsigned char pkt[2048];
+
+	build_packet(pkt, size, &harness->remote_ipv6,
+	             &harness->local_ipv6, seq);
+	return ayiya_peer_send(&harness->peer, pkt, size) == size ? 0 : -1;
+}
+
+static int
+recv_rx(harness_t *harness, int size, uint64_t deadline,
+        uint32_t *seq, uint64_t *stamp)
+{
+	unsigned char frame[14+2048];
+	int msec, ret;
+
+	while ((msec = remaining_ms(deadline)) >= 0) {
+		if (!wait_readable(harness->tap_fd, msec)) {
+			continue;
+		}
+		ret = read(harness->tap_fd, frame, sizeof(frame));
+		if (ret > 14 && frame[12] == 0x86 && frame[13] == 0xdd &&
+		    packet_match(frame+14, ret-14, size,
+		                 &harness->remote_ipv6, &harness->local_ipv6)) {
+			*seq = packet_seq(frame+14);
+			*stamp = packet_stamp(frame+14);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Returns -1 if the run was aborted because packets couldn't be sent */
+static int
+run(harness_t *harness, int rx, int size, int packets,
+    harness_result_t *result)
+{
+	uint64_t start, cpustart;
+	uint32_t base;
+	int sent, inflight, first, errors;
+
+	memset(result, 0, sizeof(*result));
+	memset(harness->pending, 0, packets);
+	base = harness->seqbase;
+	harness->seqbase += packets;
+	start = bench_nanotime();
+	cpustart = cputime();
+
+	sent = inflight = first = errors = 0;
+	while (sent < packets || inflight > 0) {
+		uint64_t deadline, stamp;
+		uint32_t seq;
+		int ret = 0;
+
+		while (sent < packets && inflight < harness->window) {
+			if (rx) {
+				ret = send_rx(harness, size, base+sent);
+			} else {
+				ret = send_tx(harness, size, base+sent);
+			}
+			if (ret < 0) {
+				break;
+			}
+			harness->pending[sent++] = 1;
+			inflight++;
+			errors = 0;
+		}
+		if (ret < 0 && ++errors >= HARNESS_MAX_ERRORS) {
+			fprintf(stderr, "Sending failed %d times, aborting\n", errors);
+			result->lost += packets - sent + inflight;
+			return -1;
+		}
+
+		deadline = bench_nanotime() + HARNESS_TIMEOUT_MS * 1000000ULL;
+		if (rx) {
+			ret = recv_rx(harness, size, deadline, &seq, &stamp);
+		} else {
+			ret = recv_tx(harness, size, deadline, &seq, &stamp);
+		}
+		if (ret < 0) {
+			/* Nothing arrived in time, consider the rest lost */
+			for (; first < sent; first++) {
+				if (harness->pending[first]) {
+					harness->pending[first] = 0;
+					result->lost++;
+				}
+			}
+			inflight = 0;
+			continue;
+		}
+
+		/* Skip duplicates and packets already counted as lost */
+		seq -= base;
+		if (seq >= sent || !harness->pending[seq]) {
+			continue;
+		}
+		harness->pending[seq] = 0;
+		while (first < sent && !harness->pending[first]) {
+			first++;
+		}
+
+		harness->latencies[result->received++] =
+			(bench_nanotime() - stamp) / 1000.0;
+		inflight--;
+	}
+
+	result->elapsed_ns = bench_nanotime() - start;
+	result->cpu_ns = cputime() - cpustart;
+	return 0;
+}
+
+static void
+print_header()
+{
+	printf("%-4s %6s %8s %6s %10s %8s %10s %8s %8s %8s %8s\n",
+	       "dir", "bytes", "packets", "lost", "pps", "Gbit/s",
+	       "cpu-us/pkt", "p50-us", "p90-us", "p99-us", "p999-us");
+}
+
+static void
+print_result(harness_t *harness, const char *dir, int size,
+             const harness_result_t *result)
+{
+	double seconds, pps, gbps, cpu;
+
+	seconds = result->elapsed_ns / 1000000000.0;
+	pps = result->received / seconds;
+	gbps = pps * size * 8 / 1000000000.0;
+	cpu = result->received ?
+	      result->cpu_ns / 1000.0 / result->received : 0.0;
+
+	printf("%-4s %6d %8d %6d %10.0f %8.3f %10.2f", dir, size,
+	       result->received, result->lost, pps, gbps, cpu);
+	if (result->received) {
+		printf(" %8.1f", bench_percentile(harness->latencies, result->received, 50));
+		printf(" %8.1f", bench_percentile(harness->latencies, result->received, 90));
+		printf(" %8.1f", bench_percentile(harness->latencies, result->received, 99));
+		printf(" %8.1f", bench_percentile(harness->latencies, result->received, 99.9));
+	} else {
+		printf(" %8s %8s %8s %8s", "-", "-", "-", "-");
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static int
+harness_init(harness_t *harness, int packets, int window)
+{
+	memset(harness, 0, sizeof(*harness));
+	inet_pton(AF_INET6, "2001:db8::2", &harness->local_ipv6);
+	inet_pton(AF_INET6, "2001:db8::1", &harness->remote_ipv6);
+	harness->window = window;
+
+	/* The warm up run sends a window of packets */
+	if (packets < window) {
+		packets = window;
+	}
+	harness->latencies = calloc(packets, sizeof(double));
+	harness->pending = calloc(packets, 1);
+	if (!harness->latencies || !harness->pending) {
+		return -1;
+	}
+
+	if (ayiya_peer_init(&harness->peer, HARNESS_PASSWORD,
+	                    &harness->remote_ipv6, &harness->local_ipv6) < 0) {
+		fprintf(stderr, "Error creating the AYIYA peer\n");
+		return -1;
+	}
+
+	harness->tunnel = ayiya_peer_connect(&harness->peer, HARNESS_PASSWORD,
+	                                     &harness->tap_fd);
+	if (!harness->tunnel) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+harness_destroy(harness_t *harness)
+{
+	tunnel_destroy(harness->tunnel);
+	ayiya_peer_destroy(&harness->peer);
+	closesocket(harness->tap_fd);
+	free(harness->latencies);
+	free(harness->pending);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int sizes[] = { 64, 512, 1280 };
+	harness_t harness;
+	harness_result_t result;
+	tunnel_stats_t stats;
+	int packets, window;
+	int i;
+
+	packets = (argc > 1) ? atoi(argv[1]) : 100000;
+	window = (argc > 2) ? atoi(argv[2]) : 64;
+	if (packets <= 0 || window <= 0) {
+		fprintf(stderr, "Usage: %s [packets [window]]\n", argv[0]);
+		return 1;
+	}
+
+	if (harness_init(&harness, packets, window) < 0) {
+		return 1;
+	}
+
+	/* The peer learns the client address from the first tx packets,
+	 * so tx always runs first and warms up both paths */
+	if (run(&harness, 0, sizes[0], window, &result) < 0) {
+		harness_destroy(&harness);
+		return 1;
+	}
+
+	print_header();
+	for (i=0; i<sizeof(sizes)/sizeof(int); i++) {
+		if (run(&harness, 0, sizes[i], packets, &result) < 0)
+			break;
+		print_result(&harness, "tx", sizes[i], &result);
+		if (run(&harness, 1, sizes[i], packets, &result) < 0)
+			break;
+		print_result(&harness, "rx", sizes[i], &result);
+	}
+
+	tunnel_get_stats(harness.tunnel, &stats);
+	printf("Socket buffer drops: %llu received, %llu sent\n",
+	       (unsigned long long) stats.rx_dropped,
+	       (unsigned long long) stats.tx_dropped);
+
+	harness_destroy(&harness);
+
+	return 0;
+}
@@ -0,0 +1,346 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks for the CPU bound parts of the client packet path.
+ * The cases and their order are fixed so that the output of two runs
+ * can be compared line by line with diff. Give a substring of the case
+ * name as an argument to run only the matching cases. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../compat.h"
+#include "../ayiya.h"
+#include "../hash_sha1.h"
+#include "../hash_md5.h"
+#include "../ndisc.h"
+#include "../checksum.h"
+#include "../tic/tic.h"
+
+#include "bench.h"
+
+/* Not exported by hash_sha1.h, but we want to see the raw block speed */
+void SHA1_Transform(sha1_quadbyte state[5], sha1_byte buffer[64]);
+
+/* Same layout as struct pseudo_ayh in tunnel_ayiya.c */
+struct bench_ayh {
+	struct ayiyahdr	ayh;
+	struct in6_addr	identity;
+	sha1_byte	hash[SHA1_DIGEST_LENGTH];
+	char		payload[2048];
+};
+
+struct sha1_arg {
+	sha1_byte data[2048];
+	unsigned int len;
+};
+
+struct ayiya_arg {
+	struct bench_ayh s;
+	sha1_byte secret[SHA1_DIGEST_LENGTH];
+	int len;
+};
+
+struct ndisc_arg {
+	unsigned char solicit[86];
+	unsigned char buf[4096];
+};
+
+static volatile unsigned int sink;
+
+static const char routerhw[] = { 0x00, 0x01, 0x23, 0x45, 0x67, 0x89 };
+
+static void
+fill_pattern(void *buf, int len)
+{
+	unsigned char *ptr = buf;
+	int i;
+
+	for (i=0; i<len; i++)
+		ptr[i] = (unsigned char) (i * 31 + 7);
+}
+
+static void
+run_sha1_transform(void *arg, uint64_t iterations)
+{
+	struct sha1_arg *a = arg;
+	sha1_quadbyte state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE,
+	                           0x10325476, 0xC3D2E1F0 };
+	uint64_t i;
+
+	for (i=0; i<iterations; i++)
+		SHA1_Transform(state, a->data);
+	sink += state[0];
+}
+
+static void
+run_sha1_update(void *arg, uint64_t iterations)
+{
+	struct sha1_arg *a = arg;
+	SHA_CTX sha1;
+	uint64_t i;
+
+	SHA1_Init(&sha1);
+	for (i=0; i<iterations; i++)
+		SHA1_Update(&sha1, a->data, a->len);
+	sink += sha1.state[0];
+}
+
+static void
+ayiya_prepare(struct ayiya_arg *a, int payload)
+{
+	SHA_CTX sha1;
+
+	memset(a, 0, sizeof(*a));
+	SHA1_Init(&sha1);
+	SHA1_Update(&sha1, (const sha1_byte *) "password", 8);
+	SHA1_Final(a->secret, &sha1);
+
+	a->s.ayh.ayh_idlen      = 4;
+	a->s.ayh.ayh_idtype     = ayiya_id_integer;
+	a->s.ayh.ayh_siglen     = 5;
+	a->s.ayh.ayh_hshmeth    = ayiya_hash_sha1;
+	a->s.ayh.ayh_autmeth    = ayiya_auth_sharedsecret;
+	a->s.ayh.ayh_opcode     = payload ? ayiya_op_forward : ayiya_op_noop;
+	a->s.ayh.ayh_nextheader = payload ? IPPROTO_IPV6 : IPPROTO_NONE;
+	a->s.ayh.ayh_epochtime  = htonl((unsigned long) time(NULL));
+	fill_pattern(&a->s.identity, sizeof(a->s.identity));
+	fill_pattern(a->s.payload, payload);
+	a->s.payload[0] = 0x60;
+
+	a->len = sizeof(a->s) - sizeof(a->s.payload) + payload;
+}
+
+/* Signing as done in the writer thread and beat of tunnel_ayiya.c */
+static void
+run_ayiya_sign(void *arg, uint64_t iterations)
+{
+	struct ayiya_arg *a = arg;
+	sha1_byte hash[SHA1_DIGEST_LENGTH];
+	SHA_CTX sha1;
+	uint64_t i;
+
+	for (i=0; i<iterations; i++) {
+		memcpy(a->s.hash, a->secret, sizeof(a->s.hash));
+
+		SHA1_Init(&sha1);
+		SHA1_Update(&sha1, (sha1_byte *) &a->s, a->len);
+		SHA1_Final(hash, &sha1);
+
+		memcpy(a->s.hash, hash, sizeof(a->s.hash));
+	}
+	sink += a->s.hash[0];
+}
+
+/* Verification as done in the reader thread of tunnel_ayiya.c */
+static void
+run_ayiya_verify(void *arg, uint64_t iterations)
+{
+	struct ayiya_arg *a = arg;
+	sha1_byte their_hash[SHA1_DIGEST_LENGTH];
+	sha1_byte our_hash[SHA1_DIGEST_LENGTH];
+	SHA_CTX sha1;
+	uint64_t i;
+
+	for (i=0; i<iterations; i++) {
+		memcpy(their_hash, a->s.hash, sizeof(their_hash));
+		memcpy(a->s.hash, a->secret, sizeof(a->s.hash));
+
+		SHA1_Init(&sha1);
+		SHA1_Update(&sha1, (sha1_byte *) &a->s, a->len);
+		SHA1_Final(our_hash, &sha1);
+
+		sink += !memcmp(their_hash, our_hash, sizeof(their_hash));
+
+		/* Restore the signature for the next round */
+		memcpy(a->s.hash, their_hash, sizeof(a->s.hash));
+	}
+}
+
+static void
+ndisc_prepare(struct ndisc_arg *a)
+{
+	unsigned char *s = a->solicit;
+
+	memset(a, 0, sizeof(*a));
+
+	/* Ethernet header to the solicited-node multicast address */
+	s[0] = 0x33; s[1] = 0x33; s[2] = 0xff;
+	s[6] = 0x02; s[11] = 0x01;
+	s[12] = 0x86; s[13] = 0xdd;
+
+	/* IPv6 header with ICMPv6 next header and hop limit 255 */
+	s[14] = 0x60;
+	s[14+5] = 32;
+	s[14+6] = 58;
+	s[14+7] = 255;
+	s[14+8] = 0x20; s[14+9] = 0x01; s[14+8+15] = 0x02;
+	s[14+24] = 0xff; s[14+25] = 0x02; s[14+24+11] = 0x01;
+	s[14+24+12] = 0xff; s[14+24+15] = 0x01;
+
+	/* Neighbor solicitation with source link-layer option */
+	s[14+40] = 135;
+	s[14+40+8] = 0x20; s[14+40+9] = 0x01; s[14+40+8+15] = 0x01;
+	s[14+40+24] = 1;
+	s[14+40+25] = 1;
+}
+
+/* Includes copying the solicitation in place as the reply is in place */
+static void
+run_ndisc_advert(void *arg, uint64_t iterations)
+{
+	struct ndisc_arg *a = arg;
+	uint64_t i;
+
+	for (i=0; i<iterations; i++) {
+		memcpy(a->buf, a->solicit, sizeof(a->solicit));
+		sink += ndisc_solicit_to_advert(a->buf, routerhw);
+	}
+}
+
+/* Digest of a heartbeat string as done in beat of tunnel_ipv6.c */
+static void
+run_md5_heartbeat(void *arg, uint64_t iterations)
+{
+	const char *str = arg;
+	unsigned char digest[16];
+	struct MD5Context md5;
+	unsigned int len;
+	uint64_t i;
+
+	len = strlen(str);
+	for (i=0; i<iterations; i++) {
+		MD5Init(&md5);
+		MD5Update(&md5, (const unsigned char *) str, len);
+		MD5Final(digest, &md5);
+		sink += digest[0];
+	}
+}
+
+static void
+run_checksum(void *arg, uint64_t iterations)
+{
+	struct sha1_arg *a = arg;
+	uint32_t sum = 0;
+	uint64_t i;
+
+	for (i=0; i<iterations; i++)
+		sum += checksum_finish(checksum_add(0, a->data, a->len));
+	sink += sum;
+}
+
+static void
+run_checksum_update(void *arg, uint64_t iterations)
+{
+	uint16_t check = 0x1234;
+	uint64_t i;
+
+	for (i=0; i<iterations; i++)
+		check = checksum_update32(check, 0xc0a80001, (uint32_t) i);
+	sink += check;
+}
+
+static void
+run_tic_checktime(void *arg, uint64_t iterations)
+{
+	time_t now = time(NULL);
+	uint64_t i;
+
+	for (i=0; i<iterations; i++)
+		sink += tic_checktime(now);
+}
+
+static int
+selected(const char *filter, const char *name)
+{
+	return (!filter || strstr(name, filter));
+}
+
+static void
+bench_case(const char *filter, const char *name, int bytes,
+           bench_func_t func, void *arg)
+{
+	bench_result_t result;
+
+	if (!selected(filter, name))
+		return;
+
+	bench_run(func, arg, &result);
+	bench_print(name, bytes, &result);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int sha1_sizes[] = { 64, 576, 1280, 1500 };
+	static const int ayiya_sizes[] = { 0, 576, 1280 };
+	static const int checksum_sizes[] = { 64, 1500 };
+	static struct sha1_arg sha1_arg;
+	static struct ayiya_arg ayiya_arg;
+	static struct ndisc_arg ndisc_arg;
+	const char *heartbeat;
+	const char *filter;
+	char name[64];
+	int i;
+
+	filter = (argc > 1) ? argv[1] : NULL;
+	bench_print_header();
+
+	fill_pattern(sha1_arg.data, sizeof(sha1_arg.data));
+	bench_case(filter, "sha1_transform", 64,
+	           run_sha1_transform, &sha1_arg);
+	for (i=0; i<sizeof(sha1_sizes)/sizeof(int); i++) {
+		sha1_arg.len = sha1_sizes[i];
+		snprintf(name, sizeof(name), "sha1_update/%d", sha1_sizes[i]);
+		bench_case(filter, name, sha1_sizes[i],
+		           run_sha1_update, &sha1_arg);
+	}
+
+	for (i=0; i<sizeof(ayiya_sizes)/sizeof(int); i++) {
+		ayiya_prepare(&ayiya_arg, ayiya_sizes[i]);
+		snprintf(name, sizeof(name), "ayiya_sign/%d", ayiya_sizes[i]);
+		bench_case(filter, name, ayiya_arg.len,
+		           run_ayiya_sign, &ayiya_arg);
+		snprintf(name, sizeof(name), "ayiya_verify/%d", ayiya_sizes[i]);
+		bench_case(filter, name, ayiya_arg.len,
+		           run_ayiya_verify, &ayiya_arg);
+	}
+
+	ndisc_prepare(&ndisc_arg);
+	bench_case(filter, "ndisc_advert", sizeof(ndisc_arg.solicit),
+	           run_ndisc_advert, &ndisc_arg);
+
+	for (i=0; i<sizeof(checksum_sizes)/sizeof(int); i++) {
+		sha1_arg.len = checksum_sizes[i];
+		snprintf(name, sizeof(name), "checksum/%d", checksum_sizes[i]);
+		bench_case(filter, name, checksum_sizes[i],
+		           run_checksum, &sha1_arg);
+	}
+	bench_case(filter, "checksum_update32", 0, run_checksum_update, NULL);
+
+	heartbeat = "HEARTBEAT TUNNEL 2001:db8:1234:5678::2 sender "
+	            "1262304000 0123456789abcdef0123456789abcdef";
+	bench_case(filter, "md5_heartbeat", strlen(heartbeat),
+	           run_md5_heartbeat, (void *) heartbeat);
+
+	bench_case(filter, "tic_checktime", 0, run_tic_checktime, NULL);
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../compat.h"
+#include "../ayiya.h"
+#include "peer.h"
+
+int
+ayiya_peer_init(ayiya_peer_t *peer, const char *password,
+                const struct in6_addr *identity,
+                const struct in6_addr *client_identity)
+{
+	struct sockaddr_in saddr;
+	socklen_t socklen;
+	SHA_CTX sha1;
+	int bufsize;
+
+	memset(peer, 0, sizeof(*peer));
+
+	peer->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (peer->fd < 0) {
+		return -1;
+	}
+
+	/* Avoid drops caused by the default buffer sizes */
+	bufsize = 4*1024*1024;
+	setsockopt(peer->fd, SOL_SOCKET, SO_RCVBUF,
+	           (const char *) &bufsize, sizeof(bufsize));
+	setsockopt(peer->fd, SOL_SOCKET, SO_SNDBUF,
+	           (const char *) &bufsize, sizeof(bufsize));
+
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	saddr.sin_port = htons(0);
+	if (bind(peer->fd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0) {
+		closesocket(peer->fd);
+		return -1;
+	}
+
+	socklen = sizeof(saddr);
+	if (getsockname(peer->fd, (struct sockaddr *) &saddr, &socklen) < 0) {
+		closesocket(peer->fd);
+		return -1;
+	}
+	peer->port = ntohs(saddr.sin_port);
+
+	memcpy(&peer->identity, identity, sizeof(peer->identity));
+	memcpy(&peer->client_identity, client_identity,
+	       sizeof(peer->client_identity));
+
+	SHA1_Init(&sha1);
+	SHA1_Update(&sha1, (const sha1_byte *) password, strlen(password));
+	SHA1_Final(peer->secret, &sha1);
+
+	return 0;
+}
+
+int
+ayiya_peer_send(ayiya_peer_t *peer, const void *payload, int len)
+{
+	unsigned char buf[PEER_HDRLEN+2048];
+	struct ayiyahdr *ayh = (struct ayiyahdr *) buf;
+	sha1_byte hash[SHA1_DIGEST_LENGTH];
+	SHA_CTX sha1;
+	int ret;
+
+	if (!peer->have_client || len > sizeof(buf)-PEER_HDRLEN) {
+		return -1;
+	}
+
+	memset(buf, 0, PEER_HDRLEN);
+	ayh->ayh_idlen      = 4;
+	ayh->ayh_idtype     = ayiya_id_integer;
+	ayh->ayh_siglen     = 5;
+	ayh->ayh_hshmeth    = ayiya_hash_sha1;
+	ayh->ayh_autmeth    = ayiya_auth_sharedsecret;
+	ayh->ayh_opcode     = ayiya_op_forward;
+	ayh->ayh_nextheader = IPPROTO_IPV6;
+	ayh->ayh_epochtime  = htonl((unsigned long) time(NULL));
+	memcpy(buf+8, &peer->identity, 16);
+	memcpy(buf+8+16, peer->secret, SHA1_DIGEST_LENGTH);
+	memcpy(buf+PEER_HDRLEN, payload, len);
+
+	SHA1_Init(&sha1);
+	SHA1_Update(&sha1, buf, PEER_HDRLEN+len);
+	SHA1_Final(hash, &sha1);
+	memcpy(buf+8+16, hash, SHA1_DIGEST_LENGTH);
+
+	ret = sendto(peer->fd, (const char *) buf, PEER_HDRLEN+len, 0,
+	             (struct sockaddr *) &peer->client, sizeof(peer->client));
+	if (ret != PEER_HDRLEN+len) {
+		return -1;
+	}
+
+	return len;
+}
+
+int
+ayiya_peer_recv(ayiya_peer_t *peer, unsigned char *buf, int size, int msec)
+{
+	struct ayiyahdr *ayh = (struct ayiyahdr *) buf;
+	sha1_byte their_hash[SHA1_DIGEST_LENGTH];
+	sha1_byte our_hash[SHA1_DIGEST_LENGTH];
+	struct sockaddr_in saddr;
+	socklen_t socklen;
+	struct timeval tv;
+	fd_set rfds;
+	SHA_CTX sha1;
+	int ret;
+
+	FD_ZERO(&rfds);
+	FD_SET(peer->fd, &rfds);
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	ret = select(peer->fd+1, &rfds, NULL, NULL, &tv);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	socklen = sizeof(saddr);
+	ret = recvfrom(peer->fd, (char *) buf, size, 0,
+	               (struct sockaddr *) &saddr, &socklen);
+	if (ret < PEER_HDRLEN) {
+		return -1;
+	}
+
+	if (ayh->ayh_idlen != 4 ||
+	    ayh->ayh_idtype != ayiya_id_integer ||
+	    ayh->ayh_siglen != 5 ||
+	    ayh->ayh_hshmeth != ayiya_hash_sha1 ||
+	    ayh->ayh_autmeth != ayiya_auth_sharedsecret ||
+	    memcmp(buf+8, &peer->client_identity, 16)) {
+		return -1;
+	}
+
+	memcpy(their_hash, buf+8+16, SHA1_DIGEST_LENGTH);
+	memcpy(buf+8+16, peer->secret, SHA1_DIGEST_LENGTH);
+
+	SHA1_Init(&sha1);
+	SHA1_Update(&sha1, buf, ret);
+	SHA1_Final(our_hash, &sha1);
+
+	if (memcmp(their_hash, our_hash, SHA1_DIGEST_LENGTH)) {
+		return -1;
+	}
+
+	memcpy(&peer->client, &saddr, sizeof(peer->client));
+	peer->have_client = 1;
+
+	if (ayh->ayh_opcode != ayiya_op_forward ||
+	    ayh->ayh_nextheader != IPPROTO_IPV6) {
+		return 0;
+	}
+
+	return ret - PEER_HDRLEN;
+}
+
+tunnel_t *
+ayiya_peer_connect(ayiya_peer_t *peer, const char *password, int *tap_fd)
+{
+	endpoint_t endpoint;
+	tunnel_t *tunnel;
+	int bufsize;
+	int sv[2];
+	int i;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+		fprintf(stderr, "Error creating the frame socketpair\n");
+		return NULL;
+	}
+	bufsize = 4*1024*1024;
+	for (i=0; i<2; i++) {
+		setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+		setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	}
+
+	memset(&endpoint, 0, sizeof(endpoint));
+	endpoint.type = TUNNEL_TYPE_AYIYA;
+	endpoint.local_ipv6 = peer->client_identity;
+	endpoint.local_prefix = 64;
+	endpoint.remote_ipv6 = peer->identity;
+	endpoint.remote_ipv4.s_addr = htonl(INADDR_LOOPBACK);
+	endpoint.remote_port = peer->port;
+	strncpy(endpoint.password, password, sizeof(endpoint.password)-1);
+	endpoint.beat_interval = 0;
+	endpoint.tap_fd = sv[1];
+
+	/* The tunnel owns sv[1] after a successful init */
+	tunnel = tunnel_init(&endpoint);
+	if (!tunnel) {
+		fprintf(stderr, "Error initializing the tunnel\n");
+		closesocket(sv[0]);
+		closesocket(sv[1]);
+		return NULL;
+	}
+	if (tunnel_start(tunnel) < 0) {
+		fprintf(stderr, "Error starting the tunnel\n");
+		tunnel_destroy(tunnel);
+		closesocket(sv[0]);
+		return NULL;
+	}
+
+	*tap_fd = sv[0];
+	return tunnel;
+}
+
+void
+ayiya_peer_destroy(ayiya_peer_t *peer)
+{
+	if (peer->fd >= 0) {
+		closesocket(peer->fd);
+		peer->fd = -1;
+	}
+}
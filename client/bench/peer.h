@@ -0,0 +1,67 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PEER_H
+#define PEER_H
+
+#include "../compat.h"
+#include "../hash_sha1.h"
+#include "../tunnel.h"
+
+/* Length of the AYIYA header with IPv6 identity and SHA1 signature */
+#define PEER_HDRLEN (8+16+SHA1_DIGEST_LENGTH)
+
+/* Minimal AYIYA server bound to a loopback UDP port, used to drive a
+ * client tunnel without a real server. The client address is learned
+ * from the first valid packet received. */
+struct ayiya_peer_s {
+	int fd;
+	int port;
+
+	struct in6_addr identity;
+	struct in6_addr client_identity;
+	sha1_byte secret[SHA1_DIGEST_LENGTH];
+
+	struct sockaddr_in client;
+	int have_client;
+};
+typedef struct ayiya_peer_s ayiya_peer_t;
+
+/* Opens the socket, identity is the server side IPv6 address of the
+ * tunnel and client_identity the client side one */
+int ayiya_peer_init(ayiya_peer_t *peer, const char *password,
+                    const struct in6_addr *identity,
+                    const struct in6_addr *client_identity);
+
+/* Signs and sends an IPv6 packet to the client, returns -1 on error or
+ * if no packet has been received from the client yet */
+int ayiya_peer_send(ayiya_peer_t *peer, const void *payload, int len);
+
+/* Waits at most msec for a packet and verifies it. Returns the length
+ * of the forwarded IPv6 payload at buf+PEER_HDRLEN, zero on timeout or
+ * for packets without payload and -1 for errors or invalid packets */
+int ayiya_peer_recv(ayiya_peer_t *peer, unsigned char *buf, int size, int msec);
+
+/* Creates and starts an AYIYA client tunnel towards the peer, with the
+ * TAP side on a socketpair. The harness end of the socketpair is stored
+ * in tap_fd and must be closed by the caller. */
+tunnel_t *ayiya_peer_connect(ayiya_peer_t *peer, const char *password, int *tap_fd);
+
+void ayiya_peer_destroy(ayiya_peer_t *peer);
+
+#endif /* PEER_H */
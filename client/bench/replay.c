@@ -0,0 +1,352 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replays a recording made with "client -w file" through an AYIYA client
+ * tunnel connected to a loopback peer like in the harness. Frames that
+ * were read from the TAP device are injected on the TAP side and frames
+ * that were written to it are sent by the peer, so both directions get
+ * the recorded packet sizes and burstiness.
+ *
+ * The recording can be replayed with the original timing, N times faster
+ * with -s N or as fast as possible with -f. Frames the tunnel doesn't
+ * forward (ARP, neighbor discovery, non-IPv6) are skipped. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../compat.h"
+#include "../threads.h"
+#include "../tunnel.h"
+#include "../capture.h"
+#include "bench.h"
+#include "peer.h"
+
+#define REPLAY_PASSWORD "replay"
+
+/* Time to wait for the last packets after the replay has finished */
+#define REPLAY_DRAIN_MS 500
+
+/* Largest frame the AYIYA tunnel can forward */
+#define REPLAY_MAX_FRAME (14+1500)
+
+struct replay_counters_s {
+	uint64_t packets;
+	uint64_t bytes;
+};
+typedef struct replay_counters_s replay_counters_t;
+
+struct replay_s {
+	tunnel_t *tunnel;
+	ayiya_peer_t peer;
+	int tap_fd;
+
+	/* Set when all frames have been sent */
+	mutex_handle_t mutex;
+	int done;
+
+	/* Sent by the replay loop, received by the receiver thread */
+	replay_counters_t sent[2];
+	replay_counters_t received[2];
+	uint64_t first_sent, last_received;
+	int skipped;
+};
+typedef struct replay_s replay_t;
+
+/* Returns non-zero if the tunnel should forward the frame */
+static int
+forwardable(const unsigned char *frame, int len)
+{
+	if (len < 14+40 || len > REPLAY_MAX_FRAME) {
+		return 0;
+	}
+	if (frame[12] != 0x86 || frame[13] != 0xdd || frame[14] >> 4 != 6) {
+		return 0;
+	}
+
+	/* Router and neighbor discovery is handled locally by the tunnel */
+	if (frame[14+6] == 58 && frame[14+7] == 255 &&
+	    frame[14+40] >= 133 && frame[14+40] <= 137) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static THREAD_RETVAL
+receiver_thread(void *arg)
+{
+	replay_t *replay = arg;
+	unsigned char buf[PEER_HDRLEN+4096];
+	int maxfd, idle, done;
+
+	maxfd = (replay->peer.fd > replay->tap_fd) ?
+	        replay->peer.fd : replay->tap_fd;
+
+	idle = 0;
+	for (;;) {
+		struct timeval tv;
+		fd_set rfds;
+		int ret;
+
+		FD_ZERO(&rfds);
+		FD_SET(replay->peer.fd, &rfds);
+		FD_SET(replay->tap_fd, &rfds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		ret = select(maxfd+1, &rfds, NULL, NULL, &tv);
+		if (ret < 0) {
+			break;
+		} else if (ret == 0) {
+			MUTEX_LOCK(replay->mutex);
+			done = replay->done;
+			MUTEX_UNLOCK(replay->mutex);
+
+			idle += 10;
+			if (done && idle >= REPLAY_DRAIN_MS) {
+				break;
+			}
+			continue;
+		}
+		idle = 0;
+
+		if (FD_ISSET(replay->peer.fd, &rfds)) {
+			ret = ayiya_peer_recv(&replay->peer, buf, sizeof(buf), 0);
+			if (ret > 0) {
+				replay->received[CAPTURE_DIR_IN].packets++;
+				replay->received[CAPTURE_DIR_IN].bytes += 14+ret;
+				replay->last_received = bench_nanotime();
+			}
+		}
+		if (FD_ISSET(replay->tap_fd, &rfds)) {
+			ret = read(replay->tap_fd, buf, sizeof(buf));
+			if (ret > 0 && forwardable(buf, ret)) {
+				replay->received[CAPTURE_DIR_OUT].packets++;
+				replay->received[CAPTURE_DIR_OUT].bytes += ret;
+				replay->last_received = bench_nanotime();
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Sends a frame towards the peer until it knows the client address */
+static int
+replay_handshake(replay_t *replay)
+{
+	unsigned char frame[14+40];
+	unsigned char buf[PEER_HDRLEN+4096];
+	int i;
+
+	memset(frame, 0, sizeof(frame));
+	frame[12] = 0x86;
+	frame[13] = 0xdd;
+	frame[14] = 0x60;
+	frame[14+6] = 59;
+	frame[14+7] = 64;
+	memcpy(frame+14+8, &replay->peer.client_identity, 16);
+	memcpy(frame+14+24, &replay->peer.identity, 16);
+
+	for (i=0; i<10 && !replay->peer.have_client; i++) {
+		if (write(replay->tap_fd, frame, sizeof(frame)) != sizeof(frame)) {
+			return -1;
+		}
+		ayiya_peer_recv(&replay->peer, buf, sizeof(buf), 100);
+	}
+
+	return replay->peer.have_client ? 0 : -1;
+}
+
+static void
+wait_until(uint64_t target)
+{
+	uint64_t now;
+
+	for (;;) {
+		now = bench_nanotime();
+		if (now >= target) {
+			break;
+		}
+
+		/* Sleep for longer gaps and spin for the last millisecond */
+		if (target - now > 2000000) {
+			sleepms((target - now) / 1000000 - 1);
+		}
+	}
+}
+
+static int
+replay_run(replay_t *replay, capture_t *capture, double speed)
+{
+	unsigned char frame[4096];
+	uint64_t first, timestamp;
+	int direction, len;
+
+	first = 0;
+	while ((len = capture_read(capture, &timestamp, &direction,
+	                           frame, sizeof(frame))) > 0) {
+		if (direction != CAPTURE_DIR_IN && direction != CAPTURE_DIR_OUT) {
+			replay->skipped++;
+			continue;
+		}
+		if (!forwardable(frame, len)) {
+			replay->skipped++;
+			continue;
+		}
+
+		if (!replay->first_sent) {
+			replay->first_sent = bench_nanotime();
+			first = timestamp;
+		}
+		if (speed > 0) {
+			wait_until(replay->first_sent +
+			           (uint64_t) ((timestamp - first) * 1000 / speed));
+		}
+
+		/* Failed sends are counted as sent, so they show up as loss */
+		if (direction == CAPTURE_DIR_IN) {
+			write(replay->tap_fd, frame, len);
+		} else {
+			ayiya_peer_send(&replay->peer, frame+14, len-14);
+		}
+		replay->sent[direction].packets++;
+		replay->sent[direction].bytes += len;
+	}
+
+	return len;
+}
+
+static void
+print_direction(const char *name, replay_counters_t *sent,
+                replay_counters_t *received, double seconds)
+{
+	uint64_t lost;
+
+	lost = (sent->packets > received->packets) ?
+	       sent->packets - received->packets : 0;
+	printf("%-4s %10llu %10llu %10llu %7.3f%% %10.0f %10.3f\n", name,
+	       (unsigned long long) sent->packets,
+	       (unsigned long long) received->packets,
+	       (unsigned long long) lost,
+	       sent->packets ? 100.0 * lost / sent->packets : 0.0,
+	       received->packets / seconds,
+	       received->bytes * 8 / seconds / 1000000.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	replay_t replay;
+	capture_t *capture;
+	thread_handle_t receiver;
+	tunnel_stats_t stats;
+	struct in6_addr local, remote;
+	const char *filename;
+	double speed, seconds;
+	int i, ret;
+
+	speed = 1.0;
+	filename = NULL;
+	for (i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "-f")) {
+			speed = 0;
+		} else if (!strcmp(argv[i], "-s") && i+1 < argc) {
+			speed = atof(argv[++i]);
+			if (speed <= 0) {
+				filename = NULL;
+				break;
+			}
+		} else {
+			filename = argv[i];
+		}
+	}
+	if (!filename) {
+		fprintf(stderr, "Usage: %s [-s speed | -f] file\n", argv[0]);
+		return 1;
+	}
+
+	capture = capture_open(filename);
+	if (!capture) {
+		fprintf(stderr, "Error opening capture file %s\n", filename);
+		return 1;
+	}
+
+	memset(&replay, 0, sizeof(replay));
+	MUTEX_CREATE(replay.mutex);
+	inet_pton(AF_INET6, "2001:db8::2", &local);
+	inet_pton(AF_INET6, "2001:db8::1", &remote);
+	if (ayiya_peer_init(&replay.peer, REPLAY_PASSWORD, &remote, &local) < 0) {
+		fprintf(stderr, "Error creating the AYIYA peer\n");
+		return 1;
+	}
+	replay.tunnel = ayiya_peer_connect(&replay.peer, REPLAY_PASSWORD,
+	                                   &replay.tap_fd);
+	if (!replay.tunnel) {
+		return 1;
+	}
+	if (replay_handshake(&replay) < 0) {
+		fprintf(stderr, "No response from the tunnel\n");
+		return 1;
+	}
+
+	THREAD_CREATE(receiver, receiver_thread, &replay);
+	ret = replay_run(&replay, capture, speed);
+
+	MUTEX_LOCK(replay.mutex);
+	replay.done = 1;
+	MUTEX_UNLOCK(replay.mutex);
+	THREAD_JOIN(receiver);
+
+	if (ret < 0) {
+		fprintf(stderr, "Error reading capture file, stopped early\n");
+	}
+
+	seconds = (replay.last_received > replay.first_sent) ?
+	          (replay.last_received - replay.first_sent) / 1000000000.0 : 0;
+	if (seconds <= 0) {
+		seconds = 1e-9;
+	}
+
+	if (speed > 0) {
+		printf("Replayed %s at %.2fx recorded speed", filename, speed);
+	} else {
+		printf("Replayed %s at full speed", filename);
+	}
+	printf(", %d frames skipped, %.3f seconds\n", replay.skipped, seconds);
+	printf("%-4s %10s %10s %10s %8s %10s %10s\n",
+	       "dir", "sent", "received", "lost", "loss", "pps", "Mbit/s");
+	print_direction("tx", &replay.sent[CAPTURE_DIR_IN],
+	                &replay.received[CAPTURE_DIR_IN], seconds);
+	print_direction("rx", &replay.sent[CAPTURE_DIR_OUT],
+	                &replay.received[CAPTURE_DIR_OUT], seconds);
+
+	tunnel_get_stats(replay.tunnel, &stats);
+	printf("Socket buffer drops: %llu received, %llu sent\n",
+	       (unsigned long long) stats.rx_dropped,
+	       (unsigned long long) stats.tx_dropped);
+
+	tunnel_destroy(replay.tunnel);
+	ayiya_peer_destroy(&replay.peer);
+	closesocket(replay.tap_fd);
+	capture_close(capture);
+	MUTEX_DESTROY(replay.mutex);
+
+	return 0;
+}
@@ -0,0 +1,222 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "threads.h"
+#include "capture.h"
+
+static const unsigned char capture_magic[] = { 'N', 'C', 'A', 'P' };
+
+struct capture_s {
+	FILE *file;
+	int writing;
+
+	/* Time of the previous record, absolute when writing */
+	uint64_t timestamp;
+
+	mutex_handle_t mutex;
+};
+
+static uint64_t
+capture_time()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int
+put_varint(unsigned char *buf, uint64_t value)
+{
+	int len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = value;
+
+	return len;
+}
+
+static int
+get_varint(FILE *file, uint64_t *value)
+{
+	int shift, c;
+
+	*value = 0;
+	for (shift=0; shift<64; shift+=7) {
+		c = fgetc(file);
+		if (c == EOF) {
+			/* Clean end of file only before the first byte */
+			return shift ? -1 : 1;
+		}
+		*value |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static capture_t *
+capture_init(const char *filename, int writing)
+{
+	capture_t *capture;
+
+	capture = calloc(1, sizeof(capture_t));
+	if (!capture) {
+		return NULL;
+	}
+
+	capture->file = fopen(filename, writing ? "wb" : "rb");
+	if (!capture->file) {
+		free(capture);
+		return NULL;
+	}
+	capture->writing = writing;
+	MUTEX_CREATE(capture->mutex);
+
+	return capture;
+}
+
+capture_t *
+capture_create(const char *filename)
+{
+	unsigned char header[8];
+	capture_t *capture;
+
+	capture = capture_init(filename, 1);
+	if (!capture) {
+		return NULL;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, capture_magic, sizeof(capture_magic));
+	header[4] = CAPTURE_VERSION;
+	if (fwrite(header, sizeof(header), 1, capture->file) != 1) {
+		capture_close(capture);
+		return NULL;
+	}
+	capture->timestamp = capture_time();
+
+	return capture;
+}
+
+capture_t *
+capture_open(const char *filename)
+{
+	unsigned char header[8];
+	capture_t *capture;
+
+	capture = capture_init(filename, 0);
+	if (!capture) {
+		return NULL;
+	}
+
+	if (fread(header, sizeof(header), 1, capture->file) != 1 ||
+	    memcmp(header, capture_magic, sizeof(capture_magic)) ||
+	    header[4] != CAPTURE_VERSION) {
+		capture_close(capture);
+		return NULL;
+	}
+
+	return capture;
+}
+
+int
+capture_write(capture_t *capture, int direction, const void *frame, int len)
+{
+	unsigned char header[24];
+	uint64_t now;
+	int hdrlen, ret;
+
+	if (!capture || len <= 0) {
+		return 0;
+	}
+
+	MUTEX_LOCK(capture->mutex);
+	now = capture_time();
+	if (now < capture->timestamp) {
+		/* Clock went backwards, keep the deltas positive */
+		now = capture->timestamp;
+	}
+
+	hdrlen = put_varint(header, now - capture->timestamp);
+	header[hdrlen++] = direction;
+	hdrlen += put_varint(header+hdrlen, len);
+	capture->timestamp = now;
+
+	ret = 0;
+	if (fwrite(header, hdrlen, 1, capture->file) != 1 ||
+	    fwrite(frame, len, 1, capture->file) != 1) {
+		ret = -1;
+	}
+	MUTEX_UNLOCK(capture->mutex);
+
+	return ret;
+}
+
+int
+capture_read(capture_t *capture, uint64_t *timestamp, int *direction,
+             void *buf, int size)
+{
+	uint64_t delta, len;
+	int ret, c;
+
+	if (!capture || capture->writing) {
+		return -1;
+	}
+
+	ret = get_varint(capture->file, &delta);
+	if (ret) {
+		return (ret > 0) ? 0 : -1;
+	}
+	c = fgetc(capture->file);
+	if (c == EOF || get_varint(capture->file, &len)) {
+		return -1;
+	}
+	if (len == 0 || len > size) {
+		return -1;
+	}
+	if (fread(buf, len, 1, capture->file) != 1) {
+		return -1;
+	}
+
+	capture->timestamp += delta;
+	*timestamp = capture->timestamp;
+	*direction = c;
+
+	return len;
+}
+
+void
+capture_close(capture_t *capture)
+{
+	if (capture) {
+		fclose(capture->file);
+		MUTEX_DESTROY(capture->mutex);
+	}
+	free(capture);
+}
@@ -0,0 +1,65 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/* Recording of the Ethernet frames passing the TAP device of a tunnel.
+ *
+ * The file starts with the 4 byte magic "NCAP", a version byte and 3
+ * reserved bytes. Each record after that is:
+ *   varint - microseconds since the previous record (or the start)
+ *   byte   - direction, CAPTURE_DIR_*
+ *   varint - length of the frame
+ *   bytes  - the Ethernet frame
+ * Varints are unsigned with 7 bits per byte, least significant first
+ * and the high bit set on all but the last byte. */
+
+#define CAPTURE_VERSION 1
+
+/* Frame read from the TAP device, going towards the server */
+#define CAPTURE_DIR_IN  0
+
+/* Frame written to the TAP device, coming from the server or local */
+#define CAPTURE_DIR_OUT 1
+
+typedef struct capture_s capture_t;
+
+/* Creates a new capture file for recording, NULL on error */
+capture_t *capture_create(const char *filename);
+
+/* Opens an existing capture file for reading, NULL on error */
+capture_t *capture_open(const char *filename);
+
+/* Appends a frame to a recording, can be called from several threads.
+ * Does nothing if capture is NULL, to make the hooks cheap when not
+ * recording. Returns -1 on error. */
+int capture_write(capture_t *capture, int direction, const void *frame, int len);
+
+/* Reads the next frame into buf, timestamp is set to microseconds since
+ * the start of the recording. Returns the frame length, 0 at the end of
+ * the file and -1 on error or if the frame doesn't fit into buf. */
+int capture_read(capture_t *capture, uint64_t *timestamp, int *direction,
+                 void *buf, int size);
+
+/* Flushes and closes the file */
+void capture_close(capture_t *capture);
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,129 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "compat.h"
+#include "checksum.h"
+
+/* The data is summed as native 32-bit words into a 64-bit accumulator,
+ * which can't overflow for any packet size and needs no carry handling
+ * in the loop. One's complement sums are independent of byte order
+ * (RFC 1071 section 2B), so the folded result only needs a swap into
+ * network order at the end. The unrolled loop has no dependencies
+ * between the loads and is vectorized by the compiler where possible. */
+static uint64_t
+checksum_native(const unsigned char *data, int len)
+{
+	uint64_t acc = 0;
+	uint32_t w[8];
+
+	while (len >= 32) {
+		memcpy(w, data, 32);
+		acc += (uint64_t) w[0] + w[1] + w[2] + w[3];
+		acc += (uint64_t) w[4] + w[5] + w[6] + w[7];
+		data += 32;
+		len -= 32;
+	}
+	while (len >= 4) {
+		memcpy(w, data, 4);
+		acc += w[0];
+		data += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		uint16_t h;
+
+		memcpy(&h, data, 2);
+		acc += h;
+		data += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* The last odd byte is padded with zero to a full word */
+		unsigned char pad[2] = { data[0], 0 };
+		uint16_t h;
+
+		memcpy(&h, pad, 2);
+		acc += h;
+	}
+
+	return acc;
+}
+
+static uint32_t
+checksum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return (uint32_t) sum;
+}
+
+uint32_t
+checksum_add(uint32_t sum, const void *data, int len)
+{
+	return sum + ntohs(checksum_fold(checksum_native(data, len)));
+}
+
+uint16_t
+checksum_finish(uint32_t sum)
+{
+	return ~checksum_fold(sum) & 0xffff;
+}
+
+uint32_t
+checksum_pseudo_ipv4(const void *src, const void *dst,
+                     uint8_t protocol, uint16_t length)
+{
+	uint32_t sum;
+
+	sum = checksum_add(0, src, 4);
+	sum = checksum_add(sum, dst, 4);
+	return sum + protocol + length;
+}
+
+uint32_t
+checksum_pseudo_ipv6(const void *src, const void *dst,
+                     uint8_t nexthdr, uint32_t length)
+{
+	uint32_t sum;
+
+	sum = checksum_add(0, src, 16);
+	sum = checksum_add(sum, dst, 16);
+	return sum + (length >> 16) + (length & 0xffff) + nexthdr;
+}
+
+uint16_t
+checksum_update16(uint16_t check, uint16_t oldval, uint16_t newval)
+{
+	uint32_t sum;
+
+	/* HC' = ~(~HC + ~m + m') */
+	sum = (~check & 0xffff) + (~oldval & 0xffff) + newval;
+	return checksum_finish(sum);
+}
+
+uint16_t
+checksum_update32(uint16_t check, uint32_t oldval, uint32_t newval)
+{
+	check = checksum_update16(check, oldval >> 16, newval >> 16);
+	return checksum_update16(check, oldval & 0xffff, newval & 0xffff);
+}
@@ -0,0 +1,51 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+
+/* Internet checksum (RFC 1071) helpers. Partial sums are 32-bit values
+ * that can be added together as long as every partial sum except the
+ * last one covers an even number of bytes. All 16-bit values are in
+ * network byte order when read from or stored into a packet. */
+
+/* Returns the unfolded one's complement sum of len bytes added to sum */
+uint32_t checksum_add(uint32_t sum, const void *data, int len);
+
+/* Folds a partial sum into 16 bits and returns its complement, the
+ * value to store into the checksum field of a packet in host order */
+uint16_t checksum_finish(uint32_t sum);
+
+/* Partial sum of the IPv4 pseudo-header, addresses point to 4 bytes */
+uint32_t checksum_pseudo_ipv4(const void *src, const void *dst,
+                              uint8_t protocol, uint16_t length);
+
+/* Partial sum of the IPv6 pseudo-header, addresses point to 16 bytes */
+uint32_t checksum_pseudo_ipv6(const void *src, const void *dst,
+                              uint8_t nexthdr, uint32_t length);
+
+/* Updates an existing checksum when a 16-bit field changes from oldval
+ * to newval, as in equation 3 of RFC 1624. All values in host order. */
+uint16_t checksum_update16(uint16_t check, uint16_t oldval, uint16_t newval);
+
+/* Same as checksum_update16 for a 32-bit field such as IPv4 address */
+uint16_t checksum_update32(uint16_t check, uint32_t oldval, uint32_t newval);
+
+#endif /* CHECKSUM_H */
@@ -25,6 +25,7 @@
 #include "compat.h"
 #include "tunnel.h"
 #include "login_tic.h"
+#include "capture.h"
 
 int running;
 
@@ -53,13 +54,27 @@ main(int argc, char *argv[])
 {
 	endpoint_t endpoint;
 	tunnel_t *tunnel;
-	int ret;
+	tunnel_stats_t stats;
+	capture_t *capture;
+	int ret, i;
 
 	INIT_SOCKETLIB(ret);
 
 	signal(SIGTERM, &sigterm);
 	signal(SIGINT, &sigterm);
 
+	/* Optionally record the traffic of the TAP device into a file */
+	capture = NULL;
+	if (argc > 2 && !strcmp(argv[1], "-w")) {
+		capture = capture_create(argv[2]);
+		if (!capture) {
+			printf("Error creating capture file %s\n", argv[2]);
+			return 1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
 	memset(&endpoint, 0, sizeof(endpoint));
 	if (argc < 2) {
 		printf("Not enough arguments\n");
@@ -117,7 +132,15 @@ main(int argc, char *argv[])
 		assert(inet_pton(AF_INET, argv[5], &endpoint.remote_ipv4) >= 0);
 		strncpy(endpoint.password, argv[6], sizeof(endpoint.password)-1);
 		assert(parseint(argv[7], &endpoint.beat_interval) >= 0);
-
+		for (i=8; i<argc; i++) {
+			if (!strcmp(argv[i], "adaptive")) {
+				endpoint.beat_adaptive = 1;
+			} else if (!strcmp(argv[i], "compress")) {
+				endpoint.compress = 1;
+			} else if (!strcmp(argv[i], "rtt")) {
+				endpoint.rtt_interval = 1;
+			}
+		}
 	} else if (!strcmp(argv[1], "v4v6test")) {
 		endpoint.type = TUNNEL_TYPE_V4V6;
 		inet_pton(AF_INET6, "2001::2", &endpoint.remote_ipv6);
@@ -138,6 +161,7 @@ main(int argc, char *argv[])
 		printf("Error initializing the tunnel, check permissions\n");
 		return -1;
 	}
+	tunnel_set_capture(tunnel, capture);
 
 	if (tunnel_start(tunnel) == -1) {
 		printf("Error starting the tunnel\n");
@@ -149,7 +173,28 @@ main(int argc, char *argv[])
 		sleepms(1000);
 	}
 
+	tunnel_get_stats(tunnel, &stats);
+	printf("Received %llu packets (%llu bytes), %llu dropped\n",
+	       (unsigned long long) stats.rx_packets,
+	       (unsigned long long) stats.rx_bytes,
+	       (unsigned long long) stats.rx_dropped);
+	printf("Sent %llu packets (%llu bytes), %llu dropped\n",
+	       (unsigned long long) stats.tx_packets,
+	       (unsigned long long) stats.tx_bytes,
+	       (unsigned long long) stats.tx_dropped);
+	if (stats.rx_payload_compressed > 0 && stats.tx_payload_compressed > 0) {
+		printf("Compression ratio %.2f received, %.2f sent\n",
+		       (double) stats.rx_payload / stats.rx_payload_compressed,
+		       (double) stats.tx_payload / stats.tx_payload_compressed);
+	}
+	if (stats.rtt_samples > 0) {
+		printf("Round trip time %.1f ms (min %.1f ms) from %llu echoes\n",
+		       stats.rtt_srtt / 1000.0, stats.rtt_min / 1000.0,
+		       (unsigned long long) stats.rtt_samples);
+	}
+
 	tunnel_destroy(tunnel);
+	capture_close(capture);
 
 	CLOSE_SOCKETLIB(ret);
 
@@ -16,8 +16,14 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <time.h>
+
 #include "compat.h"
 
+#if !defined(_WIN32) && !defined(_WIN64)
+#  include <sys/time.h>
+#endif
+
 #if defined(_WIN32) || defined(_WIN64)
 const char *
 inet_ntop(int af, const void *src, char *dst, socklen_t size)
@@ -78,3 +84,25 @@ inet_pton(int af, const char *src, void *dst)
 	return 1;
 }
 #endif
+
+uint64_t
+gettimeus()
+{
+#if defined(_WIN32) || defined(_WIN64)
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t) ((double) count.QuadPart * 1000000.0 / freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+}
@@ -20,6 +20,7 @@
 #define COMPAT_H
 
 #include <unistd.h>
+#include <stdint.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #  include <windows.h>
@@ -81,6 +82,9 @@ do { \
 
 #endif
 
+/* Monotonic time in microseconds, only useful for measuring intervals */
+uint64_t gettimeus();
+
 #  ifndef IPPROTO_IPIP
 #    define IPPROTO_IPIP 4
 #  endif
@@ -0,0 +1,244 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "compress.h"
+
+#define LZ4_HASHLOG      12
+#define LZ4_MINMATCH     4
+
+/* The format requires the last five bytes to be literals and the last
+ * match to start at least twelve bytes before the end of the block */
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT      12
+
+#define LZ4_MAXOFFSET    0xffff
+
+static uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static int
+hash32(uint32_t value)
+{
+	return (value * 2654435761U) >> (32 - LZ4_HASHLOG);
+}
+
+/* Writes the extra length bytes of a literal or match length */
+static uint8_t *
+write_length(uint8_t *op, int length)
+{
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = length;
+	return op;
+}
+
+/* Worst case size of a sequence with the given lengths in bytes */
+#define SEQUENCE_MAXLEN(litlen, matchlen) \
+	(1 + (litlen)/255 + 1 + (litlen) + 2 + (matchlen)/255 + 1)
+
+int
+compress_lz4(const uint8_t *src, int srclen, uint8_t *dst, int dstlen)
+{
+	uint16_t table[1 << LZ4_HASHLOG];
+	const uint8_t *ip, *anchor, *iend, *mflimit, *matchlimit;
+	uint8_t *op, *oend;
+	int litlen;
+
+	assert(src);
+	assert(dst);
+
+	if (srclen < 0 || srclen > COMPRESS_MAX_LENGTH) {
+		return 0;
+	}
+
+	ip = anchor = src;
+	iend = src + srclen;
+	mflimit = iend - LZ4_MFLIMIT;
+	matchlimit = iend - LZ4_LASTLITERALS;
+	op = dst;
+	oend = dst + dstlen;
+
+	memset(table, 0, sizeof(table));
+	while (srclen > LZ4_MFLIMIT && ip <= mflimit) {
+		const uint8_t *ref, *match;
+		uint32_t sequence;
+		int matchlen, offset, h;
+		uint8_t *token;
+
+		sequence = read32(ip);
+		h = hash32(sequence);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > LZ4_MAXOFFSET ||
+		    read32(ref) != sequence) {
+			/* Skip faster over data that doesn't compress */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		/* Extend the match forwards and backwards */
+		match = ip + LZ4_MINMATCH;
+		ref += LZ4_MINMATCH;
+		while (match < matchlimit && *match == *ref) {
+			match++;
+			ref++;
+		}
+		ref -= match - ip;
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		litlen = ip - anchor;
+		matchlen = match - ip - LZ4_MINMATCH;
+		offset = ip - ref;
+		if (SEQUENCE_MAXLEN(litlen, matchlen) > oend - op) {
+			return 0;
+		}
+
+		token = op++;
+		*token = (litlen < 15 ? litlen : 15) << 4;
+		if (litlen >= 15) {
+			op = write_length(op, litlen - 15);
+		}
+		memcpy(op, anchor, litlen);
+		op += litlen;
+
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		*token |= (matchlen < 15 ? matchlen : 15);
+		if (matchlen >= 15) {
+			op = write_length(op, matchlen - 15);
+		}
+
+		ip = anchor = match;
+	}
+
+	/* The block always ends with a sequence of only literals */
+	litlen = iend - anchor;
+	if (1 + litlen/255 + 1 + litlen > oend - op) {
+		return 0;
+	}
+	*op++ = (litlen < 15 ? litlen : 15) << 4;
+	if (litlen >= 15) {
+		op = write_length(op, litlen - 15);
+	}
+	memcpy(op, anchor, litlen);
+	op += litlen;
+
+	return op - dst;
+}
+
+/* Reads the extra length bytes, returns -1 if the input ends first */
+static int
+read_length(const uint8_t **ip, const uint8_t *iend, int length)
+{
+	uint8_t value;
+
+	do {
+		if (*ip >= iend) {
+			return -1;
+		}
+		value = *(*ip)++;
+		length += value;
+	} while (value == 255 && length <= COMPRESS_MAX_LENGTH);
+
+	return length;
+}
+
+int
+decompress_lz4(const uint8_t *src, int srclen, uint8_t *dst, int dstlen)
+{
+	const uint8_t *ip, *iend;
+	uint8_t *op, *oend;
+
+	assert(src);
+	assert(dst);
+
+	ip = src;
+	iend = src + srclen;
+	op = dst;
+	oend = dst + dstlen;
+
+	while (ip < iend) {
+		const uint8_t *ref;
+		int litlen, matchlen, offset;
+		uint8_t token;
+
+		token = *ip++;
+		litlen = token >> 4;
+		if (litlen == 15) {
+			litlen = read_length(&ip, iend, litlen);
+			if (litlen < 0) {
+				return -1;
+			}
+		}
+		if (litlen > iend - ip || litlen > oend - op) {
+			return -1;
+		}
+		memcpy(op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+
+		if (ip == iend) {
+			/* The last sequence has no match */
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op - dst) {
+			return -1;
+		}
+
+		matchlen = token & 15;
+		if (matchlen == 15) {
+			matchlen = read_length(&ip, iend, matchlen);
+			if (matchlen < 0) {
+				return -1;
+			}
+		}
+		matchlen += LZ4_MINMATCH;
+		if (matchlen > oend - op) {
+			return -1;
+		}
+
+		/* The match may overlap the output, copy a byte at a time */
+		ref = op - offset;
+		while (matchlen--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return op - dst;
+}
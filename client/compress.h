@@ -0,0 +1,42 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+/* Compression of tunnelled packets in the LZ4 block format, the output
+ * can be decompressed with any LZ4 implementation. Only single blocks of
+ * at most COMPRESS_MAX_LENGTH bytes are supported, which is plenty for
+ * a packet. The compressor trades ratio for speed like the reference
+ * one: a single entry hash table and no lazy matching. */
+
+#define COMPRESS_MAX_LENGTH 0xffff
+
+/* Compresses srclen bytes from src into dst, returns the compressed
+ * length or 0 if the result doesn't fit in dstlen bytes. Passing a
+ * dstlen smaller than srclen only accepts results that save space. */
+int compress_lz4(const uint8_t *src, int srclen, uint8_t *dst, int dstlen);
+
+/* Decompresses srclen bytes from src into dst, returns the length of
+ * the decompressed data or -1 if the input is invalid or doesn't fit in
+ * dstlen bytes. Never reads or writes outside the given buffers. */
+int decompress_lz4(const uint8_t *src, int srclen, uint8_t *dst, int dstlen);
+
+#endif /* COMPRESS_H */
@@ -0,0 +1,115 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "keepalive.h"
+
+/* The search is done when the bounds are this close to each other,
+ * relative to the lower bound but at least one second apart */
+#define KEEPALIVE_PRECISION(lo) ((lo)/8 > 1000 ? (lo)/8 : 1000)
+
+void
+keepalive_init(keepalive_t *keepalive, int fallback)
+{
+	assert(keepalive);
+
+	memset(keepalive, 0, sizeof(keepalive_t));
+	keepalive->state = KEEPALIVE_PROBING;
+	keepalive->lo = KEEPALIVE_MIN_MS;
+	keepalive->hi = KEEPALIVE_MAX_MS;
+	keepalive->fallback = fallback;
+}
+
+int
+keepalive_interval(keepalive_t *keepalive)
+{
+	assert(keepalive);
+
+	switch (keepalive->state) {
+	case KEEPALIVE_FAILED:
+		return keepalive->fallback;
+	case KEEPALIVE_STABLE:
+		return keepalive->lo;
+	default:
+		break;
+	}
+
+	/* Double until the first expiry, then search in between */
+	if (keepalive->hi == KEEPALIVE_MAX_MS &&
+	    keepalive->lo*2 < keepalive->hi) {
+		return keepalive->lo*2;
+	}
+	return keepalive->lo + (keepalive->hi - keepalive->lo)/2;
+}
+
+static void
+keepalive_update(keepalive_t *keepalive)
+{
+	if (keepalive->lo >= keepalive->hi ||
+	    keepalive->hi - keepalive->lo <= KEEPALIVE_PRECISION(keepalive->lo)) {
+		keepalive->state = KEEPALIVE_STABLE;
+	} else {
+		keepalive->state = KEEPALIVE_PROBING;
+	}
+}
+
+void
+keepalive_result(keepalive_t *keepalive, int gap, int expired)
+{
+	assert(keepalive);
+
+	keepalive->lost = 0;
+	if (!expired) {
+		if (gap > keepalive->lo) {
+			keepalive->lo = gap;
+		}
+		if (keepalive->lo > keepalive->hi) {
+			/* The mapping lives longer than it used to */
+			keepalive->hi = KEEPALIVE_MAX_MS;
+		}
+	} else if (keepalive->state == KEEPALIVE_STABLE && gap >= keepalive->lo) {
+		/* The learned interval doesn't hold anymore */
+		keepalive->hi = gap;
+		keepalive->lo = gap/2;
+	} else if (gap < keepalive->hi) {
+		keepalive->hi = gap;
+		if (keepalive->lo >= gap) {
+			keepalive->lo = gap/2;
+		}
+	}
+
+	if (keepalive->lo < KEEPALIVE_MIN_MS) {
+		keepalive->lo = KEEPALIVE_MIN_MS;
+	}
+	if (keepalive->hi < keepalive->lo) {
+		keepalive->hi = keepalive->lo;
+	}
+	keepalive_update(keepalive);
+}
+
+void
+keepalive_lost(keepalive_t *keepalive)
+{
+	assert(keepalive);
+
+	if (++keepalive->lost >= KEEPALIVE_MAX_LOST) {
+		keepalive->state = KEEPALIVE_FAILED;
+	}
+}
@@ -0,0 +1,78 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KEEPALIVE_H
+#define KEEPALIVE_H
+
+/* Limits of the learned keepalive interval in milliseconds */
+#define KEEPALIVE_MIN_MS (10*1000)
+#define KEEPALIVE_MAX_MS (30*60*1000)
+
+/* Time to wait for an echo response before counting it as lost */
+#define KEEPALIVE_TIMEOUT_MS (5*1000)
+
+/* Echo responses lost in a row before falling back to fixed beats */
+#define KEEPALIVE_MAX_LOST 3
+
+enum keepalive_state_e {
+	KEEPALIVE_PROBING,
+	KEEPALIVE_STABLE,
+	KEEPALIVE_FAILED
+};
+typedef enum keepalive_state_e keepalive_state_t;
+
+/* Learns the lifetime of the NAT mapping between the client and the
+ * server. The client stays idle for a gap, sends an echo request and
+ * compares the address the server saw with the previous one: a new
+ * address means the old mapping expired during the gap. The gap is
+ * doubled until a mapping expires and the lifetime is then found with
+ * a binary search. Once the search is done, beats are sent at the
+ * longest gap that kept the mapping. If a mapping expires at that gap
+ * later, the search starts again from half the gap.
+ *
+ * This is only the state machine. The caller measures the gaps and
+ * sends the requests, so it can be driven without a network. */
+struct keepalive_s {
+	keepalive_state_t state;
+
+	/* Longest gap known to keep the mapping and shortest known to
+	 * lose it, the lifetime is somewhere in between */
+	int lo;
+	int hi;
+
+	/* Fixed interval used if the server doesn't answer echoes */
+	int fallback;
+	int lost;
+};
+typedef struct keepalive_s keepalive_t;
+
+/* Fallback is the configured beat interval in milliseconds */
+void keepalive_init(keepalive_t *keepalive, int fallback);
+
+/* Returns the idle time in milliseconds before the next beat */
+int keepalive_interval(keepalive_t *keepalive);
+
+/* Reports the answer to an echo request sent after gap milliseconds of
+ * idle time, expired is non-zero if the mapping had changed */
+void keepalive_result(keepalive_t *keepalive, int gap, int expired);
+
+/* Reports an echo request that was never answered, after too many the
+ * state changes to failed and the fallback interval is used for good */
+void keepalive_lost(keepalive_t *keepalive);
+
+#endif /* KEEPALIVE_H */
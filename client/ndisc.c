@@ -0,0 +1,71 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "checksum.h"
+#include "ndisc.h"
+
+int
+ndisc_solicit_to_advert(unsigned char *buf, const char *routerhw)
+{
+	unsigned char ipbuf[16];
+	uint32_t checksum;
+	int length;
+
+	/* Ignore unspecified ND's as they are used for DAD */
+	memset(&ipbuf, 0, sizeof(ipbuf));
+	if (!memcmp(buf+14+8, ipbuf, sizeof(ipbuf))) {
+		return 0;
+	}
+
+	/* Neighbor advert is ICMPv6 header, IPv6 address and
+	 * 8 bytes of target link-layer address option */
+	length = 8+16+8;
+
+	/* Set Ethernet src/dst */
+	memcpy(buf, buf+6, 6);
+	memcpy(buf+6, routerhw, 6);
+
+	/* Add packet content length */
+	buf[14+4] = length >> 8;
+	buf[14+5] = length;
+
+	/* Set IPv6 src/dst */
+	memcpy(buf+14+24, buf+14+8, 16);        /* Destination address (from source) */
+	memcpy(buf+14+8, buf+14+40+8, 16);	/* Source address (from ICMPv6 packet) */
+
+	/* Set ICMPv6 type and code */
+	buf[14+40] = 136;
+	buf[14+40+1] = 0;
+
+	/* Add target link-layer address option */
+	buf[14+40+8+16] = 2;
+	buf[14+40+8+16+1] = 1;
+	memcpy(buf+14+40+8+16+2, routerhw, 6);
+
+	/* Checksum the pseudo-header and the ICMPv6 packet */
+	buf[14+40+2] = 0;
+	buf[14+40+3] = 0;
+	checksum = checksum_pseudo_ipv6(buf+14+8, buf+14+24, 58, length);
+	checksum = checksum_finish(checksum_add(checksum, buf+14+40, length));
+	buf[14+40+2] = checksum >> 8;
+	buf[14+40+3] = checksum;
+
+	return 14+40+length;
+}
@@ -0,0 +1,28 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NDISC_H
+#define NDISC_H
+
+/* Converts the neighbor solicitation Ethernet frame in buf into a
+ * neighbor advertisement answering with routerhw, in place. Returns
+ * the length of the reply frame or 0 if the solicitation is a DAD
+ * request that should be ignored. */
+int ndisc_solicit_to_advert(unsigned char *buf, const char *routerhw);
+
+#endif /* NDISC_H */
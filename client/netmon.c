@@ -0,0 +1,201 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "netmon.h"
+
+#if defined(__linux__)
+
+#include <sys/select.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/* Changes usually come in bursts (address, prefix route and default
+ * route), wait this long after the first one to handle them at once */
+#define NETMON_SETTLE_MS 50
+
+struct netmon_s {
+	int fd;
+};
+
+netmon_t *
+netmon_init()
+{
+	struct sockaddr_nl snl;
+	netmon_t *netmon;
+
+	netmon = calloc(1, sizeof(netmon_t));
+	if (!netmon) {
+		return NULL;
+	}
+
+	netmon->fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (netmon->fd < 0) {
+		free(netmon);
+		return NULL;
+	}
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+	                RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+	if (bind(netmon->fd, (struct sockaddr *) &snl, sizeof(snl)) < 0) {
+		close(netmon->fd);
+		free(netmon);
+		return NULL;
+	}
+
+	return netmon;
+}
+
+/* Returns non-zero if the message may change the source address used
+ * for packets to the server */
+static int
+netmon_relevant(const struct nlmsghdr *nlh)
+{
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+	{
+		const struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+
+		/* Link local and loopback addresses are never used */
+		return (ifa->ifa_scope == RT_SCOPE_UNIVERSE ||
+		        ifa->ifa_scope == RT_SCOPE_SITE);
+	}
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+	{
+		const struct rtmsg *rtm = NLMSG_DATA(nlh);
+
+		/* Kernel routes follow address changes, which are already
+		 * handled, and only the main table is used for lookups */
+		return (rtm->rtm_table == RT_TABLE_MAIN &&
+		        rtm->rtm_protocol != RTPROT_KERNEL &&
+		        !(rtm->rtm_flags & RTM_F_CLONED));
+	}
+	default:
+		return 0;
+	}
+}
+
+/* Reads all pending messages, returns 1 if any of them was relevant */
+static int
+netmon_drain(netmon_t *netmon)
+{
+	char buf[8192];
+	int changed = 0;
+
+	for (;;) {
+		struct nlmsghdr *nlh;
+		int len;
+
+		len = recv(netmon->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno == ENOBUFS) {
+				/* Messages were lost, assume something changed */
+				changed = 1;
+				continue;
+			}
+			return -1;
+		}
+
+		for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (netmon_relevant(nlh)) {
+				changed = 1;
+			}
+		}
+	}
+
+	return changed;
+}
+
+static int
+netmon_select(netmon_t *netmon, int msec)
+{
+	struct timeval tv;
+	fd_set rfds;
+
+	FD_ZERO(&rfds);
+	FD_SET(netmon->fd, &rfds);
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+
+	return select(netmon->fd+1, &rfds, NULL, NULL, &tv);
+}
+
+int
+netmon_wait(netmon_t *netmon, int msec)
+{
+	int ret;
+
+	ret = netmon_select(netmon, msec);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	ret = netmon_drain(netmon);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	while (netmon_select(netmon, NETMON_SETTLE_MS) > 0) {
+		if (netmon_drain(netmon) < 0) {
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+void
+netmon_destroy(netmon_t *netmon)
+{
+	if (netmon) {
+		close(netmon->fd);
+	}
+	free(netmon);
+}
+
+#else /* Not supported on this platform */
+
+netmon_t *
+netmon_init()
+{
+	return NULL;
+}
+
+int
+netmon_wait(netmon_t *netmon, int msec)
+{
+	sleepms(msec);
+	return 0;
+}
+
+void
+netmon_destroy(netmon_t *netmon)
+{
+}
+
+#endif
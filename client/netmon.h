@@ -0,0 +1,38 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NETMON_H
+#define NETMON_H
+
+/* Monitors changes of the local addresses and routes, which usually
+ * means that packets to the server leave from a new source address and
+ * the server or a NAT in between needs to learn it. Only implemented on
+ * Linux using rtnetlink, netmon_init returns NULL elsewhere. */
+
+typedef struct netmon_s netmon_t;
+
+netmon_t *netmon_init();
+
+/* Waits at most msec for changes, returns 1 if the addresses or routes
+ * have changed, 0 on timeout and -1 on error. All pending change
+ * notifications are consumed by a single call. */
+int netmon_wait(netmon_t *netmon, int msec);
+
+void netmon_destroy(netmon_t *netmon);
+
+#endif /* NETMON_H */
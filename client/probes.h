@@ -0,0 +1,64 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/* Static tracepoints of the "nabla" provider. When sys/sdt.h is found
+ * (HAVE_SYS_SDT_H defined by the Makefile) each probe is a single nop
+ * instruction until a tracer attaches, otherwise they compile to nothing.
+ * All probes take the same three arguments:
+ *   arg0 - pointer to the tunnel_t
+ *   arg1 - length of the packet in bytes, or 0 if not related to one
+ *   arg2 - reason code, PROBE_REASON_* for drops, errno for socket
+ *          errors and the return value for beats
+ *
+ * The probes are:
+ *   ayiya_encap  - packet sent to the AYIYA server, arg2 is the opcode
+ *   ayiya_decap  - packet from the AYIYA server written to the device
+ *   ayiya_drop   - packet from the AYIYA server dropped
+ *   nd_reply     - neighbor advertisement written to the device
+ *   arp_reply    - ARP reply written to the device
+ *   beat         - beat sent to the server
+ *   socket_error - error in select, send or receive on the tunnel socket
+ *
+ * For example with bpftrace:
+ *   bpftrace -e 'usdt:bin/client:nabla:ayiya_drop { @[arg2] = count(); }'
+ */
+
+#define PROBE_REASON_NONE      0
+#define PROBE_REASON_HOST      1  /* Packet from an unexpected address */
+#define PROBE_REASON_SHORT     2  /* Packet shorter than the header */
+#define PROBE_REASON_HEADER    3  /* Unsupported header values */
+#define PROBE_REASON_IDENTITY  4  /* Wrong tunnel identity */
+#define PROBE_REASON_TIME      5  /* Timestamp too far off */
+#define PROBE_REASON_HASH      6  /* Signature verification failed */
+#define PROBE_REASON_NOTIPV6   7  /* Payload is not an IPv6 packet */
+
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+#  define NABLA_PROBE(name, tunnel, len, reason) \
+	DTRACE_PROBE3(nabla, name, tunnel, len, reason)
+#else
+/* Arguments are still evaluated, so variables used only by probes
+ * don't trigger unused variable warnings */
+#  define NABLA_PROBE(name, tunnel, len, reason) \
+	do { (void) (tunnel); (void) (len); (void) (reason); } while (0)
+#endif
+
+#endif /* PROBES_H */
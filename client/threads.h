@@ -56,4 +56,11 @@ typedef pthread_mutex_t mutex_handle_t;
 
 #endif
 
+/* Full memory barrier for the lock-free readers */
+#if defined(__GNUC__)
+#define MEMORY_BARRIER() __sync_synchronize()
+#else
+#define MEMORY_BARRIER() MemoryBarrier()
+#endif
+
 #endif
@@ -0,0 +1,269 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "compat.h"
+#include "transport.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#  define TRANSPORT_FULL(err) ((err) == WSAENOBUFS || (err) == WSAEWOULDBLOCK)
+#else
+#  define TRANSPORT_FULL(err) ((err) == ENOBUFS || (err) == EAGAIN || \
+                               (err) == EWOULDBLOCK)
+#endif
+
+/* Sets the buffer size, the privileged option is tried first because
+ * the raw socket tunnels can exceed the system wide maximum with it */
+static int
+transport_setbuf(int fd, int optname, int forcename, int size)
+{
+	int ret = -1;
+
+	if (forcename) {
+		ret = setsockopt(fd, SOL_SOCKET, forcename,
+		                 (const char *) &size, sizeof(size));
+	}
+	if (ret < 0) {
+		ret = setsockopt(fd, SOL_SOCKET, optname,
+		                 (const char *) &size, sizeof(size));
+	}
+
+	return ret;
+}
+
+/* Applies the current buffer sizes to fd and enables drop reporting,
+ * returns non-zero if the kernel reports drops on the socket */
+static int
+transport_setopts(transport_t *transport, int fd)
+{
+	int forcename;
+	int ovfl_enabled = 0;
+
+	/* Failing to set the sizes is not fatal */
+#ifdef SO_RCVBUFFORCE
+	forcename = SO_RCVBUFFORCE;
+#else
+	forcename = 0;
+#endif
+	transport_setbuf(fd, SO_RCVBUF, forcename, transport->rcvbuf);
+#ifdef SO_SNDBUFFORCE
+	forcename = SO_SNDBUFFORCE;
+#else
+	forcename = 0;
+#endif
+	transport_setbuf(fd, SO_SNDBUF, forcename, transport->sndbuf);
+
+#ifdef SO_RXQ_OVFL
+	{
+		int one = 1;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL,
+		               &one, sizeof(one)) == 0) {
+			ovfl_enabled = 1;
+		}
+	}
+#endif
+
+	return ovfl_enabled;
+}
+
+static void
+transport_grow(transport_t *transport, int *size, int *max, int optname,
+               int forcename, const char *name)
+{
+	int newsize;
+
+	if (*size >= *max) {
+		return;
+	}
+
+	newsize = *size * 2;
+	if (newsize > *max) {
+		newsize = *max;
+	}
+	if (transport_setbuf(transport->fd, optname, forcename, newsize) < 0) {
+		logger_log(transport->logger, LOG_WARNING,
+		           "Error growing %s buffer to %d bytes: %s (%d)\n",
+		           name, newsize, strerror(GetLastError()),
+		           GetLastError());
+		/* Don't retry on every drop */
+		*max = *size;
+		return;
+	}
+
+	logger_log(transport->logger, LOG_INFO,
+	           "Grew %s buffer to %d bytes\n", name, newsize);
+	*size = newsize;
+}
+
+int
+transport_init(transport_t *transport, int fd, int bufmin, int bufmax,
+               logger_t *logger)
+{
+	assert(transport);
+
+	memset(transport, 0, sizeof(transport_t));
+	transport->fd = fd;
+	transport->logger = logger;
+	transport->rcvbuf = (bufmin > 0) ? bufmin : TRANSPORT_BUFSIZE_MIN;
+	transport->sndbuf = transport->rcvbuf;
+	transport->rcvmax = (bufmax > 0) ? bufmax : TRANSPORT_BUFSIZE_MAX;
+	if (transport->rcvmax < transport->rcvbuf) {
+		transport->rcvmax = transport->rcvbuf;
+	}
+	transport->sndmax = transport->rcvmax;
+
+	transport->ovfl_enabled = transport_setopts(transport, fd);
+	if (!transport->ovfl_enabled) {
+		logger_log(transport->logger, LOG_INFO,
+		           "Kernel drop counter not available on socket\n");
+	}
+
+	return 0;
+}
+
+int
+transport_rebind(transport_t *transport, int newfd)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	/* Sockets can't be duplicated over an existing one */
+	return -1;
+#else
+	assert(transport);
+
+	/* Apply the options to the new socket before it goes in use */
+	transport_setopts(transport, newfd);
+
+	/* Atomically closes the old socket */
+	if (dup2(newfd, transport->fd) < 0) {
+		return -1;
+	}
+	close(newfd);
+
+	return 0;
+#endif
+}
+
+int
+transport_recvfrom(transport_t *transport, void *buf, int len,
+                   struct sockaddr *from, socklen_t *fromlen,
+                   unsigned int *dropped)
+{
+	int ret;
+
+	assert(transport);
+	assert(dropped);
+
+	*dropped = 0;
+
+#ifdef SO_RXQ_OVFL
+	if (transport->ovfl_enabled) {
+		char control[CMSG_SPACE(sizeof(uint32_t))];
+		struct cmsghdr *cmsg;
+		struct msghdr msg;
+		struct iovec iov;
+
+		iov.iov_base = buf;
+		iov.iov_len = len;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = from;
+		msg.msg_namelen = *fromlen;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ret = recvmsg(transport->fd, &msg, 0);
+		if (ret < 0) {
+			return ret;
+		}
+		*fromlen = msg.msg_namelen;
+
+		/* The counter is stored when the datagram is queued, so drops
+		 * are seen with the first datagram received after them */
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			uint32_t ovfl;
+
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SO_RXQ_OVFL) {
+				continue;
+			}
+
+			memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+			if (ovfl < transport->ovfl) {
+				/* The socket was replaced by transport_rebind */
+				*dropped = ovfl;
+			} else {
+				*dropped = ovfl - transport->ovfl;
+			}
+			transport->ovfl = ovfl;
+		}
+
+		if (*dropped) {
+			int forcename;
+
+#ifdef SO_RCVBUFFORCE
+			forcename = SO_RCVBUFFORCE;
+#else
+			forcename = 0;
+#endif
+			logger_log(transport->logger, LOG_NOTICE,
+			           "Kernel dropped %u received packets\n",
+			           *dropped);
+			transport_grow(transport, &transport->rcvbuf,
+			               &transport->rcvmax, SO_RCVBUF, forcename,
+			               "receive");
+		}
+
+		return ret;
+	}
+#endif
+
+	ret = recvfrom(transport->fd, (char *) buf, len, 0, from, fromlen);
+	return ret;
+}
+
+int
+transport_sendto(transport_t *transport, const void *buf, int len,
+                 const struct sockaddr *to, socklen_t tolen)
+{
+	int forcename;
+	int ret;
+
+	assert(transport);
+
+	ret = sendto(transport->fd, (const char *) buf, len, 0, to, tolen);
+	if (ret >= 0 || !TRANSPORT_FULL(GetLastError())) {
+		return ret;
+	}
+
+#ifdef SO_SNDBUFFORCE
+	forcename = SO_SNDBUFFORCE;
+#else
+	forcename = 0;
+#endif
+	transport_grow(transport, &transport->sndbuf, &transport->sndmax,
+	               SO_SNDBUF, forcename, "send");
+
+	return 0;
+}
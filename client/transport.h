@@ -0,0 +1,75 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+
+#include "compat.h"
+#include "logger.h"
+
+/* Default limits of the socket buffer sizes, used if not configured */
+#define TRANSPORT_BUFSIZE_MIN (256*1024)
+#define TRANSPORT_BUFSIZE_MAX (4*1024*1024)
+
+/* Wrapper for the datagram socket of a tunnel. The kernel counts the
+ * datagrams dropped because of a full receive buffer (SO_RXQ_OVFL on
+ * Linux) and the buffers are doubled up to the limit when drops are
+ * seen. The receive fields are only written by the reader thread and
+ * the send fields only by the writer thread, each buffer has its own
+ * limit so that failing to grow one doesn't stop the other. Rebinding
+ * only reads the sizes, a stale size is corrected by the next drop. */
+struct transport_s {
+	int fd;
+	logger_t *logger;
+
+	/* Current size and limit of each buffer */
+	int rcvbuf;
+	int rcvmax;
+	int sndbuf;
+	int sndmax;
+
+	/* Non-zero if the kernel reports drops, last reported counter */
+	int ovfl_enabled;
+	uint32_t ovfl;
+};
+typedef struct transport_s transport_t;
+
+/* Sets the initial buffer sizes of fd and enables drop reporting.
+ * Zero bufmin or bufmax uses the default limits. */
+int transport_init(transport_t *transport, int fd, int bufmin, int bufmax,
+                   logger_t *logger);
+
+/* Same as recvfrom, the number of datagrams dropped by the kernel since
+ * the previous call is stored in dropped */
+int transport_recvfrom(transport_t *transport, void *buf, int len,
+                       struct sockaddr *from, socklen_t *fromlen,
+                       unsigned int *dropped);
+
+/* Replaces the socket with newfd while keeping the descriptor number,
+ * so the threads using it don't need to be stopped. The current buffer
+ * sizes are applied to newfd, which is closed on success. */
+int transport_rebind(transport_t *transport, int newfd);
+
+/* Same as sendto, but returns 0 if the datagram was dropped because
+ * the send buffer was full */
+int transport_sendto(transport_t *transport, const void *buf, int len,
+                     const struct sockaddr *to, socklen_t tolen);
+
+#endif /* TRANSPORT_H */
@@ -23,13 +23,169 @@
 #include "compat.h"
 #include "threads.h"
 #include "tunnel.h"
+#include "probes.h"
+#include "netmon.h"
+#include "keepalive.h"
+
+/* State of the adaptive beats, only used by the beater thread */
+struct adaptive_s {
+	keepalive_t keepalive;
+
+	/* Idle time since the last packet sent to the server, and the
+	 * longest idle time since the last echo request */
+	int idle;
+	int longest;
+	uint64_t tx_packets;
+
+	/* Idle time before the pending echo request, and the time waited
+	 * for its response or -1 if there is no request pending */
+	int gap;
+	int waiting;
+
+	int responses;
+	int have_mapping;
+	struct sockaddr_in mapping;
+};
+typedef struct adaptive_s adaptive_t;
+
+static void
+adaptive_init(tunnel_t *tunnel, adaptive_t *adaptive)
+{
+	memset(adaptive, 0, sizeof(adaptive_t));
+	keepalive_init(&adaptive->keepalive,
+	               tunnel->endpoint.beat_interval*1000);
+	adaptive->waiting = -1;
+
+	/* Get the current mapping right away */
+	adaptive->idle = keepalive_interval(&adaptive->keepalive);
+}
+
+/* Called after the tunnel socket has changed, the old mapping is gone */
+static void
+adaptive_reset(adaptive_t *adaptive)
+{
+	adaptive->have_mapping = 0;
+	adaptive->waiting = -1;
+	adaptive->idle = keepalive_interval(&adaptive->keepalive);
+}
+
+static void
+adaptive_response(tunnel_t *tunnel, adaptive_t *adaptive,
+                  const struct sockaddr_in *mapping)
+{
+	int expired;
+
+	expired = adaptive->have_mapping &&
+	          (mapping->sin_addr.s_addr != adaptive->mapping.sin_addr.s_addr ||
+	           mapping->sin_port != adaptive->mapping.sin_port);
+
+	/* The first response only tells the mapping to compare against */
+	if (adaptive->have_mapping) {
+		keepalive_result(&adaptive->keepalive, adaptive->gap, expired);
+	}
+	if (expired) {
+		logger_log(tunnel->logger, LOG_INFO,
+		           "NAT mapping expired after %d ms idle\n",
+		           adaptive->gap);
+	}
+	logger_log(tunnel->logger, LOG_DEBUG,
+	           "Keepalive interval now %d ms\n",
+	           keepalive_interval(&adaptive->keepalive));
+
+	memcpy(&adaptive->mapping, mapping, sizeof(struct sockaddr_in));
+	adaptive->have_mapping = 1;
+}
+
+/* Sends an echo request and records the time for the round trip */
+static int
+send_echo(tunnel_t *tunnel)
+{
+	MUTEX_LOCK(tunnel->echo_mutex);
+	tunnel->echo_sent = gettimeus();
+	MUTEX_UNLOCK(tunnel->echo_mutex);
+
+	return tunnel->tunmod->echo(tunnel);
+}
+
+/* Advances the adaptive beats by elapsed ms and sends a beat or an
+ * echo request when the idle time reaches the keepalive interval */
+static void
+adaptive_tick(tunnel_t *tunnel, adaptive_t *adaptive, int elapsed)
+{
+	struct sockaddr_in mapping;
+	tunnel_stats_t stats;
+	int responses;
+	int ret;
+
+	/* Data traffic keeps the mapping alive, no beats needed */
+	adaptive->idle += elapsed;
+	tunnel_get_stats(tunnel, &stats);
+	if (stats.tx_packets != adaptive->tx_packets) {
+		adaptive->tx_packets = stats.tx_packets;
+		if (adaptive->idle > adaptive->longest) {
+			adaptive->longest = adaptive->idle;
+		}
+		adaptive->idle = 0;
+	}
+
+	if (adaptive->waiting >= 0) {
+		MUTEX_LOCK(tunnel->echo_mutex);
+		responses = tunnel->echo_responses;
+		memcpy(&mapping, &tunnel->echo_mapping, sizeof(mapping));
+		MUTEX_UNLOCK(tunnel->echo_mutex);
+
+		if (responses != adaptive->responses) {
+			adaptive->responses = responses;
+			adaptive->waiting = -1;
+			adaptive_response(tunnel, adaptive, &mapping);
+		} else {
+			adaptive->waiting += elapsed;
+			if (adaptive->waiting >= KEEPALIVE_TIMEOUT_MS) {
+				logger_log(tunnel->logger, LOG_INFO,
+				           "No response to echo request\n");
+				keepalive_lost(&adaptive->keepalive);
+				adaptive->waiting = -1;
+			}
+		}
+	}
+
+	if (adaptive->waiting >= 0 ||
+	    adaptive->idle < keepalive_interval(&adaptive->keepalive)) {
+		return;
+	}
+
+	/* The server doesn't answer echoes, use normal beats instead */
+	logger_log(tunnel->logger, LOG_DEBUG,
+	           "Sending beat signal to server after %d ms idle\n",
+	           adaptive->idle);
+	if (adaptive->keepalive.state == KEEPALIVE_FAILED) {
+		ret = tunnel->tunmod->beat(tunnel);
+	} else {
+		MUTEX_LOCK(tunnel->echo_mutex);
+		adaptive->responses = tunnel->echo_responses;
+		MUTEX_UNLOCK(tunnel->echo_mutex);
+
+		adaptive->gap = (adaptive->idle > adaptive->longest) ?
+		                adaptive->idle : adaptive->longest;
+		adaptive->waiting = 0;
+		ret = send_echo(tunnel);
+	}
+	NABLA_PROBE(beat, tunnel, 0, ret);
+	adaptive->idle = 0;
+	adaptive->longest = 0;
+}
 
 static THREAD_RETVAL
 beater_thread(void *arg)
 {
 	tunnel_t *tunnel = arg;
-	int time_left;
+	netmon_t *netmon;
+	adaptive_t adaptive;
+	int use_adaptive, use_rtt;
+	int time_left, rtt_left, elapsed;
+	uint64_t waited;
 	int running;
+	int ret;
 
 	assert(tunnel);
 	assert(tunnel->tunmod);
@@ -38,6 +194,14 @@ beater_thread(void *arg)
 
 	logger_log(tunnel->logger, LOG_INFO, "Starting beater thread\n");
 
+	/* Address changes are handled right away instead of waiting for
+	 * the next beat, the tunnel is lost until the server notices */
+	netmon = netmon_init();
+	if (!netmon) {
+		logger_log(tunnel->logger, LOG_INFO,
+		           "Network change monitoring not available\n");
+	}
+
 	if (tunnel->endpoint.type == TUNNEL_TYPE_AYIYA) {
 		/* Two extra beats for AYIYA to be bug-compatible with aiccu */
 		tunnel->tunmod->beat(tunnel);
@@ -47,17 +211,69 @@ beater_thread(void *arg)
 		tunnel->tunmod->beat(tunnel);
 	}
 
+	use_adaptive = (tunnel->endpoint.beat_adaptive && tunnel->tunmod->echo);
+	if (use_adaptive) {
+		adaptive_init(tunnel, &adaptive);
+	}
+
+	/* Adaptive beats measure the round trip time with their echoes,
+	 * extra ones would keep the NAT mapping alive during the probing */
+	use_rtt = (!use_adaptive && tunnel->endpoint.rtt_interval > 0 &&
+	           tunnel->tunmod->echo);
+
 	time_left = 0;
+	rtt_left = 0;
+	elapsed = 0;
+	waited = gettimeus();
 	do {
-		if (time_left <= 0) {
+		if (use_adaptive) {
+			adaptive_tick(tunnel, &adaptive, elapsed);
+		} else if (time_left <= 0) {
 			logger_log(tunnel->logger, LOG_DEBUG,
 			           "Sending beat signal to server\n");
-			tunnel->tunmod->beat(tunnel);
+			ret = tunnel->tunmod->beat(tunnel);
+			NABLA_PROBE(beat, tunnel, 0, ret);
 			time_left = tunnel->endpoint.beat_interval*1000;
 		}
+		if (use_rtt && rtt_left <= 0) {
+			send_echo(tunnel);
+			rtt_left = tunnel->endpoint.rtt_interval*1000;
+		}
+
+		if (netmon) {
+			ret = netmon_wait(netmon, tunnel->waitms);
+		} else {
+			sleepms(tunnel->waitms);
+			ret = 0;
+		}
 
-		sleepms(tunnel->waitms);
-		time_left -= tunnel->waitms;
+		/* Network changes end the wait early, count only the time that
+		 * passed and keep the fraction of a millisecond for later */
+		elapsed = (int) ((gettimeus() - waited) / 1000);
+		waited += (uint64_t) elapsed * 1000;
+		time_left -= elapsed;
+		rtt_left -= elapsed;
+
+		if (ret < 0) {
+			logger_log(tunnel->logger, LOG_WARNING,
+			           "Error monitoring network changes, disabled\n");
+			netmon_destroy(netmon);
+			netmon = NULL;
+		} else if (ret > 0) {
+			logger_log(tunnel->logger, LOG_INFO,
+			           "Local addresses changed, rebinding tunnel\n");
+			if (tunnel->tunmod->rebind &&
+			    tunnel->tunmod->rebind(tunnel) < 0) {
+				logger_log(tunnel->logger, LOG_ERR,
+				           "Error rebinding the tunnel socket\n");
+			}
+
+			/* Let the server know the new address immediately */
+			time_left = 0;
+			if (use_adaptive) {
+				adaptive_reset(&adaptive);
+			}
+		}
 
 		MUTEX_LOCK(tunnel->run_mutex);
 		running = tunnel->running;
@@ -68,6 +284,8 @@ beater_thread(void *arg)
 	tunnel->running = 0;
 	MUTEX_UNLOCK(tunnel->run_mutex);
 
+	netmon_destroy(netmon);
+
 	logger_log(tunnel->logger, LOG_INFO, "Finished beater thread\n");
 
 	return 0;
@@ -109,6 +327,8 @@ tunnel_init(endpoint_t *endpoint)
 
 	MUTEX_CREATE(tunnel->run_mutex);
 	MUTEX_CREATE(tunnel->join_mutex);
+	MUTEX_CREATE(tunnel->stats_mutex);
+	MUTEX_CREATE(tunnel->echo_mutex);
 
 	memcpy((endpoint_t *) &tunnel->endpoint, endpoint, sizeof(endpoint_t));
 
@@ -203,6 +423,131 @@ tunnel_running(tunnel_t *tunnel)
 	return running;
 }
 
+void
+tunnel_set_capture(tunnel_t *tunnel, capture_t *capture)
+{
+	assert(tunnel);
+
+	/* Only allowed while the threads are not running */
+	MUTEX_LOCK(tunnel->run_mutex);
+	if (!tunnel->running) {
+		tunnel->capture = capture;
+	}
+	MUTEX_UNLOCK(tunnel->run_mutex);
+}
+
+/* Writers are serialized by the mutex, the sequence tells lock-free
+ * readers that an update is in progress or happened while copying */
+static void
+stats_write_begin(tunnel_t *tunnel)
+{
+	MUTEX_LOCK(tunnel->stats_mutex);
+	tunnel->stats_seq++;
+	MEMORY_BARRIER();
+}
+
+static void
+stats_write_end(tunnel_t *tunnel)
+{
+	MEMORY_BARRIER();
+	tunnel->stats_seq++;
+	MUTEX_UNLOCK(tunnel->stats_mutex);
+}
+
+void
+tunnel_get_stats(tunnel_t *tunnel, tunnel_stats_t *stats)
+{
+	unsigned int seq;
+
+	assert(tunnel);
+	assert(stats);
+
+	do {
+		seq = tunnel->stats_seq;
+		MEMORY_BARRIER();
+		memcpy(stats, (const void *) &tunnel->stats, sizeof(tunnel_stats_t));
+		MEMORY_BARRIER();
+	} while ((seq & 1) || seq != tunnel->stats_seq);
+}
+
+void
+tunnel_count_rx(tunnel_t *tunnel, int bytes, unsigned int dropped)
+{
+	stats_write_begin(tunnel);
+	if (bytes > 0) {
+		tunnel->stats.rx_packets++;
+		tunnel->stats.rx_bytes += bytes;
+	}
+	tunnel->stats.rx_dropped += dropped;
+	stats_write_end(tunnel);
+}
+
+void
+tunnel_count_tx(tunnel_t *tunnel, int bytes, unsigned int dropped)
+{
+	stats_write_begin(tunnel);
+	if (bytes > 0) {
+		tunnel->stats.tx_packets++;
+		tunnel->stats.tx_bytes += bytes;
+	}
+	tunnel->stats.tx_dropped += dropped;
+	stats_write_end(tunnel);
+}
+
+void
+tunnel_count_rx_payload(tunnel_t *tunnel, int original, int compressed)
+{
+	stats_write_begin(tunnel);
+	tunnel->stats.rx_payload += original;
+	tunnel->stats.rx_payload_compressed += compressed;
+	stats_write_end(tunnel);
+}
+
+void
+tunnel_count_tx_payload(tunnel_t *tunnel, int original, int compressed)
+{
+	stats_write_begin(tunnel);
+	tunnel->stats.tx_payload += original;
+	tunnel->stats.tx_payload_compressed += compressed;
+	stats_write_end(tunnel);
+}
+
+void
+tunnel_echo_response(tunnel_t *tunnel, const struct sockaddr_in *mapping)
+{
+	uint64_t now, sent;
+	uint32_t rtt;
+
+	now = gettimeus();
+
+	MUTEX_LOCK(tunnel->echo_mutex);
+	tunnel->echo_responses++;
+	memcpy(&tunnel->echo_mapping, mapping, sizeof(struct sockaddr_in));
+	sent = tunnel->echo_sent;
+	tunnel->echo_sent = 0;
+	MUTEX_UNLOCK(tunnel->echo_mutex);
+
+	if (!sent) {
+		/* Response to a request that was already answered */
+		return;
+	}
+	rtt = (now - sent > UINT32_MAX) ? UINT32_MAX : (uint32_t) (now - sent);
+
+	stats_write_begin(tunnel);
+	tunnel->stats.rtt_last = rtt;
+	if (!tunnel->stats.rtt_samples) {
+		tunnel->stats.rtt_min = rtt;
+		tunnel->stats.rtt_srtt = rtt;
+	} else {
+		if (rtt < tunnel->stats.rtt_min) {
+			tunnel->stats.rtt_min = rtt;
+		}
+		tunnel->stats.rtt_srtt = ((uint64_t) tunnel->stats.rtt_srtt*7 + rtt)/8;
+	}
+	tunnel->stats.rtt_samples++;
+	stats_write_end(tunnel);
+}
+
 void
 tunnel_destroy(tunnel_t *tunnel)
 {
@@ -214,6 +559,8 @@ tunnel_destroy(tunnel_t *tunnel)
 
 		MUTEX_DESTROY(tunnel->run_mutex);
 		MUTEX_DESTROY(tunnel->join_mutex);
+		MUTEX_DESTROY(tunnel->stats_mutex);
+		MUTEX_DESTROY(tunnel->echo_mutex);
 	}
 	free(tunnel);
 }
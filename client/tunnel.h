@@ -19,9 +19,12 @@
 #ifndef TUNNEL_H
 #define TUNNEL_H
 
+#include <stdint.h>
+
 #include "compat.h"
 #include "threads.h"
 #include "logger.h"
+#include "capture.h"
 
 enum tunnel_type_e {
 	TUNNEL_TYPE_V4V4,
@@ -47,9 +50,60 @@ struct endpoint_s {
 
 	char password[256];
 	int beat_interval;
+
+	/* Learn the NAT mapping lifetime and beat just before it expires,
+	 * beat_interval is used if the server doesn't answer echoes */
+	int beat_adaptive;
+
+	/* Already open frame socket used instead of a TAP device if
+	 * positive, mainly for testing without privileges */
+	int tap_fd;
+
+	/* Initial and maximum size of the socket buffers, the defaults
+	 * from transport.h are used if zero */
+	int sockbuf_min;
+	int sockbuf_max;
+
+	/* Compress the forwarded packets if it saves space, only used
+	 * by AYIYA and received packets are decompressed regardless */
+	int compress;
+
+	/* Interval of echo requests for measuring the round trip time
+	 * in seconds, zero disables. With beat_adaptive the time is
+	 * measured from its echo requests and this is not used. */
+	int rtt_interval;
 };
 typedef struct endpoint_s endpoint_t;
 
+/* Forwarding statistics, rx is traffic received from the server and
+ * tx traffic sent to it. Dropped packets were lost because of a full
+ * socket buffer and are not included in the packet counts. */
+struct tunnel_stats_s {
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t rx_dropped;
+
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t tx_dropped;
+
+	/* Forwarded payload bytes before and after compression, the
+	 * packets sent or received uncompressed count in both */
+	uint64_t rx_payload;
+	uint64_t rx_payload_compressed;
+	uint64_t tx_payload;
+	uint64_t tx_payload_compressed;
+
+	/* Round trip times of echo requests in microseconds, srtt is
+	 * smoothed like the TCP SRTT and all are zero before the first
+	 * response */
+	uint64_t rtt_samples;
+	uint32_t rtt_last;
+	uint32_t rtt_min;
+	uint32_t rtt_srtt;
+};
+typedef struct tunnel_stats_s tunnel_stats_t;
+
 typedef struct tunnel_mod_s tunnel_mod_t;
 typedef struct tunnel_data_s tunnel_data_t;
 
@@ -68,6 +122,24 @@ struct tunnel_s {
 	thread_handle_t writer;
 	thread_handle_t beater;
 
+	/* Recording of the TAP traffic if not NULL */
+	capture_t *capture;
+
+	/* The statistics are written with stats_mutex held and stats_seq
+	 * odd. Readers copy them without locking and retry until stats_seq
+	 * is even and unchanged, so they never block the forwarding. */
+	mutex_handle_t stats_mutex;
+	volatile unsigned int stats_seq;
+	tunnel_stats_t stats;
+
+	/* Number of echo responses received and the address and port of
+	 * the client as seen by the server in the last one, and the time
+	 * the pending echo request was sent or zero */
+	mutex_handle_t echo_mutex;
+	int echo_responses;
+	struct sockaddr_in echo_mapping;
+	uint64_t echo_sent;
+
 	const endpoint_t endpoint;
 	tunnel_data_t *privdata;
 };
@@ -78,6 +150,8 @@ struct tunnel_mod_s {
 	int (*start)(tunnel_t *tunnel);
 	int (*stop)(tunnel_t *tunnel);
 	int (*beat)(tunnel_t *tunnel);
+	int (*echo)(tunnel_t *tunnel);
+	int (*rebind)(tunnel_t *tunnel);
 	void (*destroy)(tunnel_t *tunnel);
 };
 
@@ -85,8 +159,18 @@ tunnel_t *tunnel_init(endpoint_t *endpoint);
 int tunnel_start(tunnel_t *tunnel);
 int tunnel_stop(tunnel_t *tunnel);
 int tunnel_running(tunnel_t *tunnel);
+void tunnel_set_capture(tunnel_t *tunnel, capture_t *capture);
+/* Never blocks, safe to call from a user interface at any rate */
+void tunnel_get_stats(tunnel_t *tunnel, tunnel_stats_t *stats);
 void tunnel_destroy(tunnel_t *tunnel);
 
+/* Used by the tunnel modules to update the statistics */
+void tunnel_count_rx(tunnel_t *tunnel, int bytes, unsigned int dropped);
+void tunnel_count_tx(tunnel_t *tunnel, int bytes, unsigned int dropped);
+void tunnel_count_rx_payload(tunnel_t *tunnel, int original, int compressed);
+void tunnel_count_tx_payload(tunnel_t *tunnel, int original, int compressed);
+void tunnel_echo_response(tunnel_t *tunnel, const struct sockaddr_in *mapping);
+
 
 const tunnel_mod_t *ipv4_initmod();
 const tunnel_mod_t *ipv6_initmod();
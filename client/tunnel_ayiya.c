@@ -30,6 +30,11 @@
  *   remote_port   - (optional) UDP port of the server
  *   password      - Shared password from the server
  *   beat_interval - (optional) interval of beat (in seconds)
+ *   beat_adaptive - (optional) learn the NAT timeout with echo requests
+ *   tap_fd        - (optional) Frame socket to use instead of a TAP device
+ *   sockbuf_min   - (optional) Initial size of the socket buffers
+ *   sockbuf_max   - (optional) Maximum size of the socket buffers
+ *   compress      - (optional) Compress the forwarded packets
  */
 
 #include <stdlib.h>
@@ -41,6 +46,10 @@
 #include "tapcfg.h"
 #include "tunnel.h"
 #include "command.h"
+#include "ndisc.h"
+#include "probes.h"
+#include "transport.h"
+#include "compress.h"
 
 #include "ayiya.h"
 #include "hash_sha1.h"
@@ -55,10 +64,22 @@ struct pseudo_ayh {
 	char		payload[2048];
 };
 
+/* Packets shorter than this are not worth compressing */
+#define COMPRESS_MIN_PAYLOAD 64
+
+/* After a packet that didn't compress the following ones are sent as
+ * they are, doubling their number each time up to this maximum */
+#define COMPRESS_MAX_BACKOFF 64
+
 struct tunnel_data_s {
 	int fd;
+	transport_t transport;
 	tapcfg_t *tapcfg;
 	sha1_byte ayiya_hash[SHA1_DIGEST_LENGTH];
+
+	/* Only used by the writer thread */
+	int compress_skip;
+	int compress_backoff;
 };
 
 static const char routerhw[] = { 0x00, 0x01, 0x23, 0x45, 0x67, 0x89 };
@@ -75,6 +96,7 @@ reader_thread(void *arg)
 	SHA_CTX sha1;
 	sha1_byte their_hash[SHA1_DIGEST_LENGTH];
 	sha1_byte our_hash[SHA1_DIGEST_LENGTH];
+	unsigned char zbuf[2048];
 
 	int running;
 	int ret;
@@ -104,6 +126,8 @@ reader_thread(void *arg)
 
 		struct sockaddr_in saddr;
 		socklen_t socklen;
+		unsigned int dropped;
+		unsigned char *payload;
 		int i, buflen;
 
 		FD_ZERO(&rfds);
@@ -113,6 +137,7 @@ reader_thread(void *arg)
 		tv.tv_usec = (tunnel->waitms % 1000) * 1000;
 		ret = select(data->fd+1, &rfds, NULL, NULL, &tv);
 		if (ret == -1) {
+			NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error when selecting for fd: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
@@ -131,9 +156,11 @@ reader_thread(void *arg)
 		           "Trying to read data from server\n");
 
 		socklen = sizeof(saddr);
-		ret = recvfrom(data->fd, (char *) (buf+14), sizeof(buf)-14, 0,
-			       (struct sockaddr *) &saddr, &socklen);
+		ret = transport_recvfrom(&data->transport, buf+14, sizeof(buf)-14,
+		                         (struct sockaddr *) &saddr, &socklen,
+		                         &dropped);
 		if (ret == -1) {
+			NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error in receiving data: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
@@ -143,9 +170,11 @@ reader_thread(void *arg)
 			           "Disconnected from the server\n");
 			break;
 		}
+		tunnel_count_rx(tunnel, ret, dropped);
 
 		if (saddr.sin_addr.s_addr != tunnel->endpoint.remote_ipv4.s_addr ||
 		    ntohs(saddr.sin_port) != tunnel->endpoint.remote_port) {
+			NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_HOST);
 			logger_log(tunnel->logger, LOG_NOTICE,
 			           "Discarding packet from incorrect host\n");
 			goto read_loop;
@@ -155,6 +184,7 @@ reader_thread(void *arg)
 		           "Read %d bytes from the server\n", ret);
 
 		if (ret < sizeof(struct ayiyahdr)) {
+			NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_SHORT);
 			logger_log(tunnel->logger, LOG_ERR, "Received packet is too short");
 			break;
 		}
@@ -165,25 +195,29 @@ reader_thread(void *arg)
 		    s->ayh.ayh_hshmeth != ayiya_hash_sha1 ||
 		    s->ayh.ayh_autmeth != ayiya_auth_sharedsecret ||
 		    (s->ayh.ayh_nextheader != IPPROTO_IPV6 &&
-		     s->ayh.ayh_nextheader != IPPROTO_NONE) ||
+		     s->ayh.ayh_nextheader != IPPROTO_NONE &&
+		     s->ayh.ayh_nextheader != AYIYA_NEXTHDR_LZ4) ||
 		    (s->ayh.ayh_opcode != ayiya_op_forward &&
 		     s->ayh.ayh_opcode != ayiya_op_echo_request &&
-		     s->ayh.ayh_opcode != ayiya_op_echo_request_forward))
+		     s->ayh.ayh_opcode != ayiya_op_echo_request_forward &&
+		     s->ayh.ayh_opcode != ayiya_op_echo_response))
 		{
 			/* Invalid AYIYA packet */
+			NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_HEADER);
 			logger_log(tunnel->logger, LOG_WARNING, "Dropping invalid AYIYA packet\n");
 			logger_log(tunnel->logger, LOG_WARNING, "idlen:   %u != %u\n", s->ayh.ayh_idlen, 4);
 			logger_log(tunnel->logger, LOG_WARNING, "idtype:  %u != %u\n", s->ayh.ayh_idtype, ayiya_id_integer);
 			logger_log(tunnel->logger, LOG_WARNING, "siglen:  %u != %u\n", s->ayh.ayh_siglen, 5);
 			logger_log(tunnel->logger, LOG_WARNING, "hshmeth: %u != %u\n", s->ayh.ayh_hshmeth, ayiya_hash_sha1);
 			logger_log(tunnel->logger, LOG_WARNING, "autmeth: %u != %u\n", s->ayh.ayh_autmeth, ayiya_auth_sharedsecret);
-			logger_log(tunnel->logger, LOG_WARNING, "nexth  : %u != %u || %u\n", s->ayh.ayh_nextheader, IPPROTO_IPV6, IPPROTO_NONE);
-			logger_log(tunnel->logger, LOG_WARNING, "opcode : %u != %u || %u || %u\n", s->ayh.ayh_opcode, ayiya_op_forward, ayiya_op_echo_request, ayiya_op_echo_request_forward);
+			logger_log(tunnel->logger, LOG_WARNING, "nexth  : %u != %u || %u || %u\n", s->ayh.ayh_nextheader, IPPROTO_IPV6, IPPROTO_NONE, AYIYA_NEXTHDR_LZ4);
+			logger_log(tunnel->logger, LOG_WARNING, "opcode : %u != %u || %u || %u || %u\n", s->ayh.ayh_opcode, ayiya_op_forward, ayiya_op_echo_request, ayiya_op_echo_request_forward, ayiya_op_echo_response);
 			goto read_loop;
 		}
 
 		if (memcmp(&s->identity, &tunnel->endpoint.remote_ipv6, sizeof(s->identity)) != 0) {
 			char strbuf[INET6_ADDRSTRLEN];
+			NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_IDENTITY);
 			inet_ntop(AF_INET6, &s->identity, strbuf, sizeof(strbuf));
 			logger_log(tunnel->logger, LOG_WARNING,
 			           "Received packet from a wrong identity \"%s\"\n", strbuf);
@@ -194,6 +228,7 @@ reader_thread(void *arg)
 		i = tic_checktime(ntohl(s->ayh.ayh_epochtime));
 		if (i != 0) {
 			char strbuf[INET6_ADDRSTRLEN];
+			NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_TIME);
 			inet_ntop(AF_INET6, &s->identity, strbuf, sizeof(strbuf));
 			logger_log(tunnel->logger, LOG_WARNING,
 			           "Time is %d seconds off for %s\n", i, buf);
@@ -213,22 +248,67 @@ reader_thread(void *arg)
 
 		/* Compare the SHA1's */
 		if (memcmp(&their_hash, &our_hash, sizeof(their_hash)) != 0) {
+			NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_HASH);
 			logger_log(tunnel->logger, LOG_WARNING, "Incorrect Hash received\n");
 			goto read_loop;
 		}
 
-		if (s->ayh.ayh_nextheader == IPPROTO_IPV6) {
-			/* Verify that this is really IPv6 */
-			if (s->payload[0] >> 4 != 6) {
+		buflen = ret + sizeof(s->payload) - sizeof(*s);
+		if (s->ayh.ayh_opcode == ayiya_op_echo_response) {
+			struct sockaddr_in mapping;
+
+			/* The payload is the IPv4 address and UDP port the
+			 * server received the echo request from */
+			if (s->ayh.ayh_nextheader != IPPROTO_NONE || buflen < 6) {
+				NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_HEADER);
 				logger_log(tunnel->logger, LOG_WARNING,
-				           "Received packet didn't start with a 6, thus is not IPv6\n");
+				           "Invalid echo response payload\n");
 				goto read_loop;
 			}
+			memset(&mapping, 0, sizeof(mapping));
+			mapping.sin_family = AF_INET;
+			memcpy(&mapping.sin_addr, s->payload, 4);
+			memcpy(&mapping.sin_port, s->payload+4, 2);
+			tunnel_echo_response(tunnel, &mapping);
+			goto read_loop;
 		}
 
-		buflen = ret + sizeof(s->payload) - sizeof(*s);
-		memmove(buf+14, s->payload, buflen);
+		payload = (unsigned char *) s->payload;
+		if (s->ayh.ayh_nextheader == AYIYA_NEXTHDR_LZ4) {
+			int origlen;
+
+			/* The original length is followed by the LZ4 block */
+			origlen = (buflen >= 2) ? (payload[0] << 8) | payload[1] : -1;
+			if (origlen < 0 ||
+			    decompress_lz4(payload+2, buflen-2,
+			                   zbuf, sizeof(zbuf)) != origlen) {
+				NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_HEADER);
+				logger_log(tunnel->logger, LOG_WARNING,
+				           "Invalid compressed payload\n");
+				goto read_loop;
+			}
+			tunnel_count_rx_payload(tunnel, origlen, buflen);
+			payload = zbuf;
+			buflen = origlen;
+		} else if (s->ayh.ayh_nextheader == IPPROTO_IPV6) {
+			tunnel_count_rx_payload(tunnel, buflen, buflen);
+		} else {
+			/* Nothing to forward to the device */
+			goto read_loop;
+		}
+
+		/* Verify that this is really IPv6 */
+		if (buflen < 1 || payload[0] >> 4 != 6) {
+			NABLA_PROBE(ayiya_drop, tunnel, ret, PROBE_REASON_NOTIPV6);
+			logger_log(tunnel->logger, LOG_WARNING,
+			           "Received packet didn't start with a 6, thus is not IPv6\n");
+			goto read_loop;
+		}
 
+		memmove(buf+14, payload, buflen);
+		NABLA_PROBE(ayiya_decap, tunnel, buflen, s->ayh.ayh_opcode);
+
+		capture_write(tunnel->capture, CAPTURE_DIR_OUT, buf, buflen+14);
 		ret = tapcfg_write(data->tapcfg, buf, buflen+14);
 		if (ret == -1) {
 			logger_log(tunnel->logger, LOG_ERR, "Error writing packet\n");
@@ -250,6 +330,45 @@ read_loop:
 	return 0;
 }
 
+/* Compresses the payload into s and returns the new payload length, or
+ * 0 if the payload should be sent as it is. Compression is skipped for
+ * a while after a packet that didn't compress, because the following
+ * ones are likely to be of the same (already compressed) kind. */
+static int
+compress_payload(tunnel_data_t *data, struct pseudo_ayh *s,
+                 const unsigned char *payload, int len)
+{
+	int maxlen, ret;
+
+	if (len < COMPRESS_MIN_PAYLOAD) {
+		return 0;
+	}
+	if (data->compress_skip > 0) {
+		data->compress_skip--;
+		return 0;
+	}
+
+	/* Result has to save space even with the length included */
+	maxlen = len - 3;
+	if (maxlen > sizeof(s->payload) - 2) {
+		maxlen = sizeof(s->payload) - 2;
+	}
+	ret = compress_lz4(payload, len, (uint8_t *) s->payload + 2, maxlen);
+	if (ret == 0) {
+		if (data->compress_backoff < COMPRESS_MAX_BACKOFF) {
+			data->compress_backoff = data->compress_backoff ?
+			                         data->compress_backoff*2 : 1;
+		}
+		data->compress_skip = data->compress_backoff;
+		return 0;
+	}
+	data->compress_backoff = 0;
+
+	s->payload[0] = (len >> 8) & 0xff;
+	s->payload[1] = len & 0xff;
+	return ret + 2;
+}
+
 static THREAD_RETVAL
 writer_thread(void *arg)
 {
@@ -273,12 +392,13 @@ writer_thread(void *arg)
 	do {
 		fd_set wfds;
 		struct sockaddr_in saddr;
-		int len, etherType;
+		int len, paylen, etherType;
 
 		if (!tapcfg_wait_readable(data->tapcfg, tunnel->waitms))
 			goto write_loop;
 
 		len = tapcfg_read(data->tapcfg, buf, sizeof(buf));
+		capture_write(tunnel->capture, CAPTURE_DIR_IN, buf, len);
 		if (len <= 0) {
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error in tapcfg reading\n");
@@ -313,68 +433,20 @@ writer_thread(void *arg)
 		 * (XXX: doesn't check for a chain, but ND is usually without)
 		 */
 		if (buf[14+6] == 58 && buf[14+7] == 255 && buf[14+40] == 135) {
-			unsigned char ipbuf[16];
-			int length, checksum;
-			int i;
+			int length;
 
-			/* Ignore unspecified ND's as they are used for DAD */
-			memset(&ipbuf, 0, sizeof(ipbuf));
-			if (!memcmp(buf+14+8, ipbuf, sizeof(ipbuf))) {
+			length = ndisc_solicit_to_advert(buf, routerhw);
+			if (!length) {
 				logger_log(tunnel->logger, LOG_DEBUG,
 				           "Found ND DAD request that is ignored\n");
 				goto write_loop;
 			}
 
-			/* Neighbor advert is ICMPv6 header, IPv6 address and
-			 * 8 bytes of target link-layer address option */
-			length = 8+16+8;
-
-			/* Set Ethernet src/dst */
-			memcpy(buf, buf+6, 6);
-			memcpy(buf+6, routerhw, 6);
-
-			/* Add packet content length */
-			buf[14+4] = length >> 8;
-			buf[14+5] = length;
-
-			/* Set IPv6 src/dst */
-			memcpy(buf+14+24, buf+14+8, 16);        /* Destination address (from source) */
-			memcpy(buf+14+8, buf+14+40+8, 16);	/* Source address (from ICMPv6 packet) */
-
-			/* Set ICMPv6 type and code */
-			buf[14+40] = 136;
-			buf[14+40+1] = 0;
-
-			/* Add target link-layer address option*/
-			buf[14+40+8+16] = 2;
-			buf[14+40+8+16+1] = 1;
-			memcpy(buf+14+40+8+16+2, routerhw, 6);
-
-			/* Zero checksum */
-			checksum = 0;
-			buf[14+40+2] = 0;
-			buf[14+40+3] = 0;
-
-			/* Add pseudo-header into the checksum */
-			checksum += buf[14+4] << 8 | buf[14+5];
-			checksum += buf[14+6];
-			for (i=0; i<32; i++)
-				checksum += buf[14+8+i] << ((i%2 == 0)?8:0);
-
-			/* Checksum the actual data */
-			for (i=0; i<length; i++)
-				checksum += buf[14+40+i] << ((i%2 == 0)?8:0);
-
-			/* Store the final checksum into ICMPv6 packet */
-			if (checksum > 0xffff)
-				checksum = (checksum & 0xffff) + (checksum >> 16);
-			checksum = ~checksum;
-			buf[14+40+2] = checksum >> 8;
-			buf[14+40+3] = checksum;
-
 			logger_log(tunnel->logger, LOG_DEBUG,
 			           "Writing reply to ND request\n");
-			ret = tapcfg_write(data->tapcfg, buf, 14+40+length);
+			NABLA_PROBE(nd_reply, tunnel, length, PROBE_REASON_NONE);
+			capture_write(tunnel->capture, CAPTURE_DIR_OUT, buf, length);
+			ret = tapcfg_write(data->tapcfg, buf, length);
 			if (ret == -1) {
 				logger_log(tunnel->logger, LOG_ERR, "Error writing packet\n");
 				break;
@@ -394,8 +466,19 @@ writer_thread(void *arg)
 		/* Our IPv6 side of this tunnel */
 		memcpy(&s.identity, &tunnel->endpoint.local_ipv6, sizeof(s.identity));
 
-		/* The payload (XXX: should we check the size) */
-		memcpy(s.payload, buf+14, len-14);
+		/* The payload, compressed if enabled and it saves space */
+		len -= 14;
+		paylen = 0;
+		if (tunnel->endpoint.compress) {
+			paylen = compress_payload(data, &s, buf+14, len);
+		}
+		if (paylen > 0) {
+			s.ayh.ayh_nextheader = AYIYA_NEXTHDR_LZ4;
+		} else {
+			/* XXX: should we check the size */
+			memcpy(s.payload, buf+14, len);
+			paylen = len;
+		}
 
 		/* Fill in the current time */
 		s.ayh.ayh_epochtime = htonl((unsigned long) time(NULL));
@@ -407,7 +490,8 @@ writer_thread(void *arg)
 		memcpy(s.hash, data->ayiya_hash, sizeof(s.hash));
 
 		/* Update the length to include AYIYA header */
-		len = sizeof(s) - sizeof(s.payload) + (len-14);
+		tunnel_count_tx_payload(tunnel, len, paylen);
+		len = sizeof(s) - sizeof(s.payload) + paylen;
 
 		/* Generate a SHA1 of the complete AYIYA packet*/
 		SHA1_Init(&sha1);
@@ -427,21 +511,29 @@ writer_thread(void *arg)
 		FD_SET(data->fd, &wfds);
 		ret = select(data->fd+1, NULL, &wfds, NULL, NULL);
 		if (ret == -1) {
+			NABLA_PROBE(socket_error, tunnel, len, GetLastError());
 			logger_log(tunnel->logger, LOG_INFO,
 			           "Error when selecting for fd: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
 			break;
 		}
 
-		ret = sendto(data->fd, (const char *) &s, len, 0,
-		             (struct sockaddr *) &saddr,
-		             sizeof(saddr));
-		if (ret <= 0) {
+		ret = transport_sendto(&data->transport, &s, len,
+		                       (struct sockaddr *) &saddr, sizeof(saddr));
+		if (ret == 0) {
+			logger_log(tunnel->logger, LOG_DEBUG,
+			           "Send buffer full, dropped packet\n");
+			tunnel_count_tx(tunnel, 0, 1);
+			goto write_loop;
+		} else if (ret < 0) {
+			NABLA_PROBE(socket_error, tunnel, len, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error writing to socket: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
 			break;
 		}
+		NABLA_PROBE(ayiya_encap, tunnel, len, ayiya_op_forward);
+		tunnel_count_tx(tunnel, len, 0);
 		logger_log(tunnel->logger, LOG_DEBUG,
 		           "Wrote %d bytes to the server\n", len);
 
@@ -490,7 +582,11 @@ init(tunnel_t *tunnel)
 		return -1;
 	}
 
-	ret = tapcfg_start(tapcfg, "ipv6tun", 1);
+	if (endpoint->tap_fd > 0) {
+		ret = tapcfg_start_fd(tapcfg, endpoint->tap_fd);
+	} else {
+		ret = tapcfg_start(tapcfg, "ipv6tun", 1);
+	}
 	if (ret < 0) {
 		return -1;
 	}
@@ -514,6 +610,8 @@ init(tunnel_t *tunnel)
 	}
 	data->fd = sock;
 	data->tapcfg = tapcfg;
+	transport_init(&data->transport, sock, endpoint->sockbuf_min,
+	               endpoint->sockbuf_max, tunnel->logger);
 
 	/* Calculate shared secret from the password */
 	SHA1_Init(&sha1);
@@ -548,9 +646,12 @@ start(tunnel_t *tunnel)
 	tapcfg = tunnel->privdata->tapcfg;
 	tapcfg_iface_set_status(tapcfg, TAPCFG_STATUS_IPV6_UP);
 
-	ifname = tapcfg_get_ifname(tapcfg);
-	assert(command_add_ipv6(ifname, &tunnel->endpoint.local_ipv6, tunnel->endpoint.local_prefix) >= 0);
-	free(ifname);
+	/* No system interface to configure when using a frame socket */
+	if (tunnel->endpoint.tap_fd <= 0) {
+		ifname = tapcfg_get_ifname(tapcfg);
+		assert(command_add_ipv6(ifname, &tunnel->endpoint.local_ipv6, tunnel->endpoint.local_prefix) >= 0);
+		free(ifname);
+	}
 	
 	THREAD_CREATE(tunnel->reader, reader_thread, tunnel);
 	THREAD_CREATE(tunnel->writer, writer_thread, tunnel);
@@ -573,7 +674,7 @@ stop(tunnel_t *tunnel)
 }
 
 static int
-beat(tunnel_t *tunnel)
+send_signal(tunnel_t *tunnel, int opcode)
 {
 	tunnel_data_t *data;
 	fd_set wfds;
@@ -602,7 +703,7 @@ beat(tunnel_t *tunnel)
 	s.ayh.ayh_siglen        = 5;                    /* 5*4 = 20 bytes = 160 bits (SHA1) */
 	s.ayh.ayh_hshmeth       = ayiya_hash_sha1;
 	s.ayh.ayh_autmeth       = ayiya_auth_sharedsecret;
-	s.ayh.ayh_opcode        = ayiya_op_noop;
+	s.ayh.ayh_opcode        = opcode;
 	s.ayh.ayh_nextheader    = IPPROTO_NONE;
 
 	/* Our IPv6 side of this tunnel */
@@ -634,6 +735,7 @@ beat(tunnel_t *tunnel)
 	FD_SET(data->fd, &wfds);
 	ret = select(data->fd+1, NULL, &wfds, NULL, NULL);
 	if (ret == -1) {
+		NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 		logger_log(tunnel->logger, LOG_ERR,
 		           "Error when selecting for fd: %s (%d)\n",
 		           strerror(GetLastError()), GetLastError());
@@ -647,6 +749,7 @@ beat(tunnel_t *tunnel)
 	                (struct sockaddr *) &target, sizeof(target));
 
 	if (lenout < 0) {
+		NABLA_PROBE(socket_error, tunnel, n, GetLastError());
 		logger_log(tunnel->logger, LOG_ERR,
 		           "Error (%d) while sending %u bytes sent to network: %s (%d)\n",
 		           lenout, n, strerror(GetLastError()), GetLastError());
@@ -657,6 +760,40 @@ beat(tunnel_t *tunnel)
 		           lenout, n, strerror(errno), errno);
 		return -1;
 	}
+	NABLA_PROBE(ayiya_encap, tunnel, n, opcode);
+
+	return 0;
+}
+
+static int
+beat(tunnel_t *tunnel)
+{
+	return send_signal(tunnel, ayiya_op_noop);
+}
+
+static int
+echo(tunnel_t *tunnel)
+{
+	return send_signal(tunnel, ayiya_op_echo_request);
+}
+
+static int
+rebind(tunnel_t *tunnel)
+{
+	int sock;
+
+	assert(tunnel);
+	assert(tunnel->privdata);
+
+	/* A new socket gets a new source port and a fresh NAT mapping */
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0) {
+		return -1;
+	}
+	if (transport_rebind(&tunnel->privdata->transport, sock) < 0) {
+		closesocket(sock);
+		return -1;
+	}
 
 	return 0;
 }
@@ -667,6 +804,8 @@ static tunnel_mod_t module =
 	start,
 	stop,
 	beat,
+	echo,
+	rebind,
 	destroy
 };
 
@@ -22,6 +22,9 @@
  *   remote_ipv4  - Remote IPv4 address of the server (if type v4v4)
  *   remote_ipv6  - Remote IPv6 address of the server (if type v4v6)
  *   local_mtu    - (optional) maximum transfer unit
+ *   tap_fd       - (optional) Frame socket to use instead of a TAP device
+ *   sockbuf_min  - (optional) Initial size of the socket buffers
+ *   sockbuf_max  - (optional) Maximum size of the socket buffers
  */
 
 #include <stdlib.h>
@@ -31,10 +34,13 @@
 #include "compat.h"
 #include "tapcfg.h"
 #include "tunnel.h"
+#include "probes.h"
+#include "transport.h"
 
 
 struct tunnel_data_s {
 	int fd;
+	transport_t transport;
 	tapcfg_t *tapcfg;
 	unsigned int netmask;
 	int family;
@@ -68,6 +74,7 @@ reader_thread(void *arg)
 
 		struct sockaddr_storage saddr;
 		socklen_t socklen;
+		unsigned int dropped;
 		int srcmatch;
 
 		FD_ZERO(&rfds);
@@ -77,6 +84,7 @@ reader_thread(void *arg)
 		tv.tv_usec = (tunnel->waitms % 1000) * 1000;
 		ret = select(data->fd+1, &rfds, NULL, NULL, &tv);
 		if (ret == -1) {
+			NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error when selecting for fd: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
@@ -97,9 +105,11 @@ reader_thread(void *arg)
 		}
 
 		socklen = sizeof(saddr);
-		ret = recvfrom(data->fd, (char *) (buf+14), sizeof(buf)-14, 0,
-			       (struct sockaddr *) &saddr, &socklen);
+		ret = transport_recvfrom(&data->transport, buf+14, sizeof(buf)-14,
+		                         (struct sockaddr *) &saddr, &socklen,
+		                         &dropped);
 		if (ret == -1) {
+			NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error reading packet: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
@@ -109,6 +119,7 @@ reader_thread(void *arg)
 			           "Disconnected from the server\n");
 			break;
 		}
+		tunnel_count_rx(tunnel, ret, dropped);
 
 		logger_log(tunnel->logger, LOG_DEBUG,
 			   "Read packet of size %d from %d.%d.%d.%d\n",
@@ -136,6 +147,7 @@ reader_thread(void *arg)
 			goto read_loop;
 		}
 
+		capture_write(tunnel->capture, CAPTURE_DIR_OUT, buf, ret+14);
 		ret = tapcfg_write(data->tapcfg, buf, ret+14);
 		if (ret == -1) {
 			logger_log(tunnel->logger, LOG_ERR,
@@ -184,6 +196,7 @@ writer_thread(void *arg)
 			goto write_loop;
 
 		buflen = tapcfg_read(data->tapcfg, buf, sizeof(buf));
+		capture_write(tunnel->capture, CAPTURE_DIR_IN, buf, buflen);
 		type = buf[12] << 8 | buf[13];
 
 		if (type == 0x0806) {
@@ -230,6 +243,8 @@ writer_thread(void *arg)
 
 			logger_log(tunnel->logger, LOG_INFO,
 			           "Replied to an ARP request\n");
+			NABLA_PROBE(arp_reply, tunnel, buflen, PROBE_REASON_NONE);
+			capture_write(tunnel->capture, CAPTURE_DIR_OUT, buf, buflen);
 			tapcfg_write(data->tapcfg, buf, buflen);
 		} else if (type == 0x800) {
 			const char broadcasthw[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
@@ -259,27 +274,39 @@ writer_thread(void *arg)
 				struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &saddr;
 				sin6->sin6_addr = tunnel->endpoint.remote_ipv6;
 				saddrlen = sizeof(struct sockaddr_in6);
+			} else {
+				logger_log(tunnel->logger, LOG_ERR,
+				           "Unsupported address family %d\n", data->family);
+				break;
 			}
 
 			FD_ZERO(&wfds);
 			FD_SET(data->fd, &wfds);
 			ret = select(data->fd+1, NULL, &wfds, NULL, NULL);
 			if (ret == -1) {
+				NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 				logger_log(tunnel->logger, LOG_ERR,
 					   "Error when selecting for fd: %s (%d)\n",
 					   strerror(GetLastError()), GetLastError());
 				break;
 			}
 
-			ret = sendto(data->fd, (char *) (buf+14), buflen-14, 0,
-				     (struct sockaddr *) &saddr, saddrlen);
-			if (ret <= 0) {
+			ret = transport_sendto(&data->transport, buf+14, buflen-14,
+			                       (struct sockaddr *) &saddr, saddrlen);
+			if (ret == 0) {
+				logger_log(tunnel->logger, LOG_DEBUG,
+				           "Send buffer full, dropped packet\n");
+				tunnel_count_tx(tunnel, 0, 1);
+				goto write_loop;
+			} else if (ret < 0) {
+				NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 				logger_log(tunnel->logger, LOG_ERR,
 					   "Error writing to socket: %s (%d)\n",
 					   strerror(GetLastError()), GetLastError());
 				break;
 			}
 
+			tunnel_count_tx(tunnel, ret, 0);
 			logger_log(tunnel->logger, LOG_DEBUG,
 				   "Wrote %d bytes to the server\n", ret);
 		} else {
@@ -342,7 +369,11 @@ init(tunnel_t *tunnel)
 		return -1;
 	}
 
-	ret = tapcfg_start(tapcfg, "ipv4tun", 1);
+	if (endpoint->tap_fd > 0) {
+		ret = tapcfg_start_fd(tapcfg, endpoint->tap_fd);
+	} else {
+		ret = tapcfg_start(tapcfg, "ipv4tun", 1);
+	}
 	if (ret < 0) {
 		return -1;
 	}
@@ -383,6 +414,8 @@ init(tunnel_t *tunnel)
 	}
 	data->fd = sock;
 	data->tapcfg = tapcfg;
+	transport_init(&data->transport, sock, endpoint->sockbuf_min,
+	               endpoint->sockbuf_max, tunnel->logger);
 	data->netmask = htonl(netmask);
 	data->family = family;
 	tunnel->privdata = data;
@@ -437,6 +470,8 @@ static tunnel_mod_t module =
 	start,
 	stop,
 	NULL,
+	NULL,
+	NULL,
 	destroy
 };
 
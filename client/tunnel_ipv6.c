@@ -23,6 +23,9 @@
  *   remote_ipv6   - Remote IPv6 address of the server (if type v6v6)
  *   password      - (optional) Shared password from the server (for beats)
  *   beat_interval - (optional) Interval of beat (in seconds)
+ *   tap_fd        - (optional) Frame socket to use instead of a TAP device
+ *   sockbuf_min   - (optional) Initial size of the socket buffers
+ *   sockbuf_max   - (optional) Maximum size of the socket buffers
  */
 
 #include <stdlib.h>
@@ -35,7 +38,10 @@
 #include "compat.h"
 #include "tapcfg.h"
 #include "tunnel.h"
+#include "probes.h"
+#include "transport.h"
 #include "command.h"
+#include "ndisc.h"
 
 #include "hash_md5.h"
 
@@ -43,6 +49,7 @@
 
 struct tunnel_data_s {
 	int fd;
+	transport_t transport;
 	tapcfg_t *tapcfg;
 	int family;
 };
@@ -76,6 +83,7 @@ reader_thread(void *arg)
 
 		struct sockaddr_storage saddr;
 		socklen_t socklen;
+		unsigned int dropped;
 		int srcmatch;
 
 		FD_ZERO(&rfds);
@@ -85,6 +93,7 @@ reader_thread(void *arg)
 		tv.tv_usec = (tunnel->waitms % 1000) * 1000;
 		ret = select(data->fd+1, &rfds, NULL, NULL, &tv);
 		if (ret == -1) {
+			NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error when selecting for fd: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
@@ -108,9 +117,11 @@ reader_thread(void *arg)
 		           "Trying to read data from server\n");
 
 		socklen = sizeof(saddr);
-		ret = recvfrom(data->fd, (char *) (buf+14), sizeof(buf)-14, 0,
-			       (struct sockaddr *) &saddr, &socklen);
+		ret = transport_recvfrom(&data->transport, buf+14, sizeof(buf)-14,
+		                         (struct sockaddr *) &saddr, &socklen,
+		                         &dropped);
 		if (ret == -1) {
+			NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error in receiving data: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
@@ -120,6 +131,7 @@ reader_thread(void *arg)
 			           "Disconnected from the server\n");
 			break;
 		}
+		tunnel_count_rx(tunnel, ret, dropped);
 
 		if (data->family != saddr.ss_family) {
 			logger_log(tunnel->logger, LOG_NOTICE,
@@ -146,6 +158,7 @@ reader_thread(void *arg)
 		logger_log(tunnel->logger, LOG_DEBUG,
 		           "Read %d bytes from the server\n", ret);
 
+		capture_write(tunnel->capture, CAPTURE_DIR_OUT, buf, ret+14);
 		ret = tapcfg_write(data->tapcfg, buf, ret+14);
 		if (ret == -1) {
 			logger_log(tunnel->logger, LOG_ERR,
@@ -190,6 +203,7 @@ writer_thread(void *arg)
 			goto write_loop;
 
 		len = tapcfg_read(data->tapcfg, buf, sizeof(buf));
+		capture_write(tunnel->capture, CAPTURE_DIR_IN, buf, len);
 		if (len <= 0) {
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error in tapcfg reading\n");
@@ -224,69 +238,21 @@ writer_thread(void *arg)
 		 * (XXX: doesn't check for a chain, but ND is usually without)
 		 */
 		if (buf[14+6] == 58 && buf[14+7] == 255 && buf[14+40] == 135) {
-			unsigned char ipbuf[16];
-			int length, checksum;
-			int i;
+			int length;
 
-			/* Ignore unspecified ND's as they are used for DAD */
-			memset(&ipbuf, 0, sizeof(ipbuf));
-			if (!memcmp(buf+14+8, ipbuf, sizeof(ipbuf))) {
+			length = ndisc_solicit_to_advert(buf, routerhw);
+			if (!length) {
 				logger_log(tunnel->logger, LOG_DEBUG,
 				           "Found ND DAD request that is ignored\n");
 				goto write_loop;
 			}
 
-			/* Neighbor advert is ICMPv6 header, IPv6 address and
-			 * 8 bytes of target link-layer address option */
-			length = 8+16+8;
-
-			/* Set Ethernet src/dst */
-			memcpy(buf, buf+6, 6);
-			memcpy(buf+6, routerhw, 6);
-
-			/* Add packet content length */
-			buf[14+4] = length >> 8;
-			buf[14+5] = length;
-
-			/* Set IPv6 src/dst */
-			memcpy(buf+14+24, buf+14+8, 16);        /* Destination address (from source) */
-			memcpy(buf+14+8, buf+14+40+8, 16);	/* Source address (from ICMPv6 packet) */
-
-			/* Set ICMPv6 type and code */
-			buf[14+40] = 136;
-			buf[14+40+1] = 0;
-
-			/* Add target link-layer address option */
-			buf[14+40+8+16] = 2;
-			buf[14+40+8+16+1] = 1;
-			memcpy(buf+14+40+8+16+2, routerhw, 6);
-
-			/* Zero checksum */
-			checksum = 0;
-			buf[14+40+2] = 0;
-			buf[14+40+3] = 0;
-
-			/* Add pseudo-header into the checksum */
-			checksum += buf[14+4] << 8 | buf[14+5];
-			checksum += buf[14+6];
-			for (i=0; i<32; i++)
-				checksum += buf[14+8+i] << ((i%2 == 0)?8:0);
-
-			/* Checksum the actual data */
-			for (i=0; i<length; i++)
-				checksum += buf[14+40+i] << ((i%2 == 0)?8:0);
-
-			/* Store the final checksum into ICMPv6 packet */
-			if (checksum > 0xffff)
-				checksum = (checksum & 0xffff) + (checksum >> 16);
-			checksum = ~checksum;
-			buf[14+40+2] = checksum >> 8;
-			buf[14+40+3] = checksum;
-
 			logger_log(tunnel->logger, LOG_INFO,
 			           "Writing reply to ND request\n");
+			NABLA_PROBE(nd_reply, tunnel, length, PROBE_REASON_NONE);
 
-			ret = tapcfg_write(data->tapcfg, buf, 14+40+length);
+			capture_write(tunnel->capture, CAPTURE_DIR_OUT, buf, length);
+			ret = tapcfg_write(data->tapcfg, buf, length);
 			if (ret == -1) {
 				logger_log(tunnel->logger, LOG_ERR,
 				           "Error writing packet\n");
@@ -318,27 +284,39 @@ writer_thread(void *arg)
 				struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &saddr;
 				sin6->sin6_addr = tunnel->endpoint.remote_ipv6;
 				saddrlen = sizeof(struct sockaddr_in6);
+			} else {
+				logger_log(tunnel->logger, LOG_ERR,
+				           "Unsupported address family %d\n", data->family);
+				break;
 			}
 
 			FD_ZERO(&wfds);
 			FD_SET(data->fd, &wfds);
 			ret = select(data->fd+1, NULL, &wfds, NULL, NULL);
 			if (ret == -1) {
+				NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 				logger_log(tunnel->logger, LOG_ERR,
 					   "Error when selecting for fd: %s (%d)\n",
 					   strerror(GetLastError()), GetLastError());
 				break;
 			}
 
-			ret = sendto(data->fd, (char *) (buf+14), len-14, 0,
-				     (struct sockaddr *) &saddr, saddrlen);
-			if (ret <= 0) {
+			ret = transport_sendto(&data->transport, buf+14, len-14,
+			                       (struct sockaddr *) &saddr, saddrlen);
+			if (ret == 0) {
+				logger_log(tunnel->logger, LOG_DEBUG,
+				           "Send buffer full, dropped packet\n");
+				tunnel_count_tx(tunnel, 0, 1);
+				goto write_loop;
+			} else if (ret < 0) {
+				NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 				logger_log(tunnel->logger, LOG_ERR,
 					   "Error in writing to socket: %s (%d)\n",
 					   strerror(GetLastError()), GetLastError());
 				break;
 			}
 
+			tunnel_count_tx(tunnel, ret, 0);
 			logger_log(tunnel->logger, LOG_DEBUG,
 				   "Wrote %d bytes to the server\n", len);
 		}
@@ -394,7 +372,11 @@ init(tunnel_t *tunnel)
 		return -1;
 	}
 
-	ret = tapcfg_start(tapcfg, "ipv6tun", 1);
+	if (endpoint->tap_fd > 0) {
+		ret = tapcfg_start_fd(tapcfg, endpoint->tap_fd);
+	} else {
+		ret = tapcfg_start(tapcfg, "ipv6tun", 1);
+	}
 	if (ret < 0) {
 		return -1;
 	}
@@ -417,6 +399,8 @@ init(tunnel_t *tunnel)
 	}
 	data->fd = sock;
 	data->tapcfg = tapcfg;
+	transport_init(&data->transport, sock, endpoint->sockbuf_min,
+	               endpoint->sockbuf_max, tunnel->logger);
 	data->family = family;
 	tunnel->privdata = data;
 
@@ -445,9 +429,12 @@ start(tunnel_t *tunnel)
 	tapcfg = tunnel->privdata->tapcfg;
 	tapcfg_iface_set_status(tapcfg, TAPCFG_STATUS_IPV6_UP);
 
-	ifname = tapcfg_get_ifname(tapcfg);
-	assert(command_add_ipv6(ifname, &tunnel->endpoint.local_ipv6, tunnel->endpoint.local_prefix) >= -1);
-	free(ifname);
+	/* No system interface to configure when using a frame socket */
+	if (tunnel->endpoint.tap_fd <= 0) {
+		ifname = tapcfg_get_ifname(tapcfg);
+		assert(command_add_ipv6(ifname, &tunnel->endpoint.local_ipv6, tunnel->endpoint.local_prefix) >= -1);
+		free(ifname);
+	}
 	
 	THREAD_CREATE(tunnel->reader, reader_thread, tunnel);
 	THREAD_CREATE(tunnel->writer, writer_thread, tunnel);
@@ -522,6 +509,7 @@ beat(tunnel_t *tunnel)
 		FD_SET(sock, &wfds);
 		ret = select(sock+1, NULL, &wfds, NULL, NULL);
 		if (ret == -1) {
+			NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error when selecting for fd: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
@@ -531,6 +519,7 @@ beat(tunnel_t *tunnel)
 		ret = sendto(sock, buf, strlen(buf), 0,
 			     (struct sockaddr *) &saddr, sizeof(saddr));
 		if (ret < -1) {
+			NABLA_PROBE(socket_error, tunnel, 0, GetLastError());
 			logger_log(tunnel->logger, LOG_ERR,
 			           "Error sending heartbeat: %s (%d)\n",
 			           strerror(GetLastError()), GetLastError());
@@ -549,6 +538,8 @@ static tunnel_mod_t module =
 	start,
 	stop,
 	beat,
+	NULL,
+	NULL,
 	destroy
 };
 
@@ -81,6 +81,21 @@ void tapcfg_destroy(tapcfg_t *tapcfg);
  */
 int tapcfg_start(tapcfg_t *tapcfg, const char *ifname, int fallback);
 
+/**
+ * Starts the structure on an already open file descriptor instead
+ * of a system TAP device. Every read and write on the descriptor
+ * must transfer exactly one Ethernet frame, which is the case for
+ * example with an AF_UNIX SOCK_DGRAM or SOCK_SEQPACKET socketpair.
+ * No system interface is created, so hardware address, status and
+ * MTU are only stored and IPv4 address configuration is ignored.
+ * This can be used for testing without any special privileges. Not
+ * supported on Windows.
+ * @param tapcfg is a pointer to an inited structure
+ * @param fd is the file descriptor, it will be closed on stop
+ * @return Negative value on error, non-negative on success.
+ */
+int tapcfg_start_fd(tapcfg_t *tapcfg, int fd);
+
 /**
  * Stops the network interface and frees all resources
  * related to it. After this a new interface using the
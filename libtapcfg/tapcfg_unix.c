@@ -36,6 +36,7 @@
 
 #include "tapcfg.h"
 #include "taplog.h"
+#include "tapprobes.h"
 
 #define MAX_IFNAME (IFNAMSIZ-1)
 #define HWADDRLEN 6
@@ -51,6 +52,11 @@ struct tapcfg_s {
 	char buffer[TAPCFG_BUFSIZE];
 	int buflen;
 
+	/* Set if tap_fd was given by tapcfg_start_fd, in that case there
+	 * is no system interface and its properties are only emulated */
+	int fd_backed;
+	int fd_mtu;
+
 	/* These are required for Solaris implementation */
 	int ip_fd, ip6_fd;
 };
@@ -140,13 +146,45 @@ err:
 	return -1;
 }
 
+int
+tapcfg_start_fd(tapcfg_t *tapcfg, int fd)
+{
+	int i;
+
+	assert(tapcfg);
+
+	if (tapcfg->started) {
+		return 0;
+	}
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* Generate a random locally administered unicast address */
+	tapcfg->hwaddr[0] = 0x02;
+	for (i=1; i<HWADDRLEN; i++)
+		tapcfg->hwaddr[i] = rand();
+
+	snprintf(tapcfg->ifname, sizeof(tapcfg->ifname), "fd%d", fd);
+	tapcfg->tap_fd = fd;
+	tapcfg->ctrl_fd = -1;
+	tapcfg->fd_backed = 1;
+	tapcfg->fd_mtu = 1500;
+	tapcfg->started = 1;
+	tapcfg->status = TAPCFG_STATUS_ALL_DOWN;
+
+	return 0;
+}
+
 void
 tapcfg_stop(tapcfg_t *tapcfg)
 {
 	assert(tapcfg);
 
 	if (tapcfg->started) {
-		tapcfg_stop_dev(tapcfg);
+		if (!tapcfg->fd_backed)
+			tapcfg_stop_dev(tapcfg);
 		if (tapcfg->tap_fd != -1) {
 			close(tapcfg->tap_fd);
 			tapcfg->tap_fd = -1;
@@ -155,6 +193,7 @@ tapcfg_stop(tapcfg_t *tapcfg)
 			close(tapcfg->ctrl_fd);
 			tapcfg->ctrl_fd = -1;
 		}
+		tapcfg->fd_backed = 0;
 		tapcfg->started = 0;
 		tapcfg->status = TAPCFG_STATUS_ALL_DOWN;
 	}
@@ -203,6 +242,7 @@ tapcfg_read(tapcfg_t *tapcfg, void *buf, int count)
 		ret = read(tapcfg->tap_fd, tapcfg->buffer,
 			   sizeof(tapcfg->buffer));
 		if (ret <= 0) {
+			TAPCFG_PROBE(read_error, tapcfg, ret, errno);
 			return ret;
 		}
 		tapcfg->buflen = ret;
@@ -219,6 +259,7 @@ tapcfg_read(tapcfg_t *tapcfg, void *buf, int count)
 	ret = tapcfg->buflen;
 	memcpy(buf, tapcfg->buffer, tapcfg->buflen);
 	tapcfg->buflen = 0;
+	TAPCFG_PROBE(read, tapcfg, ret, 0);
 
 	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Read ethernet frame:");
 	taplog_log_ethernet_info(&tapcfg->taplog, buf, ret);
@@ -267,10 +308,12 @@ tapcfg_write(tapcfg_t *tapcfg, void *buf, int count)
 
 	ret = write(tapcfg->tap_fd, buf, count);
 	if (ret != count) {
+		TAPCFG_PROBE(write_error, tapcfg, count, errno);
 		taplog_log(&tapcfg->taplog, TAPLOG_ERR,
 		           "Error trying to write data to TAP device");
 		return -1;
 	}
+	TAPCFG_PROBE(write, tapcfg, ret, 0);
 
 	taplog_log(&tapcfg->taplog, TAPLOG_DEBUG, "Wrote ethernet frame:");
 	taplog_log_ethernet_info(&tapcfg->taplog, buf, ret);
@@ -319,9 +362,11 @@ tapcfg_iface_set_hwaddr(tapcfg_t *tapcfg, const char *hwaddr, int length)
 		return -1;
 	}
 
-	ret = tapcfg_hwaddr_ioctl(tapcfg, hwaddr);
-	if (ret == -1)
-		return -1;
+	if (!tapcfg->fd_backed) {
+		ret = tapcfg_hwaddr_ioctl(tapcfg, hwaddr);
+		if (ret == -1)
+			return -1;
+	}
 
 	memcpy(tapcfg->hwaddr, hwaddr, HWADDRLEN);
 
@@ -349,6 +394,11 @@ tapcfg_iface_set_status(tapcfg_t *tapcfg, int flags)
 		return 0;
 	}
 
+	if (tapcfg->fd_backed) {
+		tapcfg->status = flags;
+		return 0;
+	}
+
 	if ((flags ^ tapcfg->status) & TAPCFG_STATUS_IPV6_ALL) {
 		tapcfg_iface_prepare_ipv6(tapcfg, flags);
 	}
@@ -403,6 +453,10 @@ tapcfg_iface_get_mtu(tapcfg_t *tapcfg)
 		return 0;
 	}
 
+	if (tapcfg->fd_backed) {
+		return tapcfg->fd_mtu;
+	}
+
 	memset(&ifr, 0, sizeof(ifr));
 	strcpy(ifr.ifr_name, tapcfg->ifname);
 
@@ -439,6 +493,11 @@ tapcfg_iface_set_mtu(tapcfg_t *tapcfg, int mtu)
 		return -1;
 	}
 
+	if (tapcfg->fd_backed) {
+		tapcfg->fd_mtu = mtu;
+		return mtu;
+	}
+
 	memset(&ifr, 0, sizeof(ifr));
 	strcpy(ifr.ifr_name, tapcfg->ifname);
 #ifdef __sun__
@@ -494,6 +553,10 @@ tapcfg_iface_set_ipv4(tapcfg_t *tapcfg, const char *addrstr, unsigned char netbi
 	for (i=netbits,mask=0; i; i--)
 		mask = (mask >> 1)|(1 << 31);
 
+	if (tapcfg->fd_backed) {
+		return 0;
+	}
+
 	tapcfg_ifaddr_ioctl(tapcfg,
 	                    addr,
 	                    ntohl(mask));
@@ -209,6 +209,16 @@ tapcfg_start(tapcfg_t *tapcfg, const char *ifname, int fallback)
 	return 0;
 }
 
+int
+tapcfg_start_fd(tapcfg_t *tapcfg, int fd)
+{
+	assert(tapcfg);
+
+	taplog_log(&tapcfg->taplog, TAPLOG_ERR,
+	           "Starting from a file descriptor is not supported on Windows");
+	return -1;
+}
+
 void
 tapcfg_stop(tapcfg_t *tapcfg)
 {
@@ -0,0 +1,32 @@
+/**
+ *  tapcfg - A cross-platform configuration utility for TAP driver
+ *  Copyright (C) 2008-2010  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef TAPPROBES_H
+#define TAPPROBES_H
+
+/* Static tracepoints of the "tapcfg" provider, no-ops unless compiled
+ * with HAVE_SYS_SDT_H. Arguments are the tapcfg_t pointer, the frame
+ * length and the errno value on errors (0 otherwise). Probes are read,
+ * write, read_error and write_error. */
+
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+#  define TAPCFG_PROBE(name, tapcfg, len, error) \
+	DTRACE_PROBE3(tapcfg, name, tapcfg, len, error)
+#else
+#  define TAPCFG_PROBE(name, tapcfg, len, error) do {} while (0)
+#endif
+
+#endif /* TAPPROBES_H */
@@ -0,0 +1,64 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+using System.Collections.Generic;
+
+namespace Nabla {
+	/* Pool of equally sized buffers for the packet path. Taking and
+	 * returning buffers doesn't allocate once the pool has warmed up,
+	 * a buffer that is never returned is simply collected by the GC. */
+	public class BufferPool {
+		private Object _lock = new Object();
+		private Stack<byte[]> _buffers;
+		private int _bufferSize;
+		private int _maxBuffers;
+
+		public BufferPool(int bufferSize, int maxBuffers) {
+			_bufferSize = bufferSize;
+			_maxBuffers = maxBuffers;
+			_buffers = new Stack<byte[]>(maxBuffers);
+		}
+
+		public int BufferSize {
+			get { return _bufferSize; }
+		}
+
+		public byte[] Take() {
+			lock (_lock) {
+				if (_buffers.Count > 0) {
+					return _buffers.Pop();
+				}
+			}
+
+			return new byte[_bufferSize];
+		}
+
+		public void Return(byte[] buffer) {
+			if (buffer == null || buffer.Length != _bufferSize) {
+				return;
+			}
+
+			lock (_lock) {
+				if (_buffers.Count < _maxBuffers) {
+					_buffers.Push(buffer);
+				}
+			}
+		}
+	}
+}
@@ -43,6 +43,8 @@ namespace Nabla {
 	}
 
 	public class DHCPPacket {
+		private static Logger _log = Logger.GetLogger("DHCPPacket");
+
 		private byte _op;
 		public byte OP { get { return _op; } private set { _op = value; } }
 		private byte _htype;
@@ -288,7 +290,7 @@ namespace Nabla {
 						/* End of option list */
 						break;
 					} else if (index == value.Length-1) {
-						Console.WriteLine("Invalid last DHCP option byte: " + value[index]);
+						_log.Debug("Invalid last DHCP option byte: {0}", value[index]);
 						break;
 					}
 					int len = value[index+1];
@@ -298,7 +300,7 @@ namespace Nabla {
 						DHCPOption option = new DHCPOption(value[index], data);
 						this.AddOption(option);
 					} else {
-						Console.WriteLine("Invalid DHCP option: Code " + value[index] + " Length " + len);
+						_log.Debug("Invalid DHCP option: Code {0} Length {1}", value[index], len);
 					}
 					index += 2 + len;
 				}
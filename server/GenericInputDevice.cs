@@ -27,19 +27,56 @@ using Nabla.Sockets;
 
 namespace Nabla {
 	public class GenericInputDevice : InputDevice {
+		private static Logger _log = Logger.GetLogger("GenericInputDevice");
+
 		private const int CLOCK_MAX_OFFSET = 120;
 		private const int waitms = 100;
 
-		private TunnelType _type;
+		/* Packets read from the raw socket with one call, each in a 2048 byte slot */
+		private const int MAX_BATCH_PACKETS = 32;
+
+		/* Next header of compressed AYIYA packets, see client/ayiya.h */
+		private const int AYIYA_NEXTHDR_LZ4 = 253;
+
+		/* Packets shorter than this are not worth compressing and after
+		 * a packet that didn't compress the following ones are sent as
+		 * they are, doubling their number each time up to the maximum */
+		private const int COMPRESS_MIN_PAYLOAD = 64;
+		private const int COMPRESS_MAX_BACKOFF = 64;
 
-		private Thread _thread;
-		private volatile bool _running;
+		/* Longest AYIYA header, with an IPv6 identity and a SHA1 signature */
+		private const int AYIYA_MAX_HEADER = 8 + 16 + SHA1Digest.Length;
+
+		private TunnelType _type;
 
 		private SessionManager _sessionManager;
+		private Reactor _reactor = null;
 
 		private Socket _udpSocket = null;
 		private RawSocket _rawSocket = null;
 
+		/* Buffers of the sending threads with room for the AYIYA header in
+		 * front of the payload, and the buffers used only by the receive
+		 * callback, which the reactor never runs in two threads at once */
+		private BufferPool _sendBuffers = new BufferPool(AYIYA_MAX_HEADER + 2048, 16);
+		private byte[] _decompressBuffer = new byte[2048];
+		private byte[] _signature = new byte[SHA1Digest.Length];
+		private byte[] _receiveBuffer = new byte[2048];
+		private byte[] _batchBuffer = new byte[MAX_BATCH_PACKETS*2048];
+		private int[] _batchOffsets = new int[MAX_BATCH_PACKETS];
+		private int[] _batchLengths = new int[MAX_BATCH_PACKETS];
+
+		/* Hasher of the current thread, the instances can't be shared */
+		[ThreadStatic]
+		private static SHA1Digest _digest;
+
+		private static SHA1Digest getDigest() {
+			if (_digest == null) {
+				_digest = new SHA1Digest();
+			}
+			return _digest;
+		}
+
 		public GenericInputDevice(string deviceName, TunnelType type) {
 			_type = type;
 
@@ -89,8 +126,6 @@ namespace Nabla {
 			if (rawFamily != AddressFamily.Unknown) {
 				_rawSocket = RawSocket.GetRawSocket(deviceName, rawFamily, rawProtocol, waitms);
 			}
-
-			_thread = new Thread(new ThreadStart(this.threadLoop));
 		}
 
 		public override void SetSessionManager(SessionManager sessionManager) {
@@ -102,33 +137,36 @@ namespace Nabla {
 		}
 
 		public override void Start() {
-			_running = true;
-			_thread.Start();
+			_reactor = _sessionManager.Reactor;
+			if (_udpSocket != null) {
+				_reactor.Register(_udpSocket, new ReadyCallback(udpReady), null);
+			} else {
+				_reactor.Register(_rawSocket, new ReadyCallback(rawReady), null);
+			}
 		}
 
 		public override void Stop() {
-			_running = false;
-			_thread.Join();
+			if (_udpSocket != null) {
+				_reactor.Unregister(_udpSocket);
+			} else {
+				_reactor.Unregister(_rawSocket);
+			}
 		}
 
 		public override void SendPacket(Int64 tunnelId, byte[] data, int offset, int length) {
-			IPEndPoint endPoint = _sessionManager.GetSessionEndPoint(tunnelId);
-			if (endPoint == null) {
+			TunnelSession session = _sessionManager.GetSession(tunnelId);
+			if (session == null || session.EndPoint == null) {
 				return;
 			}
+			IPEndPoint endPoint = session.EndPoint;
 
 			if (_type == TunnelType.AYIYAinIPv4) {
-				byte[] identityBytes;
 				int datalen;
 
 				int version = ((data[offset]&0xf0) >> 4);
 				if (version == 4) {
-					IPAddress localAddress = _sessionManager.GetIPv4TunnelLocalAddress(tunnelId);
-					identityBytes = localAddress.GetAddressBytes();
 					datalen = data[offset+2]*256 + data[offset+3];
 				} else if (version == 6) {
-					IPAddress localAddress = _sessionManager.GetIPv6TunnelLocalAddress(tunnelId);
-					identityBytes = localAddress.GetAddressBytes();
 					datalen = 40 + data[offset+4]*256 + data[offset+5];
 				} else {
 					/* Unknown IP protocol version */
@@ -140,102 +178,244 @@ namespace Nabla {
 					return;
 				}
 
-				string password = _sessionManager.GetSessionPassword(tunnelId);
+				byte[] passwdHash = session.PasswordHash;
+				if (passwdHash == null) {
+					return;
+				}
 
-				byte[] outdata = new byte[8 + identityBytes.Length + 20 + datalen];
-				outdata[0] = (byte) ((identityBytes.Length << 2) & 0xf0);
+				/* The header is built in front of the payload, only packets
+				 * too long for the pooled buffers allocate one of their own */
+				byte[] outdata;
+				if (AYIYA_MAX_HEADER + datalen <= _sendBuffers.BufferSize) {
+					outdata = _sendBuffers.Take();
+				} else {
+					outdata = new byte[AYIYA_MAX_HEADER + datalen];
+				}
+
+				int idlen = _sessionManager.GetTunnelLocalAddressBytes(tunnelId, version == 6, outdata, 8);
+				if (idlen == 0) {
+					_sendBuffers.Return(outdata);
+					return;
+				}
+				int hashOffset = 8 + idlen;
+				int payloadOffset = hashOffset + SHA1Digest.Length;
+
+				/* Compress only for clients that have sent compressed packets */
+				int zlen = 0;
+				if (session.Compress) {
+					zlen = compressPayload(session, data, offset, datalen, outdata, payloadOffset);
+				}
+				int paylen = (zlen > 0) ? zlen : datalen;
+				if (zlen == 0) {
+					Array.Copy(data, offset, outdata, payloadOffset, datalen);
+				}
+				session.CountTxPayload(datalen, paylen);
+
+				outdata[0] = (byte) ((idlen << 2) & 0xf0);
 				outdata[0] |= 0x01;
 
 				outdata[1] = 0x52;
 				outdata[2] = 0x11;
-				outdata[3] = 41;
+				outdata[3] = (byte) ((zlen > 0) ? AYIYA_NEXTHDR_LZ4 : 41);
 
 				UInt32 epochnow = (UInt32) (DateTime.UtcNow - new DateTime(1970, 1, 1)).TotalSeconds;
 				outdata[4] = (byte) (epochnow >> 24);
 				outdata[5] = (byte) (epochnow >> 16);
 				outdata[6] = (byte) (epochnow >> 8);
 				outdata[7] = (byte) (epochnow);
-				Array.Copy(identityBytes, 0, outdata, 8, identityBytes.Length);
-
-				SHA1CryptoServiceProvider sha1 = new SHA1CryptoServiceProvider();
-				byte[] passwdHash = sha1.ComputeHash(Encoding.ASCII.GetBytes(password));
 
-				int hashOffset = 8 + identityBytes.Length;
-				Array.Copy(passwdHash, 0, outdata, hashOffset, 20);
-				Array.Copy(data, offset, outdata, hashOffset+20, datalen);
+				/* The packet is signed with the password hash in place of the signature */
+				int outlen = payloadOffset + paylen;
+				Array.Copy(passwdHash, 0, outdata, hashOffset, SHA1Digest.Length);
+				getDigest().Compute(outdata, 0, outlen, outdata, hashOffset);
 
-				byte[] ourHash = sha1.ComputeHash(outdata, 0, outdata.Length);
-				Array.Copy(ourHash, 0, outdata, hashOffset, 20);
-
-				_udpSocket.SendTo(outdata, offset, length, SocketFlags.None, endPoint);
+				_udpSocket.SendTo(outdata, 0, outlen, SocketFlags.None, endPoint);
+				_sendBuffers.Return(outdata);
 			} else {
-				Console.WriteLine("Writing " + data.Length + " bytes to raw socket");
-				_rawSocket.SendTo(data, offset, length, endPoint);
+				/* In a receive callback the packet is sent with the batch */
+				int start;
+				byte[] outdata = PacketBatch.Reserve(_rawSocket, length, endPoint, out start);
+				if (outdata != null) {
+					Array.Copy(data, offset, outdata, start, length);
+				} else {
+					_rawSocket.SendTo(data, offset, length, endPoint);
+				}
 			}
 		}
 
-		private void threadLoop() {
-			byte[] data = new byte[2048];
+		/* Reactor callback of the UDP socket, handles at most a batch of
+		 * datagrams and leaves the rest for the next callback. The packets
+		 * they carry are sent to the network together at the end. */
+		private void udpReady(Object state) {
+			PacketBatch.Begin();
+			try {
+				udpReceive();
+			} finally {
+				PacketBatch.End();
+			}
+		}
+
+		private void udpReceive() {
+			byte[] data = _receiveBuffer;
+
+			for (int i=0; i<MAX_BATCH_PACKETS; i++) {
+				if (i > 0 && !_udpSocket.Poll(0, SelectMode.SelectRead)) {
+					break;
+				}
 
-			while (_running) {
 				if (_type == TunnelType.AYIYAinIPv4) {
-					while (_udpSocket.Poll(waitms*1000, SelectMode.SelectRead)) {
-						EndPoint sender = (EndPoint) new IPEndPoint(IPAddress.IPv6Any, 0);
-						int datalen = _udpSocket.ReceiveFrom(data, 0, data.Length,
-						                                     SocketFlags.None,
-						                                     ref sender);
-						//Console.WriteLine("Received an AYIYA packet from {0}", sender);
-						IPEndPoint endPoint = (IPEndPoint) sender;
-
-						if (datalen < 8) {
-							Console.WriteLine("Packet length {0} invalid", datalen);
-							continue;
-						}
-
-						handleAyiyaPacket(endPoint, data, datalen);
-					}
-				} else if (_type == TunnelType.HeartbeatIPv4) {
-					while (_udpSocket.Poll(waitms*1000, SelectMode.SelectRead)) {
-						EndPoint sender = (EndPoint) new IPEndPoint(IPAddress.Any, 0);
-						int datalen = _udpSocket.ReceiveFrom(data, 0, data.Length,
-						                                     SocketFlags.None,
-						                                     ref sender);
-						Console.WriteLine("Received a heartbeat packet from {0}", sender);
-
-						/* Nullify the port of the end point, otherwise it won't be found */
-						IPEndPoint endPoint = new IPEndPoint(((IPEndPoint) sender).Address, 0);
-
-						handleHeartbeatPacket(endPoint, data, datalen);
+					EndPoint sender = (EndPoint) new IPEndPoint(IPAddress.IPv6Any, 0);
+					int datalen = _udpSocket.ReceiveFrom(data, 0, data.Length,
+					                                     SocketFlags.None,
+					                                     ref sender);
+					//_log.Debug("Received an AYIYA packet from {0}", sender);
+					IPEndPoint endPoint = (IPEndPoint) sender;
+
+					if (datalen < 8) {
+						_log.Debug("Packet length {0} invalid", datalen);
+						continue;
 					}
+
+					handleAyiyaPacket(endPoint, data, datalen);
 				} else {
-					if (!_rawSocket.WaitForReadable())
-						continue;
+					EndPoint sender = (EndPoint) new IPEndPoint(IPAddress.Any, 0);
+					int datalen = _udpSocket.ReceiveFrom(data, 0, data.Length,
+					                                     SocketFlags.None,
+					                                     ref sender);
+					_log.Debug("Received a heartbeat packet from {0}", sender);
 
-					IPEndPoint endPoint = new IPEndPoint(IPAddress.IPv6Any, 0);
-					int datalen = _rawSocket.ReceiveFrom(data, ref endPoint);
-					endPoint = new IPEndPoint(endPoint.Address, 0);
+					/* Nullify the port of the end point, otherwise it won't be found */
+					IPEndPoint endPoint = new IPEndPoint(((IPEndPoint) sender).Address, 0);
 
-					if (datalen < 20) {
-						/* Not enough data for IP header, skip packet */
-						continue;
-					}
+					handleHeartbeatPacket(endPoint, data, datalen);
+				}
+			}
+		}
 
-					int offset = 0;
-					int version = ((data[0]&0xf0) >> 4);
-					if (version == 4) {
-						/* IPv4 header from raw socket needs to be stripped off */
-						offset = (data[0]&0x0f)*4;
-						datalen = (data[2]*256 + data[3]) - offset;
-					} else if (version == 6) {
-						offset = 0;
-						datalen = 40 + (data[4]*246 + data[5]);
-					} else {
-						continue;
-					}
+		/* Reactor callback of the raw socket, handles all the packets that were queued at once
+		 * and sends the packets they carry to the network together at the end */
+		private void rawReady(Object state) {
+			int count = _rawSocket.ReceiveBatch(_batchBuffer, _batchOffsets, _batchLengths);
+			PacketBatch.Begin();
+			try {
+				for (int i=0; i<count; i++) {
+					handleRawPacket(_batchBuffer, _batchOffsets[i], _batchLengths[i]);
+				}
+			} finally {
+				PacketBatch.End();
+			}
+		}
 
-					_sessionManager.PacketFromInputDevice(this, data, offset, datalen);
+		private void handleRawPacket(byte[] data, int start, int length) {
+			if (length < 20) {
+				/* Not enough data for IP header, skip packet */
+				return;
+			}
+
+			int offset = start;
+			int datalen;
+			int version = ((data[start]&0xf0) >> 4);
+			if (version == 4) {
+				/* IPv4 header from raw socket needs to be stripped off */
+				offset = start + (data[start]&0x0f)*4;
+				datalen = (data[start+2]*256 + data[start+3]) - (offset - start);
+			} else if (version == 6) {
+				datalen = 40 + (data[start+4]*256 + data[start+5]);
+			} else {
+				return;
+			}
+
+			/* The packets of a batch are next to each other, don't read past this one */
+			if (datalen < 0 || (offset - start) + datalen > length) {
+				return;
+			}
+
+			_sessionManager.PacketFromInputDevice(this, data, offset, datalen);
+		}
+
+		/* Compresses the payload into outdata at outoffset prefixed with its original
+		 * length, returns the compressed length or 0 if it didn't save space */
+		private int compressPayload(TunnelSession session, byte[] data, int offset, int length, byte[] outdata, int outoffset) {
+			if (length < COMPRESS_MIN_PAYLOAD) {
+				return 0;
+			}
+
+			/* Several threads may send to the same session, so the counters are
+			 * changed with Interlocked and never go negative. Two threads doubling
+			 * the backoff at once only retry compression a bit sooner. */
+			int skip = session.CompressSkip;
+			while (skip > 0) {
+				int prev = Interlocked.CompareExchange(ref session.CompressSkip, skip-1, skip);
+				if (prev == skip) {
+					return 0;
 				}
+				skip = prev;
+			}
+
+			int ret = LZ4.Compress(data, offset, length, outdata, outoffset+2,
+			                       Math.Min(length, outdata.Length-outoffset)-3);
+			if (ret == 0) {
+				int backoff = session.CompressBackoff;
+				if (backoff < COMPRESS_MAX_BACKOFF) {
+					backoff = (backoff > 0) ? backoff*2 : 1;
+				}
+				Interlocked.Exchange(ref session.CompressBackoff, backoff);
+				Interlocked.Exchange(ref session.CompressSkip, backoff);
+				return 0;
+			}
+			if (session.CompressBackoff != 0) {
+				Interlocked.Exchange(ref session.CompressBackoff, 0);
+			}
+
+			outdata[outoffset]   = (byte) (length >> 8);
+			outdata[outoffset+1] = (byte) (length);
+			return ret + 2;
+		}
+
+		private void sendAyiyaEchoResponse(Int64 tunnelId, bool ipv4, IPEndPoint destination) {
+			IPAddress localAddress;
+			if (ipv4) {
+				localAddress = _sessionManager.GetIPv4TunnelLocalAddress(tunnelId);
+			} else {
+				localAddress = _sessionManager.GetIPv6TunnelLocalAddress(tunnelId);
+			}
+			byte[] sourceBytes = destination.Address.GetAddressBytes();
+			if (localAddress == null || sourceBytes.Length != 4) {
+				return;
+			}
+			byte[] identityBytes = localAddress.GetAddressBytes();
+
+			/* The payload is the address and port the request came from,
+			 * the client notices from it when its NAT mapping changes */
+			byte[] outdata = new byte[8 + identityBytes.Length + 20 + 6];
+			outdata[0] = (byte) ((identityBytes.Length << 2) & 0xf0);
+			outdata[0] |= 0x01;
+
+			outdata[1] = 0x52;
+			outdata[2] = 0x14;
+			outdata[3] = 59;
+
+			UInt32 epochnow = (UInt32) (DateTime.UtcNow - new DateTime(1970, 1, 1)).TotalSeconds;
+			outdata[4] = (byte) (epochnow >> 24);
+			outdata[5] = (byte) (epochnow >> 16);
+			outdata[6] = (byte) (epochnow >> 8);
+			outdata[7] = (byte) (epochnow);
+			Array.Copy(identityBytes, 0, outdata, 8, identityBytes.Length);
+
+			int hashOffset = 8 + identityBytes.Length;
+			int payloadOffset = hashOffset + 20;
+			Array.Copy(sourceBytes, 0, outdata, payloadOffset, 4);
+			outdata[payloadOffset+4] = (byte) (destination.Port >> 8);
+			outdata[payloadOffset+5] = (byte) (destination.Port);
+
+			TunnelSession session = _sessionManager.GetSession(tunnelId);
+			if (session == null || session.PasswordHash == null) {
+				return;
 			}
+			Array.Copy(session.PasswordHash, 0, outdata, hashOffset, SHA1Digest.Length);
+			getDigest().Compute(outdata, 0, outdata.Length, outdata, hashOffset);
+
+			_udpSocket.SendTo(outdata, 0, outdata.Length, SocketFlags.None, destination);
 		}
 
 		private void handleHeartbeatPacket(IPEndPoint source, byte[] data, int datalen) {
@@ -245,14 +425,14 @@ namespace Nabla {
 					strlen = i;
 					break;
 				} else if (data[i] < 32 || data[i] > 126) {
-					Console.WriteLine("Heartbeat packet contains non-ascii characters");
+					_log.Debug("Heartbeat packet contains non-ascii characters");
 					return;
 				}
 			}
 
 			string str = Encoding.ASCII.GetString(data, 0, strlen);
 			if (!str.StartsWith("HEARTBEAT TUNNEL ")) { 
-				Console.WriteLine("Heartbeat string not found");
+				_log.Debug("Heartbeat string not found");
 				return;
 			}
 
@@ -270,11 +450,11 @@ namespace Nabla {
 				}
 				epochtime = UInt32.Parse(words[4]);
 			} catch (Exception) {
-				Console.WriteLine("Error parsing heartbeat packet");
+				_log.Debug("Error parsing heartbeat packet");
 				return;
 			}
 
-			Console.WriteLine("Identifier: {0} Source: {1} Epochtime: {2}", identifier, sourceaddr, epochtime);
+			_log.Debug("Identifier: {0} Source: {1} Epochtime: {2}", identifier, sourceaddr, epochtime);
 
 			/* Check for epoch time correctness */
 			UInt32 epochnow = (UInt32) (DateTime.UtcNow - new DateTime(1970, 1, 1)).TotalSeconds;                     
@@ -282,14 +462,14 @@ namespace Nabla {
 			if (epochdiff < 0)
 				epochdiff = -epochdiff;
 			if (epochdiff > CLOCK_MAX_OFFSET) {
-				Console.WriteLine("The clock is too much off ({0} seconds)", epochdiff);                                  
+				_log.Debug("The clock is too much off ({0} seconds)", epochdiff);                                  
 				return;
 			}
 
 			Int64 tunnelId = _sessionManager.TunnelIdFromAddress(identifier);
 			if (tunnelId < 0) {
 				/* Invalid or timed out session */
-				Console.WriteLine("Session for Heartbeat not found");
+				_log.Debug("Session for Heartbeat not found");
 				return;
 			}
 
@@ -302,7 +482,7 @@ namespace Nabla {
 			string ourHashStr = BitConverter.ToString(ourHash).Replace("-", "").ToLower();
 
 			if (!theirHashStr.Equals(ourHashStr)) {
-				Console.WriteLine("Incorrect Heartbeat hash");
+				_log.Debug("Incorrect Heartbeat hash");
 				return;
 			}
 
@@ -312,15 +492,15 @@ namespace Nabla {
 		private void handleAyiyaPacket(IPEndPoint source, byte[] data, int datalen) {
 			if ((data[0] != 0x11 && data[0] != 0x41) || // IDlen = 1 | 4, IDtype = int
 			     data[1] != 0x52 || // siglen = 5, method = SHA1
-			    // auth = sharedsecret, opcode = noop | forward | echo response
-			    (data[2] != 0x10 && data[2] != 0x11 && data[2] != 0x14)) {
+			    // auth = sharedsecret, opcode = noop | forward | echo request | echo response
+			    (data[2] != 0x10 && data[2] != 0x11 && data[2] != 0x12 && data[2] != 0x14)) {
 				return;
 			}
 
 			/* Start with the size of AYIYA header */
 			int hlen = 8 + (data[0] >> 4)*4 + (data[1] >> 4)*4;
 			if (datalen < hlen) {
-				Console.WriteLine("AYIYA header length {0} invalid", datalen);
+				_log.Debug("AYIYA header length {0} invalid", datalen);
 				return;
 			}
 
@@ -331,13 +511,20 @@ namespace Nabla {
 			} else if (data[3] == 41 && datalen >= hlen+40) { /* IPPROTO_IPV6 */
 				/* In case of IPv6, add the header and payload lengths */
 				length += 40 + data[length+4]*256 + data[length+5];
+			} else if (data[3] == AYIYA_NEXTHDR_LZ4 && datalen >= hlen+2) {
+				/* Compressed packets can only be forwarded */
+				if ((data[2] & 0x0f) != 1) {
+					return;
+				}
+				length = datalen;
 			} else if (data[3] == 59) { /* IPPROTO_NONE */
-				/* In case of no content, opcode should be nop or echo response */
-				if ((data[2] & 0x0f) != 0 && (data[2] & 0x0f) != 4) {
+				/* In case of no content, opcode should be nop or echo */
+				if ((data[2] & 0x0f) != 0 && (data[2] & 0x0f) != 2 &&
+				    (data[2] & 0x0f) != 4) {
 					return;
 				}
 			} else {
-				Console.WriteLine("Invalid next header in AYIYA packet: " + data[3]);
+				_log.Debug("Invalid next header in AYIYA packet: {0}", data[3]);
 				return;
 			}
 
@@ -348,44 +535,69 @@ namespace Nabla {
 			if (epochdiff < 0)
 				epochdiff = -epochdiff;
 			if (epochdiff > CLOCK_MAX_OFFSET) {
-				Console.WriteLine("The clock is too much off ({0} seconds)", epochdiff);
+				_log.Debug("The clock is too much off ({0} seconds)", epochdiff);
 				return;
 			}
 
-			/* Extract the identifier part from AYIYA header */
-			byte[] ipaddr = new byte[((data[0] >> 4) == 1) ? 4 : 16];
-			Array.Copy(data, 8, ipaddr, 0, ipaddr.Length);
-			IPAddress identifier = new IPAddress(ipaddr);
-
-			Int64 tunnelId = _sessionManager.TunnelIdFromAddress(identifier);
-			if (tunnelId < 0) {
+			/* The identifier part of AYIYA header is an IPv4 or IPv6 address */
+			int idlen = ((data[0] >> 4) == 1) ? 4 : 16;
+			Int64 tunnelId = _sessionManager.TunnelIdFromAddress(data, 8, idlen);
+			TunnelSession session = _sessionManager.GetSession(tunnelId);
+			if (session == null) {
 				/* Invalid or timed out session */
-				Console.WriteLine("Session for AYIYA not found");
+				_log.Debug("Session for AYIYA not found");
 				return;
 			}
 
-			SHA1CryptoServiceProvider sha1 = new SHA1CryptoServiceProvider();
-			string passwd = _sessionManager.GetSessionPassword(tunnelId);
-			byte[] passwdHash = sha1.ComputeHash(Encoding.ASCII.GetBytes(passwd));
+			byte[] passwdHash = session.PasswordHash;
+			if (passwdHash == null) {
+				return;
+			}
 
 			/* Replace the hash with password hash */
-			byte[] theirHash = new byte[20];
+			byte[] theirHash = _signature;
 			int hashOffset = 8 + (data[0] >> 4)*4;
-			Array.Copy(data, hashOffset, theirHash, 0, 20);
-			Array.Copy(passwdHash, 0, data, hashOffset, 20);
+			Array.Copy(data, hashOffset, theirHash, 0, SHA1Digest.Length);
+			Array.Copy(passwdHash, 0, data, hashOffset, SHA1Digest.Length);
 
-			byte[] ourHash = sha1.ComputeHash(data, 0, length);
-			if (!BitConverter.ToString(ourHash).Equals(BitConverter.ToString(theirHash))) {
-				Console.WriteLine("Incorrect AYIYA hash");
-				return;
+			getDigest().Compute(data, 0, length, data, hashOffset);
+			for (int i=0; i<SHA1Digest.Length; i++) {
+				if (data[hashOffset+i] != theirHash[i]) {
+					_log.Debug("Incorrect AYIYA hash");
+					return;
+				}
 			}
-			_sessionManager.UpdateSession(identifier, source);
+			_sessionManager.UpdateSession(tunnelId, source);
 
 			/* In case of NOP act like it would be a heartbeat */
 			if ((data[2] & 0x0f) == 0) {
 				return;
 			}
 
+			/* Echo requests are used by clients to detect NAT timeouts */
+			if ((data[2] & 0x0f) == 2) {
+				sendAyiyaEchoResponse(tunnelId, idlen == 4, source);
+				return;
+			}
+
+			if (data[3] == AYIYA_NEXTHDR_LZ4) {
+				/* The original length is followed by the LZ4 block */
+				int origlen = data[hlen]*256 + data[hlen+1];
+				byte[] plain = _decompressBuffer;
+				if (origlen > plain.Length ||
+				    LZ4.Decompress(data, hlen+2, datalen-hlen-2, plain, 0, origlen) != origlen) {
+					_log.Debug("Invalid compressed AYIYA payload");
+					return;
+				}
+
+				/* The client supports compression, use it for replies too */
+				session.Compress = true;
+				session.CountRxPayload(origlen, datalen-hlen);
+				_sessionManager.PacketFromInputDevice(this, plain, 0, origlen);
+				return;
+			}
+
+			session.CountRxPayload(datalen-hlen, datalen-hlen);
 			_sessionManager.PacketFromInputDevice(this, data, hlen, datalen-hlen);
 		}
 	}
@@ -0,0 +1,225 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+
+namespace Nabla {
+	/* Compression of tunnelled packets in the LZ4 block format, same as
+	 * client/compress.c. Only single blocks of at most MaxLength bytes
+	 * are supported, which is plenty for a packet. */
+	public class LZ4 {
+		public const int MaxLength = 0xffff;
+
+		private const int HASHLOG = 12;
+		private const int MINMATCH = 4;
+
+		/* The format requires the last five bytes to be literals and the
+		 * last match to start at least twelve bytes before the end */
+		private const int LASTLITERALS = 5;
+		private const int MFLIMIT = 12;
+
+		private const int MAXOFFSET = 0xffff;
+
+		/* Hash table of the current thread, cleared for every block. The
+		 * entries are positions plus one, so zero means no position. */
+		[ThreadStatic]
+		private static int[] _table;
+
+		private static UInt32 read32(byte[] data, int offset) {
+			return (UInt32) (data[offset] | (data[offset+1] << 8) |
+			                 (data[offset+2] << 16) | (data[offset+3] << 24));
+		}
+
+		private static int hash32(UInt32 value) {
+			return (int) ((value * 2654435761U) >> (32 - HASHLOG));
+		}
+
+		private static int writeLength(byte[] dst, int op, int length) {
+			while (length >= 255) {
+				dst[op++] = 255;
+				length -= 255;
+			}
+			dst[op++] = (byte) length;
+			return op;
+		}
+
+		/* Compresses length bytes from src into dst, returns the compressed
+		 * length or 0 if the result doesn't fit in dstlen bytes */
+		public static int Compress(byte[] src, int offset, int length,
+		                           byte[] dst, int dstoffset, int dstlen) {
+			if (length < 0 || length > MaxLength) {
+				return 0;
+			}
+
+			int[] table = _table;
+			if (table == null) {
+				table = _table = new int[1 << HASHLOG];
+			}
+			Array.Clear(table, 0, table.Length);
+
+			int ip = offset;
+			int anchor = offset;
+			int iend = offset + length;
+			int mflimit = iend - MFLIMIT;
+			int matchlimit = iend - LASTLITERALS;
+			int op = dstoffset;
+			int oend = dstoffset + dstlen;
+			int litlen;
+
+			while (length > MFLIMIT && ip <= mflimit) {
+				UInt32 sequence = read32(src, ip);
+				int h = hash32(sequence);
+				int reference = table[h] - 1;
+				table[h] = ip + 1;
+
+				if (reference < 0 || ip - reference > MAXOFFSET ||
+				    read32(src, reference) != sequence) {
+					/* Skip faster over data that doesn't compress */
+					ip += 1 + ((ip - anchor) >> 6);
+					continue;
+				}
+
+				/* Extend the match forwards and backwards */
+				int match = ip + MINMATCH;
+				int mref = reference + MINMATCH;
+				while (match < matchlimit && src[match] == src[mref]) {
+					match++;
+					mref++;
+				}
+				while (ip > anchor && reference > offset && src[ip-1] == src[reference-1]) {
+					ip--;
+					reference--;
+				}
+
+				litlen = ip - anchor;
+				int matchlen = match - ip - MINMATCH;
+				int moffset = ip - reference;
+				if (1 + litlen/255 + 1 + litlen + 2 + matchlen/255 + 1 > oend - op) {
+					return 0;
+				}
+
+				int token = op++;
+				dst[token] = (byte) ((litlen < 15 ? litlen : 15) << 4);
+				if (litlen >= 15) {
+					op = writeLength(dst, op, litlen - 15);
+				}
+				Array.Copy(src, anchor, dst, op, litlen);
+				op += litlen;
+
+				dst[op++] = (byte) moffset;
+				dst[op++] = (byte) (moffset >> 8);
+				dst[token] |= (byte) (matchlen < 15 ? matchlen : 15);
+				if (matchlen >= 15) {
+					op = writeLength(dst, op, matchlen - 15);
+				}
+
+				ip = anchor = match;
+			}
+
+			/* The block always ends with a sequence of only literals */
+			litlen = iend - anchor;
+			if (1 + litlen/255 + 1 + litlen > oend - op) {
+				return 0;
+			}
+			dst[op++] = (byte) ((litlen < 15 ? litlen : 15) << 4);
+			if (litlen >= 15) {
+				op = writeLength(dst, op, litlen - 15);
+			}
+			Array.Copy(src, anchor, dst, op, litlen);
+			op += litlen;
+
+			return op - dstoffset;
+		}
+
+		private static int readLength(byte[] src, ref int ip, int iend, int length) {
+			byte value;
+
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				value = src[ip++];
+				length += value;
+			} while (value == 255 && length <= MaxLength);
+
+			return length;
+		}
+
+		/* Decompresses length bytes from src into dst, returns the length of
+		 * the decompressed data or -1 if the input is invalid or doesn't
+		 * fit in dstlen bytes */
+		public static int Decompress(byte[] src, int offset, int length,
+		                             byte[] dst, int dstoffset, int dstlen) {
+			int ip = offset;
+			int iend = offset + length;
+			int op = dstoffset;
+			int oend = dstoffset + dstlen;
+
+			while (ip < iend) {
+				int token = src[ip++];
+				int litlen = token >> 4;
+				if (litlen == 15) {
+					litlen = readLength(src, ref ip, iend, litlen);
+					if (litlen < 0) {
+						return -1;
+					}
+				}
+				if (litlen > iend - ip || litlen > oend - op) {
+					return -1;
+				}
+				Array.Copy(src, ip, dst, op, litlen);
+				ip += litlen;
+				op += litlen;
+
+				if (ip == iend) {
+					/* The last sequence has no match */
+					break;
+				}
+
+				if (iend - ip < 2) {
+					return -1;
+				}
+				int moffset = src[ip] | (src[ip+1] << 8);
+				ip += 2;
+				if (moffset == 0 || moffset > op - dstoffset) {
+					return -1;
+				}
+
+				int matchlen = token & 15;
+				if (matchlen == 15) {
+					matchlen = readLength(src, ref ip, iend, matchlen);
+					if (matchlen < 0) {
+						return -1;
+					}
+				}
+				matchlen += MINMATCH;
+				if (matchlen > oend - op) {
+					return -1;
+				}
+
+				/* The match may overlap the output, copy a byte at a time */
+				int reference = op - moffset;
+				while (matchlen-- > 0) {
+					dst[op++] = dst[reference++];
+				}
+			}
+
+			return op - dstoffset;
+		}
+	}
+}
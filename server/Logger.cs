@@ -0,0 +1,353 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+using System.IO;
+using System.Threading;
+using System.Collections.Generic;
+
+namespace Nabla {
+	/* Same levels as syslog and the client logger */
+	public enum LogLevel {
+		Emergency = 0,
+		Alert = 1,
+		Critical = 2,
+		Error = 3,
+		Warning = 4,
+		Notice = 5,
+		Info = 6,
+		Debug = 7
+	}
+
+	/* Logger for one category, usually a class name. Messages are only
+	 * queued by the calling thread and formatted and written by a single
+	 * background thread, so packet threads never block on console I/O.
+	 * Queueing is lock-free, a message that is below the level of its
+	 * category costs a single comparison. Each category may queue at
+	 * most RateLimit messages per second, the rest are counted and the
+	 * count is written instead. */
+	public class Logger {
+		private const int MAX_QUEUED = 4096;
+		private const int DEFAULT_RATELIMIT = 100;
+
+		private class LogEntry {
+			public LogEntry Next;
+			public DateTime Time;
+			public Logger Logger;
+			public LogLevel Level;
+			public string Format;
+			public object[] Args;
+		}
+
+		private static Object _lock = new Object();
+		private static Dictionary<string, Logger> _loggers = new Dictionary<string, Logger>();
+		private static LogLevel _defaultLevel = LogLevel.Info;
+		private static TextWriter _output = Console.Out;
+		private static Thread _thread = null;
+		private static AutoResetEvent _event = new AutoResetEvent(false);
+
+		/* Queue of entries in reverse order, pushed with CAS */
+		private static LogEntry _head = null;
+		private static int _queued = 0;
+		private static int _dropped = 0;
+
+		private string _category;
+		private volatile int _level;
+		private bool _configured = false;	// level set explicitly, kept by DefaultLevel
+		private volatile int _rateLimit = DEFAULT_RATELIMIT;
+		private int _window = Environment.TickCount;
+		private int _windowCount = 0;
+		private int _suppressed = 0;
+
+		private Logger(string category, LogLevel level) {
+			_category = category;
+			_level = (int) level;
+		}
+
+		public static Logger GetLogger(string category) {
+			lock (_lock) {
+				Logger logger;
+				if (!_loggers.TryGetValue(category, out logger)) {
+					logger = new Logger(category, _defaultLevel);
+					_loggers.Add(category, logger);
+				}
+				return logger;
+			}
+		}
+
+		/* Level of the categories that have not been configured */
+		public static LogLevel DefaultLevel {
+			get { return _defaultLevel; }
+			set {
+				lock (_lock) {
+					_defaultLevel = value;
+					foreach (Logger logger in _loggers.Values) {
+						if (!logger._configured) {
+							logger._level = (int) value;
+						}
+					}
+				}
+			}
+		}
+
+		public static TextWriter Output {
+			get { return _output; }
+			set {
+				if (value == null) {
+					throw new ArgumentNullException("value");
+				}
+				_output = value;
+			}
+		}
+
+		/* Parses a comma separated list of levels like "info,AYIYA=debug",
+		 * where an entry without a category sets the default level */
+		public static void Configure(string config) {
+			if (config == null) {
+				return;
+			}
+
+			foreach (string entry in config.Split(',')) {
+				string[] words = entry.Trim().Split('=');
+				if (words.Length == 1 && words[0].Length > 0) {
+					DefaultLevel = ParseLevel(words[0]);
+				} else if (words.Length == 2) {
+					GetLogger(words[0].Trim()).Level = ParseLevel(words[1]);
+				}
+			}
+		}
+
+		public static LogLevel ParseLevel(string level) {
+			return (LogLevel) Enum.Parse(typeof(LogLevel), level.Trim(), true);
+		}
+
+		public string Category {
+			get { return _category; }
+		}
+
+		public LogLevel Level {
+			get { return (LogLevel) _level; }
+			set {
+				lock (_lock) {
+					_configured = true;
+					_level = (int) value;
+				}
+			}
+		}
+
+		/* Messages per second queued at most, zero disables the limit */
+		public int RateLimit {
+			get { return _rateLimit; }
+			set { _rateLimit = value; }
+		}
+
+		public bool IsEnabled(LogLevel level) {
+			return (int) level <= _level;
+		}
+
+		public void Log(LogLevel level, string format, params object[] args) {
+			if ((int) level > _level) {
+				return;
+			}
+			if (!checkRate()) {
+				Interlocked.Increment(ref _suppressed);
+				return;
+			}
+			if (Interlocked.Increment(ref _queued) > MAX_QUEUED) {
+				Interlocked.Decrement(ref _queued);
+				Interlocked.Increment(ref _dropped);
+				return;
+			}
+
+			LogEntry entry = new LogEntry();
+			entry.Time = DateTime.Now;
+			entry.Logger = this;
+			entry.Level = level;
+			entry.Format = format;
+			entry.Args = args;
+
+			LogEntry head;
+			do {
+				head = _head;
+				entry.Next = head;
+			} while (Interlocked.CompareExchange(ref _head, entry, head) != head);
+
+			/* The writer empties the whole queue when woken up, so it only
+			 * needs to be woken up when the queue was empty */
+			if (head == null) {
+				ensureThread();
+				_event.Set();
+			}
+		}
+
+		public void Error(string format, params object[] args) {
+			Log(LogLevel.Error, format, args);
+		}
+
+		public void Warning(string format, params object[] args) {
+			Log(LogLevel.Warning, format, args);
+		}
+
+		public void Notice(string format, params object[] args) {
+			Log(LogLevel.Notice, format, args);
+		}
+
+		public void Info(string format, params object[] args) {
+			Log(LogLevel.Info, format, args);
+		}
+
+		public void Debug(string format, params object[] args) {
+			Log(LogLevel.Debug, format, args);
+		}
+
+		/* Debug messages are mostly on the packet path, these overloads are
+		 * chosen for up to three arguments and don't allocate the argument
+		 * array or box the arguments unless the message is enabled */
+		public void Debug<T0>(string format, T0 arg0) {
+			if ((int) LogLevel.Debug <= _level) {
+				Log(LogLevel.Debug, format, arg0);
+			}
+		}
+
+		public void Debug<T0, T1>(string format, T0 arg0, T1 arg1) {
+			if ((int) LogLevel.Debug <= _level) {
+				Log(LogLevel.Debug, format, arg0, arg1);
+			}
+		}
+
+		public void Debug<T0, T1, T2>(string format, T0 arg0, T1 arg1, T2 arg2) {
+			if ((int) LogLevel.Debug <= _level) {
+				Log(LogLevel.Debug, format, arg0, arg1, arg2);
+			}
+		}
+
+		/* Writes all queued messages before returning, for example before
+		 * the process exits */
+		public static void Flush() {
+			lock (_lock) {
+				writeQueued();
+			}
+		}
+
+		private bool checkRate() {
+			int limit = _rateLimit;
+			if (limit <= 0) {
+				return true;
+			}
+
+			int now = Environment.TickCount;
+			int window = _window;
+			if (now - window >= 1000 &&
+			    Interlocked.CompareExchange(ref _window, now, window) == window) {
+				Interlocked.Exchange(ref _windowCount, 0);
+			}
+
+			return Interlocked.Increment(ref _windowCount) <= limit;
+		}
+
+		private static void ensureThread() {
+			if (_thread != null) {
+				return;
+			}
+
+			lock (_lock) {
+				if (_thread == null) {
+					Thread thread = new Thread(new ThreadStart(threadLoop));
+					thread.IsBackground = true;
+					thread.Name = "Logger";
+					thread.Start();
+					_thread = thread;
+				}
+			}
+		}
+
+		private static void threadLoop() {
+			while (true) {
+				/* Wake up once a second even if idle to report the
+				 * messages suppressed by the rate limit */
+				_event.WaitOne(1000, false);
+
+				lock (_lock) {
+					writeQueued();
+					writeSuppressed();
+				}
+			}
+		}
+
+		/* Called with _lock held */
+		private static void writeQueued() {
+			LogEntry entry = Interlocked.Exchange(ref _head, null);
+
+			/* Reverse the entries into the order they were queued */
+			LogEntry reversed = null;
+			int count = 0;
+			while (entry != null) {
+				LogEntry next = entry.Next;
+				entry.Next = reversed;
+				reversed = entry;
+				entry = next;
+				count++;
+			}
+			Interlocked.Add(ref _queued, -count);
+
+			for (entry = reversed; entry != null; entry = entry.Next) {
+				string message;
+				try {
+					message = String.Format(entry.Format, entry.Args);
+				} catch (FormatException) {
+					message = entry.Format;
+				}
+				write(entry.Time, entry.Logger._category, entry.Level, message);
+			}
+
+			int dropped = Interlocked.Exchange(ref _dropped, 0);
+			if (dropped > 0) {
+				write(DateTime.Now, "Logger", LogLevel.Warning,
+				      dropped + " messages dropped, queue full");
+			}
+
+			_output.Flush();
+		}
+
+		/* Called with _lock held */
+		private static void writeSuppressed() {
+			bool written = false;
+			foreach (Logger logger in _loggers.Values) {
+				int suppressed = Interlocked.Exchange(ref logger._suppressed, 0);
+				if (suppressed > 0) {
+					write(DateTime.Now, logger._category, LogLevel.Notice,
+					      suppressed + " messages suppressed by rate limit");
+					written = true;
+				}
+			}
+
+			if (written) {
+				_output.Flush();
+			}
+		}
+
+		private static void write(DateTime time, string category, LogLevel level, string message) {
+			try {
+				_output.WriteLine("{0:yyyy-MM-dd HH:mm:ss.fff} {1} [{2}] {3}",
+				                  time, level.ToString().ToLower(), category, message);
+			} catch (IOException) {
+				/* Nothing sensible to do if the log can't be written */
+			}
+		}
+	}
+}
@@ -19,17 +19,40 @@
 using System;
 using System.Net;
 using System.Net.Sockets;
+using System.Threading;
 using System.Collections.Generic;
 
 namespace Nabla {
+	/* Connection state of a mapping, only TCP goes past New */
+	public enum NATState {
+		New,		// No reply seen yet, or not TCP
+		Established,	// TCP handshake seen in both directions
+		FinWait,	// FIN seen in one direction
+		TimeWait,	// FIN seen in both directions
+		Closed		// RST seen
+	}
+
 	public class NATMapping {
 		public readonly ProtocolType Protocol;
-		public DateTime LastActive;
+
+		/* Tick count of the last packet and the connection state, updated
+		 * by packets without locking */
+		public volatile int LastActive;
+		public volatile NATState State = NATState.New;
+		public bool FinOut;
+		public bool FinIn;
+
+		/* Links of the timer wheel slot, owned by the NATMapper */
+		internal NATMapping WheelPrev;
+		internal NATMapping WheelNext;
+		internal int WheelSlot = -1;
 
 		public readonly IPAddress InternalAddress;
+		public readonly UInt32 InternalIPv4;
 		public readonly UInt16 InternalID;
 
 		public IPAddress ExternalAddress;
+		public UInt32 ExternalIPv4;
 		public UInt16 ExternalID;
 
 		public NATMapping(ProtocolType protocol,
@@ -37,6 +60,7 @@ namespace Nabla {
 				  UInt16 id) {
 			Protocol = protocol;
 			InternalAddress = internalIP;
+			InternalIPv4 = NATRewriter.AddressToUInt32(internalIP);
 			InternalID = id;
 		}
 	}
@@ -58,6 +82,12 @@ namespace Nabla {
 			}
 		}
 
+		public int Count {
+			get {
+				return _list.Count;
+			}
+		}
+
 		public static NATAddressList operator +(NATAddressList list, IPAddress address) {
 			List<IPAddress> tmplist = new List<IPAddress>(list._list);
 			tmplist.Add(address);
@@ -65,69 +95,532 @@ namespace Nabla {
 		}
 	}
 
+	/* Free external ports of one protocol on one external address, one
+	 * bit per port. Allocation tries the preferred port first and then
+	 * continues from a cursor that rotates over the bitmap, skipping 32
+	 * ports at a time when they are all in use. */
+	public class NATPortPool {
+		private UInt32[] _bitmap = new UInt32[65536/32];
+		private int _cursor = 0;
+		private int _used = 0;
+		private int _exhausted = 0;
+
+		public readonly IPAddress Address;
+		public readonly ProtocolType Protocol;
+
+		public NATPortPool(IPAddress address, ProtocolType protocol) {
+			Address = address;
+			Protocol = protocol;
+
+			/* Port zero is not valid for TCP and UDP, never use it */
+			_bitmap[0] = 1;
+			_used = 1;
+		}
+
+		/* Number of ports in use, not counting the reserved port zero */
+		public int Used {
+			get { return _used - 1; }
+		}
+
+		/* Number of times an allocation failed because all ports were used */
+		public int Exhausted {
+			get { return _exhausted; }
+		}
+
+		/* Returns a free port, preferably the given one, or -1 if the pool
+		 * is exhausted */
+		public int Allocate(UInt16 preferred) {
+			if ((_bitmap[preferred >> 5] & (1U << (preferred & 31))) == 0) {
+				_bitmap[preferred >> 5] |= 1U << (preferred & 31);
+				_used++;
+				return preferred;
+			}
+
+			for (int i=0; i<_bitmap.Length && _used < 65536; i++) {
+				int word = (_cursor + i) % _bitmap.Length;
+				UInt32 bits = _bitmap[word];
+				if (bits == 0xffffffff) {
+					continue;
+				}
+
+				int bit = 0;
+				while ((bits & (1U << bit)) != 0) {
+					bit++;
+				}
+
+				_bitmap[word] |= 1U << bit;
+				_cursor = word;
+				_used++;
+				return word*32 + bit;
+			}
+
+			_exhausted++;
+			return -1;
+		}
+
+		public void Release(UInt16 port) {
+			if ((_bitmap[port >> 5] & (1U << (port & 31))) != 0) {
+				_bitmap[port >> 5] &= ~(1U << (port & 31));
+				_used--;
+			}
+		}
+	}
+
+	/* Open addressing hash table from a packed key to a mapping, with
+	 * linear probing and the keys and values in flat arrays. Zero is
+	 * never a valid key, so it marks the empty slots. Writers must hold
+	 * a lock, lookups don't lock or allocate and a miss is simply an
+	 * empty slot. Removed entries leave a tombstone that is never reused
+	 * for another key, so a lookup can't find a key with the value of
+	 * another one and entries never move while readers probe. The
+	 * arrays are rebuilt without the tombstones when they fill up and
+	 * replaced as a whole, so a lookup sees either the old or the new
+	 * table. */
+	internal class NATTable {
+		private const int INITIAL_CAPACITY = 256;
+		private const Int64 TOMBSTONE = -1;
+
+		private class Slots {
+			public Int64[] Keys;
+			public NATMapping[] Values;
+			public int Mask;
+
+			public Slots(int capacity) {
+				Keys = new Int64[capacity];
+				Values = new NATMapping[capacity];
+				Mask = capacity-1;
+			}
+		}
+
+		private volatile Slots _slots = new Slots(INITIAL_CAPACITY);
+		private int _count = 0;		// live entries
+		private int _used = 0;		// live entries and tombstones
+
+		public int Count {
+			get { return _count; }
+		}
+
+		public NATMapping Lookup(Int64 key) {
+			Slots slots = _slots;
+			int i = hash(key) & slots.Mask;
+			while (true) {
+				Int64 k = slots.Keys[i];
+				if (k == key) {
+					return slots.Values[i];
+				} else if (k == 0) {
+					return null;
+				}
+				i = (i+1) & slots.Mask;
+			}
+		}
+
+		public void Add(Int64 key, NATMapping value) {
+			if ((_used+1)*2 > _slots.Keys.Length) {
+				/* Grow only if the live entries need it, otherwise the
+				 * rebuild just drops the tombstones */
+				int capacity = _slots.Keys.Length;
+				if ((_count+1)*4 > capacity) {
+					capacity *= 2;
+				}
+
+				Slots rebuilt = new Slots(capacity);
+				Slots slots = _slots;
+				for (int i=0; i<slots.Keys.Length; i++) {
+					if (slots.Keys[i] > 0) {
+						insert(rebuilt, slots.Keys[i], slots.Values[i]);
+					}
+				}
+				_slots = rebuilt;
+				_used = _count;
+			}
+
+			if (insert(_slots, key, value)) {
+				_used++;
+				_count++;
+			}
+		}
+
+		public bool Remove(Int64 key) {
+			Slots slots = _slots;
+			int i = hash(key) & slots.Mask;
+			while (slots.Keys[i] != key) {
+				if (slots.Keys[i] == 0) {
+					return false;
+				}
+				i = (i+1) & slots.Mask;
+			}
+
+			/* A lookup that matched the key just before gets either the
+			 * removed value or null, both are right for a removed entry */
+			slots.Keys[i] = TOMBSTONE;
+			slots.Values[i] = null;
+			_count--;
+
+			return true;
+		}
+
+		/* Returns true if the key was added, false if its value was replaced */
+		private static bool insert(Slots slots, Int64 key, NATMapping value) {
+			int i = hash(key) & slots.Mask;
+			while (slots.Keys[i] != 0 && slots.Keys[i] != key) {
+				i = (i+1) & slots.Mask;
+			}
+
+			/* Value first, so a lookup never finds the key without it */
+			bool added = (slots.Keys[i] == 0);
+			slots.Values[i] = value;
+			slots.Keys[i] = key;
+			return added;
+		}
+
+		private static int hash(Int64 key) {
+			/* Multiplicative hashing, the high bits are the best mixed */
+			UInt64 h = (UInt64) key * 0x9e3779b97f4a7c15UL;
+			return (int) (h >> 32);
+		}
+	}
+
+	/* Translates the addresses and ids of connections and tracks their
+	 * state. Idle mappings are removed by a timer wheel with one slot per
+	 * second, TCP connections are removed soon after they are closed. */
 	public class NATMapper {
-		private Dictionary<ProtocolType, Dictionary<UInt16, List<NATMapping>>> _intMap
-			= new Dictionary<ProtocolType, Dictionary<UInt16, List<NATMapping>>>();
-		private Dictionary<ProtocolType, Dictionary<UInt16, NATMapping>> _extMap
-			= new Dictionary<ProtocolType, Dictionary<UInt16, NATMapping>>();
+		private static Logger _log = Logger.GetLogger("NATMapper");
+
+		private const byte TCP_FIN = 0x01;
+		private const byte TCP_SYN = 0x02;
+		private const byte TCP_RST = 0x04;
+		private const byte TCP_ACK = 0x10;
+
+		/* Idle timeouts in milliseconds, see RFC 4787 and RFC 5382 */
+		private const int UDP_TIMEOUT = 5*60*1000;
+		private const int ICMP_TIMEOUT = 60*1000;
+		private const int TCP_ESTABLISHED_TIMEOUT = (2*60+4)*60*1000;
+		private const int TCP_TRANSITORY_TIMEOUT = 4*60*1000;
+		private const int TCP_CLOSED_TIMEOUT = 10*1000;
+
+		private const int WHEEL_SIZE = 64;
+		private const int WHEEL_RESOLUTION = 1000;
+
+		private NATMapping[] _wheel = new NATMapping[WHEEL_SIZE];
+		private int _wheelPosition = 0;
+
+		/* A packet thread may still hold a mapping it looked up just before the
+		 * mapping was removed, so the external port is released only on the
+		 * second tick after the removal, when no such packet can be left. */
+		private List<NATMapping> _removed = new List<NATMapping>();
+		private List<NATMapping> _releasing = new List<NATMapping>();
+		private Timer _timer;
+		private long _reaped = 0;
+		private double _reapRate = 0;
+
+		private Object _lock = new Object();
+		private bool[] _protocols = new bool[256];
+
+		/* Keyed by protocol, address and id, the internal ones for outgoing
+		 * packets and the external ones for incoming packets */
+		private NATTable _intMap = new NATTable();
+		private NATTable _extMap = new NATTable();
 		public NATAddressList Addresses = new NATAddressList();
 
-		public NATMapping GetIntMapping(ProtocolType type, IPAddress ipAddr, UInt16 port) {
-			try {
-				foreach (NATMapping m in _intMap[type][port]) {
-					if (ipAddr.Equals(m.InternalAddress)) {
-						m.LastActive = DateTime.Now;
-						return m;
-					}
+		/* Free ports of each external address and protocol, keyed the same
+		 * way as the tables with a zero id */
+		private Dictionary<Int64, NATPortPool> _pools = new Dictionary<Int64, NATPortPool>();
+
+		public NATMapper() {
+			_timer = new Timer(new TimerCallback(timerTick), null,
+			                   WHEEL_RESOLUTION, WHEEL_RESOLUTION);
+		}
+
+		/* Number of mappings currently in use */
+		public int Count {
+			get { return _intMap.Count; }
+		}
+
+		/* Number of mappings removed because of timeouts */
+		public long Reaped {
+			get {
+				lock (_lock) {
+					return _reaped;
+				}
+			}
+		}
+
+		/* Mappings removed per second, a moving average */
+		public double ReapRate {
+			get {
+				lock (_lock) {
+					return _reapRate;
 				}
-			} catch (KeyNotFoundException) {
 			}
+		}
 
-			return null;
+		public NATMapping GetIntMapping(ProtocolType type, IPAddress ipAddr, UInt16 port) {
+			return GetIntMapping(type, ipAddr.GetAddressBytes(), 0, port);
+		}
+
+		/* Same as above, but reads the IPv4 address from a buffer */
+		public NATMapping GetIntMapping(ProtocolType type, byte[] addr, int offset, UInt16 port) {
+			return _intMap.Lookup(key(type, addr, offset, port));
+		}
+
+		public NATMapping GetExtMapping(ProtocolType type, IPAddress ipAddr, UInt16 port) {
+			return GetExtMapping(type, ipAddr.GetAddressBytes(), 0, port);
 		}
 
-		public NATMapping GetExtMapping(ProtocolType type, UInt16 port) {
-			try {
-				return _extMap[type][port];
-			} catch (KeyNotFoundException) {
-				return null;
+		/* Same as above, but reads the IPv4 address from a buffer */
+		public NATMapping GetExtMapping(ProtocolType type, byte[] addr, int offset, UInt16 port) {
+			return _extMap.Lookup(key(type, addr, offset, port));
+		}
+
+		/* Returns the port pools created so far, to report the ports used
+		 * and the exhaustion counts of each address */
+		public NATPortPool[] GetPortPools() {
+			lock (_lock) {
+				NATPortPool[] pools = new NATPortPool[_pools.Count];
+				_pools.Values.CopyTo(pools, 0);
+				return pools;
 			}
 		}
 
 		public void AddProtocol(ProtocolType t) {
-			if (_intMap.ContainsKey(t) || _extMap.ContainsKey(t))
-				throw new Exception("Protocol already added");
+			lock (_lock) {
+				if (_protocols[(int) t & 0xff])
+					throw new Exception("Protocol already added");
 
-			_intMap.Add(t, new Dictionary<UInt16, List<NATMapping>>());
-			_extMap.Add(t, new Dictionary<UInt16, NATMapping>());
+				_protocols[(int) t & 0xff] = true;
+			}
 		}
 
+		/* Maps the internal address and id of m to an external address and
+		 * id. Each internal address always uses the same external address
+		 * if it has free ports, so the addresses share the load and a host
+		 * keeps one public address. Another address is used only if all the
+		 * ports of the first one are in use. */
 		public void AddMapping(NATMapping m) {
-			/* This shouldn't happen since getIntMapping should be checked first */
-			if (GetIntMapping(m.Protocol, m.InternalAddress, m.InternalID) != null)
-				throw new Exception("Internal ID already mapped");
-
-			int externalID = -1;
-			for (int i=0; i<65536; i++) {
-				if (!_extMap[m.Protocol].ContainsKey((UInt16) (m.InternalID+i))) {
-					externalID = (m.InternalID+i)&0xffff;
-					break;
+			byte[] intaddr = m.InternalAddress.GetAddressBytes();
+			Int64 intkey = key(m.Protocol, intaddr, 0, m.InternalID);
+
+			lock (_lock) {
+				if (!_protocols[(int) m.Protocol & 0xff])
+					throw new Exception("Protocol " + m.Protocol + " not added");
+
+				/* This shouldn't happen since getIntMapping should be checked first */
+				if (_intMap.Lookup(intkey) != null)
+					throw new Exception("Internal ID already mapped");
+
+				NATAddressList addresses = Addresses;
+				if (addresses.Count == 0)
+					throw new Exception("No external addresses to map to");
+
+				int first = (int) ((UInt32) (key(0, intaddr, 0, 0) >> 16) % (UInt32) addresses.Count);
+				NATPortPool pool = null;
+				int externalID = -1;
+				for (int i=0; i<addresses.Count && externalID < 0; i++) {
+					pool = getPool(addresses[(first+i) % addresses.Count], m.Protocol);
+					externalID = pool.Allocate(m.InternalID);
+					if (externalID < 0) {
+						_log.Warning("External ports of {0} for {1} exhausted",
+						             pool.Address, m.Protocol);
+					}
 				}
+				if (externalID < 0)
+					throw new Exception("Couldn't find external port, ran out of ports?");
+
+				m.ExternalAddress = pool.Address;
+				m.ExternalIPv4 = NATRewriter.AddressToUInt32(pool.Address);
+				m.ExternalID = (UInt16) externalID;
+				m.LastActive = Environment.TickCount;
+				m.State = NATState.New;
+				schedule(m);
+
+				byte[] extaddr = m.ExternalAddress.GetAddressBytes();
+				_intMap.Add(intkey, m);
+				_extMap.Add(key(m.Protocol, extaddr, 0, m.ExternalID), m);
 			}
-			if (externalID == -1)
-				throw new Exception("Couldn't find external port, ran out of ports?");
+		}
 
-			m.ExternalAddress = Addresses[0];
-			m.ExternalID = (UInt16) externalID;
-			m.LastActive = DateTime.Now;
+		public void RemoveMapping(NATMapping m) {
+			byte[] intaddr = m.InternalAddress.GetAddressBytes();
+			Int64 intkey = key(m.Protocol, intaddr, 0, m.InternalID);
 
-			if (!_intMap[m.Protocol].ContainsKey(m.InternalID))
-				_intMap[m.Protocol].Add(m.InternalID, new List<NATMapping>());
+			lock (_lock) {
+				if (_intMap.Lookup(intkey) != m)
+					return;
 
-			_intMap[m.Protocol][m.InternalID].Add(m);
-			_extMap[m.Protocol].Add(m.ExternalID, m);
+				removeMapping(m, intkey);
+			}
 		}
-	}
-}
 
+		/* Called with _lock held */
+		private void removeMapping(NATMapping m, Int64 intkey) {
+			byte[] extaddr = m.ExternalAddress.GetAddressBytes();
+			_intMap.Remove(intkey);
+			_extMap.Remove(key(m.Protocol, extaddr, 0, m.ExternalID));
+			_removed.Add(m);
+			unschedule(m);
+		}
 
+		/* Called for every translated packet, tcpflags are the flags byte of
+		 * the TCP header and outbound is true for packets to the network.
+		 * Only a state change that shortens the timeout takes the lock. */
+		public void Track(NATMapping m, byte tcpflags, bool outbound) {
+			m.LastActive = Environment.TickCount;
+			if (m.Protocol != ProtocolType.Tcp) {
+				return;
+			}
+
+			NATState state = m.State;
+			NATState next = state;
+			if ((tcpflags & TCP_RST) != 0) {
+				next = NATState.Closed;
+			} else if ((tcpflags & TCP_SYN) != 0 && (tcpflags & TCP_ACK) == 0) {
+				/* A new connection may reuse the ids of a closed one */
+				if (state == NATState.TimeWait || state == NATState.Closed) {
+					m.FinOut = m.FinIn = false;
+					next = NATState.New;
+				}
+			} else if ((tcpflags & TCP_FIN) != 0 && state != NATState.Closed) {
+				if (outbound) {
+					m.FinOut = true;
+				} else {
+					m.FinIn = true;
+				}
+				next = (m.FinOut && m.FinIn) ? NATState.TimeWait : NATState.FinWait;
+			} else if (state == NATState.New && !outbound && (tcpflags & TCP_ACK) != 0) {
+				/* Reply to our SYN, the handshake is done */
+				next = NATState.Established;
+			}
+
+			if (next != state) {
+				m.State = next;
+				if (getTimeout(m.Protocol, next) < getTimeout(m.Protocol, state)) {
+					lock (_lock) {
+						if (m.WheelSlot >= 0) {
+							unschedule(m);
+							schedule(m);
+						}
+					}
+				}
+			}
+		}
+
+		/* Idle time in milliseconds after which a mapping is removed */
+		private static int getTimeout(ProtocolType type, NATState state) {
+			if (type == ProtocolType.Udp) {
+				return UDP_TIMEOUT;
+			} else if (type != ProtocolType.Tcp) {
+				return ICMP_TIMEOUT;
+			}
+
+			switch (state) {
+			case NATState.Established:
+				return TCP_ESTABLISHED_TIMEOUT;
+			case NATState.TimeWait:
+			case NATState.Closed:
+				return TCP_CLOSED_TIMEOUT;
+			default:
+				return TCP_TRANSITORY_TIMEOUT;
+			}
+		}
+
+		/* Called with _lock held, puts m into the slot of its expiry time or
+		 * the last slot of the wheel if it expires later than that */
+		private void schedule(NATMapping m) {
+			int left = (m.LastActive + getTimeout(m.Protocol, m.State)) - Environment.TickCount;
+			int slots = left/WHEEL_RESOLUTION + 1;
+			if (slots < 1) {
+				slots = 1;
+			} else if (slots > WHEEL_SIZE-1) {
+				slots = WHEEL_SIZE-1;
+			}
+
+			int slot = (_wheelPosition + slots) % WHEEL_SIZE;
+			m.WheelSlot = slot;
+			m.WheelPrev = null;
+			m.WheelNext = _wheel[slot];
+			if (_wheel[slot] != null) {
+				_wheel[slot].WheelPrev = m;
+			}
+			_wheel[slot] = m;
+		}
+
+		/* Called with _lock held */
+		private void unschedule(NATMapping m) {
+			if (m.WheelSlot < 0) {
+				return;
+			}
+
+			if (m.WheelPrev != null) {
+				m.WheelPrev.WheelNext = m.WheelNext;
+			} else {
+				_wheel[m.WheelSlot] = m.WheelNext;
+			}
+			if (m.WheelNext != null) {
+				m.WheelNext.WheelPrev = m.WheelPrev;
+			}
+			m.WheelPrev = m.WheelNext = null;
+			m.WheelSlot = -1;
+		}
+
+		/* Runs once per wheel slot. Mappings in the slot that are still in
+		 * use are scheduled again from their last activity, so a packet
+		 * never has to touch the wheel. */
+		private void timerTick(Object state) {
+			lock (_lock) {
+				foreach (NATMapping r in _releasing) {
+					getPool(r.ExternalAddress, r.Protocol).Release(r.ExternalID);
+				}
+				_releasing.Clear();
+
+				List<NATMapping> removed = _removed;
+				_removed = _releasing;
+				_releasing = removed;
+
+				_wheelPosition = (_wheelPosition + 1) % WHEEL_SIZE;
+
+				NATMapping m = _wheel[_wheelPosition];
+				_wheel[_wheelPosition] = null;
+
+				int now = Environment.TickCount;
+				int reaped = 0;
+				while (m != null) {
+					NATMapping next = m.WheelNext;
+					m.WheelPrev = m.WheelNext = null;
+					m.WheelSlot = -1;
+
+					if (now - m.LastActive >= getTimeout(m.Protocol, m.State)) {
+						removeMapping(m, key(m.Protocol, m.InternalAddress.GetAddressBytes(), 0, m.InternalID));
+						reaped++;
+					} else {
+						schedule(m);
+					}
+					m = next;
+				}
+
+				_reaped += reaped;
+				_reapRate = (_reapRate*7 + reaped*1000.0/WHEEL_RESOLUTION)/8;
+			}
+		}
+
+		/* Called with _lock held */
+		private NATPortPool getPool(IPAddress address, ProtocolType type) {
+			Int64 poolkey = key(type, address.GetAddressBytes(), 0, 0);
+
+			NATPortPool pool;
+			if (!_pools.TryGetValue(poolkey, out pool)) {
+				pool = new NATPortPool(address, type);
+				_pools.Add(poolkey, pool);
+			}
+
+			return pool;
+		}
+
+		/* Protocol in bits 48-55, address in bits 16-47 and the id in bits
+		 * 0-15. The protocols used are never zero, so neither is the key. */
+		private static Int64 key(ProtocolType type, byte[] addr, int offset, UInt16 id) {
+			Int64 address = ((Int64) addr[offset] << 24) | ((Int64) addr[offset+1] << 16) |
+			                ((Int64) addr[offset+2] << 8) | (Int64) addr[offset+3];
+			return (((Int64) type & 0xff) << 48) | (address << 16) | id;
+		}
+	}
+}
@@ -0,0 +1,191 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+using System.Net;
+using System.Net.Sockets;
+
+namespace Nabla {
+	/* Rewrites the addresses and ids of an IPv4 packet in place, in the
+	 * buffer of the caller. Nothing is copied and nothing is allocated:
+	 * addresses are handled as integers and the checksums
+	 * are updated incrementally as described in RFC 1624, so rewriting a
+	 * packet is a few reads and stores. */
+	public struct NATRewriter {
+		private byte[] _data;
+		private int _offset;
+		private int _hlen;
+		private ProtocolType _protocol;
+
+		/* Offset of the transport checksum in the packet or -1 if there
+		 * is none, which is the case for UDP packets with checksum zero */
+		private int _checksum;
+
+		/* Returns false unless data holds a complete IPv4 header and the
+		 * TCP, UDP or ICMP echo header needed for the translation */
+		public static bool TryParse(byte[] data, int offset, int length, out NATRewriter packet) {
+			packet = new NATRewriter();
+			if (length < 20 || offset+length > data.Length || (data[offset] >> 4) != 4) {
+				return false;
+			}
+
+			int hlen = (data[offset] & 0x0f) * 4;
+			int totlen = (data[offset+2] << 8) | data[offset+3];
+			if (hlen < 20 || totlen < hlen || totlen > length) {
+				return false;
+			}
+
+			/* Only the first fragment has the transport header */
+			if (((data[offset+6] & 0x1f) | data[offset+7]) != 0) {
+				return false;
+			}
+
+			int checksum;
+			ProtocolType protocol = (ProtocolType) data[offset+9];
+			if (protocol == ProtocolType.Tcp) {
+				if (totlen < hlen+20) {
+					return false;
+				}
+				checksum = hlen+16;
+			} else if (protocol == ProtocolType.Udp) {
+				if (totlen < hlen+8) {
+					return false;
+				}
+				checksum = hlen+6;
+				if (data[offset+checksum] == 0 && data[offset+checksum+1] == 0) {
+					checksum = -1;
+				}
+			} else if (protocol == ProtocolType.Icmp) {
+				/* Only echo requests and replies have identifiers */
+				if (totlen < hlen+8 || (data[offset+hlen] != 0 && data[offset+hlen] != 8)) {
+					return false;
+				}
+				checksum = hlen+2;
+			} else {
+				return false;
+			}
+
+			packet._data = data;
+			packet._offset = offset;
+			packet._hlen = hlen;
+			packet._protocol = protocol;
+			packet._checksum = checksum;
+			return true;
+		}
+
+		public ProtocolType ProtocolType {
+			get { return _protocol; }
+		}
+
+		public UInt32 SourceAddress {
+			get { return readUInt32(_offset+12); }
+		}
+
+		public UInt32 DestinationAddress {
+			get { return readUInt32(_offset+16); }
+		}
+
+		/* Flags of the TCP header, zero for other protocols */
+		public byte TcpFlags {
+			get { return (_protocol == ProtocolType.Tcp) ? _data[_offset+_hlen+13] : (byte) 0; }
+		}
+
+		/* Source port for TCP and UDP, identifier for ICMP */
+		public UInt16 IntNatID {
+			get { return readUInt16(_offset+_hlen+(_protocol == ProtocolType.Icmp ? 4 : 0)); }
+		}
+
+		/* Destination port for TCP and UDP, identifier for ICMP */
+		public UInt16 ExtNatID {
+			get { return readUInt16(_offset+_hlen+(_protocol == ProtocolType.Icmp ? 4 : 2)); }
+		}
+
+		public void RewriteSource(UInt32 address, UInt16 id) {
+			rewrite(_offset+12, address,
+			        _offset+_hlen+(_protocol == ProtocolType.Icmp ? 4 : 0), id);
+		}
+
+		public void RewriteDestination(UInt32 address, UInt16 id) {
+			rewrite(_offset+16, address,
+			        _offset+_hlen+(_protocol == ProtocolType.Icmp ? 4 : 2), id);
+		}
+
+		/* Converts an IPv4 address to the integer used above */
+		public static UInt32 AddressToUInt32(IPAddress address) {
+			byte[] bytes = address.GetAddressBytes();
+			if (bytes.Length != 4) {
+				throw new Exception("IPv4 address family required");
+			}
+			return ((UInt32) bytes[0] << 24) | ((UInt32) bytes[1] << 16) |
+			       ((UInt32) bytes[2] << 8) | (UInt32) bytes[3];
+		}
+
+		private void rewrite(int addrpos, UInt32 address, int idpos, UInt16 id) {
+			UInt32 oldaddr = readUInt32(addrpos);
+			UInt16 oldid = readUInt16(idpos);
+
+			/* Sum of ~m + m' for each changed 16-bit word (RFC 1624 eqn. 3) */
+			int addrsum = (~(int) (oldaddr >> 16) & 0xffff) + (int) (address >> 16) +
+			              (~(int) oldaddr & 0xffff) + (int) (address & 0xffff);
+			int idsum = (~(int) oldid & 0xffff) + id;
+
+			/* The IP header checksum only covers the address, the TCP and UDP
+			 * checksums include the address in the pseudo header and the port,
+			 * the ICMP checksum only covers the identifier */
+			updateChecksum(_offset+10, addrsum);
+			if (_protocol == ProtocolType.Icmp) {
+				updateChecksum(_offset+_checksum, idsum);
+			} else if (_checksum >= 0) {
+				updateChecksum(_offset+_checksum, addrsum + idsum);
+				if (_protocol == ProtocolType.Udp &&
+				    _data[_offset+_checksum] == 0 && _data[_offset+_checksum+1] == 0) {
+					/* Zero means no checksum in UDP, the same value is 0xffff */
+					_data[_offset+_checksum] = 0xff;
+					_data[_offset+_checksum+1] = 0xff;
+				}
+			}
+
+			_data[addrpos]   = (byte) (address >> 24);
+			_data[addrpos+1] = (byte) (address >> 16);
+			_data[addrpos+2] = (byte) (address >> 8);
+			_data[addrpos+3] = (byte) address;
+			_data[idpos]     = (byte) (id >> 8);
+			_data[idpos+1]   = (byte) id;
+		}
+
+		/* HC' = ~(~HC + sum), folded back to 16 bits */
+		private void updateChecksum(int pos, int sum) {
+			sum += ~((_data[pos] << 8) | _data[pos+1]) & 0xffff;
+			sum = (sum & 0xffff) + (sum >> 16);
+			sum = (sum & 0xffff) + (sum >> 16);
+			sum = ~sum & 0xffff;
+
+			_data[pos]   = (byte) (sum >> 8);
+			_data[pos+1] = (byte) sum;
+		}
+
+		private UInt32 readUInt32(int pos) {
+			return ((UInt32) _data[pos] << 24) | ((UInt32) _data[pos+1] << 16) |
+			       ((UInt32) _data[pos+2] << 8) | (UInt32) _data[pos+3];
+		}
+
+		private UInt16 readUInt16(int pos) {
+			return (UInt16) ((_data[pos] << 8) | _data[pos+1]);
+		}
+	}
+}
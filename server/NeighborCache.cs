@@ -0,0 +1,348 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+using System.Net;
+using System.Threading;
+using System.Collections.Generic;
+
+namespace Nabla {
+	public enum NeighborState {
+		Incomplete,	// Requests sent, no reply yet
+		Reachable,	// Reply received recently
+		Stale,		// Reply is old, still used but confirmed again
+		Failed		// No reply to any request, packets are dropped
+	}
+
+	/* Sends an ARP request or a neighbor solicitation for target */
+	public delegate void NeighborRequestCallback(IPAddress source, IPAddress target);
+
+	/* Sends a packet that was waiting for the hardware address of target */
+	public delegate void NeighborFlushCallback(IPAddress target, byte[] hwaddr, byte[] packet);
+
+	/* Cache of hardware addresses for both ARP and IPv6 neighbor discovery.
+	 * Resolving never blocks: packets to a neighbor that is not known yet
+	 * are queued in the entry and the requests are sent from a timer, the
+	 * queue is sent when the reply arrives. Entries age from reachable to
+	 * stale and are removed when not used, the least recently used entry
+	 * is dropped when the cache is full. */
+	public class NeighborCache : IDisposable {
+		private static Logger _log = Logger.GetLogger("NeighborCache");
+
+		private const int MAX_ENTRIES = 1024;	// entries kept at most
+		private const int MAX_QUEUED = 8;	// packets queued per unresolved neighbor
+		private const int MAX_REQUESTS = 3;	// requests sent before failing
+
+		private const int TIMER_INTERVAL = 200;		// milliseconds between timer runs
+		private const int REQUEST_INTERVAL = 1000;	// milliseconds between requests
+		private const int REACHABLE_TIME = 30*1000;	// reachable before turning stale
+		private const int STALE_TIME = 10*60*1000;	// stale and unused before removed
+		private const int FAILED_TIME = 20*1000;	// failed before resolving again
+
+		private class Entry {
+			public IPAddress Address;
+			public IPAddress Source;
+			public byte[] HardwareAddress;
+			public NeighborState State;
+
+			public int Updated;	// tick count of the last state change
+			public int Used;	// tick count of the last lookup
+			public int Requests;	// requests sent since the last reply
+			public int NextRequest;	// tick count of the next request, if resolving
+			public bool Resolving;
+
+			public Queue<byte[]> Pending = new Queue<byte[]>();
+			public LinkedListNode<Entry> Node;
+		}
+
+		private Object _lock = new Object();
+		private Dictionary<IPAddress, Entry> _entries = new Dictionary<IPAddress, Entry>();
+		private LinkedList<Entry> _lru = new LinkedList<Entry>();
+
+		private NeighborRequestCallback _requestCallback;
+		private NeighborFlushCallback _flushCallback;
+		private Timer _timer;
+
+		public NeighborCache(NeighborRequestCallback requestCallback, NeighborFlushCallback flushCallback) {
+			_requestCallback = requestCallback;
+			_flushCallback = flushCallback;
+			_timer = new Timer(new TimerCallback(timerTick), null, TIMER_INTERVAL, TIMER_INTERVAL);
+		}
+
+		public int Count {
+			get {
+				lock (_lock) {
+					return _entries.Count;
+				}
+			}
+		}
+
+		public NeighborState GetState(IPAddress addr) {
+			lock (_lock) {
+				Entry entry;
+				if (!_entries.TryGetValue(addr, out entry)) {
+					return NeighborState.Failed;
+				}
+				return entry.State;
+			}
+		}
+
+		/* Returns the hardware address of target if it is known. Otherwise
+		 * a copy of the packet is queued until target is resolved and null
+		 * is returned, packet can be null if there is nothing to send. The
+		 * source is used as the sender address of ARP requests. */
+		public byte[] Resolve(IPAddress source, IPAddress target, byte[] packet, int offset, int length) {
+			bool request = false;
+
+			lock (_lock) {
+				int now = Environment.TickCount;
+
+				Entry entry;
+				if (_entries.TryGetValue(target, out entry)) {
+					entry.Used = now;
+					_lru.Remove(entry.Node);
+					_lru.AddFirst(entry.Node);
+
+					if (entry.State == NeighborState.Reachable) {
+						return entry.HardwareAddress;
+					} else if (entry.State == NeighborState.Stale) {
+						/* Use the old address but confirm it in the background */
+						if (!entry.Resolving) {
+							startResolving(entry, source, now);
+						}
+						return entry.HardwareAddress;
+					} else if (entry.State == NeighborState.Failed) {
+						return null;
+					}
+				} else {
+					entry = new Entry();
+					entry.Address = target;
+					entry.State = NeighborState.Incomplete;
+					entry.Updated = now;
+					entry.Used = now;
+					entry.Node = new LinkedListNode<Entry>(entry);
+					addEntry(entry);
+
+					/* Send the first request right away */
+					startResolving(entry, source, now);
+					request = true;
+				}
+
+				if (packet != null) {
+					if (entry.Pending.Count >= MAX_QUEUED) {
+						entry.Pending.Dequeue();
+					}
+
+					byte[] copy = new byte[length];
+					Array.Copy(packet, offset, copy, 0, length);
+					entry.Pending.Enqueue(copy);
+				}
+			}
+
+			if (request) {
+				sendRequest(source, target);
+			}
+			return null;
+		}
+
+		/* Called when a reply or an advertisement is received, returns true
+		 * if the address was not known before. Queued packets are sent. */
+		public bool Update(IPAddress addr, byte[] hwaddr) {
+			bool added;
+			byte[][] pending;
+
+			lock (_lock) {
+				int now = Environment.TickCount;
+
+				Entry entry;
+				if (!_entries.TryGetValue(addr, out entry)) {
+					entry = new Entry();
+					entry.Address = addr;
+					entry.Used = now;
+					entry.Node = new LinkedListNode<Entry>(entry);
+					addEntry(entry);
+				}
+
+				added = (entry.HardwareAddress == null || !equals(entry.HardwareAddress, hwaddr));
+				entry.HardwareAddress = hwaddr;
+				entry.State = NeighborState.Reachable;
+				entry.Updated = now;
+				entry.Requests = 0;
+				entry.Resolving = false;
+
+				pending = entry.Pending.ToArray();
+				entry.Pending.Clear();
+
+				/* Wake up the threads waiting in Wait */
+				Monitor.PulseAll(_lock);
+			}
+
+			foreach (byte[] packet in pending) {
+				try {
+					_flushCallback(addr, hwaddr, packet);
+				} catch (Exception e) {
+					_log.Error("Exception sending queued packet: {0}", e);
+				}
+			}
+
+			return added;
+		}
+
+		/* Waits until addr is resolved or fails, returns the hardware address
+		 * or null. Only meant for probing addresses, packets never wait. */
+		public byte[] Wait(IPAddress source, IPAddress target, int timeoutms) {
+			DateTime endTime = DateTime.Now + new TimeSpan(0, 0, 0, 0, timeoutms);
+
+			byte[] hwaddr = Resolve(source, target, null, 0, 0);
+			lock (_lock) {
+				while (hwaddr == null) {
+					Entry entry;
+					if (!_entries.TryGetValue(target, out entry) ||
+					    entry.State == NeighborState.Failed) {
+						break;
+					}
+					if (entry.HardwareAddress != null) {
+						hwaddr = entry.HardwareAddress;
+						break;
+					}
+
+					TimeSpan wait = endTime - DateTime.Now;
+					if (wait <= TimeSpan.Zero) {
+						break;
+					}
+					Monitor.Wait(_lock, wait);
+				}
+			}
+
+			return hwaddr;
+		}
+
+		/* Stops the timer, the cache can't be used after this */
+		public void Dispose() {
+			lock (_lock) {
+				if (_timer != null) {
+					_timer.Dispose();
+					_timer = null;
+				}
+			}
+		}
+
+		public void Clear() {
+			lock (_lock) {
+				_entries.Clear();
+				_lru.Clear();
+			}
+		}
+
+		/* Called with _lock held */
+		private void addEntry(Entry entry) {
+			if (_entries.Count >= MAX_ENTRIES) {
+				Entry last = _lru.Last.Value;
+				_lru.RemoveLast();
+				_entries.Remove(last.Address);
+			}
+
+			_entries.Add(entry.Address, entry);
+			_lru.AddFirst(entry.Node);
+		}
+
+		/* Called with _lock held */
+		private void startResolving(Entry entry, IPAddress source, int now) {
+			entry.Source = source;
+			entry.Resolving = true;
+			entry.Requests = 0;
+			entry.NextRequest = now;
+		}
+
+		private void timerTick(Object state) {
+			List<Entry> requests = new List<Entry>();
+
+			lock (_lock) {
+				int now = Environment.TickCount;
+				bool failed = false;
+
+				List<Entry> expired = new List<Entry>();
+				foreach (Entry entry in _entries.Values) {
+					if (entry.Resolving && now - entry.NextRequest >= 0) {
+						if (entry.Requests >= MAX_REQUESTS) {
+							/* No replies, drop the packets and the old address */
+							entry.State = NeighborState.Failed;
+							entry.HardwareAddress = null;
+							entry.Updated = now;
+							entry.Resolving = false;
+							entry.Pending.Clear();
+							failed = true;
+						} else {
+							/* Resolve was the first request if just started */
+							if (entry.Requests > 0 || entry.State == NeighborState.Stale) {
+								requests.Add(entry);
+							}
+							entry.Requests++;
+							entry.NextRequest = now + REQUEST_INTERVAL;
+						}
+					}
+
+					if (entry.State == NeighborState.Reachable &&
+					    now - entry.Updated >= REACHABLE_TIME) {
+						entry.State = NeighborState.Stale;
+						entry.Updated = now;
+					} else if (entry.State == NeighborState.Stale && !entry.Resolving &&
+					           now - entry.Used >= STALE_TIME) {
+						expired.Add(entry);
+					} else if (entry.State == NeighborState.Failed &&
+					           now - entry.Updated >= FAILED_TIME) {
+						expired.Add(entry);
+					}
+				}
+
+				foreach (Entry entry in expired) {
+					_entries.Remove(entry.Address);
+					_lru.Remove(entry.Node);
+				}
+
+				if (failed) {
+					Monitor.PulseAll(_lock);
+				}
+			}
+
+			foreach (Entry entry in requests) {
+				sendRequest(entry.Source, entry.Address);
+			}
+		}
+
+		private void sendRequest(IPAddress source, IPAddress target) {
+			try {
+				_requestCallback(source, target);
+			} catch (Exception e) {
+				_log.Error("Exception sending request for {0}: {1}", target, e);
+			}
+		}
+
+		private static bool equals(byte[] b1, byte[] b2) {
+			if (b1.Length != b2.Length) {
+				return false;
+			}
+			for (int i=0; i<b1.Length; i++) {
+				if (b1[i] != b2[i]) {
+					return false;
+				}
+			}
+			return true;
+		}
+	}
+}
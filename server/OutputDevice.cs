@@ -27,15 +27,30 @@ namespace Nabla {
 	public delegate void OutputDeviceCallback(OutputDevice source, byte[] data, int offset, int length);
 
 	public class OutputDevice {
+		private static Logger _log = Logger.GetLogger("OutputDevice");
+
+		private string _deviceName;
 		private ParallelDevice _device;
 		private NATMapper _mapper = new NATMapper();
 		private OutputDeviceCallback _callback;
 
 		public IPAddress IPv6LocalAddress = null;
 
-		public OutputDevice(string deviceName, bool enableIPv4, bool enableIPv6, OutputDeviceCallback cb) {
-			_device = new ParallelDevice(deviceName);
+		public OutputDevice(string deviceName, bool enableIPv4, bool enableIPv6, OutputDeviceCallback cb)
+			: this(deviceName, enableIPv4, enableIPv6, 1, cb) {
+		}
+
+		/* Workers is the number of threads receiving packets from the device */
+		public OutputDevice(string deviceName, bool enableIPv4, bool enableIPv6, int workers, OutputDeviceCallback cb)
+			: this(deviceName, enableIPv4, enableIPv6, workers, null, cb) {
+		}
+
+		/* Same as above, but the packets are received by the threads of reactor if not null */
+		public OutputDevice(string deviceName, bool enableIPv4, bool enableIPv6, int workers, Reactor reactor, OutputDeviceCallback cb) {
+			_deviceName = deviceName;
+			_device = new ParallelDevice(deviceName, workers);
 			_device.ReceivePacketCallback = new ReceivePacketCallback(receivePacket);
+			_device.Reactor = reactor;
 			_mapper.AddProtocol(ProtocolType.Tcp);
 			_mapper.AddProtocol(ProtocolType.Udp);
 			_mapper.AddProtocol(ProtocolType.Icmp);
@@ -43,8 +58,8 @@ namespace Nabla {
 
 			DateTime confStart = DateTime.Now;
 			bool confSuccess = _device.AutoConfigureRoutes(enableIPv4, enableIPv6, 2000);
-			Console.WriteLine("Configure took timespan: " + (DateTime.Now - confStart));
-			Console.WriteLine("Configure success was: " + confSuccess);
+			_log.Info("Configure took timespan: {0}", DateTime.Now - confStart);
+			_log.Info("Configure success was: {0}", confSuccess);
 
 			if (_device.IPv4Route != null) {
 				IPConfig route = _device.IPv4Route;
@@ -72,7 +87,7 @@ namespace Nabla {
 
 				_device.AddSubnet(ipv4, 32);
 				_mapper.Addresses += ipv4;
-				Console.WriteLine("Added IPv4 address: {0}", ipv4);
+				_log.Info("Added IPv4 address: {0}", ipv4);
 			}
 
 			if (_device.IPv6Route != null) {
@@ -107,10 +122,29 @@ namespace Nabla {
 				ipv6 = new IPAddress(ipv6Bytes);
 				IPv6LocalAddress = ipv6;
 
-				Console.WriteLine("Added IPv6 subnet: {0}/{1}", ipv6, 104);
+				_log.Info("Added IPv6 subnet: {0}/{1}", ipv6, 104);
 			}
 		}
 
+		/* Routes found while configuring the device, null if the family
+		 * is not enabled or couldn't be configured */
+		public IPConfig IPv4Route {
+			get { return _device.IPv4Route; }
+		}
+
+		public IPConfig IPv6Route {
+			get { return _device.IPv6Route; }
+		}
+
+		public string DeviceName {
+			get { return _deviceName; }
+		}
+
+		/* Mappings of the IPv4 connections, for reporting their counts */
+		public NATMapper Mapper {
+			get { return _mapper; }
+		}
+
 		public void Start() {
 			_device.Start();
 		}
@@ -120,80 +154,75 @@ namespace Nabla {
 		}
 
 		public void SendPacket(byte[] data) {
-			AddressFamily addressFamily = getPacketFamily(data);
+			SendPacket(data, 0, data.Length);
+		}
+
+		/* Packets are sent without copying, the addresses of IPv4 packets are
+		 * translated in place so the data is modified */
+		public void SendPacket(byte[] data, int offset, int length) {
+			AddressFamily addressFamily = getPacketFamily(data, offset);
 
 			if (addressFamily == AddressFamily.InterNetwork) {
-				NATPacket packet;
-				try {
-					packet = new NATPacket(data);
-				} catch (Exception) {
-					/* Packet not supported by NATPacket */
+				NATRewriter packet;
+				if (!NATRewriter.TryParse(data, offset, length, out packet)) {
+					/* Packet not supported by NATRewriter */
 					return;
 				}
 
-				Console.WriteLine("Protocol type {0}, NAT identifier {0}",
-				                  packet.ProtocolType, packet.IntNatID);
-
+				/* Source address of the packet at offset 12 */
 				NATMapping m = _mapper.GetIntMapping(packet.ProtocolType,
-				                                     packet.SourceAddress,
+				                                     data, offset+12,
 				                                     packet.IntNatID);
 
 				if (m == null) {
-					Console.WriteLine("Unmapped connection, add mapping");
+					_log.Debug("Unmapped connection, add mapping");
+					byte[] source = new byte[4];
+					Array.Copy(data, offset+12, source, 0, 4);
 					m = new NATMapping(packet.ProtocolType,
-					                   packet.SourceAddress,
+					                   new IPAddress(source),
 					                   packet.IntNatID);
 					_mapper.AddMapping(m);
 				}
 
-				Console.WriteLine("Using external IP {0} with ID {1} (0x{1:x})",
-				                  m.ExternalAddress, m.ExternalID);
+				_mapper.Track(m, packet.TcpFlags, true);
 
 				/* Convert the source values to the public ones */
-				packet.SourceAddress = m.ExternalAddress;
-				packet.IntNatID = m.ExternalID;
-
-				/* Override the original data packet */
-				data = packet.Bytes;
+				packet.RewriteSource(m.ExternalIPv4, m.ExternalID);
 			}
 
 			/* FIXME: Catch exceptions */
-			_device.SendPacket(data);
+			_device.SendPacket(data, offset, length);
 		}
 
-		private void receivePacket(byte[] data) {
-			AddressFamily addressFamily = getPacketFamily(data);
+		private void receivePacket(byte[] data, int offset, int length) {
+			AddressFamily addressFamily = getPacketFamily(data, offset);
 			if (addressFamily == AddressFamily.InterNetwork) {
-				NATPacket packet;
-				try {
-					packet = new NATPacket(data);
-				} catch (Exception) {
-					/* Packet not supported by NATPacket */
+				NATRewriter packet;
+				if (!NATRewriter.TryParse(data, offset, length, out packet)) {
+					/* Packet not supported by NATRewriter */
 					return;
 				}
 
+				/* Destination address of the packet at offset 16 */
 				NATMapping m = _mapper.GetExtMapping(packet.ProtocolType,
+				                                     data, offset+16,
 				                                     packet.ExtNatID);
 
 				if (m == null) {
 					return;
 				}
 
-				Console.WriteLine("Received external IP {0} with port {1} (0x{1:x})",
-				                  m.ExternalAddress, m.ExternalID);
+				_mapper.Track(m, packet.TcpFlags, false);
 
 				/* Convert the destination values to the local ones */
-				packet.DestinationAddress = m.InternalAddress;
-				packet.ExtNatID = m.InternalID;
-
-				data = packet.Bytes;
+				packet.RewriteDestination(m.InternalIPv4, m.InternalID);
 			}
 
-			_callback(this, data, 0, data.Length);
+			_callback(this, data, offset, length);
 		}
 
-		private AddressFamily getPacketFamily(byte[] data) {
-			switch (data[0] >> 4) {
+		private AddressFamily getPacketFamily(byte[] data, int offset) {
+			switch (data[offset] >> 4) {
 			case 4:
 				return AddressFamily.InterNetwork;
 			case 6:
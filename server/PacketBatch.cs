@@ -0,0 +1,151 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+using System.Net;
+using Nabla.Sockets;
+
+namespace Nabla {
+	/* Collects the packets that a thread sends to raw sockets while it handles a batch
+	 * of received packets, and sends them with one SendBatch per socket at the end. The
+	 * packets are built directly into slots of an arena of the thread, so batching them
+	 * doesn't allocate. Packets sent outside of Begin and End aren't batched. */
+	public class PacketBatch {
+		private static Logger _log = Logger.GetLogger("PacketBatch");
+
+		/* Packets of each socket per send, the slots fit an Ethernet frame */
+		private const int MAX_PACKETS = 64;
+		private const int SLOT_SIZE = 14+2048;
+		private const int MAX_SOCKETS = 4;
+
+		private class SocketQueue {
+			public RawSocket Socket;
+			public byte[] Data = new byte[MAX_PACKETS*SLOT_SIZE];
+			public int[] Offsets = new int[MAX_PACKETS];
+			public int[] Lengths = new int[MAX_PACKETS];
+			public IPEndPoint[] EndPoints = new IPEndPoint[MAX_PACKETS];
+			public int Count = 0;
+
+			public SocketQueue() {
+				for (int i=0; i<MAX_PACKETS; i++) {
+					Offsets[i] = i*SLOT_SIZE;
+				}
+			}
+		}
+
+		/* Batch of the current thread, created on its first Begin */
+		[ThreadStatic]
+		private static PacketBatch _current;
+
+		private int _depth = 0;
+		private SocketQueue[] _queues = new SocketQueue[MAX_SOCKETS];
+
+		/* Starts batching the sends of the current thread, calls may be nested and
+		 * the packets are sent when the outermost batch ends */
+		public static void Begin() {
+			if (_current == null) {
+				_current = new PacketBatch();
+			}
+			_current._depth++;
+		}
+
+		public static void End() {
+			PacketBatch batch = _current;
+			if (--batch._depth == 0) {
+				for (int i=0; i<MAX_SOCKETS && batch._queues[i] != null; i++) {
+					flush(batch._queues[i]);
+				}
+			}
+		}
+
+		/* Reserves room for a packet of length bytes to the socket and returns the buffer
+		 * to build it into at offset, the packet is then sent when the batch ends. Returns
+		 * null if the thread isn't batching or the packet doesn't fit, then the caller has
+		 * to send it itself. The end point is null for sockets bound to an interface. */
+		public static byte[] Reserve(RawSocket socket, int length, IPEndPoint endPoint, out int offset) {
+			offset = 0;
+
+			PacketBatch batch = _current;
+			if (batch == null || batch._depth == 0 || length > SLOT_SIZE) {
+				return null;
+			}
+
+			SocketQueue queue = batch.getQueue(socket);
+			if (queue == null) {
+				return null;
+			}
+
+			/* A socket is either bound or sends to end points, never both */
+			if (queue.Count > 0 && (queue.EndPoints[0] == null) != (endPoint == null)) {
+				return null;
+			}
+
+			if (queue.Count == MAX_PACKETS) {
+				flush(queue);
+			}
+
+			int slot = queue.Count++;
+			queue.Lengths[slot] = length;
+			queue.EndPoints[slot] = endPoint;
+
+			offset = queue.Offsets[slot];
+			return queue.Data;
+		}
+
+		/* Returns the queue of the socket, an empty queue of another socket is reused */
+		private SocketQueue getQueue(RawSocket socket) {
+			SocketQueue free = null;
+			for (int i=0; i<MAX_SOCKETS; i++) {
+				SocketQueue queue = _queues[i];
+				if (queue == null) {
+					if (free == null) {
+						free = _queues[i] = new SocketQueue();
+					}
+					break;
+				} else if (queue.Socket == socket) {
+					return queue;
+				} else if (free == null && queue.Count == 0) {
+					free = queue;
+				}
+			}
+
+			if (free != null) {
+				free.Socket = socket;
+			}
+			return free;
+		}
+
+		private static void flush(SocketQueue queue) {
+			int count = queue.Count;
+			if (count == 0) {
+				return;
+			}
+			queue.Count = 0;
+
+			IPEndPoint[] endPoints = (queue.EndPoints[0] != null) ? queue.EndPoints : null;
+			try {
+				int sent = queue.Socket.SendBatch(queue.Data, queue.Offsets, queue.Lengths, count, endPoints);
+				if (sent < count) {
+					_log.Debug("Dropped {0} of {1} packets in a batch", count - sent, count);
+				}
+			} catch (Exception e) {
+				_log.Warning("Error sending a batch of {0} packets: {1}", count, e.Message);
+			}
+		}
+	}
+}
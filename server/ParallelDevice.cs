@@ -22,22 +22,50 @@ using System.Net.Sockets;
 using System.Threading;
 using System.Collections.Generic;
 using Nabla.Sockets;
+using BPF = Nabla.Sockets.PacketFilter;
 
 namespace Nabla {
-	public delegate void ReceivePacketCallback(byte[] data);
+	public delegate void ReceivePacketCallback(byte[] data, int offset, int length);
 
 	public class ParallelDevice {
+		private static Logger _log = Logger.GetLogger("ParallelDevice");
+
 		private const int ETHERTYPE_IPv4 = 0x0800;
 		private const int ETHERTYPE_ARP  = 0x0806;
 		private const int ETHERTYPE_IPv6 = 0x86dd;
 
-		private const int ARP_RETRIES = 3;    	// send 3 requests before giving up
-		private const int ARP_RETRY_DELAY = 1;	// wait for 1 second between requests
+		private const int PROBE_TIMEOUT = 5000;	// milliseconds to wait for probe replies
+		private const int MAX_CONTROL_QUEUED = 256;	// control frames waiting for the control worker
+
+		/* Sizes of the packet rings of each socket, the receive ring of 8 MB holds a few
+		 * milliseconds of traffic at line rate and only the first socket sends frames */
+		private const int RING_BLOCKS = 64;
+		private const int RING_BLOCK_SIZE = 128*1024;
+		private const int RING_FRAMES = 512;
+		private const int RING_FRAME_SIZE = 4096;
+		private const int MAX_BATCH_FRAMES = 64;	// frames handled per receive call
 
 		private byte[] _hwaddr;		// Hardware address of the original interface
 		private RawSocket _socket;	// Raw link layer socket to receive and send packets
 		private Thread _thread;		// Thread that is running to receive packets from device
 
+		/* With more than one worker, each worker thread reads its own socket and the sockets
+		 * are joined to a fanout group that spreads the packets by a hash of their flow. The
+		 * first worker reads _socket and handles all the control frames, the others queue them
+		 * for it. The callback may then be called from several threads at the same time. */
+		private string _deviceName;
+		private int _workers;
+		private RawSocket[] _workerSockets = null;
+		private Thread[] _workerThreads = null;
+		private Queue<byte[]> _controlQueue = new Queue<byte[]>();
+
+		/* Buffers for the Ethernet frames of outgoing packets, senders may run in parallel.
+		 * With a transmit ring only the header is built and the kernel is kicked by the last
+		 * of the concurrent senders, so frames queued meanwhile are sent with one call. */
+		private BufferPool _sendBuffers = new BufferPool(14+2048, 16);
+		private BufferPool _headerBuffers = new BufferPool(14, 16);
+		private int _ringSenders = 0;
+
 		private Object _runlock = new Object();	// Runlock to prevent modifications when starting or stopping
 		private bool _running = false;		// A boolean telling if the device is running currently
 
@@ -46,14 +74,15 @@ namespace Nabla {
 		 * send packets from address 192.168.1.10 to the public network.
 		 *
 		 * NOTE: All the addresses in these subnets should be handled by the callback delegate! */
-		private List<IPConfig> _subnets = new List<IPConfig>();
+		private RoutingTable<IPConfig> _subnets = new RoutingTable<IPConfig>();
+
+		/* Lock for replacing the kernel filters of the sockets, the filter is built from
+		 * the subnets so that the frames dropped by handleFrame never reach the process */
+		private Object _filterLock = new Object();
 
-		/* Dictionary that maps an IP address into the hardware address of the host, despite
-		 * the name this dictionary is also used to hold the hardware address mapping of IPv6
-		 * hosts discovered using the neighbor discovery protocol */
-		// FIXME: This dictionary is growing indefinitely and should be purged somehow
-		private Dictionary<IPAddress, byte[]> _arptable = new Dictionary<IPAddress, byte[]>();
-		private Object _arplock = new Object();	// Lock for modifying the _arptable dictionary
+		/* Cache that maps an IP address into the hardware address of the host, both for ARP
+		 * and for IPv6 hosts discovered using the neighbor discovery protocol */
+		private NeighborCache _neighbors;
 
 		/* This callback handles all the incoming packets, cannot be modified while running */
 		private ReceivePacketCallback _callback = null;
@@ -73,6 +102,27 @@ namespace Nabla {
 			}
 		}
 
+		/* Reactor that receives from the sockets while running, the device has threads of its
+		 * own if null. Configuring and probing always use a thread of the device. */
+		private Reactor _reactor = null;
+		public Reactor Reactor {
+			get {
+				return _reactor;
+			}
+			set {
+				lock (_runlock) {
+					if (_running) {
+						throw new Exception("Can't set reactor while running");
+					}
+
+					_reactor = value;
+				}
+			}
+		}
+
+		/* Serializes the handling of control frames of the reactor callbacks */
+		private Object _controlLock = new Object();
+
 		/* Configuration information stores the IPv4 and IPv6 information of the network, this means
 		 * the network prefix, network prefix length (netmask) and the default route information, for
 		 * example 192.168.1.0/24 and 192.168.1.1 could be a valid route information for IPv6, in case
@@ -106,11 +156,34 @@ namespace Nabla {
 		}
 
 		/* Constructor taking the name of the physical interface we will attach to as a parameter */
-		public ParallelDevice(string deviceName) {
+		public ParallelDevice(string deviceName) : this(deviceName, 1) {
+		}
+
+		/* Same as above, but receives packets with the given number of worker threads */
+		public ParallelDevice(string deviceName, int workers) {
+			if (workers < 1) {
+				throw new Exception("Number of workers " + workers + " invalid");
+			}
+
+			/* The control worker checks its queue whenever the socket wait times out */
+			_deviceName = deviceName;
+			_workers = workers;
 			_hwaddr = RawSocket.GetHardwareAddress(deviceName);
 			_socket = RawSocket.GetRawSocket(deviceName,
 			                                 AddressFamily.DataLink,
-			                                 0, 100);
+			                                 0, (workers > 1) ? 10 : 100);
+			setupRings(_socket, RING_FRAMES);
+			updateFilter();
+			createNeighborCache();
+		}
+
+		/* The cache has a timer of its own, so it is disposed when the device stops
+		 * and created again when the device is used next. Called with runlock held. */
+		private void createNeighborCache() {
+			if (_neighbors == null) {
+				_neighbors = new NeighborCache(new NeighborRequestCallback(sendNeighborRequest),
+				                               new NeighborFlushCallback(sendQueuedPacket));
+			}
 		}
 
 		/* This method will attempt to automatically configure the network and route information for
@@ -148,6 +221,7 @@ namespace Nabla {
 				bool success = false;
 				lock (_confLock) {
 					/* Starting the thread is ok as long as we're inside conflock */
+					createNeighborCache();
 					_running = true;
 					_thread = new Thread(new ThreadStart(threadLoop));
 					_thread.Start();
@@ -206,11 +280,73 @@ namespace Nabla {
 				if (_running)
 					return;
 
+				if (_workers > 1 && _workerSockets == null) {
+					joinFanoutGroup();
+				}
+
+				createNeighborCache();
 				_running = true;
+				if (_reactor != null) {
+					_reactor.Register(_socket, new ReadyCallback(socketReady), new ReceiveState(_socket));
+					if (_workerSockets != null) {
+						foreach (RawSocket socket in _workerSockets) {
+							_reactor.Register(socket, new ReadyCallback(socketReady), new ReceiveState(socket));
+						}
+					}
+					_log.Info("Parallel device started with {0} sockets in reactor", 1 + (_workerSockets != null ? _workerSockets.Length : 0));
+					return;
+				}
+
 				_thread = new Thread(new ThreadStart(threadLoop));
 				_thread.Start();
+
+				if (_workerSockets != null) {
+					_workerThreads = new Thread[_workerSockets.Length];
+					for (int i=0; i<_workerSockets.Length; i++) {
+						_workerThreads[i] = new Thread(new ParameterizedThreadStart(workerLoop));
+						_workerThreads[i].Start(_workerSockets[i]);
+					}
+				}
+			}
+			_log.Info("Parallel device started with {0} workers", 1 + (_workerSockets != null ? _workerSockets.Length : 0));
+		}
+
+		/* Creates the sockets of the other workers and joins all the sockets to a new fanout
+		 * group. Sockets can't leave the group, so they are kept until the device is gone and
+		 * configuring or probing should be done before the first start. If the platform can't
+		 * do fanout, a single worker is used. */
+		private void joinFanoutGroup() {
+			RawSocket[] sockets = new RawSocket[_workers-1];
+			try {
+				/* The group ids are shared with other processes, so a free one is
+				 * picked when the first socket creates the group */
+				int group = _socket.JoinFanoutGroup(-1);
+				_log.Debug("Created fanout group {0}", group);
+				for (int i=0; i<sockets.Length; i++) {
+					sockets[i] = RawSocket.GetRawSocket(_deviceName,
+					                                    AddressFamily.DataLink,
+					                                    0, 100);
+					sockets[i].JoinFanoutGroup(group);
+					setupRings(sockets[i], 0);
+				}
+			} catch (Exception e) {
+				_log.Warning("Using a single worker, fanout failed: {0}", e.Message);
+				_workers = 1;
+				return;
+			}
+
+			_workerSockets = sockets;
+			updateFilter();
+		}
+
+		/* Maps the packet rings of a socket if the platform supports them, otherwise the
+		 * frames are received and sent one system call at a time */
+		private void setupRings(RawSocket socket, int frames) {
+			try {
+				socket.SetupRings(RING_BLOCKS, RING_BLOCK_SIZE, frames, RING_FRAME_SIZE);
+			} catch (Exception e) {
+				_log.Notice("Not using packet rings: {0}", e.Message);
 			}
-			Console.WriteLine("Parallel device started");
 		}
 
 		/* Stop running the parallel device and wait that the thread has finished */
@@ -220,16 +356,36 @@ namespace Nabla {
 					return;
 
 				_running = false;
-				_thread.Join();
+				if (_reactor != null) {
+					_reactor.Unregister(_socket);
+					if (_workerSockets != null) {
+						foreach (RawSocket socket in _workerSockets) {
+							_reactor.Unregister(socket);
+						}
+					}
+				} else {
+					_thread.Join();
+				}
+
+				if (_workerThreads != null) {
+					foreach (Thread thread in _workerThreads) {
+						thread.Join();
+					}
+					_workerThreads = null;
+				}
+
+				_neighbors.Dispose();
+				_neighbors = null;
 			}
-			Console.WriteLine("Parallel device stopped");
+			_log.Info("Parallel device stopped");
 		}
 
 		/* Add a subnet that will be replied to in ARP replies, it is the
 		 * responsibility of the program adding a subnet to make sure that there
 		 * are no duplicate addresses in the network at the moment */
 		public void AddSubnet(IPAddress addr, int prefixlen) {
-			_subnets.Add(new IPConfig(addr, prefixlen, null));
+			_subnets.Add(addr, prefixlen, new IPConfig(addr, prefixlen, null));
+			updateFilter();
 		}
 
 		public void SendPacket(byte[] data) {
@@ -251,7 +407,8 @@ namespace Nabla {
 		 * If the destination address is neither multicast nor broadcast, a check is made
 		 * whether the default route is configured. If it is configured it is sent as a link
 		 * local or using the default route hardware address depending on if it belongs to
-		 * the subnet or not. */
+		 * the subnet or not. If that hardware address is not known yet, the packet is queued
+		 * in the neighbor cache and sent once resolved, so this method never blocks. */
 		public void SendPacket(byte[] data, int offset, int datalen) {
 			int version = (data[offset] >> 4) & 0x0f;
 
@@ -288,7 +445,7 @@ namespace Nabla {
 			}
 
 			if (!addressInSubnets(src)) {
-				Console.WriteLine("Dropping packet from source address " + src);
+				_log.Debug("Dropping packet from source address {0}", src);
 			}
 
 			byte[] hwaddr;
@@ -337,30 +494,95 @@ namespace Nabla {
 					throw new Exception("Address " + dest + " not a local address and default route was not found");
 				}
 
-				/* Lookup the ARP/ND table and attempt a request automatically if not found */
-				hwaddr = resolveHardwareAddress(src, dest);
+				/* Lookup the neighbor cache, if the address is not known yet the packet is
+				 * queued and sent when the address is resolved */
+				NeighborCache neighbors = _neighbors;
+				if (neighbors == null) {
+					/* The device is stopped */
+					return;
+				}
+				hwaddr = neighbors.Resolve(src, dest, data, offset, datalen);
 				if (hwaddr == null) {
-					Console.WriteLine("Resolving address " + dest + " not successful, packet dropped");
 					return;
 				}
 			}
 
-			/* Construct the 14-byte Ethernet header for the packet */
-			byte[] outbuf = new byte[14+datalen];
-			Array.Copy(hwaddr, 0, outbuf, 0, 6);
-			Array.Copy(_hwaddr, 0, outbuf, 6, 6);
-			if (dest.AddressFamily == AddressFamily.InterNetwork) {
-				outbuf[12] = 0x08;
-				outbuf[13] = 0x00;
+			sendFrame(hwaddr, data, offset, datalen);
+		}
+
+		/* Sends a packet that was queued while resolving the hardware address */
+		private void sendQueuedPacket(IPAddress target, byte[] hwaddr, byte[] packet) {
+			sendFrame(hwaddr, packet, 0, packet.Length);
+		}
+
+		private void sendFrame(byte[] hwaddr, byte[] data, int offset, int datalen) {
+			int version = (data[offset] >> 4) & 0x0f;
+
+			if (_socket.HasTransmitRing) {
+				byte[] header = _headerBuffers.Take();
+				Array.Copy(hwaddr, 0, header, 0, 6);
+				Array.Copy(_hwaddr, 0, header, 6, 6);
+				header[12] = (byte) ((version == 4) ? 0x08 : 0x86);
+				header[13] = (byte) ((version == 4) ? 0x00 : 0xdd);
+
+				Interlocked.Increment(ref _ringSenders);
+				try {
+					queueFrame(header, data, offset, datalen);
+				} finally {
+					if (Interlocked.Decrement(ref _ringSenders) == 0) {
+						_socket.FlushFrames();
+					}
+					_headerBuffers.Return(header);
+				}
+				return;
+			}
+
+			/* Construct the 14-byte Ethernet header for the packet, in a receive callback
+			 * the frame is built into the batch that is sent when the callback ends */
+			int start;
+			byte[] outbuf = PacketBatch.Reserve(_socket, 14+datalen, null, out start);
+			bool batched = (outbuf != null);
+			if (!batched) {
+				if (14+datalen <= _sendBuffers.BufferSize) {
+					outbuf = _sendBuffers.Take();
+				} else {
+					outbuf = new byte[14+datalen];
+				}
+			}
+			Array.Copy(hwaddr, 0, outbuf, start, 6);
+			Array.Copy(_hwaddr, 0, outbuf, start+6, 6);
+			if (version == 4) {
+				outbuf[start+12] = 0x08;
+				outbuf[start+13] = 0x00;
 			} else {
-				outbuf[12] = 0x86;
-				outbuf[13] = 0xdd;
+				outbuf[start+12] = 0x86;
+				outbuf[start+13] = 0xdd;
+			}
+			Array.Copy(data, offset, outbuf, start+14, datalen);
+			if (batched) {
+				return;
 			}
-			Array.Copy(data, offset, outbuf, 14, datalen);
 
 			/* Inject the constructed Ethernet frame using the raw socket */
-			_socket.Send(outbuf);
-			//Console.WriteLine("Sent packet to host " + dest);
+			try {
+				_socket.Send(outbuf, 0, 14+datalen);
+			} finally {
+				_sendBuffers.Return(outbuf);
+			}
+		}
+
+		/* Queues a frame in the transmit ring, if the ring is full the queued frames are
+		 * sent and the frame is dropped if the kernel doesn't free a slot in time */
+		private void queueFrame(byte[] header, byte[] data, int offset, int datalen) {
+			if (_socket.QueueFrame(header, data, offset, datalen)) {
+				return;
+			}
+
+			_socket.FlushFrames();
+			if (!_socket.WaitForWritable() ||
+			    !_socket.QueueFrame(header, data, offset, datalen)) {
+				_log.Debug("Dropping packet, transmit ring full");
+			}
 		}
 
 		/* This will attempt to find out if a certain IP address is currently present in the
@@ -376,10 +598,9 @@ namespace Nabla {
 					throw new Exception("Can't probe addresses while running");
 				}
 
-				/* Clear ARP table just to be sure information is current */
-				lock (_arplock) {
-					_arptable.Clear();
-				}
+				/* Clear neighbor cache just to be sure information is current */
+				createNeighborCache();
+				_neighbors.Clear();
 
 				ReceivePacketCallback originalCallback = _callback;
 				_callback = null;
@@ -388,7 +609,7 @@ namespace Nabla {
 				_thread = new Thread(new ThreadStart(threadLoop));
 				_thread.Start();
 
-				if (resolveHardwareAddress(null, target) == null) {
+				if (_neighbors.Wait(null, target, PROBE_TIMEOUT) == null) {
 					success = false;
 				}
 
@@ -401,192 +622,382 @@ namespace Nabla {
 			return success;
 		}
 
-		/* This privately used function will attempt to resolve an address by first looking
-		 * up the _arptable dictionary and if not found from there, it will make ARP_RETRIES
-		 * tries to resolve the address with a delay of ARP_RETRY_DELAY between retries. If
-		 * the address is still not found, it will return null as its return value. Otherwise
-		 * a byte array containing the hardware address of the destionation is returned.
-		 *
-		 * The source address is the source used in ARP requests, it is not necessary in
-		 * ND requests and therefore ignored in case of IPv6 addresses. It can be null which
-		 * simply means that the default 0.0.0.0 address is used as a source. The target
-		 * is the address to be resolved. */
-		private byte[] resolveHardwareAddress(IPAddress source, IPAddress target) {
-			if (source != null && source.AddressFamily != target.AddressFamily) {
-				throw new Exception("Source and target families don't match");
-			}
-
-			lock (_arplock) {
-				if (!_arptable.ContainsKey(target)) {
-					/* Wait one second between requests */
-					TimeSpan span = new TimeSpan(0, 0, ARP_RETRY_DELAY);
-
-					for (int i=0; i<ARP_RETRIES; i++) {
-						/* Send ARP/NDSol request to get the hardware address */
-						if (target.AddressFamily == AddressFamily.InterNetwork) {
-							/* If source is unknown, perform an ARP probe */
-							if (source == null || source.AddressFamily != AddressFamily.InterNetwork) {
-								source = new IPAddress(new byte[] { 0, 0, 0, 0 });
-							}
-
-							sendARPRequest(source, target);
-						} else {
-							sendNDSol(target);
-						}
+		/* Sends the ARP request or neighbor solicitation for the neighbor cache. The source
+		 * address is used only in ARP requests, null means the 0.0.0.0 address of a probe. */
+		private void sendNeighborRequest(IPAddress source, IPAddress target) {
+			if (target.AddressFamily == AddressFamily.InterNetwork) {
+				if (source == null || source.AddressFamily != AddressFamily.InterNetwork) {
+					source = new IPAddress(new byte[] { 0, 0, 0, 0 });
+				}
 
-						DateTime startTime = DateTime.Now;
-						while (!_arptable.ContainsKey(target)) {
-							TimeSpan wait = (startTime + span) - DateTime.Now;
-							if (wait < TimeSpan.Zero)
-								break;
+				sendARPRequest(source, target);
+			} else {
+				sendNDSol(target);
+			}
+		}
 
-							Monitor.Wait(_arplock, wait);
-						}
+		/* This is the main thread loop that handles all incoming packets from the device, with
+		 * several workers it is the control worker that also handles the ARP, ND and DHCP frames */
+		private void threadLoop() {
+			receiveLoop(_socket, true);
+		}
 
-						if (_arptable.ContainsKey(target)) {
-							break;
-						}
-					}
+		/* Thread loop of the other workers, each reading its own socket of the fanout group */
+		private void workerLoop(Object socket) {
+			receiveLoop((RawSocket) socket, false);
+		}
+
+		private void receiveLoop(RawSocket socket, bool control) {
+			byte[] data = new byte[RING_BLOCK_SIZE];
+			int[] offsets = new int[MAX_BATCH_FRAMES];
+			int[] lengths = new int[MAX_BATCH_FRAMES];
 
-					if (!_arptable.ContainsKey(target)) {
-						return null;
+			while (_running) {
+				if (control) {
+					handleQueuedControlFrames();
+				}
+
+				/* Read the incoming frames, none if the wait timed out */
+				int count = socket.ReceiveBatch(data, offsets, lengths);
+				PacketBatch.Begin();
+				try {
+					for (int i=0; i<count; i++) {
+						if (lengths[i] < 14)
+							continue;
+
+						handleFrame(data, offsets[i], lengths[i], control);
 					}
+				} finally {
+					PacketBatch.End();
 				}
+			}
+		}
+
+		/* Receive buffers of a socket in the reactor, its callback never runs twice at once */
+		private class ReceiveState {
+			public RawSocket Socket;
+			public byte[] Data = new byte[RING_BLOCK_SIZE];
+			public int[] Offsets = new int[MAX_BATCH_FRAMES];
+			public int[] Lengths = new int[MAX_BATCH_FRAMES];
 
-				return _arptable[target];
+			public ReceiveState(RawSocket socket) {
+				Socket = socket;
 			}
 		}
 
-		/* This is the main thread loop that handles all incoming packets from the device. */
-		private void threadLoop() {
-			byte[] data = new byte[2048];
+		/* Reactor callback of a readable socket. Any socket may be handled by any thread of
+		 * the reactor, so all the control frames are queued and then handled one thread at
+		 * a time by the threads that find some in the queue. */
+		private void socketReady(Object obj) {
+			ReceiveState state = (ReceiveState) obj;
+
+			/* The packets forwarded to the tunnels are sent together at the end */
+			int count = state.Socket.ReceiveBatch(state.Data, state.Offsets, state.Lengths);
+			PacketBatch.Begin();
+			try {
+				for (int i=0; i<count; i++) {
+					if (state.Lengths[i] < 14)
+						continue;
 
-			while (_running) {
-				/* If there are no incoming packets, simply continue */
-				if (!_socket.WaitForReadable())
-					continue;
+					handleFrame(state.Data, state.Offsets[i], state.Lengths[i], false);
+				}
+			} finally {
+				PacketBatch.End();
+			}
 
-				/* Read incoming packet and check its size */
-				int datalen = _socket.Receive(data);
-				if (datalen < 14)
-					continue;
+			bool pending;
+			lock (_controlQueue) {
+				pending = (_controlQueue.Count > 0);
+			}
+			if (pending) {
+				lock (_controlLock) {
+					handleQueuedControlFrames();
+				}
+			}
+		}
 
-				/* Read the Ethernet type of the packet */
-				int etherType = (data[12] << 8) | data[13];
-				if (etherType == ETHERTYPE_ARP) {
-					if (datalen < 22) {
-						/* XXX: Should too small ARP packet be reported? */
-						continue;
-					}
+		/* Handles one received Ethernet frame, control frames are only handled if control
+		 * is true and otherwise queued for the control worker. The control handlers expect
+		 * the frame at the start of the buffer, so frames of a batch are queued as well. */
+		private void handleFrame(byte[] data, int offset, int datalen, bool control) {
+			bool queue = (!control || offset != 0);
+
+			/* Read the Ethernet type of the packet */
+			int etherType = (data[offset+12] << 8) | data[offset+13];
+			if (etherType == ETHERTYPE_ARP) {
+				if (queue) {
+					queueControlFrame(data, offset, datalen);
+					return;
+				}
 
-					int opcode = (data[20] << 8) | data[21];
-					if (opcode == 1) {
-						handleARPRequest(data, datalen);
-					} else if (opcode == 2) {
-						handleARPReply(data, datalen);
-					} else if (opcode == 3 || opcode == 4) {
-						/* This is a RARP request not handled */
-					} else {
-						Console.WriteLine("Invalid ARP opcode: " + opcode);
-					}
+				if (datalen < 22) {
+					/* XXX: Should too small ARP packet be reported? */
+					return;
+				}
 
-					continue;
-				} else if (etherType == ETHERTYPE_IPv4) {
-					if (datalen < 14+20) {
-						/* XXX: Should too small IPv4 packet be reported? */
-						continue;
-					}
+				int opcode = (data[20] << 8) | data[21];
+				if (opcode == 1) {
+					handleARPRequest(data, datalen);
+				} else if (opcode == 2) {
+					handleARPReply(data, datalen);
+				} else if (opcode == 3 || opcode == 4) {
+					/* This is a RARP request not handled */
+				} else {
+					_log.Debug("Invalid ARP opcode: {0}", opcode);
+				}
 
-					/* Get destination address */
-					byte[] ipaddr = new byte[4];
-					Array.Copy(data, 26, ipaddr, 0, 4);
-					IPAddress dest = new IPAddress(ipaddr);
-
-					/* Check if the destination is multicast or broadcast */
-					bool multicast = (ipaddr[0] < 224 && ipaddr[0] > 239);
-					bool broadcast = (ipaddr[0] == 255 && ipaddr[1] == 255 &&
-					                  ipaddr[2] == 255 && ipaddr[3] == 255);
-
-					/* Check for DHCP UDP packet content (UDP protocol value 17) */
-					int dataidx = 14 + (data[14]&0x0f)*4;
-					if (data[14+9] == 17 && datalen >= dataidx+8) {
-						int srcPort = (data[dataidx] << 8) | data[dataidx+1];
-						int dstPort = (data[dataidx+2] << 8) | data[dataidx+3];
-
-						/* DHCP server port 67 and client port 68 */
-						if (srcPort == 67 && dstPort == 68) {
-							handleDHCPReply(data, dataidx+8, datalen);
-							continue;
+				return;
+			} else if (etherType == ETHERTYPE_IPv4) {
+				if (datalen < 14+20) {
+					/* XXX: Should too small IPv4 packet be reported? */
+					return;
+				}
+
+				/* Check if the destination at offset 30 is multicast or broadcast */
+				int dst = offset+30;
+				bool multicast = (data[dst] < 224 && data[dst] > 239);
+				bool broadcast = (data[dst] == 255 && data[dst+1] == 255 &&
+				                  data[dst+2] == 255 && data[dst+3] == 255);
+
+				/* Check for DHCP UDP packet content (UDP protocol value 17) */
+				int dataidx = 14 + (data[offset+14]&0x0f)*4;
+				if (data[offset+14+9] == 17 && datalen >= dataidx+8) {
+					int srcPort = (data[offset+dataidx] << 8) | data[offset+dataidx+1];
+					int dstPort = (data[offset+dataidx+2] << 8) | data[offset+dataidx+3];
+
+					/* DHCP server port 67 and client port 68 */
+					if (srcPort == 67 && dstPort == 68) {
+						if (queue) {
+							queueControlFrame(data, offset, datalen);
+							return;
 						}
+						handleDHCPReply(data, dataidx+8, datalen);
+						return;
 					}
+				}
 
-					if (!multicast && !broadcast && !addressInSubnets(dest)) {
-						/* Packet not destined to us */
-						continue;
+				if (!multicast && !broadcast && !addressInSubnets(data, dst, 4)) {
+					/* Packet not destined to us */
+					return;
+				}
+			} else if (etherType == ETHERTYPE_IPv6) {
+				if (datalen < 14+40) {
+					/* XXX: Should too small IPv6 packet be reported? */
+					return;
+				}
+
+				/* Check for ND packet, ICMPv6 next header value 58, hop limit 255 */
+				if (data[offset+14+6] == 58 && data[offset+14+7] == 255) {
+					if (datalen < 14+40+8) {
+						/* XXX: Should too small ICMPv6 packet be reported? */
+						return;
 					}
-				} else if (etherType == ETHERTYPE_IPv6) {
-					if (datalen < 14+40) {
-						/* XXX: Should too small IPv6 packet be reported? */
-						continue;
+
+					/* Valid ICMPv6 packet found */
+					int type = data[offset+14+40];
+
+					/* Control worker handles the recognized ND packet types */
+					if (type >= 134 && type <= 136 && queue) {
+						queueControlFrame(data, offset, datalen);
+						return;
 					}
 
-					/* Check for ND packet, ICMPv6 next header value 58, hop limit 255 */
-					if (data[14+6] == 58 && data[14+7] == 255) {
-						if (datalen < 14+40+8) {
-							/* XXX: Should too small ICMPv6 packet be reported? */
-							continue;
-						}
+					/* Handle and skip recognized ND packet types */
+					if (type == 133) {
+						/* XXX: Router solicitation, not handled */
+					} else if (type == 134) {
+						handleNDRouterAdv(data, datalen);
+						return;
+					} else if (type == 135) {
+						handleNDSol(data, datalen);
+						return;
+					} else if (type == 136) {
+						handleNDAdv(data, datalen);
+						return;
+					}
+				}
 
-						/* Valid ICMPv6 packet found */
-						int type = data[14+40];
+				/* Destination address at offset 38, multicast addresses are ff00::/8 */
+				if (data[offset+38] != 0xff && !addressInSubnets(data, offset+38, 16)) {
+					/* Packet not destined to us */
+					return;
+				}
+			} else {
+				/* Unknown protocol, skip packet */
+				return;
+			}
 
-						/* Handle and skip recognized ND packet types */
-						if (type == 133) {
-							/* XXX: Router solicitation, not handled */
-						} else if (type == 134) {
-							handleNDRouterAdv(data, datalen);
-							continue;
-						} else if (type == 135) {
-							handleNDSol(data, datalen);
-							continue;
-						} else if (type == 136) {
-							handleNDAdv(data, datalen);
-							continue;
-						}
+			if (_callback != null) {
+				/* Skip the 14 byte Ethernet header, the data is only
+				 * valid until the callback returns */
+				_callback(data, offset+14, datalen - 14);
+			}
+		}
+
+		private void queueControlFrame(byte[] data, int offset, int datalen) {
+			byte[] frame = new byte[datalen];
+			Array.Copy(data, offset, frame, 0, datalen);
+
+			lock (_controlQueue) {
+				if (_controlQueue.Count < MAX_CONTROL_QUEUED) {
+					_controlQueue.Enqueue(frame);
+				}
+			}
+		}
+
+		private void handleQueuedControlFrames() {
+			while (true) {
+				byte[] frame;
+				lock (_controlQueue) {
+					if (_controlQueue.Count == 0) {
+						return;
 					}
+					frame = _controlQueue.Dequeue();
+				}
 
-					/* Get destination address */
-					byte[] ipaddr = new byte[16];
-					Array.Copy(data, 38, ipaddr, 0, 16);
-					IPAddress addr = new IPAddress(ipaddr);
+				handleFrame(frame, 0, frame.Length, true);
+			}
+		}
 
-					if (!addr.IsIPv6Multicast && !addressInSubnets(addr)) {
-						/* Packet not destined to us */
-						continue;
+		private bool addressInSubnets(IPAddress addr) {
+			// XXX: If we ever use promiscuous mode, the last 3 bytes should be checked
+			return (_subnets.Lookup(addr) != null);
+		}
+
+		private bool addressInSubnets(byte[] data, int offset, int length) {
+			return (_subnets.Lookup(data, offset, length) != null);
+		}
+
+		/* Attaches a filter built from the current subnets to all the sockets. If that fails
+		 * the filters are removed, an outdated filter could drop frames to the new subnets. */
+		private void updateFilter() {
+			lock (_filterLock) {
+				List<RawSocket> sockets = new List<RawSocket>();
+				sockets.Add(_socket);
+				if (_workerSockets != null) {
+					sockets.AddRange(_workerSockets);
+				}
+
+				try {
+					BPF filter = buildFilter();
+					foreach (RawSocket socket in sockets) {
+						socket.SetFilter(filter);
 					}
-				} else {
-					/* Unknown protocol, skip packet */
+				} catch (Exception e) {
+					_log.Notice("Not using packet filter: {0}", e.Message);
+					foreach (RawSocket socket in sockets) {
+						try {
+							socket.SetFilter(null);
+						} catch (Exception) {}
+					}
+				}
+			}
+		}
+
+		/* Builds a filter accepting the same frames as handleFrame: ARP, DHCP replies, ND
+		 * router advertisements, solicitations and advertisements, IPv4 broadcast, IPv6
+		 * multicast and anything sent to the subnets. Conditional jumps are kept short and
+		 * long ones go through unconditional jumps, so any number of subnets fits. */
+		private BPF buildFilter() {
+			const UInt32 ACCEPT = 0x40000;
+
+			IPConfig[] subnets = _subnets.GetValues();
+			BPF filter = new BPF();
+
+			filter.Statement(BPF.LD|BPF.H|BPF.ABS, 12);
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, ETHERTYPE_ARP, null, "notarp");
+			filter.Statement(BPF.RET|BPF.K, ACCEPT);
+			filter.Label("notarp");
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, ETHERTYPE_IPv4, null, "notipv4");
+			filter.Jump("ipv4");
+			filter.Label("notipv4");
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, ETHERTYPE_IPv6, null, "drop");
+			filter.Jump("ipv6");
+			filter.Label("drop");
+			filter.Statement(BPF.RET|BPF.K, 0);
+
+			/* DHCP replies from port 67 to 68, fragments after the first have no ports */
+			filter.Label("ipv4");
+			filter.Statement(BPF.LD|BPF.B|BPF.ABS, 14+9);
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, 17, null, "ipv4dst");
+			filter.Statement(BPF.LD|BPF.H|BPF.ABS, 14+6);
+			filter.Jump(BPF.JMP|BPF.JSET|BPF.K, 0x1fff, "ipv4dst", null);
+			filter.Statement(BPF.LDX|BPF.B|BPF.MSH, 14);
+			filter.Statement(BPF.LD|BPF.H|BPF.IND, 14);
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, 67, null, "ipv4dst");
+			filter.Statement(BPF.LD|BPF.H|BPF.IND, 14+2);
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, 68, null, "ipv4dst");
+			filter.Statement(BPF.RET|BPF.K, ACCEPT);
+
+			/* Broadcast and the IPv4 subnets by the destination address at offset 30 */
+			filter.Label("ipv4dst");
+			filter.Statement(BPF.LD|BPF.W|BPF.ABS, 30);
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, 0xffffffff, null, "ipv4subnets");
+			filter.Statement(BPF.RET|BPF.K, ACCEPT);
+			filter.Label("ipv4subnets");
+			for (int i=0; i<subnets.Length; i++) {
+				byte[] prefix = subnets[i].Address.GetAddressBytes();
+				if (prefix.Length != 4) {
+					continue;
+				}
+
+				filter.Statement(BPF.LD|BPF.W|BPF.ABS, 30);
+				addPrefixWord(filter, prefix, 0, subnets[i].PrefixLength, "ipv4next" + i);
+				filter.Statement(BPF.RET|BPF.K, ACCEPT);
+				filter.Label("ipv4next" + i);
+			}
+			filter.Statement(BPF.RET|BPF.K, 0);
+
+			/* ND packets have next header ICMPv6 and hop limit 255 */
+			filter.Label("ipv6");
+			filter.Statement(BPF.LD|BPF.B|BPF.ABS, 14+6);
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, 58, null, "ipv6dst");
+			filter.Statement(BPF.LD|BPF.B|BPF.ABS, 14+7);
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, 255, null, "ipv6dst");
+			filter.Statement(BPF.LD|BPF.B|BPF.ABS, 14+40);
+			filter.Jump(BPF.JMP|BPF.JGE|BPF.K, 134, null, "ipv6dst");
+			filter.Jump(BPF.JMP|BPF.JGT|BPF.K, 136, "ipv6dst", null);
+			filter.Statement(BPF.RET|BPF.K, ACCEPT);
+
+			/* Multicast and the IPv6 subnets by the destination address at offset 38 */
+			filter.Label("ipv6dst");
+			filter.Statement(BPF.LD|BPF.B|BPF.ABS, 38);
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, 0xff, null, "ipv6subnets");
+			filter.Statement(BPF.RET|BPF.K, ACCEPT);
+			filter.Label("ipv6subnets");
+			for (int i=0; i<subnets.Length; i++) {
+				byte[] prefix = subnets[i].Address.GetAddressBytes();
+				if (prefix.Length != 16) {
 					continue;
 				}
 
-				if (_callback != null) {
-					/* Remove the 14 byte Ethernet header from data */
-					byte[] outbuf = new byte[data.Length - 14];
-					Array.Copy(data, 14, outbuf, 0, outbuf.Length);
-					_callback(outbuf);
+				for (int word=0; word*32 < subnets[i].PrefixLength; word++) {
+					filter.Statement(BPF.LD|BPF.W|BPF.ABS, (UInt32) (38 + word*4));
+					addPrefixWord(filter, prefix, word, subnets[i].PrefixLength, "ipv6next" + i);
 				}
+				filter.Statement(BPF.RET|BPF.K, ACCEPT);
+				filter.Label("ipv6next" + i);
 			}
+			filter.Statement(BPF.RET|BPF.K, 0);
+
+			return filter;
 		}
 
-		private bool addressInSubnets(IPAddress addr) {
-			foreach (IPConfig config in _subnets) {
-				if (config.AddressInSubnet(addr)) {
-					// XXX: If we ever use promiscuous mode, the last 3 bytes should be checked
-					return true;
-				}
+		/* Compares the loaded address word to the word of the prefix, jumping to next if the
+		 * address is outside of the prefix */
+		private static void addPrefixWord(BPF filter, byte[] prefix, int word, int prefixlen, string next) {
+			int bits = Math.Min(32, prefixlen - word*32);
+			if (bits <= 0) {
+				return;
 			}
 
-			return false;
+			UInt32 mask = (bits == 32) ? 0xffffffff : ~(0xffffffff >> bits);
+			UInt32 value = ((UInt32) prefix[word*4] << 24) | ((UInt32) prefix[word*4+1] << 16) |
+			               ((UInt32) prefix[word*4+2] << 8) | (UInt32) prefix[word*4+3];
+			if (mask != 0xffffffff) {
+				filter.Statement(BPF.ALU|BPF.AND|BPF.K, mask);
+			}
+			filter.Jump(BPF.JMP|BPF.JEQ|BPF.K, value & mask, null, next);
 		}
 
 		private int ICMPv6Checksum(byte[] data) {
@@ -670,7 +1081,7 @@ namespace Nabla {
 			data[21] = 0x02;
 
 			_socket.Send(data, datalen);
-			Console.WriteLine("Replied to ARP packet with IP {0}", addr);
+			_log.Debug("Replied to ARP packet with IP {0}", addr);
 		}
 
 		private void handleARPReply(byte[] data, int datalen) {
@@ -694,23 +1105,23 @@ namespace Nabla {
 				if (hwaddr[i] != _hwaddr[i]) {
 					break;
 				} else if (i == 5) {
-					Console.WriteLine("Local hardware address {0} not added to ARP table",
-						BitConverter.ToString(hwaddr).Replace('-', ':').ToLower());
+					if (_log.IsEnabled(LogLevel.Debug)) {
+						_log.Debug("Local hardware address {0} not added to ARP table",
+							BitConverter.ToString(hwaddr).Replace('-', ':').ToLower());
+					}
 					return;
 				}
 			}
 
-			lock (_arplock) {
-				if (_arptable.ContainsKey(addr)) {
-					Console.WriteLine("Hardware address for IP {0} already known", addr);
-					return;
-				}
-				_arptable.Add(addr, hwaddr);
-				Monitor.PulseAll(_arplock);
+			if (!_neighbors.Update(addr, hwaddr)) {
+				_log.Debug("Hardware address for IP {0} already known", addr);
+				return;
 			}
 
-			Console.WriteLine("Added hardware address {0} for IP address {1} into ARP table",
-				BitConverter.ToString(hwaddr).Replace('-', ':').ToLower(), addr);
+			if (_log.IsEnabled(LogLevel.Debug)) {
+				_log.Debug("Added hardware address {0} for IP address {1} into ARP table",
+					BitConverter.ToString(hwaddr).Replace('-', ':').ToLower(), addr);
+			}
 		}
 
 		private void sendDHCPDiscover() {
@@ -973,7 +1384,7 @@ namespace Nabla {
 			data[14+40+3] = (byte)  checksum;
 
 			_socket.Send(data, 14+40+length);
-			Console.WriteLine("Replied to Neighbor Solicitation with IP {0}", addr);
+			_log.Debug("Replied to Neighbor Solicitation with IP {0}", addr);
 		}
 
 		private void handleNDAdv(byte[] data, int datalen) {
@@ -997,24 +1408,23 @@ namespace Nabla {
 				if (hwaddr[i] != _hwaddr[i]) {
 					break;
 				} else if (i == 5) {
-					Console.WriteLine("Local hardware address {0} not added to ARP table",
-						BitConverter.ToString(hwaddr).Replace('-', ':').ToLower());
+					if (_log.IsEnabled(LogLevel.Debug)) {
+						_log.Debug("Local hardware address {0} not added to ARP table",
+							BitConverter.ToString(hwaddr).Replace('-', ':').ToLower());
+					}
 					return;
 				}
 			}
 
-			lock (_arplock) {
-				if (_arptable.ContainsKey(addr)) {
-					Console.WriteLine("Hardware address for IP {0} already known", addr);
-					return;
-				}
-
-				_arptable.Add(addr, hwaddr);
-				Monitor.PulseAll(_arplock);
+			if (!_neighbors.Update(addr, hwaddr)) {
+				_log.Debug("Hardware address for IP {0} already known", addr);
+				return;
 			}
 
-			Console.WriteLine("Added hardware address {0} for IP address {1} into ARP table",
-				BitConverter.ToString(hwaddr).Replace('-', ':').ToLower(), addr);
+			if (_log.IsEnabled(LogLevel.Debug)) {
+				_log.Debug("Added hardware address {0} for IP address {1} into ARP table",
+					BitConverter.ToString(hwaddr).Replace('-', ':').ToLower(), addr);
+			}
 		}
 	}
 }
@@ -0,0 +1,309 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+using System.Net.Sockets;
+using System.Threading;
+using System.Collections.Generic;
+using Nabla.Sockets;
+
+namespace Nabla {
+	/* Called when a registered socket has data to read, state is the object given to Register */
+	public delegate void ReadyCallback(Object state);
+
+	/* Waits for all the sockets of the server with one epoll descriptor and runs the callback
+	 * of a ready socket in one of a fixed number of worker threads. All the workers wait on
+	 * the same descriptor, a ready socket is returned to only one of them and not reported
+	 * again before its callback has returned, so a callback never runs in two threads at
+	 * once and doesn't need to read everything that is queued. Callbacks must not block.
+	 *
+	 * If the platform has no epoll or the socket has no descriptor, as with pcap, the socket
+	 * is waited for by a thread of its own that calls the callback in the same way. */
+	public class Reactor {
+		private static Logger _log = Logger.GetLogger("Reactor");
+
+		private const int WAITMS = 100;	// wait of the threads of sockets without epoll
+
+		private class Source {
+			public int Token;
+			public int Descriptor;	// -1 if the socket has a thread of its own
+			public Object Socket;
+			public ReadyCallback Callback;
+			public Object State;
+
+			public bool Busy;	// callback is running
+			public bool Removed;
+			public Thread Thread;
+		}
+
+		private EventPoll _poll = null;
+		private int _workers;
+		private Thread[] _threads = null;
+
+		private Object _runlock = new Object();
+		private volatile bool _running = false;
+
+		/* Registered sources by their token and by their socket, protected by _lock that
+		 * is also pulsed whenever a callback returns */
+		private Object _lock = new Object();
+		private Dictionary<int, Source> _tokens = new Dictionary<int, Source>();
+		private Dictionary<Object, Source> _sockets = new Dictionary<Object, Source>();
+		private int _nextToken = 0;
+
+		/* Source whose callback the current thread is running */
+		[ThreadStatic]
+		private static Source _current;
+
+		public Reactor(int workers) {
+			if (workers < 1) {
+				throw new Exception("Number of workers " + workers + " invalid");
+			}
+
+			_workers = workers;
+			try {
+				_poll = new EventPoll();
+			} catch (Exception e) {
+				_log.Notice("Using a thread per socket, event poll failed: {0}", e.Message);
+			}
+		}
+
+		public void Register(RawSocket socket, ReadyCallback callback, Object state) {
+			register(socket, socket.Descriptor, callback, state);
+		}
+
+		public void Register(Socket socket, ReadyCallback callback, Object state) {
+			int descriptor = -1;
+			if (Environment.OSVersion.Platform == PlatformID.Unix) {
+				descriptor = socket.Handle.ToInt32();
+			}
+
+			register(socket, descriptor, callback, state);
+		}
+
+		private void register(Object socket, int descriptor, ReadyCallback callback, Object state) {
+			Source source = new Source();
+			source.Descriptor = (_poll != null) ? descriptor : -1;
+			source.Socket = socket;
+			source.Callback = callback;
+			source.State = state;
+
+			lock (_lock) {
+				if (_sockets.ContainsKey(socket)) {
+					throw new Exception("Socket already registered to the reactor");
+				}
+
+				/* Tokens are never reused, a late event of a removed socket is ignored */
+				source.Token = _nextToken;
+				_nextToken = (_nextToken + 1) & 0x7fffffff;
+
+				if (source.Descriptor != -1) {
+					_poll.Add(source.Descriptor, source.Token);
+				}
+				_tokens.Add(source.Token, source);
+				_sockets.Add(socket, source);
+
+				if (source.Descriptor == -1 && _running) {
+					startSourceThread(source);
+				}
+			}
+		}
+
+		/* Removes the socket and waits until its callback has returned, unless called from
+		 * the callback itself. The socket can be closed after this returns. */
+		public void Unregister(Object socket) {
+			Source source;
+
+			lock (_lock) {
+				if (!_sockets.TryGetValue(socket, out source)) {
+					return;
+				}
+
+				_sockets.Remove(socket);
+				_tokens.Remove(source.Token);
+				source.Removed = true;
+
+				if (source.Descriptor != -1) {
+					try {
+						_poll.Remove(source.Descriptor);
+					} catch (Exception e) {
+						_log.Warning("{0}", e.Message);
+					}
+				}
+
+				while (source.Busy && _current != source) {
+					Monitor.Wait(_lock);
+				}
+			}
+
+			if (source.Thread != null && source.Thread != Thread.CurrentThread) {
+				source.Thread.Join();
+			}
+		}
+
+		public void Start() {
+			lock (_runlock) {
+				if (_running)
+					return;
+
+				_running = true;
+				if (_poll != null) {
+					_threads = new Thread[_workers];
+					for (int i=0; i<_threads.Length; i++) {
+						_threads[i] = new Thread(new ThreadStart(workerLoop));
+						_threads[i].Start();
+					}
+				}
+
+				lock (_lock) {
+					foreach (Source source in _sockets.Values) {
+						if (source.Descriptor == -1) {
+							startSourceThread(source);
+						}
+					}
+				}
+			}
+			_log.Info("Reactor started with {0} workers", (_poll != null) ? _workers : 0);
+		}
+
+		/* Stops all the threads, the sockets stay registered for the next start */
+		public void Stop() {
+			lock (_runlock) {
+				if (!_running)
+					return;
+
+				_running = false;
+				if (_poll != null) {
+					_poll.Wakeup();
+					foreach (Thread thread in _threads) {
+						thread.Join();
+					}
+					_threads = null;
+					_poll.Reset();
+				}
+
+				List<Thread> threads = new List<Thread>();
+				lock (_lock) {
+					foreach (Source source in _sockets.Values) {
+						if (source.Thread != null) {
+							threads.Add(source.Thread);
+							source.Thread = null;
+						}
+					}
+				}
+				foreach (Thread thread in threads) {
+					thread.Join();
+				}
+			}
+			_log.Info("Reactor stopped");
+		}
+
+		private void startSourceThread(Source source) {
+			source.Thread = new Thread(new ParameterizedThreadStart(sourceLoop));
+			source.Thread.Start(source);
+		}
+
+		/* Waits for the next ready socket, the wakeup of Stop is reported to all workers */
+		private void workerLoop() {
+			int[] tokens = new int[1];
+
+			while (_running) {
+				int count;
+				try {
+					count = _poll.Wait(tokens, -1);
+				} catch (Exception e) {
+					_log.Error("Reactor worker stopped: {0}", e.Message);
+					return;
+				}
+
+				if (count == 0 || tokens[0] == EventPoll.WAKEUP_TOKEN) {
+					continue;
+				}
+
+				Source source;
+				lock (_lock) {
+					if (!_tokens.TryGetValue(tokens[0], out source)) {
+						continue;
+					}
+					source.Busy = true;
+				}
+
+				dispatch(source);
+
+				lock (_lock) {
+					source.Busy = false;
+					if (!source.Removed) {
+						try {
+							_poll.Rearm(source.Descriptor, source.Token);
+						} catch (Exception e) {
+							_log.Warning("{0}", e.Message);
+						}
+					}
+					Monitor.PulseAll(_lock);
+				}
+			}
+		}
+
+		/* Thread loop of a socket that can't be waited for with epoll */
+		private void sourceLoop(Object state) {
+			Source source = (Source) state;
+
+			while (_running && !source.Removed) {
+				bool ready;
+				try {
+					if (source.Socket is RawSocket) {
+						ready = ((RawSocket) source.Socket).WaitForReadable();
+					} else {
+						ready = ((Socket) source.Socket).Poll(WAITMS*1000, SelectMode.SelectRead);
+					}
+				} catch (Exception e) {
+					_log.Error("Error waiting for socket: {0}", e.Message);
+					return;
+				}
+
+				if (!ready) {
+					continue;
+				}
+
+				lock (_lock) {
+					if (source.Removed) {
+						return;
+					}
+					source.Busy = true;
+				}
+
+				dispatch(source);
+
+				lock (_lock) {
+					source.Busy = false;
+					Monitor.PulseAll(_lock);
+				}
+			}
+		}
+
+		private void dispatch(Source source) {
+			_current = source;
+			try {
+				source.Callback(source.State);
+			} catch (Exception e) {
+				_log.Error("Error handling socket: {0}", e);
+			} finally {
+				_current = null;
+			}
+		}
+	}
+}
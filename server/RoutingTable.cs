@@ -0,0 +1,244 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+using System.Net;
+using System.Net.Sockets;
+using System.Collections.Generic;
+
+namespace Nabla {
+	/* Longest prefix match table for IPv4 and IPv6 addresses. Both
+	 * families use a trie with a stride of one byte, where each node
+	 * has 256 entries and a prefix that doesn't end on a byte boundary
+	 * is expanded to all the entries it covers. A lookup reads at most
+	 * one node per address byte, so four for IPv4 and sixteen for IPv6,
+	 * and doesn't allocate memory.
+	 *
+	 * Lookups don't take locks. Changes are rare, so each change builds
+	 * new tries from the list of routes and replaces the old ones. */
+	public class RoutingTable<T> where T : class {
+		private class Route {
+			public byte[] Prefix;
+			public int PrefixLength;
+			public T Value;
+		}
+
+		private class Node {
+			public T[] Values = new T[256];
+			public int[] Lengths = new int[256];
+			public Node[] Children = new Node[256];
+		}
+
+		/* Root of a trie and the value of the zero length prefix */
+		private class Trie {
+			public Node Root = new Node();
+			public T Default = null;
+		}
+
+		private Object _lock = new Object();
+		private List<Route> _routes = new List<Route>();
+		private volatile Trie _ipv4 = new Trie();
+		private volatile Trie _ipv6 = new Trie();
+
+		public RoutingTable() {
+		}
+
+		public int Count {
+			get {
+				lock (_lock) {
+					return _routes.Count;
+				}
+			}
+		}
+
+		/* Adds a route or replaces the value of an existing one, the bits
+		 * of prefix after prefixlen are ignored */
+		public void Add(IPAddress prefix, int prefixlen, T value) {
+			if (value == null) {
+				throw new ArgumentNullException("value");
+			}
+
+			byte[] bytes = prefix.GetAddressBytes();
+			if (prefixlen < 0 || prefixlen > bytes.Length*8) {
+				throw new Exception("Prefix length " + prefixlen + " invalid for family " + prefix.AddressFamily);
+			}
+
+			lock (_lock) {
+				int index = findRoute(bytes, prefixlen);
+				if (index >= 0) {
+					_routes[index].Value = value;
+				} else {
+					Route route = new Route();
+					route.Prefix = bytes;
+					route.PrefixLength = prefixlen;
+					route.Value = value;
+					_routes.Add(route);
+				}
+				rebuild(bytes.Length);
+			}
+		}
+
+		public bool Contains(IPAddress prefix, int prefixlen) {
+			lock (_lock) {
+				return (findRoute(prefix.GetAddressBytes(), prefixlen) >= 0);
+			}
+		}
+
+		/* Removes a route, returns false if it wasn't found */
+		public bool Remove(IPAddress prefix, int prefixlen) {
+			byte[] bytes = prefix.GetAddressBytes();
+
+			lock (_lock) {
+				int index = findRoute(bytes, prefixlen);
+				if (index < 0) {
+					return false;
+				}
+
+				_routes.RemoveAt(index);
+				rebuild(bytes.Length);
+				return true;
+			}
+		}
+
+		public void Clear() {
+			lock (_lock) {
+				_routes.Clear();
+				_ipv4 = new Trie();
+				_ipv6 = new Trie();
+			}
+		}
+
+		/* Returns the values of all the routes in the order they were added */
+		public T[] GetValues() {
+			lock (_lock) {
+				T[] values = new T[_routes.Count];
+				for (int i=0; i<_routes.Count; i++) {
+					values[i] = _routes[i].Value;
+				}
+				return values;
+			}
+		}
+
+		/* Returns the value of the longest matching route or null */
+		public T Lookup(IPAddress addr) {
+			byte[] bytes = addr.GetAddressBytes();
+			return Lookup(bytes, 0, bytes.Length);
+		}
+
+		/* Same as above, but reads the address of length 4 (IPv4) or 16
+		 * (IPv6) bytes directly from a buffer, for example a packet */
+		public T Lookup(byte[] data, int offset, int length) {
+			Trie trie;
+			if (length == 4) {
+				trie = _ipv4;
+			} else if (length == 16) {
+				trie = _ipv6;
+			} else {
+				return null;
+			}
+
+			T best = trie.Default;
+			Node node = trie.Root;
+			for (int i=0; i<length && node != null; i++) {
+				int b = data[offset+i];
+				if (node.Values[b] != null) {
+					best = node.Values[b];
+				}
+				node = node.Children[b];
+			}
+
+			return best;
+		}
+
+		/* Called with _lock held */
+		private int findRoute(byte[] prefix, int prefixlen) {
+			for (int i=0; i<_routes.Count; i++) {
+				Route route = _routes[i];
+				if (route.Prefix.Length == prefix.Length &&
+				    route.PrefixLength == prefixlen &&
+				    prefixEquals(route.Prefix, prefix, prefixlen)) {
+					return i;
+				}
+			}
+
+			return -1;
+		}
+
+		private static bool prefixEquals(byte[] b1, byte[] b2, int prefixlen) {
+			for (int i=0; i<prefixlen/8; i++) {
+				if (b1[i] != b2[i]) {
+					return false;
+				}
+			}
+
+			if (prefixlen%8 != 0) {
+				int mask = (0xff << (8 - prefixlen%8)) & 0xff;
+				if ((b1[prefixlen/8] & mask) != (b2[prefixlen/8] & mask)) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		/* Called with _lock held, builds the trie of one family */
+		private void rebuild(int addrlen) {
+			Trie trie = new Trie();
+
+			foreach (Route route in _routes) {
+				if (route.Prefix.Length != addrlen) {
+					continue;
+				}
+
+				if (route.PrefixLength == 0) {
+					trie.Default = route.Value;
+					continue;
+				}
+
+				/* Walk to the node of the last byte of the prefix */
+				int depth = (route.PrefixLength-1)/8;
+				Node node = trie.Root;
+				for (int i=0; i<depth; i++) {
+					int b = route.Prefix[i];
+					if (node.Children[b] == null) {
+						node.Children[b] = new Node();
+					}
+					node = node.Children[b];
+				}
+
+				/* Expand the remaining bits to all the entries they cover,
+				 * without overwriting entries of longer prefixes */
+				int bits = route.PrefixLength - depth*8;
+				int first = route.Prefix[depth] & ((0xff << (8-bits)) & 0xff);
+				int count = 1 << (8-bits);
+				for (int i=first; i<first+count; i++) {
+					if (node.Values[i] == null || node.Lengths[i] <= route.PrefixLength) {
+						node.Values[i] = route.Value;
+						node.Lengths[i] = route.PrefixLength;
+					}
+				}
+			}
+
+			if (addrlen == 4) {
+				_ipv4 = trie;
+			} else {
+				_ipv6 = trie;
+			}
+		}
+	}
+}
@@ -25,6 +25,8 @@ namespace Nabla {
 	public delegate string SASLAuthCallback(string username);
 
 	public class SASLAuth {
+		private static Logger _log = Logger.GetLogger("SASLAuth");
+
 		/* List to keep track of currently used method */
 		private enum SASLMethod {
 			Unsupported,
@@ -208,7 +210,7 @@ namespace Nabla {
 					return rspauth;
 				}
 			} catch (Exception e) {
-				Console.WriteLine(e);
+				_log.Warning("Error parsing challenge response: {0}", e);
 			}
 
 			_finished = true;
@@ -0,0 +1,126 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System;
+
+namespace Nabla {
+	/* SHA1 that writes the digest into a buffer given by the caller, so
+	 * hashing a packet doesn't allocate like HashAlgorithm.ComputeHash.
+	 * An instance can be reused, but not by several threads at once. */
+	public class SHA1Digest {
+		public const int Length = 20;
+
+		private UInt32[] _state = new UInt32[5];
+		private UInt32[] _w = new UInt32[80];
+		private byte[] _block = new byte[64];
+
+		/* Hashes length bytes of data and writes the digest at digestOffset,
+		 * which may be inside the hashed data since it is written last */
+		public void Compute(byte[] data, int offset, int length, byte[] digest, int digestOffset) {
+			_state[0] = 0x67452301;
+			_state[1] = 0xefcdab89;
+			_state[2] = 0x98badcfe;
+			_state[3] = 0x10325476;
+			_state[4] = 0xc3d2e1f0;
+
+			int end = offset + length;
+			int pos = offset;
+			while (end - pos >= 64) {
+				transform(data, pos);
+				pos += 64;
+			}
+
+			/* Pad the rest with a one bit, zeros and the length in bits */
+			int rest = end - pos;
+			Array.Copy(data, pos, _block, 0, rest);
+			_block[rest++] = 0x80;
+			if (rest > 56) {
+				Array.Clear(_block, rest, 64 - rest);
+				transform(_block, 0);
+				rest = 0;
+			}
+			Array.Clear(_block, rest, 56 - rest);
+
+			UInt64 bits = (UInt64) length << 3;
+			for (int i=0; i<8; i++) {
+				_block[63-i] = (byte) (bits >> (i*8));
+			}
+			transform(_block, 0);
+
+			for (int i=0; i<5; i++) {
+				digest[digestOffset+i*4]   = (byte) (_state[i] >> 24);
+				digest[digestOffset+i*4+1] = (byte) (_state[i] >> 16);
+				digest[digestOffset+i*4+2] = (byte) (_state[i] >> 8);
+				digest[digestOffset+i*4+3] = (byte) (_state[i]);
+			}
+		}
+
+		private static UInt32 rotl(UInt32 value, int bits) {
+			return (value << bits) | (value >> (32 - bits));
+		}
+
+		private void transform(byte[] data, int offset) {
+			UInt32[] w = _w;
+
+			for (int i=0; i<16; i++) {
+				int p = offset + i*4;
+				w[i] = (UInt32) ((data[p] << 24) | (data[p+1] << 16) |
+				                 (data[p+2] << 8) | data[p+3]);
+			}
+			for (int i=16; i<80; i++) {
+				w[i] = rotl(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+			}
+
+			UInt32 a = _state[0];
+			UInt32 b = _state[1];
+			UInt32 c = _state[2];
+			UInt32 d = _state[3];
+			UInt32 e = _state[4];
+
+			for (int i=0; i<80; i++) {
+				UInt32 f, k;
+				if (i < 20) {
+					f = (b & c) | (~b & d);
+					k = 0x5a827999;
+				} else if (i < 40) {
+					f = b ^ c ^ d;
+					k = 0x6ed9eba1;
+				} else if (i < 60) {
+					f = (b & c) | (b & d) | (c & d);
+					k = 0x8f1bbcdc;
+				} else {
+					f = b ^ c ^ d;
+					k = 0xca62c1d6;
+				}
+
+				UInt32 temp = rotl(a, 5) + f + e + k + w[i];
+				e = d;
+				d = c;
+				c = rotl(b, 30);
+				b = a;
+				a = temp;
+			}
+
+			_state[0] += a;
+			_state[1] += b;
+			_state[2] += c;
+			_state[3] += d;
+			_state[4] += e;
+		}
+	}
+}
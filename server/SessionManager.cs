@@ -25,18 +25,42 @@ using System.Security.Cryptography;
 
 namespace Nabla {
 	public class SessionManager {
+		private static Logger _log = Logger.GetLogger("SessionManager");
+
 		private Object _runlock = new Object();
 		private bool _running;
 
 		private List<InputDevice> _inputDevices = new List<InputDevice>();
 		private List<OutputDevice> _outputDevices = new List<OutputDevice>();
 
+		/* Receives from the sockets of all the devices with a fixed number of threads */
+		private Reactor _reactor = new Reactor(Math.Max(2, Environment.ProcessorCount));
+
+		/* Output device for each destination, the connected subnet of a
+		 * device and the default routes of the first device added */
+		private RoutingTable<OutputDevice> _routes = new RoutingTable<OutputDevice>();
+
+		/* Tunnel ids are dense and at most 24 bits, so the sessions are
+		 * kept in an array indexed by the id. Packets look up sessions
+		 * without locking, writers hold _sessionlock and replace the whole
+		 * array when it has to grow, so readers never see a partial copy. */
+		private const Int64 MAX_TUNNEL_ID = 0xffffff;
+		private const int INITIAL_CAPACITY = 1024;
+
 		private Object _sessionlock = new Object();
-		private Dictionary<Int64, TunnelSession> _sessions = new Dictionary<Int64, TunnelSession>();
+		private volatile TunnelSession[] _sessions = new TunnelSession[INITIAL_CAPACITY];
+
+		/* IPv6 local address of the first output device that has one */
+		private byte[] _ipv6LocalBytes = null;
 
 		public SessionManager() {
 		}
 
+		/* Devices register their sockets here when started */
+		public Reactor Reactor {
+			get { return _reactor; }
+		}
+
 		public void AddInputDevice(InputDevice dev) {
 			lock (_runlock) {
 				if (_running) {
@@ -62,13 +86,38 @@ namespace Nabla {
 		}
 
 		public void AddOutputDevice(string deviceName, bool ipv4, bool ipv6) {
-			OutputDeviceCallback callback = new OutputDeviceCallback(packetFromOutputDevice);
+			AddOutputDevice(deviceName, ipv4, ipv6, 1);
+		}
+
+		/* Workers is the number of threads receiving packets from the device,
+		 * PacketFromOutputDevice is called from all of them */
+		public void AddOutputDevice(string deviceName, bool ipv4, bool ipv6, int workers) {
+			OutputDeviceCallback callback = new OutputDeviceCallback(PacketFromOutputDevice);
 			lock (_runlock) {
 				if (_running) {
 					throw new Exception("Can't add devices while running, stop the manager first");
 				}
 
-				_outputDevices.Add(new OutputDevice(deviceName, ipv4, ipv6, callback));
+				OutputDevice dev = new OutputDevice(deviceName, ipv4, ipv6, workers, _reactor, callback);
+				_outputDevices.Add(dev);
+				if (_ipv6LocalBytes == null && dev.IPv6LocalAddress != null) {
+					_ipv6LocalBytes = dev.IPv6LocalAddress.GetAddressBytes();
+				}
+				addRoutes(dev, dev.IPv4Route, IPAddress.Any);
+				addRoutes(dev, dev.IPv6Route, IPAddress.IPv6Any);
+			}
+		}
+
+		private void addRoutes(OutputDevice dev, IPConfig route, IPAddress any) {
+			if (route == null) {
+				return;
+			}
+
+			if (!_routes.Contains(route.Address, route.PrefixLength)) {
+				_routes.Add(route.Address, route.PrefixLength, dev);
+			}
+			if (!_routes.Contains(any, 0)) {
+				_routes.Add(any, 0, dev);
 			}
 		}
 
@@ -76,30 +125,69 @@ namespace Nabla {
 			if (session == null) {
 				return;
 			}
+			if (session.TunnelId <= 0 || session.TunnelId > MAX_TUNNEL_ID) {
+				throw new Exception("Tunnel id " + session.TunnelId + " out of range");
+			}
 
-			_sessions[session.TunnelId] = session;
+			lock (_sessionlock) {
+				TunnelSession[] sessions = _sessions;
+				if (session.TunnelId >= sessions.Length) {
+					int capacity = sessions.Length;
+					while (capacity <= session.TunnelId) {
+						capacity *= 2;
+					}
+
+					TunnelSession[] grown = new TunnelSession[capacity];
+					Array.Copy(sessions, grown, sessions.Length);
+					sessions = grown;
+				}
+
+				/* Filled before publishing, readers see the new array only
+				 * after the volatile write below */
+				sessions[session.TunnelId] = session;
+				_sessions = sessions;
+			}
 		}
 
-		public Int64 TunnelIdFromAddress(IPAddress remoteAddress) {
-			Int64 tunnelId = 0;
+		private TunnelSession lookupSession(Int64 tunnelId) {
+			TunnelSession[] sessions = _sessions;
+			if (tunnelId <= 0 || tunnelId >= sessions.Length) {
+				return null;
+			}
 
-			if (remoteAddress.AddressFamily == AddressFamily.InterNetwork) {
-				byte[] addrBytes = remoteAddress.GetAddressBytes();
+			return sessions[tunnelId];
+		}
 
-				tunnelId += (Int64) (addrBytes[1] << 14);
-				tunnelId += (Int64) (addrBytes[2] << 6);
-				tunnelId += (Int64) ((addrBytes[3]&0xfc) >> 2);
-			} else if (remoteAddress.AddressFamily == AddressFamily.InterNetworkV6) {
-				byte[] addrBytes = remoteAddress.GetAddressBytes();
+		/* Tunnel id encoded in the address bytes at offset, length is 4 for
+		 * IPv4 and 16 for IPv6 addresses. Returns -1 for other lengths. */
+		private static Int64 addressToTunnelId(byte[] addr, int offset, int length) {
+			Int64 tunnelId = 0;
 
-				tunnelId += (Int64) (addrBytes[10] << 16);
-				tunnelId += (Int64) (addrBytes[11] << 8);
-				tunnelId += (Int64) (addrBytes[12]);
+			if (length == 4) {
+				tunnelId += (Int64) (addr[offset+1] << 14);
+				tunnelId += (Int64) (addr[offset+2] << 6);
+				tunnelId += (Int64) ((addr[offset+3]&0xfc) >> 2);
+			} else if (length == 16) {
+				tunnelId += (Int64) (addr[offset+10] << 16);
+				tunnelId += (Int64) (addr[offset+11] << 8);
+				tunnelId += (Int64) (addr[offset+12]);
 			} else {
 				return -1;
 			}
 
-			if (!_sessions.ContainsKey(tunnelId)) {
+			return tunnelId;
+		}
+
+		public Int64 TunnelIdFromAddress(IPAddress remoteAddress) {
+			byte[] addrBytes = remoteAddress.GetAddressBytes();
+			return TunnelIdFromAddress(addrBytes, 0, addrBytes.Length);
+		}
+
+		/* Same as above for an address inside a packet buffer, used on the
+		 * packet path as it doesn't allocate */
+		public Int64 TunnelIdFromAddress(byte[] addr, int offset, int length) {
+			Int64 tunnelId = addressToTunnelId(addr, offset, length);
+			if (lookupSession(tunnelId) == null) {
 				return -1;
 			}
 
@@ -111,23 +199,35 @@ namespace Nabla {
 		}
 
 		public void UpdateSession(Int64 tunnelId, IPEndPoint endPoint) {
-			if (tunnelId <= 0 || !_sessions.ContainsKey(tunnelId)) {
+			TunnelSession session = lookupSession(tunnelId);
+			if (session == null) {
 				return;
 			}
 
-			TunnelSession session = _sessions[tunnelId];
 			session.EndPoint = endPoint;
 			// XXX: Update the last alive
 		}
 
+		public TunnelSession GetSession(Int64 tunnelId) {
+			return lookupSession(tunnelId);
+		}
+
 		public IPEndPoint GetSessionEndPoint(Int64 tunnelId) {
-			// XXX: Check that the session exists
-			return _sessions[tunnelId].EndPoint;
+			TunnelSession session = lookupSession(tunnelId);
+			if (session == null) {
+				return null;
+			}
+
+			return session.EndPoint;
 		}
 
 		public string GetSessionPassword(Int64 tunnelId) {
-			// XXX: Check that the session exists
-			return _sessions[tunnelId].Password;
+			TunnelSession session = lookupSession(tunnelId);
+			if (session == null) {
+				return null;
+			}
+
+			return session.Password;
 		}
 
 		public bool IPv4IsAvailable {
@@ -171,6 +271,31 @@ namespace Nabla {
 			return new IPAddress(addrBytes);
 		}
 
+		/* Writes the local address of the tunnel at offset without allocating, for
+		 * the packet path. Returns the length of the address or 0 if there is none. */
+		public int GetTunnelLocalAddressBytes(Int64 tunnelId, bool ipv6, byte[] buffer, int offset) {
+			if (ipv6) {
+				byte[] localBytes = _ipv6LocalBytes;
+				if (localBytes == null) {
+					return 0;
+				}
+
+				Array.Copy(localBytes, 0, buffer, offset, localBytes.Length);
+				return localBytes.Length;
+			}
+
+			if (tunnelId > 0x3fffff) {
+				return 0;
+			}
+
+			/* Same as GetIPv4TunnelLocalAddress */
+			buffer[offset]   = 10;
+			buffer[offset+1] = (byte) ((tunnelId >> 14) & 0xff);
+			buffer[offset+2] = (byte) ((tunnelId >>  6) & 0xff);
+			buffer[offset+3] = (byte) (((tunnelId <<  2) & 0xfc) | 0x01);
+			return 4;
+		}
+
 		public bool IPv6IsAvailable {
 			get {
 				IPAddress localAddress = null;
@@ -229,6 +354,7 @@ namespace Nabla {
 					return;
 				}
 
+				_reactor.Start();
 				foreach (InputDevice dev in _inputDevices) {
 					dev.Start();
 				}
@@ -251,21 +377,49 @@ namespace Nabla {
 				foreach (OutputDevice dev in _outputDevices) {
 					dev.Stop();
 				}
+				_reactor.Stop();
 				_running = false;
 			}
 		}
 
+		/* Logs the NAT mapping and port counts of the output devices, called
+		 * periodically by the server */
+		public void LogStatistics() {
+			foreach (OutputDevice dev in _outputDevices) {
+				NATMapper mapper = dev.Mapper;
+				_log.Info("NAT mappings of {0}: {1} active, {2} reaped, {3} reaped/s",
+				          dev.DeviceName, mapper.Count, mapper.Reaped,
+				          mapper.ReapRate.ToString("F2"));
+
+				/* Ports of each external address, exhaustion means that
+				 * new connections had to use another address or failed */
+				foreach (NATPortPool pool in mapper.GetPortPools()) {
+					if (pool.Exhausted > 0) {
+						_log.Warning("NAT ports of {0} for {1}: {2} used, exhausted {3} times",
+						             pool.Address, pool.Protocol, pool.Used, pool.Exhausted);
+					} else {
+						_log.Info("NAT ports of {0} for {1}: {2} used",
+						          pool.Address, pool.Protocol, pool.Used);
+					}
+				}
+			}
+		}
+
 		/* Incoming packet from an InputDevice.
 		 * data - actual packet bytes
 		 * offset - offset where the actual data of the packet begins
-		 * length - length of the data in bytes */
+		 * length - length of the data in bytes
+		 *
+		 * The packet is passed on without copying, so the data is only
+		 * valid until this method returns. No memory is allocated. */
 		public void PacketFromInputDevice(InputDevice source, byte[] data, int offset, int length) {
 			if (offset+length > data.Length) {
 				/* Not enough data to work on */
 				return;
 			}
 
-			IPAddress sourceAddress;
+			Int64 tunnelId;
+			OutputDevice dev;
 			int version = ((data[offset]&0xff) >> 4);
 			if (version == 4) {
 				if (length < 20) {
@@ -273,54 +427,47 @@ namespace Nabla {
 					return;
 				}
 
-				byte[] ipaddr = new byte[4];
-				Array.Copy(data, offset+12, ipaddr, 0, 4);
-				sourceAddress = new IPAddress(ipaddr);
+				tunnelId = addressToTunnelId(data, offset+12, 4);
+				dev = _routes.Lookup(data, offset+16, 4);
 			} else if (version == 6) {
 				if (length < 40) {
 					/* Not enough bytes for IPv6 header */
 					return;
 				}
 
-				byte[] ipaddr = new byte[16];
-				Array.Copy(data, offset+8, ipaddr, 0, 16);
-				sourceAddress = new IPAddress(ipaddr);
+				tunnelId = addressToTunnelId(data, offset+8, 16);
+				dev = _routes.Lookup(data, offset+24, 16);
 			} else {
 				/* Unknown protocol version */
 				return;
 			}
 
-			Int64 tunnelId = TunnelIdFromAddress(sourceAddress);
-			Console.WriteLine("Got tunnel id " + tunnelId + " for source " + sourceAddress);
-			if (tunnelId < 0) {
+			if (lookupSession(tunnelId) == null || dev == null) {
 				return;
 			}
 
 			// XXX: Should check if the session is alive
 
-			byte[] outdata = new byte[length];
-			Array.Copy(data, offset, outdata, 0, length);
-
-			foreach (OutputDevice dev in _outputDevices) {
-				try {
-					dev.SendPacket(outdata);
-				} catch (Exception e) {
-					Console.WriteLine("Exception sending packet: " + e);
-				}
+			try {
+				dev.SendPacket(data, offset, length);
+			} catch (Exception e) {
+				_log.Error("Exception sending packet: {0}", e);
 			}
 		}
 
 		/* Incoming packet from an OutputDevice.
 		 * data - actual packet bytes
 		 * offset - offset where the actual data of the packet begins
-		 * length - length of the data in bytes */
-		private void packetFromOutputDevice(OutputDevice source, byte[] data, int offset, int length) {
+		 * length - length of the data in bytes
+		 *
+		 * Like PacketFromInputDevice, doesn't copy or allocate. */
+		public void PacketFromOutputDevice(OutputDevice source, byte[] data, int offset, int length) {
 			if (offset+length > data.Length) {
 				/* Not enough data to work on */
 				return;
 			}
 
-			IPAddress destination;
+			Int64 tunnelId;
 			int version = ((data[offset]&0xff) >> 4);
 			if (version == 4) {
 				if (length < 20) {
@@ -329,9 +476,7 @@ namespace Nabla {
 				}
 				length = data[offset+2]*256 + data[offset+3];
 
-				byte[] ipaddr = new byte[4];
-				Array.Copy(data, offset+16, ipaddr, 0, 4);
-				destination = new IPAddress(ipaddr);
+				tunnelId = addressToTunnelId(data, offset+16, 4);
 			} else if (version == 6) {
 				if (length < 40) {
 					/* Not enough bytes for IPv6 header */
@@ -339,9 +484,7 @@ namespace Nabla {
 				}
 				length = 40 + data[offset+4]*256 + data[offset+5];
 
-				byte[] ipaddr = new byte[16];
-				Array.Copy(data, offset+24, ipaddr, 0, 16);
-				destination = new IPAddress(ipaddr);
+				tunnelId = addressToTunnelId(data, offset+24, 16);
 			} else {
 				/* Unknown protocol version */
 				return;
@@ -352,28 +495,19 @@ namespace Nabla {
 				return;
 			}
 
-			Int64 tunnelId = TunnelIdFromAddress(destination);
-			Console.WriteLine("Got tunnel id " + tunnelId + " for destination " + destination);
-			if (tunnelId < 0) {
-				return;
-			}
-
-			if (!_sessions.ContainsKey(tunnelId)) {
+			TunnelSession session = lookupSession(tunnelId);
+			if (session == null) {
 				return;
 			}
 
 			// XXX: Should check if the session is alive
-			byte[] outdata = new byte[length];
-			Array.Copy(data, offset, outdata, 0, length);
 
-			TunnelSession session = _sessions[tunnelId];
 			foreach (InputDevice dev in _inputDevices) {
 				if (dev.GetSupportedType() == session.TunnelType) {
-					dev.SendPacket(tunnelId, outdata, 0, outdata.Length);
+					dev.SendPacket(tunnelId, data, offset, length);
 					break;
 				}
 			}
 		}
-
 	}
 }
@@ -0,0 +1,135 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+using System;
+using System.Runtime.InteropServices;
+
+namespace Nabla.Sockets {
+	/* Waits for any number of descriptors to become readable with epoll. A descriptor that
+	 * is returned from Wait is disabled until it is rearmed, so several threads can wait
+	 * at the same time and each ready descriptor is returned to only one of them. Only
+	 * supported by librawsock on Linux, the constructor throws on other platforms. */
+	public class EventPoll : IDisposable {
+		/* Token returned by Wait after Wakeup was called */
+		public const int WAKEUP_TOKEN = -1;
+
+		private bool _disposed = false;
+		private IntPtr _poll;
+
+		[DllImport("rawsock")]
+		private static extern IntPtr rawsock_poll_init(ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_poll_add(IntPtr poll, int fd, int token, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_poll_rearm(IntPtr poll, int fd, int token, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_poll_remove(IntPtr poll, int fd, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_poll_wait(IntPtr poll, int[] tokens, int maxtokens, int waitms, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_poll_wakeup(IntPtr poll, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_poll_reset(IntPtr poll, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern void rawsock_poll_destroy(IntPtr poll);
+
+		[DllImport("rawsock")]
+		private static extern string rawsock_strerror(int errno);
+
+		public EventPoll() {
+			int errno = 0;
+
+			_poll = rawsock_poll_init(ref errno);
+			if (_poll == IntPtr.Zero) {
+				throw new Exception("Error initializing event poll: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+		}
+
+		/* Adds a descriptor that is returned as token when readable */
+		public void Add(int fd, int token) {
+			int errno = 0;
+
+			if (rawsock_poll_add(_poll, fd, token, ref errno) == -1) {
+				throw new Exception("Error adding descriptor to event poll: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+		}
+
+		/* Enables a descriptor returned from Wait again */
+		public void Rearm(int fd, int token) {
+			int errno = 0;
+
+			if (rawsock_poll_rearm(_poll, fd, token, ref errno) == -1) {
+				throw new Exception("Error rearming descriptor in event poll: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+		}
+
+		public void Remove(int fd) {
+			int errno = 0;
+
+			if (rawsock_poll_remove(_poll, fd, ref errno) == -1) {
+				throw new Exception("Error removing descriptor from event poll: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+		}
+
+		/* Stores the tokens of the ready descriptors, returns their number or 0 if waitms
+		 * passed first. A negative waitms waits until something is ready. */
+		public int Wait(int[] tokens, int waitms) {
+			int errno = 0;
+
+			int ret = rawsock_poll_wait(_poll, tokens, tokens.Length, waitms, ref errno);
+			if (ret == -1) {
+				throw new Exception("Error waiting for event poll: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+
+			return ret;
+		}
+
+		/* Makes all the current and future waits return WAKEUP_TOKEN until Reset */
+		public void Wakeup() {
+			int errno = 0;
+
+			if (rawsock_poll_wakeup(_poll, ref errno) == -1) {
+				throw new Exception("Error waking up event poll: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+		}
+
+		public void Reset() {
+			int errno = 0;
+
+			if (rawsock_poll_reset(_poll, ref errno) == -1) {
+				throw new Exception("Error resetting event poll: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+		}
+
+		public void Dispose() {
+			Dispose(true);
+			GC.SuppressFinalize(this);
+		}
+
+		protected virtual void Dispose(bool disposing) {
+			if (!_disposed) {
+				rawsock_poll_destroy(_poll);
+				_disposed = true;
+			}
+		}
+	}
+}
@@ -0,0 +1,137 @@
+/**
+ *  Nabla - Automatic IP Tunneling and Connectivity
+ *  Copyright (C) 2009-2010  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+using System;
+using System.Collections.Generic;
+
+namespace Nabla.Sockets {
+	/* Builder for classic BPF programs that the kernel runs on every frame
+	 * before it is queued to a raw socket. Jumps refer to labels that are
+	 * resolved when the program is compiled, conditional jumps can only go
+	 * 255 instructions forward so longer ones need an unconditional jump. */
+	public class PacketFilter {
+		/* Instruction classes, sizes, modes and operations, see linux/filter.h */
+		public const int LD   = 0x00;
+		public const int LDX  = 0x01;
+		public const int ALU  = 0x04;
+		public const int JMP  = 0x05;
+		public const int RET  = 0x06;
+
+		public const int W    = 0x00;
+		public const int H    = 0x08;
+		public const int B    = 0x10;
+		public const int ABS  = 0x20;
+		public const int IND  = 0x40;
+		public const int MSH  = 0xa0;
+
+		public const int AND  = 0x50;
+		public const int JA   = 0x00;
+		public const int JEQ  = 0x10;
+		public const int JGT  = 0x20;
+		public const int JGE  = 0x30;
+		public const int JSET = 0x40;
+		public const int K    = 0x00;
+
+		/* Longest program accepted by the kernel */
+		public const int MAX_INSTRUCTIONS = 4096;
+
+		private class Instruction {
+			public int Code;
+			public string True;
+			public string False;
+			public UInt32 K;
+		}
+
+		private List<Instruction> _code = new List<Instruction>();
+		private Dictionary<string, int> _labels = new Dictionary<string, int>();
+
+		public int Count {
+			get { return _code.Count; }
+		}
+
+		/* Adds an instruction that doesn't jump */
+		public void Statement(int code, UInt32 k) {
+			Jump(code, k, null, null);
+		}
+
+		/* Adds a conditional jump, a null label means the next instruction */
+		public void Jump(int code, UInt32 k, string jt, string jf) {
+			Instruction insn = new Instruction();
+			insn.Code = code;
+			insn.True = jt;
+			insn.False = jf;
+			insn.K = k;
+			_code.Add(insn);
+		}
+
+		/* Adds an unconditional jump that can go any distance forward */
+		public void Jump(string label) {
+			Jump(JMP|JA, 0, label, null);
+		}
+
+		/* Marks the position of the next instruction */
+		public void Label(string name) {
+			if (_labels.ContainsKey(name)) {
+				throw new Exception("Label " + name + " defined twice");
+			}
+			_labels.Add(name, _code.Count);
+		}
+
+		/* Returns the program as an array of struct sock_filter */
+		public byte[] Compile() {
+			if (_code.Count > MAX_INSTRUCTIONS) {
+				throw new Exception("Filter of " + _code.Count + " instructions too long");
+			}
+
+			byte[] program = new byte[_code.Count*8];
+			for (int i=0; i<_code.Count; i++) {
+				Instruction insn = _code[i];
+				UInt32 k = insn.K;
+				int jt = offset(insn.True, i);
+				int jf = offset(insn.False, i);
+
+				if (insn.Code == (JMP|JA)) {
+					k = (UInt32) jt;
+					jt = 0;
+				} else if (jt > 255 || jf > 255) {
+					throw new Exception("Jump from instruction " + i + " too long");
+				}
+
+				Array.Copy(BitConverter.GetBytes((UInt16) insn.Code), 0, program, i*8, 2);
+				program[i*8+2] = (byte) jt;
+				program[i*8+3] = (byte) jf;
+				Array.Copy(BitConverter.GetBytes(k), 0, program, i*8+4, 4);
+			}
+
+			return program;
+		}
+
+		private int offset(string label, int index) {
+			if (label == null) {
+				return 0;
+			}
+
+			int target;
+			if (!_labels.TryGetValue(label, out target)) {
+				throw new Exception("Label " + label + " not defined");
+			}
+			if (target <= index) {
+				throw new Exception("Jump to label " + label + " not forward");
+			}
+
+			return target - (index+1);
+		}
+	}
+}
@@ -88,6 +88,84 @@ namespace Nabla.Sockets {
 			return Receive(buffer, buffer.Length);
 		}
 
+		/* Waits for packets and receives as many as are queued with one call, up to the
+		 * length of offsets. The start of each packet in buffer is stored into offsets and
+		 * its length into lengths, packets are received into slots of buffer.Length divided
+		 * by offsets.Length bytes or packed back to back when copied from a ring. Returns
+		 * the number of packets, which is 0 if the wait timed out. If endPoints is given,
+		 * the senders are stored into it when the address family has end points. */
+		public virtual int ReceiveBatch(byte[] buffer, int[] offsets, int[] lengths, IPEndPoint[] endPoints) {
+			if (offsets.Length == 0 || !WaitForReadable()) {
+				return 0;
+			}
+
+			offsets[0] = 0;
+			if (endPoints != null) {
+				IPEndPoint endPoint = new IPEndPoint(IPAddress.IPv6Any, 0);
+				lengths[0] = ReceiveFrom(buffer, 0, buffer.Length/offsets.Length, ref endPoint);
+				endPoints[0] = endPoint;
+			} else {
+				lengths[0] = Receive(buffer, 0, buffer.Length/offsets.Length);
+			}
+			return 1;
+		}
+
+		public int ReceiveBatch(byte[] buffer, int[] offsets, int[] lengths) {
+			return ReceiveBatch(buffer, offsets, lengths, null);
+		}
+
+		/* Sends count packets from buffer with one call where possible, packet i starts at
+		 * offsets[i] and has length lengths[i]. The end points may be null for sockets that
+		 * are bound to an interface. Returns the number of packets sent. */
+		public virtual int SendBatch(byte[] buffer, int[] offsets, int[] lengths, int count, IPEndPoint[] endPoints) {
+			for (int i=0; i<count; i++) {
+				SendTo(buffer, offsets[i], lengths[i], (endPoints != null) ? endPoints[i] : null);
+			}
+			return count;
+		}
+
+		/* Maps receive and transmit rings shared with the kernel, frames are then received
+		 * a block at a time and frames queued for transmit are sent with one call. The ring
+		 * has the given number of blocks of blockSize bytes, the transmit ring has at least
+		 * the given number of frameSize byte slots and is not created if frames is 0. */
+		public virtual void SetupRings(int blocks, int blockSize, int frames, int frameSize) {
+			throw new Exception("Packet rings not supported by " + GetType().Name);
+		}
+
+		public virtual bool HasTransmitRing {
+			get { return false; }
+		}
+
+		/* Copies header and data into the next free slot of the transmit ring, the frame
+		 * is sent on the next FlushFrames. Returns false if the ring is full. */
+		public virtual bool QueueFrame(byte[] header, byte[] buffer, int offset, int size) {
+			throw new Exception("Packet rings not supported by " + GetType().Name);
+		}
+
+		/* Sends all the frames queued in the transmit ring */
+		public virtual void FlushFrames() {
+			throw new Exception("Packet rings not supported by " + GetType().Name);
+		}
+
+		/* Attaches a filter that the kernel runs on every frame, only the accepted frames
+		 * are received. A null filter removes the current one. */
+		public virtual void SetFilter(PacketFilter filter) {
+			throw new Exception("Packet filters not supported by " + GetType().Name);
+		}
+
+		/* Joins a group of sockets on the same interface, the received
+		 * packets are spread over the group by a hash of their flow. A
+		 * negative group creates a new one with an id that isn't used by
+		 * any process, the id of the joined group is returned. */
+		public virtual int JoinFanoutGroup(int group) {
+			throw new Exception("Packet fanout not supported by " + GetType().Name);
+		}
+
+		/* Descriptor that can be waited for with EventPoll, -1 if there is none */
+		public virtual int Descriptor {
+			get { return -1; }
+		}
+
 		public byte[] GetHardwareAddress() {
 			return GetHardwareAddress(_ifname);
 		}
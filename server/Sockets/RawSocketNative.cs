@@ -25,6 +25,28 @@ namespace Nabla.Sockets {
 		private IntPtr _sock;
 		private int _waitms;
 
+		/* Space for the addresses of a batch, a sockaddr_in6 is the largest needed */
+		private const int BATCH_ADDRLEN = 28;
+		private const int MAX_BATCH = 64;
+		private byte[] _recvAddrs = new byte[MAX_BATCH*BATCH_ADDRLEN];
+		private int[] _recvAddrLens = new int[MAX_BATCH];
+
+		/* Addresses of a sent batch, senders may run in parallel so these are locked. The
+		 * end point of each slot is kept, an end point that is already there isn't copied
+		 * again, so sending to the same end points serializes nothing after the first time. */
+		private Object _sendLock = new Object();
+		private byte[] _sendAddrs = new byte[MAX_BATCH*BATCH_ADDRLEN];
+		private int[] _sendAddrLens = new int[MAX_BATCH];
+		private IPEndPoint[] _sendEndPoints = new IPEndPoint[MAX_BATCH];
+
+		private static IPEndPoint _anyIPv4 = new IPEndPoint(IPAddress.Any, 0);
+		private static IPEndPoint _anyIPv6 = new IPEndPoint(IPAddress.IPv6Any, 0);
+
+		/* With rings, sends go through the transmit ring that senders share */
+		private bool _rxRing = false;
+		private bool _txRing = false;
+		private Object _txLock = new Object();
+
 		[DllImport("rawsock")]
 		private static extern int rawsock_get_family(byte[] sockaddr);
 
@@ -46,9 +68,36 @@ namespace Nabla.Sockets {
 		[DllImport("rawsock")]
 		private static extern int rawsock_recvfrom(IntPtr sock, byte[] buf, int offset, int len, byte[] sockaddr, ref int addrlen, ref int err);
 
+		[DllImport("rawsock")]
+		private static extern int rawsock_recv_batch(IntPtr sock, int waitms, byte[] buf, int slotlen, int[] lengths, byte[] addrs, int addrlen, int[] addrlens, int maxmsgs, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_send_batch(IntPtr sock, byte[] buf, int[] offsets, int[] lengths, int first, byte[] addrs, int addrlen, int[] addrlens, int count, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_join_fanout(IntPtr sock, int group, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_set_filter(IntPtr sock, byte[] code, int count, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_setup_ring(IntPtr sock, int blocks, int blocksize, int frames, int framesize, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_ring_receive(IntPtr sock, byte[] buf, int offset, int len, int[] offsets, int[] lengths, int maxframes, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_ring_queue(IntPtr sock, byte[] hdr, int hdrlen, byte[] buf, int offset, int len, ref int err);
+
+		[DllImport("rawsock")]
+		private static extern int rawsock_ring_flush(IntPtr sock, ref int err);
+
 		[DllImport("rawsock")]
 		private static extern string rawsock_strerror(int errno);
 
+		[DllImport("rawsock")]
+		private static extern int rawsock_get_fd(IntPtr sock);
+
 		[DllImport("rawsock")]
 		private static extern void rawsock_destroy(IntPtr sock);
 
@@ -119,6 +168,25 @@ namespace Nabla.Sockets {
 			int length = 0;
 			int ret;
 
+			/* The kernel sends from the ring only once it is mapped */
+			if (_txRing) {
+				if (remoteEP != null) {
+					throw new Exception("Destination address not supported with a transmit ring");
+				}
+
+				lock (_txLock) {
+					if (!QueueFrame(null, buffer, offset, size)) {
+						FlushFrames();
+						if (!WaitForWritable() || !QueueFrame(null, buffer, offset, size)) {
+							throw new Exception("Error writing to raw socket: transmit ring full");
+						}
+					}
+					FlushFrames();
+				}
+
+				return size;
+			}
+
 			if (remoteEP != null) {
 				SocketAddress socketAddress = remoteEP.Serialize();
 
@@ -158,6 +226,19 @@ namespace Nabla.Sockets {
 			int length = 0;
 			int ret;
 
+			/* Frames only arrive to the ring once it is mapped */
+			if (_rxRing) {
+				int[] offsets = new int[1];
+				int[] lengths = new int[1];
+
+				ret = rawsock_ring_receive(_sock, buffer, offset, size, offsets, lengths, 1, ref errno);
+				if (ret == -1) {
+					throw new Exception("Error reading from raw socket: " + rawsock_strerror(errno) + " (" + errno + ")");
+				}
+
+				return (ret == 1) ? lengths[0] : 0;
+			}
+
 			if (remoteEP != null) {
 				SocketAddress socketAddress = remoteEP.Serialize();
 
@@ -190,6 +271,204 @@ namespace Nabla.Sockets {
 			return ret;
 		}
 
+		/* The arrays are pinned for the call, so the packets are copied straight into the
+		 * buffer with one call per batch, including the wait, instead of one per packet */
+		public override int ReceiveBatch(byte[] buffer, int[] offsets, int[] lengths, IPEndPoint[] endPoints) {
+			int errno = 0;
+			int count = Math.Min(offsets.Length, lengths.Length);
+			int ret;
+
+			if (_rxRing) {
+				if (!WaitForReadable()) {
+					return 0;
+				}
+
+				/* Frames from the ring have no sender addresses */
+				ret = rawsock_ring_receive(_sock, buffer, 0, buffer.Length, offsets, lengths, count, ref errno);
+				if (ret > 0 && endPoints != null) {
+					Array.Clear(endPoints, 0, ret);
+				}
+			} else {
+				count = Math.Min(count, MAX_BATCH);
+				int slot = buffer.Length / count;
+
+				ret = rawsock_recv_batch(_sock, _waitms, buffer, slot, lengths,
+				                         (endPoints != null) ? _recvAddrs : null, BATCH_ADDRLEN,
+				                         _recvAddrLens, count, ref errno);
+				for (int i=0; i<ret; i++) {
+					offsets[i] = i*slot;
+					if (endPoints != null) {
+						endPoints[i] = getEndPoint(_recvAddrs, i*BATCH_ADDRLEN, _recvAddrLens[i]);
+					}
+				}
+			}
+			if (ret == -1) {
+				throw new Exception("Error reading from raw socket: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+
+			return ret;
+		}
+
+		public override int SendBatch(byte[] buffer, int[] offsets, int[] lengths, int count, IPEndPoint[] endPoints) {
+			int sent = 0;
+
+			if (_txRing) {
+				return base.SendBatch(buffer, offsets, lengths, count, endPoints);
+			}
+
+			/* The native side sends at most MAX_BATCH packets per call */
+			while (sent < count) {
+				int batch = Math.Min(count - sent, MAX_BATCH);
+
+				int ret;
+				if (endPoints == null) {
+					ret = sendBatch(buffer, offsets, lengths, sent, null, null, batch);
+				} else {
+					lock (_sendLock) {
+						for (int i=0; i<batch; i++) {
+							setSendAddress(i, endPoints[sent+i]);
+						}
+						ret = sendBatch(buffer, offsets, lengths, sent, _sendAddrs, _sendAddrLens, batch);
+					}
+				}
+
+				sent += ret;
+				if (ret < batch) {
+					break;
+				}
+			}
+
+			return sent;
+		}
+
+		private int sendBatch(byte[] buffer, int[] offsets, int[] lengths, int first, byte[] addrs, int[] addrlens, int count) {
+			int errno = 0;
+
+			int ret = rawsock_send_batch(_sock, buffer, offsets, lengths, first,
+			                             addrs, BATCH_ADDRLEN, addrlens, count, ref errno);
+			if (ret == -1) {
+				throw new Exception("Error writing to raw socket: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+
+			return ret;
+		}
+
+		/* Stores the end point into a slot of the send arena with the .NET address family
+		 * in the first two bytes, called with _sendLock held */
+		private void setSendAddress(int slot, IPEndPoint endPoint) {
+			if (_sendEndPoints[slot] == endPoint) {
+				return;
+			}
+
+			SocketAddress socketAddress = endPoint.Serialize();
+			if (socketAddress.Size > BATCH_ADDRLEN) {
+				throw new Exception("Address family " + socketAddress.Family + " of endpoint unsupported");
+			}
+
+			/* The family is read as a native unsigned short */
+			int offset = slot*BATCH_ADDRLEN;
+			int family = (int) socketAddress.Family;
+			_sendAddrs[offset] = (byte) (BitConverter.IsLittleEndian ? family : family >> 8);
+			_sendAddrs[offset+1] = (byte) (BitConverter.IsLittleEndian ? family >> 8 : family);
+			for (int i=2; i<socketAddress.Size; i++)
+				_sendAddrs[offset+i] = socketAddress[i];
+			_sendAddrLens[slot] = socketAddress.Size;
+			_sendEndPoints[slot] = endPoint;
+		}
+
+		/* Creates the end point of an address returned by the native side, which stores
+		 * the .NET address family in the first two bytes */
+		private static IPEndPoint getEndPoint(byte[] addrs, int offset, int length) {
+			AddressFamily family = (AddressFamily) BitConverter.ToUInt16(addrs, offset);
+
+			IPEndPoint template;
+			if (family == AddressFamily.InterNetwork) {
+				template = _anyIPv4;
+			} else if (family == AddressFamily.InterNetworkV6) {
+				template = _anyIPv6;
+			} else {
+				return null;
+			}
+
+			SocketAddress socketAddress = new SocketAddress(family, length);
+			for (int i=2; i<length; i++)
+				socketAddress[i] = addrs[offset+i];
+			return (IPEndPoint) template.Create(socketAddress);
+		}
+
+		public override void SetupRings(int blocks, int blockSize, int frames, int frameSize) {
+			int errno = 0;
+
+			int ret = rawsock_setup_ring(_sock, blocks, blockSize, frames, frameSize, ref errno);
+			if (ret == -1) {
+				throw new Exception("Error setting up packet rings: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+
+			_rxRing = true;
+			_txRing = (frames > 0);
+		}
+
+		public override bool HasTransmitRing {
+			get { return _txRing; }
+		}
+
+		public override bool QueueFrame(byte[] header, byte[] buffer, int offset, int size) {
+			int errno = 0;
+			int ret;
+
+			lock (_txLock) {
+				ret = rawsock_ring_queue(_sock, header, (header != null) ? header.Length : 0,
+				                         buffer, offset, size, ref errno);
+			}
+			if (ret == -1) {
+				throw new Exception("Error writing to raw socket: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+
+			return (ret == 1);
+		}
+
+		public override void FlushFrames() {
+			int errno = 0;
+			int ret;
+
+			lock (_txLock) {
+				ret = rawsock_ring_flush(_sock, ref errno);
+			}
+			if (ret == -1) {
+				throw new Exception("Error writing to raw socket: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+		}
+
+		public override void SetFilter(PacketFilter filter) {
+			int errno = 0;
+			byte[] code = null;
+			int count = 0;
+
+			if (filter != null) {
+				code = filter.Compile();
+				count = filter.Count;
+			}
+
+			int ret = rawsock_set_filter(_sock, code, count, ref errno);
+			if (ret == -1) {
+				throw new Exception("Error setting packet filter: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+		}
+
+		public override int JoinFanoutGroup(int group) {
+			int errno = 0;
+
+			int ret = rawsock_join_fanout(_sock, group, ref errno);
+			if (ret == -1) {
+				throw new Exception("Error joining fanout group: " + rawsock_strerror(errno) + " (" + errno + ")");
+			}
+			return ret;
+		}
+
+		public override int Descriptor {
+			get { return rawsock_get_fd(_sock); }
+		}
+
 		public void Dispose() {
 			Dispose(true);
 			GC.SuppressFinalize(this);
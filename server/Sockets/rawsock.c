@@ -13,6 +13,11 @@
  *  Lesser General Public License for more details.
  */
 
+#if defined(__linux__)
+/* Needed for recvmmsg and sendmmsg */
+#  define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <assert.h>
 
@@ -38,11 +43,16 @@
 #if defined(_WIN32) || defined(_WIN64)
 #elif defined(__linux__)
 #  include <sys/ioctl.h>
+#  include <sys/mman.h>
+#  include <sys/epoll.h>
+#  include <poll.h>
+#  include <stdint.h>
 #  include <arpa/inet.h>
 #  include <linux/if.h>
 #  include <linux/if_arp.h>
 #  include <linux/if_ether.h>
 #  include <linux/if_packet.h>
+#  include <linux/filter.h>
 #elif defined(__sun__)
 #  include <stdio.h>
 #  include <fcntl.h>
@@ -56,6 +66,17 @@
 #define FAMILY_IPv6    1
 #define FAMILY_PACKET  2
 
+#if defined(__linux__) && defined(TPACKET3_HDRLEN)
+#  define RAWSOCK_RINGS
+#endif
+
+/* Most packets received or sent with one batch call */
+#define RAWSOCK_MAX_BATCH 64
+
+/* Milliseconds after which a partially filled receive block is handed
+ * to the reader, this is the latency added when there is little traffic */
+#define RING_RETIRE_MS 2
+
 struct rawsock_s {
 	int sockfd;
 	char *ifname;
@@ -63,9 +84,36 @@ struct rawsock_s {
 
 	char *address;
 	int addrlen;
+
+	/* Memory mapped TPACKET_V3 rings, the receive ring is followed by
+	 * the optional transmit ring in the same mapping */
+	char *ring;
+	size_t ringlen;
+
+	int rx_blocks;
+	int rx_blocksize;
+	int rx_block;		/* block currently read */
+	int rx_left;		/* frames left in the current block */
+	char *rx_frame;		/* next frame in the current block */
+
+	char *tx_ring;
+	int tx_frames;
+	int tx_framesize;
+	int tx_frame;		/* next frame to fill */
 };
 typedef struct rawsock_s rawsock_t;
 
+/* Readiness notification for any number of descriptors, each returned
+ * descriptor is disabled until it is rearmed, so several threads can
+ * wait at the same time and a descriptor is never handled twice */
+struct rawsock_poll_s {
+	int epfd;
+	int wakefd[2];		/* readable when the waiters should return */
+};
+typedef struct rawsock_poll_s rawsock_poll_t;
+
+#define POLL_WAKEUP_TOKEN -1
+
 int
 rawsock_get_family(struct sockaddr *saddr)
 {
@@ -295,6 +343,30 @@ rawsock_sendto(rawsock_t *rawsock, const void *buf, int offset, int len,
 	return ret;
 }
 
+#if defined(RAWSOCK_RINGS)
+static struct tpacket_block_desc *
+rawsock_rx_block(rawsock_t *rawsock)
+{
+	return (struct tpacket_block_desc *)
+		(rawsock->ring + rawsock->rx_block * rawsock->rx_blocksize);
+}
+
+/* Returns non-zero if there are frames to read in the receive ring */
+static int
+rawsock_rx_ready(rawsock_t *rawsock)
+{
+	if (rawsock->rx_left > 0) {
+		return 1;
+	}
+	if (rawsock_rx_block(rawsock)->hdr.bh1.block_status & TP_STATUS_USER) {
+		/* Don't read the frames before the status */
+		__sync_synchronize();
+		return 1;
+	}
+	return 0;
+}
+#endif
+
 int
 rawsock_wait_for_readable(rawsock_t *rawsock, int waitms, int *err)
 {
@@ -304,6 +376,31 @@ rawsock_wait_for_readable(rawsock_t *rawsock, int waitms, int *err)
 
 	assert(rawsock);
 
+#if defined(RAWSOCK_RINGS)
+	if (rawsock->ring) {
+		struct pollfd pfd;
+
+		if (rawsock_rx_ready(rawsock)) {
+			return 1;
+		}
+
+		pfd.fd = rawsock->sockfd;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, waitms);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				/* Handle interrupt as timeout */
+				return 0;
+			}
+			*err = errno;
+			return -1;
+		}
+
+		return rawsock_rx_ready(rawsock);
+	}
+#endif
+
 	FD_ZERO(&rfds);
 	FD_SET(rawsock->sockfd, &rfds);
 
@@ -345,6 +442,803 @@ rawsock_recvfrom(rawsock_t *rawsock, void *buf, int offset, int len,
 	return ret;
 }
 
+/* Replaces the family of a received address with the .NET value, so
+ * that the managed side can read it from the first two bytes */
+static void
+rawsock_export_family(struct sockaddr *saddr)
+{
+	unsigned short family = rawsock_get_family(saddr);
+	memcpy(saddr, &family, sizeof(family));
+}
+
+/* Copies an address given by the managed side, which has the .NET
+ * family in the first two bytes, and sets the native family */
+static int
+rawsock_import_address(struct sockaddr_storage *saddr, const void *addr,
+                       int addrlen)
+{
+	unsigned short family;
+
+	if (addrlen < (int) sizeof(family) ||
+	    addrlen > (int) sizeof(struct sockaddr_storage)) {
+		return -1;
+	}
+
+	memset(saddr, 0, sizeof(struct sockaddr_storage));
+	memcpy(saddr, addr, addrlen);
+	memcpy(&family, addr, sizeof(family));
+	memset(saddr, 0, sizeof(family));
+	return rawsock_set_family((struct sockaddr *) saddr, family);
+}
+
+int
+rawsock_recv_batch(rawsock_t *rawsock, int waitms, void *buf, int slotlen,
+                   int *lengths, void *addrs, int addrlen, int *addrlens,
+                   int maxmsgs, int *err)
+{
+	int ret;
+
+	assert(rawsock);
+
+	ret = rawsock_wait_for_readable(rawsock, waitms, err);
+	if (ret <= 0) {
+		return ret;
+	}
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	{
+		struct mmsghdr msgs[RAWSOCK_MAX_BATCH];
+		struct iovec iovs[RAWSOCK_MAX_BATCH];
+		int i;
+
+		if (maxmsgs > RAWSOCK_MAX_BATCH) {
+			maxmsgs = RAWSOCK_MAX_BATCH;
+		}
+
+		memset(msgs, 0, sizeof(struct mmsghdr) * maxmsgs);
+		for (i=0; i<maxmsgs; i++) {
+			iovs[i].iov_base = (char *) buf + i*slotlen;
+			iovs[i].iov_len = slotlen;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			if (addrs) {
+				msgs[i].msg_hdr.msg_name = (char *) addrs + i*addrlen;
+				msgs[i].msg_hdr.msg_namelen = addrlen;
+			}
+		}
+
+		/* The socket is readable, so take what is queued without waiting */
+		ret = recvmmsg(rawsock->sockfd, msgs, maxmsgs, MSG_DONTWAIT, NULL);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			*err = errno;
+			return -1;
+		}
+
+		for (i=0; i<ret; i++) {
+			lengths[i] = msgs[i].msg_len;
+			if (addrs) {
+				addrlens[i] = msgs[i].msg_hdr.msg_namelen;
+				rawsock_export_family((struct sockaddr *)
+				                      ((char *) addrs + i*addrlen));
+			}
+		}
+
+		return ret;
+	}
+#else
+	/* One packet at a time where there is no batch call */
+	{
+		socklen_t fromlen = addrlen;
+
+		ret = recvfrom(rawsock->sockfd, buf, slotlen, 0,
+		               (struct sockaddr *) addrs,
+		               addrs ? &fromlen : NULL);
+		if (ret == -1) {
+			*err = GetLastError();
+			return -1;
+		}
+
+		lengths[0] = ret;
+		if (addrs) {
+			addrlens[0] = fromlen;
+			rawsock_export_family((struct sockaddr *) addrs);
+		}
+
+		return 1;
+	}
+#endif
+}
+
+int
+rawsock_send_batch(rawsock_t *rawsock, const void *buf, const int *offsets,
+                   const int *lengths, int first, const void *addrs,
+                   int addrlen, const int *addrlens, int count, int *err)
+{
+	struct sockaddr_storage names[RAWSOCK_MAX_BATCH];
+	int ret;
+	int i;
+
+	assert(rawsock);
+
+	/* The packets start from index first of the arrays, the addresses
+	 * are converted into copies so the caller can reuse them as they are */
+	offsets += first;
+	lengths += first;
+	if (addrs) {
+		addrs = (const char *) addrs + first*addrlen;
+		addrlens += first;
+	}
+
+	if (count > RAWSOCK_MAX_BATCH) {
+		count = RAWSOCK_MAX_BATCH;
+	}
+
+	for (i=0; addrs && i<count; i++) {
+		if (rawsock_import_address(&names[i],
+		                           (const char *) addrs + i*addrlen,
+		                           addrlens[i]) == -1) {
+			*err = EINVAL;
+			return -1;
+		}
+	}
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	{
+		struct mmsghdr msgs[RAWSOCK_MAX_BATCH];
+		struct iovec iovs[RAWSOCK_MAX_BATCH];
+
+		memset(msgs, 0, sizeof(struct mmsghdr) * count);
+		for (i=0; i<count; i++) {
+			iovs[i].iov_base = (char *) buf + offsets[i];
+			iovs[i].iov_len = lengths[i];
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			if (addrs) {
+				msgs[i].msg_hdr.msg_name = &names[i];
+				msgs[i].msg_hdr.msg_namelen = addrlens[i];
+			}
+		}
+
+		ret = sendmmsg(rawsock->sockfd, msgs, count, 0);
+		if (ret == -1) {
+			*err = errno;
+		}
+
+		return ret;
+	}
+#else
+	for (i=0; i<count; i++) {
+		ret = sendto(rawsock->sockfd, (const char *) buf + offsets[i],
+		             lengths[i], 0,
+		             addrs ? (struct sockaddr *) &names[i] : NULL,
+		             addrs ? addrlens[i] : 0);
+		if (ret == -1) {
+			if (i > 0) {
+				/* Report the packets that were sent */
+				break;
+			}
+			*err = GetLastError();
+			return -1;
+		}
+	}
+
+	return i;
+#endif
+}
+
+#if defined(__linux__) && defined(PACKET_FANOUT)
+/* Returns true if a fanout group with the id exists, found by joining
+ * it with a probe socket of another mode. Joining a group of another
+ * mode or device fails, an unused id creates a group that is removed
+ * when the probe is closed. */
+static int
+rawsock_fanout_exists(int group, int *err)
+{
+	int sockfd;
+	int arg;
+	int ret;
+
+	sockfd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (sockfd == -1) {
+		*err = errno;
+		return -1;
+	}
+
+	arg = (group & 0xffff) | (PACKET_FANOUT_LB << 16);
+	ret = setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg));
+	closesocket(sockfd);
+	return (ret == -1);
+}
+#endif
+
+/* Joins the fanout group or creates a new one if group is negative,
+ * returns the id of the group or -1 on error */
+int
+rawsock_join_fanout(rawsock_t *rawsock, int group, int *err)
+{
+	assert(rawsock);
+
+#if defined(__linux__) && defined(PACKET_FANOUT)
+	if (rawsock->domain == AF_PACKET) {
+		static unsigned int created = 0;
+		unsigned int first, i;
+		int mode;
+		int arg;
+		int ret;
+
+		/* Hash mode keeps the packets of a flow on one socket, defrag
+		 * makes sure the fragments of a datagram are hashed together */
+		mode = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+
+		if (group >= 0) {
+			arg = (group & 0xffff) | (mode << 16);
+			ret = setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_FANOUT,
+			                 &arg, sizeof(arg));
+			if (ret == -1) {
+				*err = errno;
+				return -1;
+			}
+			return group & 0xffff;
+		}
+
+#ifdef PACKET_FANOUT_FLAG_UNIQUEID
+		/* Let the kernel pick an unused id and read it back, older
+		 * kernels reject the flag with EINVAL */
+		arg = (mode | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+		ret = setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_FANOUT,
+		                 &arg, sizeof(arg));
+		if (ret == 0) {
+			socklen_t arglen = sizeof(arg);
+
+			ret = getsockopt(rawsock->sockfd, SOL_PACKET, PACKET_FANOUT,
+			                 &arg, &arglen);
+			if (ret == -1) {
+				*err = errno;
+				return -1;
+			}
+			return arg & 0xffff;
+		} else if (errno != EINVAL) {
+			*err = errno;
+			return -1;
+		}
+#endif
+
+		/* Ids are shared by all the processes, skip the ones in use.
+		 * Another process may still take the id before it is joined,
+		 * then joining fails and the next id is tried. */
+		first = getpid() * 16 + created++;
+		for (i=0; i<256; i++) {
+			group = (first + i) & 0xffff;
+			ret = rawsock_fanout_exists(group, err);
+			if (ret == -1) {
+				return -1;
+			} else if (ret) {
+				*err = EADDRINUSE;
+				continue;
+			}
+
+			arg = group | (mode << 16);
+			ret = setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_FANOUT,
+			                 &arg, sizeof(arg));
+			if (ret == 0) {
+				return group;
+			}
+			*err = errno;
+			if (*err != EINVAL) {
+				return -1;
+			}
+		}
+
+		return -1;
+	}
+#endif
+
+	/* Not supported on this platform or socket type */
+	*err = EINVAL;
+	return -1;
+}
+
+int
+rawsock_set_filter(rawsock_t *rawsock, const void *code, int count, int *err)
+{
+	assert(rawsock);
+
+#if defined(__linux__)
+	{
+		struct sock_fprog fprog;
+		int ret;
+
+		if (count == 0) {
+			/* Removing a filter that doesn't exist is fine */
+			ret = setsockopt(rawsock->sockfd, SOL_SOCKET, SO_DETACH_FILTER,
+			                 NULL, 0);
+			if (ret == -1 && errno != ENOENT) {
+				*err = errno;
+				return -1;
+			}
+			return 0;
+		}
+
+		/* The new filter replaces the old one atomically */
+		fprog.len = count;
+		fprog.filter = (struct sock_filter *) code;
+		ret = setsockopt(rawsock->sockfd, SOL_SOCKET, SO_ATTACH_FILTER,
+		                 &fprog, sizeof(fprog));
+		if (ret == -1) {
+			*err = errno;
+		}
+
+		return ret;
+	}
+#endif
+
+	/* Not supported on this platform */
+	*err = EINVAL;
+	return -1;
+}
+
+int
+rawsock_setup_ring(rawsock_t *rawsock, int blocks, int blocksize,
+                   int frames, int framesize, int *err)
+{
+	assert(rawsock);
+
+#if defined(RAWSOCK_RINGS)
+	if (rawsock->domain == AF_PACKET && !rawsock->ring &&
+	    blocks > 0 && blocksize > 0 && framesize > 0 &&
+	    blocksize % framesize == 0 && frames >= 0) {
+		struct tpacket_req3 rxreq, txreq;
+		int version = TPACKET_V3;
+		int loss = 1;
+		size_t rxlen, txlen;
+		void *ring;
+
+		if (setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_VERSION,
+		               &version, sizeof(version)) == -1) {
+			*err = errno;
+			return -1;
+		}
+
+		/* Frames the kernel can't send are skipped instead of
+		 * stopping the whole transmit ring */
+		if (setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_LOSS,
+		               &loss, sizeof(loss)) == -1) {
+			*err = errno;
+			goto fail;
+		}
+
+		/* Received frames are packed into the blocks back to back,
+		 * the frame size only needs to be valid for the kernel */
+		memset(&rxreq, 0, sizeof(rxreq));
+		rxreq.tp_block_size = blocksize;
+		rxreq.tp_block_nr = blocks;
+		rxreq.tp_frame_size = framesize;
+		rxreq.tp_frame_nr = (blocksize / framesize) * blocks;
+		rxreq.tp_retire_blk_tov = RING_RETIRE_MS;
+		if (setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_RX_RING,
+		               &rxreq, sizeof(rxreq)) == -1) {
+			*err = errno;
+			goto fail;
+		}
+		rxlen = (size_t) blocks * blocksize;
+
+		/* Frames to send have fixed size slots */
+		memset(&txreq, 0, sizeof(txreq));
+		txlen = 0;
+		if (frames > 0) {
+			txreq.tp_block_size = blocksize;
+			txreq.tp_block_nr = (frames + blocksize/framesize - 1) /
+			                    (blocksize/framesize);
+			txreq.tp_frame_size = framesize;
+			txreq.tp_frame_nr = (blocksize / framesize) *
+			                    txreq.tp_block_nr;
+			if (setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_TX_RING,
+			               &txreq, sizeof(txreq)) == -1) {
+				*err = errno;
+				goto fail;
+			}
+			txlen = (size_t) txreq.tp_block_nr * blocksize;
+		}
+
+		ring = mmap(NULL, rxlen + txlen, PROT_READ | PROT_WRITE,
+		            MAP_SHARED, rawsock->sockfd, 0);
+		if (ring == MAP_FAILED) {
+			*err = errno;
+			goto fail;
+		}
+
+		rawsock->ring = ring;
+		rawsock->ringlen = rxlen + txlen;
+		rawsock->rx_blocks = blocks;
+		rawsock->rx_blocksize = blocksize;
+		rawsock->rx_block = 0;
+		rawsock->rx_left = 0;
+		rawsock->rx_frame = NULL;
+		if (txlen) {
+			rawsock->tx_ring = rawsock->ring + rxlen;
+			rawsock->tx_frames = txreq.tp_frame_nr;
+			rawsock->tx_framesize = framesize;
+			rawsock->tx_frame = 0;
+		}
+
+		return 0;
+
+fail:
+		/* Free the rings and go back to the default version, so
+		 * the socket can still be used without them */
+		memset(&rxreq, 0, sizeof(rxreq));
+		setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_TX_RING,
+		           &rxreq, sizeof(rxreq));
+		setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_RX_RING,
+		           &rxreq, sizeof(rxreq));
+		version = TPACKET_V1;
+		setsockopt(rawsock->sockfd, SOL_PACKET, PACKET_VERSION,
+		           &version, sizeof(version));
+		return -1;
+	}
+#endif
+
+	/* Not supported on this platform or socket type */
+	*err = EINVAL;
+	return -1;
+}
+
+int
+rawsock_ring_receive(rawsock_t *rawsock, void *buf, int offset, int len,
+                     int *offsets, int *lengths, int maxframes, int *err)
+{
+	assert(rawsock);
+
+#if defined(RAWSOCK_RINGS)
+	if (rawsock->ring) {
+		int count = 0;
+		int pos = 0;
+
+		while (count < maxframes) {
+			struct tpacket_block_desc *block;
+			struct tpacket3_hdr *hdr;
+			int snaplen;
+
+			block = rawsock_rx_block(rawsock);
+			if (rawsock->rx_left == 0) {
+				if (!rawsock_rx_ready(rawsock)) {
+					break;
+				}
+				rawsock->rx_left = block->hdr.bh1.num_pkts;
+				rawsock->rx_frame = (char *) block +
+				                    block->hdr.bh1.offset_to_first_pkt;
+			}
+
+			if (rawsock->rx_left > 0) {
+				hdr = (struct tpacket3_hdr *) rawsock->rx_frame;
+				snaplen = hdr->tp_snaplen;
+				if (pos + snaplen > len) {
+					if (count > 0) {
+						/* Continue from this frame next time */
+						break;
+					}
+					snaplen = len;
+				}
+
+				memcpy((char *) buf + offset + pos,
+				       rawsock->rx_frame + hdr->tp_mac, snaplen);
+				offsets[count] = offset + pos;
+				lengths[count] = snaplen;
+				pos += snaplen;
+				count++;
+
+				rawsock->rx_frame += hdr->tp_next_offset;
+				rawsock->rx_left--;
+			}
+
+			if (rawsock->rx_left == 0) {
+				/* Give the block back once all frames are copied */
+				__sync_synchronize();
+				block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+				rawsock->rx_block = (rawsock->rx_block + 1) %
+				                    rawsock->rx_blocks;
+			}
+		}
+
+		return count;
+	}
+#endif
+
+	*err = EINVAL;
+	return -1;
+}
+
+int
+rawsock_ring_queue(rawsock_t *rawsock, const void *hdr, int hdrlen,
+                   const void *buf, int offset, int len, int *err)
+{
+	assert(rawsock);
+
+#if defined(RAWSOCK_RINGS)
+	if (rawsock->tx_ring) {
+		struct tpacket3_hdr *frame;
+		char *data;
+
+		frame = (struct tpacket3_hdr *)
+			(rawsock->tx_ring + rawsock->tx_frame * rawsock->tx_framesize);
+		if (frame->tp_status != TP_STATUS_AVAILABLE &&
+		    frame->tp_status != TP_STATUS_WRONG_FORMAT) {
+			/* The ring is full until the kernel sends the frame */
+			return 0;
+		}
+
+		/* Without PACKET_TX_HAS_OFF the data follows the aligned header */
+		data = (char *) frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+		if (hdrlen + len > rawsock->tx_framesize -
+		                   TPACKET_ALIGN(sizeof(struct tpacket3_hdr))) {
+			*err = EMSGSIZE;
+			return -1;
+		}
+
+		if (hdrlen > 0) {
+			memcpy(data, hdr, hdrlen);
+		}
+		memcpy(data + hdrlen, (const char *) buf + offset, len);
+		frame->tp_len = hdrlen + len;
+		frame->tp_next_offset = 0;
+
+		/* The kernel may take the frame as soon as the status is set */
+		__sync_synchronize();
+		frame->tp_status = TP_STATUS_SEND_REQUEST;
+		rawsock->tx_frame = (rawsock->tx_frame + 1) % rawsock->tx_frames;
+
+		return 1;
+	}
+#endif
+
+	*err = EINVAL;
+	return -1;
+}
+
+int
+rawsock_ring_flush(rawsock_t *rawsock, int *err)
+{
+	assert(rawsock);
+
+#if defined(RAWSOCK_RINGS)
+	if (rawsock->tx_ring) {
+		int ret;
+
+		/* One call sends all the queued frames, don't wait for the
+		 * device as a full ring is noticed when queueing anyway */
+		ret = send(rawsock->sockfd, NULL, 0, MSG_DONTWAIT);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == ENOBUFS) {
+				return 0;
+			}
+			*err = errno;
+		}
+
+		return ret;
+	}
+#endif
+
+	*err = EINVAL;
+	return -1;
+}
+
+int
+rawsock_get_fd(rawsock_t *rawsock)
+{
+	assert(rawsock);
+
+	return rawsock->sockfd;
+}
+
+rawsock_poll_t *
+rawsock_poll_init(int *err)
+{
+#if defined(__linux__)
+	rawsock_poll_t *rawpoll;
+	struct epoll_event event;
+
+	rawpoll = calloc(1, sizeof(rawsock_poll_t));
+	if (!rawpoll) {
+		*err = ENOMEM;
+		return NULL;
+	}
+
+	rawpoll->epfd = epoll_create(16);
+	if (rawpoll->epfd == -1) {
+		*err = errno;
+		free(rawpoll);
+		return NULL;
+	}
+
+	if (pipe(rawpoll->wakefd) == -1) {
+		*err = errno;
+		close(rawpoll->epfd);
+		free(rawpoll);
+		return NULL;
+	}
+
+	/* The wakeup pipe is level triggered and wakes all the waiters */
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = (uint32_t) POLL_WAKEUP_TOKEN;
+	if (epoll_ctl(rawpoll->epfd, EPOLL_CTL_ADD, rawpoll->wakefd[0], &event) == -1) {
+		*err = errno;
+		close(rawpoll->wakefd[0]);
+		close(rawpoll->wakefd[1]);
+		close(rawpoll->epfd);
+		free(rawpoll);
+		return NULL;
+	}
+
+	return rawpoll;
+#else
+	/* Not supported on this platform */
+	*err = EINVAL;
+	return NULL;
+#endif
+}
+
+#if defined(__linux__)
+static int
+rawsock_poll_ctl(rawsock_poll_t *rawpoll, int op, int fd, int token, int *err)
+{
+	struct epoll_event event;
+
+	assert(rawpoll);
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.u64 = (uint32_t) token;
+	if (epoll_ctl(rawpoll->epfd, op, fd, &event) == -1) {
+		*err = errno;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+int
+rawsock_poll_add(rawsock_poll_t *rawpoll, int fd, int token, int *err)
+{
+#if defined(__linux__)
+	return rawsock_poll_ctl(rawpoll, EPOLL_CTL_ADD, fd, token, err);
+#else
+	*err = EINVAL;
+	return -1;
+#endif
+}
+
+int
+rawsock_poll_rearm(rawsock_poll_t *rawpoll, int fd, int token, int *err)
+{
+#if defined(__linux__)
+	return rawsock_poll_ctl(rawpoll, EPOLL_CTL_MOD, fd, token, err);
+#else
+	*err = EINVAL;
+	return -1;
+#endif
+}
+
+int
+rawsock_poll_remove(rawsock_poll_t *rawpoll, int fd, int *err)
+{
+#if defined(__linux__)
+	struct epoll_event event;
+
+	assert(rawpoll);
+
+	/* Older kernels need an event even though it is ignored */
+	memset(&event, 0, sizeof(event));
+	if (epoll_ctl(rawpoll->epfd, EPOLL_CTL_DEL, fd, &event) == -1) {
+		*err = errno;
+		return -1;
+	}
+
+	return 0;
+#else
+	*err = EINVAL;
+	return -1;
+#endif
+}
+
+int
+rawsock_poll_wait(rawsock_poll_t *rawpoll, int *tokens, int maxtokens,
+                  int waitms, int *err)
+{
+#if defined(__linux__)
+	struct epoll_event events[16];
+	int ret, i;
+
+	assert(rawpoll);
+
+	if (maxtokens > 16) {
+		maxtokens = 16;
+	}
+
+	ret = epoll_wait(rawpoll->epfd, events, maxtokens, waitms);
+	if (ret == -1) {
+		if (errno == EINTR) {
+			/* Handle interrupt as timeout */
+			return 0;
+		}
+		*err = errno;
+		return -1;
+	}
+
+	for (i=0; i<ret; i++) {
+		tokens[i] = (int) (uint32_t) events[i].data.u64;
+	}
+
+	return ret;
+#else
+	*err = EINVAL;
+	return -1;
+#endif
+}
+
+int
+rawsock_poll_wakeup(rawsock_poll_t *rawpoll, int *err)
+{
+#if defined(__linux__)
+	char c = 0;
+
+	assert(rawpoll);
+
+	if (write(rawpoll->wakefd[1], &c, 1) == -1) {
+		*err = errno;
+		return -1;
+	}
+
+	return 0;
+#else
+	*err = EINVAL;
+	return -1;
+#endif
+}
+
+int
+rawsock_poll_reset(rawsock_poll_t *rawpoll, int *err)
+{
+#if defined(__linux__)
+	struct pollfd pfd;
+	char buf[64];
+
+	assert(rawpoll);
+
+	/* Read what the wakeups wrote, the pipe is never written much */
+	pfd.fd = rawpoll->wakefd[0];
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) > 0) {
+		if (read(rawpoll->wakefd[0], buf, sizeof(buf)) == -1) {
+			*err = errno;
+			return -1;
+		}
+	}
+
+	return 0;
+#else
+	*err = EINVAL;
+	return -1;
+#endif
+}
+
+void
+rawsock_poll_destroy(rawsock_poll_t *rawpoll)
+{
+#if defined(__linux__)
+	if (rawpoll) {
+		close(rawpoll->wakefd[0]);
+		close(rawpoll->wakefd[1]);
+		close(rawpoll->epfd);
+	}
+#endif
+	free(rawpoll);
+}
+
 char *
 rawsock_strerror(int errnum)
 {
@@ -466,6 +1360,11 @@ void
 rawsock_destroy(rawsock_t *rawsock)
 {
 	if (rawsock) {
+#if defined(RAWSOCK_RINGS)
+		if (rawsock->ring) {
+			munmap(rawsock->ring, rawsock->ringlen);
+		}
+#endif
 		closesocket(rawsock->sockfd);
 		free(rawsock->ifname);
 		free(rawsock->address);
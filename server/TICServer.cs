@@ -26,6 +26,8 @@ using Nabla.Database;
 
 namespace Nabla {
 	public class TICServer : InputDevice {
+		private static Logger _log = Logger.GetLogger("TICServer");
+
 		private Object _runlock = new Object();
 		private volatile bool _running = false;
 
@@ -76,13 +78,13 @@ namespace Nabla {
 						/* SessionManager couldn't find an address to this endpoint, maybe we have
 						 * exceeded the number of tunnels or IPv6 wasn't found in output device */
 
-						Console.WriteLine("Session not added, IPv6 maybe not enabled?");
+						_log.Warning("Session not added, IPv6 maybe not enabled?");
 						continue;
 					}
 
 					if (!t.Enabled || !t.UserEnabled) {
 						// XXX: We add it anyway, but should mark session as not enabled
-						Console.WriteLine("Tunnel T" + t.TunnelId + " not enabled, session not added");
+						_log.Notice("Tunnel T{0} not enabled, session not added", t.TunnelId);
 					}
 
 					TunnelSession session = null;
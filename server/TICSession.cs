@@ -26,6 +26,8 @@ using Nabla.Database;
 
 namespace Nabla {
 	public class TICSession {
+		private static Logger _log = Logger.GetLogger("TICSession");
+
 		private enum SessionState {
 			Initial,
 			Challenge,
@@ -137,12 +139,12 @@ namespace Nabla {
 					_sessionInfo.OSName = words[3];
 				}
 
-				Console.WriteLine("Client information:");
-				Console.WriteLine("TICVersion: " + _sessionInfo.TICVersion);
-				Console.WriteLine("ClientName: " + _sessionInfo.ClientName);
-				Console.WriteLine("ClientVersion: " + _sessionInfo.ClientVersion);
-				Console.WriteLine("OSName: " + _sessionInfo.OSName);
-				Console.WriteLine("OSVersion: " + _sessionInfo.OSVersion);
+				_log.Info("Client information:");
+				_log.Info("TICVersion: {0}", _sessionInfo.TICVersion);
+				_log.Info("ClientName: {0}", _sessionInfo.ClientName);
+				_log.Info("ClientVersion: {0}", _sessionInfo.ClientVersion);
+				_log.Info("OSName: {0}", _sessionInfo.OSName);
+				_log.Info("OSVersion: {0}", _sessionInfo.OSVersion);
 
 				return "200 Client Identity accepted";
 			} else if (command.Equals("username") && _sessionInfo.State == SessionState.Initial) {
@@ -27,22 +27,49 @@ using Nabla.Database;
 
 namespace Nabla {
 	public class TSPServer : InputDevice {
+		private static Logger _log = Logger.GetLogger("TSPServer");
+
 		private Object _runlock = new Object();
-		private volatile bool _running = false;
 
 		private string _dbName;
 		private string _deviceName;
 		private bool _ipv6;
 
+		/* Packets handled per callback of the UDP socket */
+		private const int MAX_UDP_PACKETS = 32;
+
+		/* Unsent response bytes a TCP client may have before its session is closed */
+		private const int MAX_PENDING_BYTES = 65536;
+
 		private Socket _udpSocket;
 		private TcpListener _tcpListener;
 		private SessionManager _sessionManager;
-		private Thread _udpThread;
-		private Thread _tcpThread;
+		private Reactor _reactor;
 
+		/* Used only by the UDP callback, which never runs twice at once */
+		private byte[] _udpBuffer = new byte[2048];
 		private Dictionary<IPEndPoint, TSPSession> _udpSessions =
 			new Dictionary<IPEndPoint, TSPSession>();
 
+		/* State of a TCP session between the callbacks of its socket. Commands are read
+		 * into the buffer until a whole line, and its content if it has a Content-length,
+		 * is there. A command that doesn't fit in the buffer closes the session.
+		 * Responses are queued and sent in the background, so a client that doesn't read
+		 * can't block a reactor worker. The queue is protected by locking the connection. */
+		private class TcpConnection {
+			public TcpClient Client;
+			public TSPSession Session;
+			public byte[] Buffer = new byte[512];
+			public int Length = 0;
+
+			public Queue<byte[]> Pending = new Queue<byte[]>();
+			public int PendingBytes = 0;
+			public int Sent = 0;		// bytes sent of the first pending response
+			public bool Sending = false;
+			public bool Closed = false;
+		}
+		private List<TcpConnection> _tcpConnections = new List<TcpConnection>();
+
 		/* Use the default port */
 		public TSPServer(string dbName, string deviceName, bool ipv6) : this(dbName, deviceName, ipv6, 3653) {}
 
@@ -104,20 +131,29 @@ namespace Nabla {
 		public override void Start() {
 			lock (_runlock) {
 				_tcpListener.Start();
-				_running = true;
 
-				_udpThread = new Thread(new ThreadStart(udpListenerThread));
-				_udpThread.Start();
-				_tcpThread = new Thread(new ThreadStart(tcpListenerThread));
-				_tcpThread.Start();
+				_reactor = _sessionManager.Reactor;
+				_reactor.Register(_udpSocket, new ReadyCallback(udpReady), null);
+				_reactor.Register(_tcpListener.Server, new ReadyCallback(tcpAcceptReady), null);
 			}
 		}
 
 		public override void Stop() {
 			lock (_runlock) {
-				_running = false;
-				_tcpThread.Join();
+				_reactor.Unregister(_udpSocket);
+				_reactor.Unregister(_tcpListener.Server);
 				_tcpListener.Stop();
+
+				TcpConnection[] connections;
+				lock (_tcpConnections) {
+					connections = _tcpConnections.ToArray();
+				}
+				foreach (TcpConnection connection in connections) {
+					closeConnection(connection);
+
+					/* Don't wait for the responses to a client that isn't reading */
+					connection.Client.Close();
+				}
 			}
 		}
 
@@ -129,10 +165,16 @@ namespace Nabla {
 			_udpSocket.SendTo(data, offset, length, SocketFlags.None, endPoint);
 		}
 
-		private void udpListenerThread() {
-			byte[] data = new byte[2048];
+		/* Reactor callback of the UDP socket, handles at most a batch of
+		 * packets and leaves the rest for the next callback */
+		private void udpReady(Object state) {
+			byte[] data = _udpBuffer;
+
+			for (int i=0; i<MAX_UDP_PACKETS; i++) {
+				if (i > 0 && !_udpSocket.Poll(0, SelectMode.SelectRead)) {
+					break;
+				}
 
-			while (_running) {
 				EndPoint sender = (EndPoint) new IPEndPoint(IPAddress.IPv6Any, 0);
 
 				int datalen = _udpSocket.ReceiveFrom(data, 0, data.Length,
@@ -164,7 +206,7 @@ namespace Nabla {
 
 				if (!signalingPacket) {
 					if (session == null) {
-						Console.WriteLine("Tunnel IP packet without initiated session!");
+						_log.Debug("Tunnel IP packet without initiated session!");
 						continue;
 					}
 
@@ -186,7 +228,7 @@ namespace Nabla {
 				if (tspString.StartsWith("Content-length:")) {
 					int newline = tspString.IndexOf("\r\n");
 					if (newline < 0) {
-						Console.WriteLine("Invalid packet, no newline after Content-length");
+						_log.Debug("Invalid packet, no newline after Content-length");
 						continue;
 					}
 
@@ -199,7 +241,7 @@ namespace Nabla {
 						Array.Copy(tspData, newline+2, content, 0, len);
 						tspData = content;
 					} catch (Exception e) {
-						Console.WriteLine("Exception parsing Content-length: " + e);
+						_log.Debug("Exception parsing Content-length: {0}", e);
 					}
 				}
 
@@ -223,100 +265,216 @@ namespace Nabla {
 			}
 		}
 
-		private void tcpListenerThread() {
-			while (_running) {
-				TcpClient client = _tcpListener.AcceptTcpClient();
+		/* Reactor callback of the TCP listener, accepts one connection */
+		private void tcpAcceptReady(Object state) {
+			if (!_tcpListener.Pending()) {
+				return;
+			}
+
+			TcpConnection connection = new TcpConnection();
+			connection.Client = _tcpListener.AcceptTcpClient();
+
+			IPEndPoint remoteEndPoint = (IPEndPoint) connection.Client.Client.RemoteEndPoint;
+			IPEndPoint localEndPoint = (IPEndPoint) connection.Client.Client.LocalEndPoint;
+			connection.Session = new TSPSession(_sessionManager, _dbName, ProtocolType.Tcp,
+			                                    remoteEndPoint.Address, localEndPoint.Address);
 
-				Thread thread = new Thread(new ParameterizedThreadStart(tcpSessionThread));
-				thread.Start(client);
+			lock (_tcpConnections) {
+				_tcpConnections.Add(connection);
 			}
+			_reactor.Register(connection.Client.Client, new ReadyCallback(tcpReady), connection);
 		}
 
-		private void tcpSessionThread(object data) {
-			byte[] buf = new byte[512];
-			int buflen = 0;
+		/* Reactor callback of a TCP session, reads what is available and handles all
+		 * the complete commands in the buffer */
+		private void tcpReady(Object state) {
+			TcpConnection connection = (TcpConnection) state;
+			byte[] buf = connection.Buffer;
+
+			int read;
+			try {
+				read = connection.Client.Client.Receive(buf, connection.Length,
+				                                        buf.Length - connection.Length,
+				                                        SocketFlags.None);
+			} catch (SocketException) {
+				read = 0;
+			}
+
+			if (read == 0) {
+				/* End of file or the connection was reset */
+				closeConnection(connection);
+				return;
+			}
+			connection.Length += read;
 
-			TcpClient client = (TcpClient) data;
+			string command;
+			while ((command = nextCommand(connection)) != null) {
+				byte[] outBytes;
+				connection.Session.HandleCommand(command);
+				while ((outBytes = connection.Session.DequeueResponse()) != null) {
+					if (!sendResponse(connection, outBytes)) {
+						_log.Debug("TSP client not reading responses, closing the session");
+						closeConnection(connection);
+						return;
+					}
+				}
 
-			IPEndPoint remoteEndPoint = (IPEndPoint) client.Client.RemoteEndPoint;
-			IPEndPoint localEndPoint = (IPEndPoint) client.Client.LocalEndPoint;
-			TSPSession session = new TSPSession(_sessionManager, _dbName, ProtocolType.Tcp,
-			                                    remoteEndPoint.Address, localEndPoint.Address);
+				if (connection.Session.Finished()) {
+					closeConnection(connection);
+					return;
+				}
+			}
 
-			Stream stream = client.GetStream();
+			if (connection.Length == buf.Length) {
+				_log.Debug("TSP command too long, closing the session");
+				closeConnection(connection);
+			}
+		}
+
+		/* Removes the next complete command from the buffer of the connection,
+		 * returns null if the whole command hasn't been received yet */
+		private string nextCommand(TcpConnection connection) {
+			byte[] buf = connection.Buffer;
 
-			while (!session.Finished()) {
-				int read = stream.Read(buf, buflen, buf.Length-buflen);
-				if (read == 0 && buflen == 0) {
-					/* XXX: End of file */
+			/* Find a newline in buffer */
+			int newline = -1;
+			for (int i=1; i<connection.Length; i++) {
+				if (buf[i] == '\n' && buf[i-1] == '\r') {
+					newline = i-1;
 					break;
 				}
-				buflen += read;
-
-				/* Find a newline in buffer */
-				int newline = -1;
-				for (int i=1; i<buflen; i++) {
-					if (buf[i] == '\n' && buf[i-1] == '\r') {
-						newline = i-1;
-						break;
-					}
+			}
+
+			if (newline == -1) {
+				return null;
+			}
+
+			string line = Encoding.UTF8.GetString(buf, 0, newline);
+			int used = newline+2;
+
+			/* If Content-length is set, the command is the content after the line */
+			if (line.StartsWith("Content-length:")) {
+				string lenstr = line.Substring("Content-length:".Length).Trim();
+
+				int len;
+				try {
+					len = int.Parse(lenstr);
+				} catch (Exception) {
+					len = -1;
+				}
+				if (len < 0 || used+len > buf.Length) {
+					/* Content that never fits fills the buffer and closes the session */
+					_log.Debug("Invalid Content-length: {0}", lenstr);
+					connection.Length = buf.Length;
+					return null;
 				}
 
-				if (newline == -1) {
-					/* XXX: No newline found */
-					break;
+				if (connection.Length < used+len) {
+					return null;
 				}
 
-				string line = Encoding.UTF8.GetString(buf, 0, newline);
+				line = Encoding.UTF8.GetString(buf, used, len);
+				used += len;
+			}
 
-				/* Move the bytes after first line to the beginning of the buffer */
-				buflen -= newline+2;
-				Array.Copy(buf, newline+2, buf, 0, buflen);
+			/* Move the bytes after the command to the beginning of the buffer */
+			connection.Length -= used;
+			Array.Copy(buf, used, buf, 0, connection.Length);
 
-				/* If Content-length is set, read multiline content */
-				if (line.StartsWith("Content-length:")) {
-					string lenstr = line.Substring("Content-length:".Length).Trim();
-					try {
-						int len = int.Parse(lenstr);
-						byte[] content = new byte[len];
+			return line;
+		}
 
-						while (buflen < content.Length) {
-							read = stream.Read(buf, buflen, buf.Length-buflen);
-							if (read == 0) {
-								break;
-							}
-							buflen += read;
-						}
-
-						if (buflen < content.Length) {
-							/* XXX: End of file */
-							break;
-						}
-
-						/* Copy content into the content array */
-						Array.Copy(buf, 0, content, 0, content.Length);
-
-						/* Move the additional bytes to the beginning of buffer */
-						buflen -= content.Length;
-						Array.Copy(buf, content.Length, buf, 0, buflen);
-
-						line = Encoding.UTF8.GetString(content);
-					} catch (Exception) {
-						/* XXX: Break doesn't work here very well */
-						break;
+		/* Queues a response and starts sending it unless a send is already running,
+		 * returns false if the client has too many bytes left unread */
+		private bool sendResponse(TcpConnection connection, byte[] data) {
+			lock (connection) {
+				if (connection.PendingBytes + data.Length > MAX_PENDING_BYTES) {
+					return false;
+				}
+
+				connection.Pending.Enqueue(data);
+				connection.PendingBytes += data.Length;
+				if (!connection.Sending) {
+					connection.Sending = true;
+					beginSend(connection);
+				}
+			}
+
+			return true;
+		}
+
+		/* Called with the connection locked and a response pending */
+		private void beginSend(TcpConnection connection) {
+			byte[] data = connection.Pending.Peek();
+
+			try {
+				connection.Client.Client.BeginSend(data, connection.Sent, data.Length - connection.Sent,
+				                                   SocketFlags.None, new AsyncCallback(sendDone), connection);
+			} catch (Exception) {
+				/* The connection was reset or closed, tcpReady closes it on the next read */
+				connection.Pending.Clear();
+				connection.PendingBytes = 0;
+				connection.Sending = false;
+			}
+		}
+
+		/* Completion of a send, continues with the rest of the queue */
+		private void sendDone(IAsyncResult result) {
+			TcpConnection connection = (TcpConnection) result.AsyncState;
+
+			lock (connection) {
+				int sent;
+				try {
+					sent = connection.Client.Client.EndSend(result);
+				} catch (Exception) {
+					sent = -1;
+				}
+
+				if (sent > 0) {
+					connection.Sent += sent;
+					connection.PendingBytes -= sent;
+					if (connection.Sent == connection.Pending.Peek().Length) {
+						connection.Pending.Dequeue();
+						connection.Sent = 0;
 					}
+				} else {
+					connection.Pending.Clear();
+					connection.PendingBytes = 0;
 				}
 
-				byte[] outBytes;
-				session.HandleCommand(line);
-				while ((outBytes = session.DequeueResponse()) != null) {
-					stream.Write(outBytes, 0, outBytes.Length);
-					stream.Flush();
+				if (connection.Pending.Count > 0) {
+					beginSend(connection);
+					return;
+				}
+
+				connection.Sending = false;
+				if (!connection.Closed) {
+					return;
 				}
 			}
 
-			session.Cleanup();
-			client.Close();
+			/* The session ended while its last responses were being sent */
+			connection.Client.Close();
+		}
+
+		private void closeConnection(TcpConnection connection) {
+			lock (_tcpConnections) {
+				if (!_tcpConnections.Remove(connection)) {
+					return;
+				}
+			}
+
+			_reactor.Unregister(connection.Client.Client);
+			connection.Session.Cleanup();
+
+			lock (connection) {
+				connection.Closed = true;
+				if (connection.Sending) {
+					/* sendDone closes the client after the last response */
+					return;
+				}
+			}
+			connection.Client.Close();
 		}
 	}
 }
@@ -28,6 +28,8 @@ using Nabla.Database;
 
 namespace Nabla {
 	public class TSPSession {
+		private static Logger _log = Logger.GetLogger("TSPSession");
+
 		private enum SessionState {
 			Initial,
 			Authenticate,
@@ -188,7 +190,7 @@ namespace Nabla {
 					xmlDoc.LoadXml(command);
 				} catch (XmlException xmle) {
 					/* XXX: Handle parsing errors */
-					Console.WriteLine("XML parsing error: " + xmle);
+					_log.Warning("XML parsing error: {0}", xmle);
 				}
 				return handleXmlCommand(xmlDoc);
 			}
@@ -207,7 +209,7 @@ namespace Nabla {
 			string action = doc.GetAttribute("action");
 			string type = doc.GetAttribute("type");
 
-			Console.WriteLine("Tunnel request action: " + action + " type: " + type);
+			_log.Info("Tunnel request action: {0} type: {1}", action, type);
 
 			if (action.Equals("create")) {
 				return handleCreateCommand(doc, type);
@@ -276,7 +278,7 @@ namespace Nabla {
 			TunnelInfo tunnel = null;
 			TunnelInfo[] tunnels = _db.ListTunnels(_sessionInfo.UserId, "tsp");
 			foreach (TunnelInfo t in tunnels) {
-				Console.WriteLine("Checking tunnel endpoint: " + t.Endpoint);
+				_log.Debug("Checking tunnel endpoint: {0}", t.Endpoint);
 				if (!t.Enabled || !t.UserEnabled)
 					continue;
 
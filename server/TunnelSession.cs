@@ -22,16 +22,34 @@ using System.Net;
 using System.Net.Sockets;
 using System.Collections.Generic;
 using System.Security.Cryptography;
+using System.Threading;
 
 namespace Nabla {
 	public class TunnelSession {
 		public readonly Int64 TunnelId;
 		public readonly TunnelType TunnelType;
-		public IPEndPoint EndPoint = null;
+		/* Updated by the input devices while packets are being sent */
+		public volatile IPEndPoint EndPoint = null;
 
 		public readonly string Password = null;
+		/* SHA1 of the password, the shared secret of AYIYA packets */
+		public readonly byte[] PasswordHash = null;
 		public DateTime LastAlive;
 
+		/* Set when the client sends compressed packets, the packets to the
+		 * client are compressed only after that. The counters are updated
+		 * by the sending threads with Interlocked. */
+		public bool Compress = false;
+		public int CompressSkip = 0;
+		public int CompressBackoff = 0;
+
+		/* Forwarded payload bytes before and after compression, counted for every packet
+		 * with Interlocked so a ratio may be off by the packets counted while reading it */
+		private Int64 _rxPayload = 0;
+		private Int64 _rxPayloadCompressed = 0;
+		private Int64 _txPayload = 0;
+		private Int64 _txPayloadCompressed = 0;
+
 		public TunnelSession(Int64 id, TunnelType type) {
 			TunnelId = id;
 			TunnelType = type;
@@ -40,12 +58,43 @@ namespace Nabla {
 
 		public TunnelSession(Int64 id, TunnelType type, string password) : this(id, type) {
 			Password = password;
+			if (password != null) {
+				byte[] passwordBytes = Encoding.ASCII.GetBytes(password);
+				PasswordHash = new byte[SHA1Digest.Length];
+				new SHA1Digest().Compute(passwordBytes, 0, passwordBytes.Length, PasswordHash, 0);
+			}
 		}
 
 		public TunnelSession(Int64 id, TunnelType type, IPEndPoint endPoint) : this(id, type) {
 			EndPoint = endPoint;
 		}
 
+		public void CountRxPayload(int original, int compressed) {
+			Interlocked.Add(ref _rxPayload, original);
+			Interlocked.Add(ref _rxPayloadCompressed, compressed);
+		}
+
+		public void CountTxPayload(int original, int compressed) {
+			Interlocked.Add(ref _txPayload, original);
+			Interlocked.Add(ref _txPayloadCompressed, compressed);
+		}
+
+		public double RxCompressionRatio {
+			get {
+				return ratio(Interlocked.Read(ref _rxPayload), Interlocked.Read(ref _rxPayloadCompressed));
+			}
+		}
+
+		public double TxCompressionRatio {
+			get {
+				return ratio(Interlocked.Read(ref _txPayload), Interlocked.Read(ref _txPayloadCompressed));
+			}
+		}
+
+		private static double ratio(Int64 original, Int64 compressed) {
+			return (compressed > 0) ? (double) original / compressed : 1.0;
+		}
+
 		public override string ToString() {
 			string ret = "";
 
@@ -53,7 +102,9 @@ namespace Nabla {
 			ret += "TunnelType: " + TunnelType + "\n";
 			ret += "EndPoint: " + EndPoint + "\n";
 			ret += "Password: " + Password + "\n";
-			ret += "LastAlive: " + LastAlive.ToString("s");
+			ret += "LastAlive: " + LastAlive.ToString("s") + "\n";
+			ret += "Compression: " + RxCompressionRatio.ToString("F2") + " received, " +
+			       TxCompressionRatio.ToString("F2") + " sent";
 
 			return ret;
 		}
@@ -0,0 +1,98 @@
+using System;
+using System.Diagnostics;
+using System.Net;
+using Nabla;
+
+public class ForwardingBenchmark {
+	private const int SESSIONS = 1000;
+
+	/* Input device that only counts the packets it should send, after compressing
+	 * them like the AYIYA device does for the clients that compress */
+	private class NullInputDevice : InputDevice {
+		public int Packets = 0;
+
+		private SessionManager _sessionManager;
+		private byte[] _compressed = new byte[2048];
+
+		public override void SetSessionManager(SessionManager sessionManager) {
+			_sessionManager = sessionManager;
+		}
+
+		public override TunnelType GetSupportedType() {
+			return TunnelType.AYIYAinIPv4;
+		}
+
+		public override void Start() {
+		}
+
+		public override void Stop() {
+		}
+
+		public override void SendPacket(Int64 tunnelId, byte[] data, int offset, int length) {
+			TunnelSession session = _sessionManager.GetSession(tunnelId);
+			int zlen = LZ4.Compress(data, offset, length, _compressed, 0, length);
+			session.CountTxPayload(length, (zlen > 0) ? zlen : length);
+			Packets++;
+		}
+	}
+
+	private static void Main(string[] args) {
+		int packets = (args.Length > 0) ? Int32.Parse(args[0]) : 1000000;
+
+		SessionManager manager = new SessionManager();
+		NullInputDevice device = new NullInputDevice();
+		manager.AddInputDevice(device);
+
+		byte[][] addresses = new byte[SESSIONS][];
+		for (int i=0; i<SESSIONS; i++) {
+			manager.AddSession(new TunnelSession(i+1, TunnelType.AYIYAinIPv4, "password"));
+			addresses[i] = manager.GetIPv4TunnelRemoteAddress(i+1).GetAddressBytes();
+		}
+
+		/* IPv4 packet with some headroom in front, like in a receive buffer */
+		byte[] buffer = new byte[2048];
+		int offset = 64;
+		int length = 84;
+		Array.Copy(getPingRequest(), 0, buffer, offset, length);
+
+		/* Warm up so that everything is compiled before measuring */
+		forward(manager, addresses, buffer, offset, length, SESSIONS);
+		device.Packets = 0;
+
+		int collections = GC.CollectionCount(0);
+		Stopwatch stopwatch = Stopwatch.StartNew();
+		forward(manager, addresses, buffer, offset, length, packets);
+		stopwatch.Stop();
+		collections = GC.CollectionCount(0) - collections;
+
+		Console.WriteLine("Forwarded {0} of {1} packets in {2} ms ({3:F0} packets/s)",
+		                  device.Packets, packets, stopwatch.ElapsedMilliseconds,
+		                  packets / stopwatch.Elapsed.TotalSeconds);
+		Console.WriteLine("Gen0 collections: {0}", collections);
+	}
+
+	private static void forward(SessionManager manager, byte[][] addresses,
+	                            byte[] buffer, int offset, int length, int packets) {
+		for (int i=0; i<packets; i++) {
+			/* Destination address of the packet rotates between the tunnels */
+			Array.Copy(addresses[i % SESSIONS], 0, buffer, offset+16, 4);
+			manager.PacketFromOutputDevice(null, buffer, offset, length);
+		}
+	}
+
+	private static byte[] getPingRequest() {
+		return new byte[] {
+			0x45, 0x00, 0x00, 0x54, 0x00, 0x00, 0x40, 0x00,
+			0x40, 0x01, 0xb7, 0x4d, 0xc0, 0xa8, 0x01, 0x0a,
+			0x0a, 0x00, 0x00, 0x06, 0x08, 0x00, 0x06, 0x81,
+			0x06, 0x6c, 0x00, 0x01, 0xe5, 0xa3, 0x23, 0x4a,
+			0xec, 0x20, 0x0b, 0x00, 0x08, 0x09, 0x0a, 0x0b,
+			0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13,
+			0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b,
+			0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23,
+			0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b,
+			0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33,
+			0x34, 0x35, 0x36, 0x37
+		};
+	}
+}
@@ -0,0 +1,104 @@
+using System;
+using System.Net;
+using System.Net.Sockets;
+using System.Threading;
+using Nabla;
+
+/* Looks mappings up from several threads while another thread keeps adding and
+ * removing mappings, a lookup must never miss a mapping that stays in the tables
+ * or return the mapping of another connection. */
+public class NATMapperTest {
+	private const int STABLE = 256;
+	private const int CHURN = 2048;
+	private const int ADDRESSES = 64;
+
+	private static NATMapper _mapper = new NATMapper();
+	private static NATMapping[] _stable = new NATMapping[STABLE];
+	private static byte[] _stableAddr = IPAddress.Parse("10.0.0.1").GetAddressBytes();
+	private static volatile bool _running = true;
+	private static int _lookups = 0;
+	private static int _errors = 0;
+
+	private static void Main(string[] args) {
+		int seconds = (args.Length > 0) ? Int32.Parse(args[0]) : 5;
+
+		_mapper.AddProtocol(ProtocolType.Udp);
+		for (int i=1; i<=ADDRESSES; i++) {
+			_mapper.Addresses += IPAddress.Parse("192.0.2." + i);
+		}
+		for (int i=0; i<STABLE; i++) {
+			_stable[i] = new NATMapping(ProtocolType.Udp, new IPAddress(_stableAddr), (UInt16) (i+1));
+			_mapper.AddMapping(_stable[i]);
+		}
+
+		Thread[] readers = new Thread[Math.Max(2, Environment.ProcessorCount-1)];
+		for (int i=0; i<readers.Length; i++) {
+			readers[i] = new Thread(new ParameterizedThreadStart(readerLoop));
+			readers[i].Start(i);
+		}
+
+		/* Removed mappings keep their ports for a couple of seconds, the
+		 * churn is spread over all the external addresses so that they
+		 * have enough ports for it */
+		Random random = new Random();
+		NATMapping[] churn = new NATMapping[CHURN];
+		DateTime end = DateTime.Now.AddSeconds(seconds);
+		int operations = 0;
+		while (DateTime.Now < end) {
+			for (int n=0; n<1000; n++) {
+				int i = random.Next(CHURN);
+				if (churn[i] != null) {
+					_mapper.RemoveMapping(churn[i]);
+					churn[i] = null;
+				} else {
+					churn[i] = new NATMapping(ProtocolType.Udp, new IPAddress(churnAddress(i)), (UInt16) (1000+i));
+					_mapper.AddMapping(churn[i]);
+				}
+				operations++;
+			}
+			Thread.Sleep(1);
+		}
+
+		_running = false;
+		foreach (Thread reader in readers) {
+			reader.Join();
+		}
+
+		Console.WriteLine("{0} adds and removes, {1} lookups, {2} errors", operations, _lookups, _errors);
+		Console.WriteLine((_errors == 0) ? "OK" : "FAILED");
+	}
+
+	private static byte[] churnAddress(int n) {
+		return new byte[] { 10, 1, (byte) (n >> 8), (byte) n };
+	}
+
+	private static void readerLoop(Object seed) {
+		Random random = new Random((int) seed);
+		int lookups = 0;
+
+		while (_running) {
+			NATMapping expected = _stable[random.Next(STABLE)];
+			NATMapping m = _mapper.GetIntMapping(ProtocolType.Udp, _stableAddr, 0, expected.InternalID);
+			if (m != expected) {
+				Interlocked.Increment(ref _errors);
+			}
+
+			byte[] extaddr = expected.ExternalAddress.GetAddressBytes();
+			m = _mapper.GetExtMapping(ProtocolType.Udp, extaddr, 0, expected.ExternalID);
+			if (m != expected) {
+				Interlocked.Increment(ref _errors);
+			}
+
+			int n = random.Next(CHURN);
+			byte[] intaddr = churnAddress(n);
+			m = _mapper.GetIntMapping(ProtocolType.Udp, intaddr, 0, (UInt16) (1000+n));
+			if (m != null && (m.InternalID != 1000+n || !m.InternalAddress.Equals(new IPAddress(intaddr)))) {
+				Interlocked.Increment(ref _errors);
+			}
+
+			lookups += 3;
+		}
+
+		Interlocked.Add(ref _lookups, lookups);
+	}
+}
@@ -22,22 +22,35 @@ using System.Threading;
 
 namespace Nabla {
 	public class Server {
+		/* Seconds between the statistics in the log */
+		private const int STATISTICS_INTERVAL = 60;
+
 		private static void Main(string[] args) {
-			if (args.Length != 3) {
+			if (args.Length != 3 && args.Length != 4) {
 				Console.WriteLine("Invalid number of arguments\n");
-				Console.WriteLine("Usage: mono Server.exe <dbname> <internal device> <external device>\n");
+				Console.WriteLine("Usage: mono Server.exe <dbname> <internal device> <external device> [workers]\n");
 				return;
 			}
 
+			/* Threads receiving packets from the external device */
+			int workers = (args.Length > 3) ? Int32.Parse(args[3]) : 1;
+
+			/* Log levels like "info,GenericInputDevice=debug", data path
+			 * messages are logged at debug level and hidden by default */
+			Logger.Configure(Environment.GetEnvironmentVariable("NABLA_LOG"));
+
 			SessionManager sessionManager = new SessionManager();
-			sessionManager.AddOutputDevice(args[2], false, true);
+			sessionManager.AddOutputDevice(args[2], false, true, workers);
 			sessionManager.AddInputDevice(new TICServer(args[0], args[1]));
 			sessionManager.AddInputDevice(new TSPServer(args[0], args[1], false));
 
 			sessionManager.Start();
 
-			while (true) {
+			for (int seconds=1; ; seconds++) {
 				Thread.Sleep(1000);
+				if (seconds % STATISTICS_INTERVAL == 0) {
+					sessionManager.LogStatistics();
+				}
 			}
 		}
 	}